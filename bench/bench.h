@@ -0,0 +1,52 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+// Timing of the benchmark programs. Build with optimization, the numbers of a debug build mean nothing
+namespace Bench {
+	inline volatile uint64_t sink{ 0 };
+
+	// keeps a result from being optimized away
+	inline void keep(const uint64_t value) {
+		sink = value;
+	}
+
+	// runs the function iterations times and prints the mean time of one call
+	template<typename Function>
+	double measure(const std::string &name, const uint64_t iterations, Function function) {
+		auto start = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < iterations; ++i) {
+			function(i);
+		}
+		std::chrono::duration<double, std::nano> elapsed{ std::chrono::steady_clock::now() - start };
+		auto perCall = elapsed.count() / iterations;
+		std::cout << std::left << std::setw(48) << name << std::right << std::fixed << std::setprecision(1)
+			<< std::setw(12) << perCall << " ns" << std::endl;
+		return perCall;
+	}
+
+	inline void report(const std::string &name, const double value, const std::string &unit) {
+		std::cout << std::left << std::setw(48) << name << std::right << std::fixed << std::setprecision(1)
+			<< std::setw(12) << value << " " << unit << std::endl;
+	}
+
+	// xorshift64, the same sequence on every run
+	class Random final {
+	public:
+		explicit Random(const uint64_t seed = 88172645463325252ULL) : state_{ seed } {}
+
+		uint64_t next() {
+			state_ ^= state_ << 13;
+			state_ ^= state_ >> 7;
+			state_ ^= state_ << 17;
+			return state_;
+		}
+
+	private:
+		uint64_t state_;
+	};
+}
@@ -0,0 +1,84 @@
+#include "bench.h"
+#include "../src/frame_cache.h"
+#include "../src/wire_format.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Fan-out of broadcasts: every recipient encoding the frame from the row, as before the frame cache,
+// against the first recipient encoding it and the others taking the shared frame. A delivery ends
+// with the frame and the seq appended to the queue of the client
+namespace {
+	const size_t MESSAGE_LENGTH{ 1024 }; // of the server
+	const size_t SLOTS{ 1024 };
+	const unsigned MESSAGES{ 1024 }; // in flight, one slot each
+	const unsigned RECIPIENTS{ 500 };
+
+	struct Row {
+		unsigned long long message_id;
+		int64_t sent;
+		unsigned sender_id;
+		std::string sender;
+		std::string text;
+	};
+
+	// the frame and the trailing seq, as the outbound queue keeps them
+	void push(std::string &queue, const std::string_view frame, const unsigned long long seq) {
+		char trailer[Chat::MAX_VARINT];
+		queue.append(frame);
+		queue.append(trailer, Chat::encodeVarint(seq, trailer));
+	}
+
+	std::string_view encode(const Row &row, char *buffer) {
+		Chat::WireRecord record{ Chat::WireRecord::BROADCAST, 0, row.message_id, static_cast<uint64_t>(row.sent), row.sender_id,
+			row.sender, {}, row.text };
+		return { buffer, Chat::encodeRecord(record, buffer, MESSAGE_LENGTH - Chat::MAX_VARINT - 1) };
+	}
+
+	void fanOut(const size_t textLength) {
+		std::vector<Row> rows;
+		for (unsigned i = 0; i < MESSAGES; ++i) {
+			rows.push_back(Row{ 1000000 + i, 1700000000 + i, 42, "alice", std::string(textLength, 'x') });
+		}
+		const uint64_t deliveries{ static_cast<uint64_t>(MESSAGES) * RECIPIENTS };
+		auto suffix = ", text " + std::to_string(textLength) + " bytes";
+		std::string queue;
+		queue.reserve(MESSAGES * MESSAGE_LENGTH);
+
+		// recipient by recipient, each one reads every message in flight
+		auto perClient = Bench::measure("encoded by every recipient" + suffix, deliveries, [&](uint64_t i) {
+			const auto &row = rows[i % MESSAGES];
+			if (i % MESSAGES == 0) {
+				queue.clear();
+			}
+			char buffer[MESSAGE_LENGTH];
+			push(queue, encode(row, buffer), i);
+		});
+
+		FrameCache cache{ SLOTS, MESSAGE_LENGTH };
+		uint64_t misses{ 0 };
+		auto shared = Bench::measure("shared by the frame cache" + suffix, deliveries, [&](uint64_t i) {
+			const auto &row = rows[i % MESSAGES];
+			if (i % MESSAGES == 0) {
+				queue.clear();
+			}
+			if (!cache.visit(row.message_id, [&](std::string_view frame) { push(queue, frame, i); })) {
+				char buffer[MESSAGE_LENGTH];
+				auto frame = encode(row, buffer);
+				cache.store(row.message_id, frame);
+				push(queue, frame, i);
+				++misses;
+			}
+		});
+		Bench::report("  speedup" + suffix, perClient / shared, "x");
+		Bench::report("  cache misses" + suffix, 100.0 * misses / deliveries, "%");
+	}
+}
+
+int main() {
+	for (auto length: { 16, 200, 900 }) {
+		fanOut(length);
+	}
+	return 0;
+}
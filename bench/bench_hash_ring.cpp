@@ -0,0 +1,119 @@
+#include "bench.h"
+#include "../src/hash_ring.h"
+
+#include <list>
+#include <numeric>
+#include <unordered_map>
+#include <vector>
+
+// Lookups and rebuilds of the ring, the share of users moved by a change of the nodes,
+// and the user cache hits of the nodes with sessions pinned by the ring or spread at random
+namespace {
+	const unsigned USERS{ 1000000 };
+
+	std::vector<unsigned> nodeList(const unsigned count) {
+		std::vector<unsigned> nodes(count);
+		std::iota(nodes.begin(), nodes.end(), 1);
+		return nodes;
+	}
+
+	double moved(const HashRing &before, const HashRing &after) {
+		unsigned count{ 0 };
+		for (unsigned user = 1; user <= USERS; ++user) {
+			count += before.owner(user) != after.owner(user);
+		}
+		return 100.0 * count / USERS;
+	}
+
+	double movedModulo(const unsigned before, const unsigned after) {
+		unsigned count{ 0 };
+		for (unsigned user = 1; user <= USERS; ++user) {
+			count += user % before != user % after;
+		}
+		return 100.0 * count / USERS;
+	}
+
+	// least recently used users kept by a node
+	class Cache final {
+	public:
+		explicit Cache(const size_t capacity) : capacity_{ capacity } {}
+
+		bool get(const unsigned user) {
+			auto it = index_.find(user);
+			if (it != index_.end()) {
+				order_.splice(order_.begin(), order_, it->second);
+				return true;
+			}
+			if (index_.size() == capacity_) {
+				index_.erase(order_.back());
+				order_.pop_back();
+			}
+			order_.push_front(user);
+			index_[user] = order_.begin();
+			return false;
+		}
+
+	private:
+		const size_t capacity_;
+		std::list<unsigned> order_;
+		std::unordered_map<unsigned, std::list<unsigned>::iterator> index_;
+	};
+
+	void lookups() {
+		for (auto count: { 3u, 16u }) {
+			HashRing ring{ nodeList(count) };
+			Bench::Random random;
+			Bench::measure("owner, " + std::to_string(count) + " nodes", 2000000, [&](uint64_t) {
+				Bench::keep(ring.owner(static_cast<unsigned>(random.next())));
+			});
+			Bench::measure("owner, " + std::to_string(count) + " nodes, node 1 down", 2000000, [&](uint64_t) {
+				Bench::keep(ring.owner(static_cast<unsigned>(random.next()), [](unsigned node) { return node != 1; }));
+			});
+		}
+	}
+
+	void rebuilds() {
+		for (auto count: { 3u, 16u, 64u }) {
+			auto nodes = nodeList(count);
+			Bench::measure("rebuild, " + std::to_string(count) + " nodes", 2000, [&](uint64_t) {
+				HashRing ring{ nodes };
+				Bench::keep(ring.owner(1));
+			});
+		}
+	}
+
+	void rebalance() {
+		HashRing three{ nodeList(3) };
+		HashRing four{ nodeList(4) };
+		HashRing two{ nodeList(2) };
+		Bench::report("users moved, 3 -> 4 nodes, ring", moved(three, four), "%");
+		Bench::report("users moved, 3 -> 4 nodes, user % N", movedModulo(3, 4), "%");
+		Bench::report("users moved, 3 -> 2 nodes, ring", moved(three, two), "%");
+		Bench::report("users moved, 3 -> 2 nodes, user % N", movedModulo(3, 2), "%");
+	}
+
+	void cacheHits() {
+		// every node caches a fifth of the users, a session reads the user on its node
+		const unsigned nodes{ 3 }, users{ 100000 }, sessions{ 2000000 };
+		HashRing ring{ nodeList(nodes) };
+		for (auto pinned: { false, true }) {
+			std::vector<Cache> caches(nodes, Cache{ users / 5 });
+			Bench::Random random;
+			unsigned hits{ 0 };
+			for (unsigned i = 0; i < sessions; ++i) {
+				auto user = static_cast<unsigned>(random.next() % users) + 1;
+				auto node = pinned ? ring.owner(user) - 1 : static_cast<unsigned>(random.next() % nodes);
+				hits += caches[node].get(user);
+			}
+			Bench::report(pinned ? "user cache hits, pinned by the ring" : "user cache hits, any node", 100.0 * hits / sessions, "%");
+		}
+	}
+}
+
+int main() {
+	lookups();
+	rebuilds();
+	rebalance();
+	cacheHits();
+	return 0;
+}
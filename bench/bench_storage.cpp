@@ -0,0 +1,119 @@
+#include "bench.h"
+#include "../src/config_file.h"
+#include "../src/id_allocator.h"
+#include "../src/storage.h"
+
+#include <algorithm>
+#include <ctime>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+extern "C" {
+	#include <unistd.h>
+}
+
+// The same workload against each storage backend: users signing up and looked up, private messages,
+// broadcasts to every user, unread messages read and acknowledged, history pages.
+// Arguments are server config files, each one selects a backend with its options. Without them
+// the sqlite backend on a temporary file and the memory backend are compared
+namespace {
+	const unsigned USERS{ 1000 };
+	const unsigned PRIVATE_MESSAGES{ 5000 };
+	const unsigned BROADCASTS{ 100 }; // to every user
+	const unsigned READERS{ 100 }; // users reading their unread messages
+	const unsigned PAGE{ 50 };
+
+	std::string login(const unsigned index) {
+		return "user" + std::to_string(index);
+	}
+
+	void run(const std::string &configFile) {
+		ConfigFile config{ configFile };
+		auto backend = config.get("StorageBackend", "mysql");
+		std::cout << "[" << backend << "] " << configFile << std::endl;
+		IdAllocator ids{ 1000 };
+		auto storage = Storage::create(config, getpid());
+		storage->setIdAllocator(&ids);
+		auto now = std::time(nullptr);
+		std::string text(100, 'x');
+
+		std::vector<std::string> logins;
+		for (unsigned i = 0; i < USERS; ++i) {
+			logins.push_back(login(i));
+		}
+		Bench::measure("sign up", USERS, [&](uint64_t i) {
+			storage->saveUser(storage->nextUserId(), logins[i], std::string(64, 'a'), "User " + logins[i]);
+		});
+		Bench::measure("user by login", USERS, [&](uint64_t i) {
+			storage->forEachUserByLogin({ logins[(i * 7) % USERS] }, [](const Storage::User &user) { Bench::keep(user.id); });
+		});
+		Bench::measure("private message", PRIVATE_MESSAGES, [&](uint64_t i) {
+			storage->savePrivateMessage(logins[i % USERS], logins[(i * 13 + 1) % USERS], text, false, now);
+		});
+		Bench::measure("broadcast to " + std::to_string(USERS) + " users", BROADCASTS, [&](uint64_t i) {
+			storage->saveBroadcastMessage(logins[i % USERS], text, logins, now);
+		});
+
+		// every reader has all the broadcasts and a few private messages waiting
+		std::vector<unsigned> readers;
+		storage->forEachUserByLogin({ logins.begin(), logins.begin() + READERS }, [&](const Storage::User &user) { readers.push_back(user.id); });
+		uint64_t deliveries{ 0 };
+		auto perReader = Bench::measure("unread read and acknowledged (per reader)", readers.size(), [&](uint64_t i) {
+			unsigned long long last{ 0 };
+			storage->forEachUnread(readers[i], 0, 1000000, [&](const Storage::Delivery &delivery) {
+				last = delivery.seq;
+				++deliveries;
+			});
+			storage->acknowledge(readers[i], last);
+		});
+		Bench::report("  per delivery", perReader * readers.size() / std::max<uint64_t>(deliveries, 1), "ns");
+
+		Bench::measure("broadcast history page", USERS, [&](uint64_t) {
+			storage->forEachBroadcastHistory(0, PAGE, [](const Storage::HistoryEntry &entry) { Bench::keep(entry.id); });
+		});
+		Bench::measure("private history page", USERS, [&](uint64_t i) {
+			storage->forEachPrivateHistory(logins[i], logins[(i * 13 + 1) % USERS], 0, PAGE,
+				[](const Storage::HistoryEntry &entry) { Bench::keep(entry.id); });
+		});
+		storage.reset();
+		Storage::cleanup(config, getpid());
+	}
+
+	std::string writeConfig(const std::string &name, const std::string &options) {
+		auto path = (std::filesystem::temp_directory_path() / (name + "-" + std::to_string(getpid()) + ".cfg")).string();
+		std::ofstream file{ path };
+		file << options;
+		return path;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	std::vector<std::string> configs{ argv + 1, argv + argc };
+	std::vector<std::string> temporary;
+	auto database = (std::filesystem::temp_directory_path() / ("bench_storage-" + std::to_string(getpid()) + ".db")).string();
+	if (configs.empty()) {
+		temporary.push_back(writeConfig("bench_sqlite", "StorageBackend = sqlite\nSqliteFile = " + database + "\n"));
+		temporary.push_back(writeConfig("bench_memory", "StorageBackend = memory\n"));
+		configs = temporary;
+	}
+	int result{ 0 };
+	for (const auto &config: configs) {
+		try {
+			run(config);
+		}
+		catch (const std::exception &e) {
+			std::cerr << "Error: " << e.what() << std::endl;
+			result = 1;
+		}
+	}
+	for (const auto &path: temporary) {
+		std::filesystem::remove(path);
+	}
+	for (const auto &suffix: { "", "-wal", "-shm" }) {
+		std::filesystem::remove(database + suffix);
+	}
+	return result;
+}
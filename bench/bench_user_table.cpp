@@ -0,0 +1,106 @@
+#include "bench.h"
+#include "../src/user_table.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+extern "C" {
+	#include <malloc.h>
+}
+
+// UserTable against the std::map of users by login it replaced: adding users, lookups by login and
+// by user id, and the heap taken by the users
+namespace {
+	const unsigned USERS{ 1000000 };
+	const uint64_t LOOKUPS{ 2000000 };
+
+	// a user of the replaced map, the id was found by a scan
+	struct MapUser {
+		std::string login;
+		std::string password;
+		std::string name;
+		unsigned user_id;
+	};
+
+	using UserMap = std::map<std::string, MapUser>;
+
+	std::string login(const unsigned user_id) {
+		return "user" + std::to_string(user_id);
+	}
+
+	std::string password(const unsigned user_id) {
+		// a SHA-256 hash in hex, as stored
+		auto text = std::to_string(user_id * 2654435761u);
+		return std::string(64 - text.size(), 'a') + text;
+	}
+
+	std::string name(const unsigned user_id) {
+		return "User number " + std::to_string(user_id);
+	}
+
+	size_t heap() {
+		return mallinfo2().uordblks;
+	}
+
+	void load(UserMap &map, UserTable &table) {
+		auto before = heap();
+		Bench::measure("add, std::map", USERS, [&](uint64_t i) {
+			auto id = static_cast<unsigned>(i) + 1;
+			auto key = login(id);
+			map.emplace(key, MapUser{ key, password(id), name(id), id });
+		});
+		auto mapHeap = heap() - before;
+		before = heap();
+		Bench::measure("add, UserTable", USERS, [&](uint64_t i) {
+			auto id = static_cast<unsigned>(i) + 1;
+			table.add(id, login(id), password(id), name(id));
+		});
+		auto tableHeap = heap() - before;
+		Bench::report("heap, std::map", static_cast<double>(mapHeap) / (1 << 20), "MiB");
+		Bench::report("heap, UserTable", static_cast<double>(tableHeap) / (1 << 20), "MiB");
+	}
+
+	void lookups(const UserMap &map, const UserTable &table) {
+		// the logins are made beforehand, only the lookups are timed
+		std::vector<std::string> hits, misses;
+		Bench::Random random;
+		for (unsigned i = 0; i < 1 << 16; ++i) {
+			auto id = static_cast<unsigned>(random.next() % USERS) + 1;
+			hits.push_back(login(id));
+			misses.push_back(login(id + USERS));
+		}
+		auto mask = hits.size() - 1;
+		Bench::measure("login found, std::map", LOOKUPS, [&](uint64_t i) {
+			Bench::keep(map.find(hits[i & mask])->second.user_id);
+		});
+		Bench::measure("login found, UserTable", LOOKUPS, [&](uint64_t i) {
+			Bench::keep(table.id(table.find(hits[i & mask])));
+		});
+		Bench::measure("login missing, std::map", LOOKUPS, [&](uint64_t i) {
+			Bench::keep(map.find(misses[i & mask]) == map.end());
+		});
+		Bench::measure("login missing, UserTable", LOOKUPS, [&](uint64_t i) {
+			Bench::keep(table.find(misses[i & mask]));
+		});
+
+		Bench::measure("user id, std::map scan", 200, [&](uint64_t) {
+			auto id = static_cast<unsigned>(random.next() % USERS) + 1;
+			auto it = std::find_if(map.begin(), map.end(), [&](const auto &user) { return user.second.user_id == id; });
+			Bench::keep(it->second.login.size());
+		});
+		Bench::measure("user id, UserTable", LOOKUPS, [&](uint64_t) {
+			auto id = static_cast<unsigned>(random.next() % USERS) + 1;
+			Bench::keep(table.login(table.findId(id)).size());
+		});
+	}
+}
+
+int main() {
+	UserMap map;
+	UserTable table;
+	load(map, table);
+	lookups(map, table);
+	return 0;
+}
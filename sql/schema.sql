@@ -1,5 +1,10 @@
+DROP TABLE IF EXISTS `id_sequences`;
+DROP TABLE IF EXISTS `journal_checkpoint`;
 DROP TABLE IF EXISTS `unread_messages`;
+DROP TABLE IF EXISTS `delivery_cursors`;
 DROP TABLE IF EXISTS `messages`;
+DROP TABLE IF EXISTS `channel_members`;
+DROP TABLE IF EXISTS `channels`;
 DROP TABLE IF EXISTS `users_sessions`;
 DROP TABLE IF EXISTS `users`;
 
@@ -19,22 +24,54 @@ CREATE TABLE `active_sessions` (
 	`port` INT NOT NULL,
 	`session_start` TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP,
 	`last_activity` TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP,
+	`node` INT UNSIGNED NOT NULL DEFAULT 0,
 	UNIQUE(`user_id`),
-	UNIQUE(`pid`),
+	UNIQUE(`node`, `pid`),
 	FOREIGN KEY (`user_id`)
 		REFERENCES `users`(`id`)
 		ON DELETE CASCADE
 		ON UPDATE CASCADE
 );
 
+CREATE TABLE `channels` (
+	`id` BIGINT NOT NULL PRIMARY KEY,
+	`name` VARCHAR(200) NOT NULL,
+	UNIQUE(`name`)
+);
+
+CREATE TABLE `channel_members` (
+	`channel_id` BIGINT NOT NULL,
+	`user_id` BIGINT NOT NULL,
+	UNIQUE(`channel_id`, `user_id`),
+	FOREIGN KEY (`channel_id`)
+		REFERENCES `channels`(`id`)
+		ON DELETE CASCADE
+		ON UPDATE CASCADE,
+	FOREIGN KEY (`user_id`)
+		REFERENCES `users`(`id`)
+		ON DELETE CASCADE
+		ON UPDATE CASCADE
+);
+
+-- messages, unread_messages and delivery_cursors move to the shards of the DBShards option, see shard_schema.sql.
+-- Logins and the channel name are stored with the message, history and delivery read no other table
 CREATE TABLE `messages` (
 	`id` BIGINT NOT NULL PRIMARY KEY,
 	`type` VARCHAR(10),
 	`sender` BIGINT NOT NULL,
+	`sender_login` VARCHAR(200) NOT NULL,
 	`receiver` BIGINT,
+	`receiver_login` VARCHAR(200),
+	`channel_id` BIGINT,
+	`channel_name` VARCHAR(200),
 	`text` TEXT NOT NULL,
 	`sent` TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP,
+	`is_copy` BOOLEAN NOT NULL DEFAULT FALSE,
 	CHECK(`type` IN ('BROADCAST', 'PRIVATE')),
+	INDEX `messages_conversation` (`receiver`, `sender`, `id`),
+	INDEX `messages_channel` (`channel_id`, `receiver`, `id`),
+	-- private conversations in both directions, walked by the retention job
+	INDEX `messages_pair` ((LEAST(`receiver`, `sender`)), (GREATEST(`receiver`, `sender`))),
 	FOREIGN KEY (`sender`)
 		REFERENCES `users`(`id`)
 		ON DELETE CASCADE
@@ -42,13 +79,19 @@ CREATE TABLE `messages` (
 	FOREIGN KEY (`receiver`)
 		REFERENCES `users`(`id`)
 		ON DELETE CASCADE
+		ON UPDATE CASCADE,
+	FOREIGN KEY (`channel_id`)
+		REFERENCES `channels`(`id`)
+		ON DELETE CASCADE
 		ON UPDATE CASCADE
 );
 
 CREATE TABLE `unread_messages` (
 	`message_id` BIGINT NOT NULL,
 	`user_id` BIGINT NOT NULL,
+	`seq` BIGINT UNSIGNED NOT NULL,
 	UNIQUE(`message_id`, `user_id`),
+	UNIQUE(`user_id`, `seq`),
 	FOREIGN KEY (`user_id`)
 		REFERENCES `users`(`id`)
 		ON DELETE CASCADE
@@ -59,4 +102,35 @@ CREATE TABLE `unread_messages` (
 		ON UPDATE CASCADE
 );
 
+CREATE TABLE `delivery_cursors` (
+	`user_id` BIGINT NOT NULL PRIMARY KEY,
+	`last_seq` BIGINT UNSIGNED NOT NULL,
+	`acked_seq` BIGINT UNSIGNED NOT NULL,
+	FOREIGN KEY (`user_id`)
+		REFERENCES `users`(`id`)
+		ON DELETE CASCADE
+		ON UPDATE CASCADE
+);
 
+CREATE TABLE `journal_checkpoint` (
+	`id` INT NOT NULL PRIMARY KEY,
+	`position` BIGINT UNSIGNED NOT NULL
+);
+
+-- next id to hand out, reserved by the nodes in blocks. Message ids are unique across all shards
+CREATE TABLE `id_sequences` (
+	`name` VARCHAR(50) NOT NULL PRIMARY KEY,
+	`next_id` BIGINT NOT NULL
+);
+
+-- channel 0 stands for the broadcast
+INSERT INTO `id_sequences` (`name`, `next_id`) VALUES ('users', 0), ('messages', 0), ('channels', 1);
+
+-- lowest id every node may still commit, saved every second. Readers of messages in id order stop below it
+CREATE TABLE `id_horizons` (
+	`node` INT NOT NULL,
+	`name` VARCHAR(50) NOT NULL,
+	`next_id` BIGINT NOT NULL,
+	`updated` TIMESTAMP NOT NULL,
+	PRIMARY KEY (`node`, `name`)
+);
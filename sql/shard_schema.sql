@@ -0,0 +1,54 @@
+-- Schema of a message shard, see the DBShards option. Users, channels and id_sequences stay
+-- in the primary database (schema.sql), so the shard tables refer to them without foreign keys
+
+DROP TABLE IF EXISTS `unread_messages`;
+DROP TABLE IF EXISTS `delivery_cursors`;
+DROP TABLE IF EXISTS `messages`;
+DROP TABLE IF EXISTS `journal_checkpoint`;
+
+-- a copy is kept on the shard of a recipient while the message is unread there,
+-- the message itself is on the shard of its receiver or channel
+CREATE TABLE `messages` (
+	`id` BIGINT NOT NULL PRIMARY KEY,
+	`type` VARCHAR(10),
+	`sender` BIGINT NOT NULL,
+	`sender_login` VARCHAR(200) NOT NULL,
+	`receiver` BIGINT,
+	`receiver_login` VARCHAR(200),
+	`channel_id` BIGINT,
+	`channel_name` VARCHAR(200),
+	`text` TEXT NOT NULL,
+	`sent` TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP,
+	`is_copy` BOOLEAN NOT NULL DEFAULT FALSE,
+	CHECK(`type` IN ('BROADCAST', 'PRIVATE')),
+	INDEX `messages_conversation` (`receiver`, `sender`, `id`),
+	INDEX `messages_channel` (`channel_id`, `receiver`, `id`),
+	-- private conversations in both directions, walked by the retention job
+	INDEX `messages_pair` ((LEAST(`receiver`, `sender`)), (GREATEST(`receiver`, `sender`))),
+	INDEX `messages_sender` (`sender`)
+);
+
+CREATE TABLE `unread_messages` (
+	`message_id` BIGINT NOT NULL,
+	`user_id` BIGINT NOT NULL,
+	`seq` BIGINT UNSIGNED NOT NULL,
+	UNIQUE(`message_id`, `user_id`),
+	UNIQUE(`user_id`, `seq`),
+	FOREIGN KEY (`message_id`)
+		REFERENCES `messages`(`id`)
+		ON DELETE CASCADE
+		ON UPDATE CASCADE
+);
+
+CREATE TABLE `delivery_cursors` (
+	`user_id` BIGINT NOT NULL PRIMARY KEY,
+	`last_seq` BIGINT UNSIGNED NOT NULL,
+	`acked_seq` BIGINT UNSIGNED NOT NULL
+);
+
+-- journal position of the records written to this shard, see JournalDir. A batch that failed
+-- to commit on another database is applied again without the records this shard already has
+CREATE TABLE `journal_checkpoint` (
+	`id` INT NOT NULL PRIMARY KEY,
+	`position` BIGINT UNSIGNED NOT NULL
+);
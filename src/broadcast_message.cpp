@@ -11,17 +11,19 @@ namespace fs = std::filesystem;
 BroadcastMessage::BroadcastMessage(
 	const std::string &sender,
 	const std::string &text,
-	const std::map<std::string, ChatUser> &user_list
-	) :
-	users_unread_{ user_list } {
+	UserDirectory &user_list
+	) {
 	sender_ = sender;
 	text_ = text;
+	user_list.forEachLogin([this](std::string_view login) {
+		users_unread_.emplace(login);
+	});
 }
 
 BroadcastMessage::BroadcastMessage(
 	const std::string &sender, 
 	const std::string &text,
-	const std::map<std::string, ChatUser> &user_list,
+	UserDirectory &user_list,
 	const std::string &user_list_str 
 	) {
 	sender_ = sender;
@@ -29,9 +31,8 @@ BroadcastMessage::BroadcastMessage(
 
 	auto users = Chat::split(user_list_str, ",");
 	for (const auto &s: users) {
-		auto it = user_list.find(s);
-		if (it != user_list.end()) {
-			users_unread_.emplace(it->first, it->second);
+		if (user_list.find(s)) {
+			users_unread_.insert(s);
 		}
 	}
 }
@@ -67,7 +68,7 @@ void BroadcastMessage::save(const std::string &filename) const {
 	auto size = users_unread_.size();
 	size_t i = 0;
 	for (auto it = users_unread_.begin(); it != users_unread_.end(); ++it) {
-		file << it->first;
+		file << *it;
 		if (i < size - 1) {
 			file << ',';
 		}
@@ -77,32 +78,24 @@ void BroadcastMessage::save(const std::string &filename) const {
 	file.close();
 }
 
-void BroadcastMessage::save(Mysql &mysql) const {
-	std::stringstream ss;
-	mysql.query("SELECT COALESCE(max(`id`), -1) FROM `messages`");
-	auto rows = mysql.fetchAll();
-	unsigned new_id = std::stoi(rows.front().at(0)) + 1;
-	ss << "INSERT INTO `messages` (`id`, `type`, `sender`, `text`) VALUES (" <<
-		new_id << ", 'BROADCAST', "
-		"(SELECT `id` FROM `users` WHERE `login` = '" << sender_ << "'), "
-		"'" << text_ << "')";
-	if (!mysql.query(ss.str())) {
-		std::cout << ss.str() << std::endl;
-		std::cout << mysql.getError() << std::endl;
-	}
-	
-	for (auto it: users_unread_) {
-		ss.str(std::string{});
-		ss << "INSERT INTO `unread_messages` (`message_id`, `user_id`) "
-			"VALUES (" << new_id << ", "
-			"(SELECT `id` FROM `users` WHERE `login` = '" << it.first << "'))";
-		if (!mysql.query(ss.str())) {
-			std::cout << ss.str() << std::endl;
-			std::cout << mysql.getError() << std::endl;
-		}
+void BroadcastMessage::save(Storage &storage) const {
+	std::vector<std::string> recipients;
+	recipients.reserve(users_unread_.size());
+	for (const auto &it: users_unread_) {
+		recipients.push_back(it);
 	}
+	storage.saveBroadcastMessage(sender_, text_, recipients, sent_);
 }
 
-std::string BroadcastMessage::createTransferString() const {
-	return std::string{ "BROADCAST\n" } + sender_ + "\n" + text_ + "\n";
+void BroadcastMessage::save(MessageJournal &journal) const {
+	MessageJournal::Record record;
+	record.type = MessageJournal::BROADCAST;
+	record.sent = sent_;
+	record.sender = sender_;
+	record.text = text_;
+	record.recipients.reserve(users_unread_.size());
+	for (const auto &it: users_unread_) {
+		record.recipients.push_back(it);
+	}
+	journal.append(record);
 }
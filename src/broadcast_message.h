@@ -1,15 +1,15 @@
 #pragma once
 #include "chat_message.h"
-#include "chat_user.h"
+#include "user_directory.h"
 
-#include <map>
+#include <set>
 #include <string>
 #include <vector>
 
 class BroadcastMessage final : public ChatMessage {
 public:
-	BroadcastMessage(const std::string &, const std::string &, const std::map<std::string, ChatUser> &);
-	BroadcastMessage(const std::string &, const std::string &, const std::map<std::string, ChatUser> &, const std::string &);
+	BroadcastMessage(const std::string &, const std::string &, UserDirectory &);
+	BroadcastMessage(const std::string &, const std::string &, UserDirectory &, const std::string &);
 
 	// print the message
 	void print() const override;
@@ -21,15 +21,15 @@ public:
 	bool isRead() const override;
   
 	// save message to database
-	void save(Mysql &mysql) const override;
+	void save(Storage &storage) const override;
+
+	// append message to the write-ahead journal
+	void save(MessageJournal &journal) const override;
 	
 	// save message to file
 	void save(const std::string&) const override;
 
-	// pack string with message information for transferring it through a network
-	std::string createTransferString() const override;
-
 private:
 
-	std::map<std::string, ChatUser> users_unread_;
+	std::set<std::string> users_unread_; // logins
 };
@@ -0,0 +1,84 @@
+#include "channel_index.h"
+
+#include <algorithm>
+
+ChannelIndex::ChannelIndex() :
+	memory_{ std::make_unique<SharedMemory>(sizeof(std::atomic<uint64_t>)) },
+	generation_{ memory_->as<std::atomic<uint64_t>>() } {
+}
+
+void ChannelIndex::refresh(Storage &storage) {
+	// read before loading, so a change made during the load is not missed
+	auto generation = generation_->load();
+	if (generation == loaded_) {
+		return;
+	}
+	std::unordered_map<std::string, Channel> channels;
+	std::unordered_map<unsigned, std::string> logins;
+	storage.forEachChannelMember([&](const Storage::ChannelMember &member) {
+		auto &channel = channels[std::string{ member.channel }];
+		channel.id = member.channel_id;
+		// rows come ordered by user id
+		channel.members.push_back(member.user_id);
+		logins.try_emplace(member.user_id, member.login);
+	});
+	channels_ = std::move(channels);
+	logins_ = std::move(logins);
+	loaded_ = generation;
+}
+
+void ChannelIndex::changed() {
+	generation_->fetch_add(1);
+}
+
+void ChannelIndex::join(Storage &storage, const std::string &channel, const unsigned user_id) {
+	storage.joinChannel(channel, user_id);
+	changed();
+}
+
+bool ChannelIndex::leave(Storage &storage, const std::string &channel, const unsigned user_id) {
+	if (!isMember(storage, channel, user_id)) {
+		return false;
+	}
+	storage.leaveChannel(channel, user_id);
+	changed();
+	return true;
+}
+
+bool ChannelIndex::isMember(Storage &storage, const std::string &channel, const unsigned user_id) {
+	refresh(storage);
+	auto it = channels_.find(channel);
+	return it != channels_.end() && std::binary_search(it->second.members.begin(), it->second.members.end(), user_id);
+}
+
+std::vector<std::string> ChannelIndex::members(Storage &storage, const std::string &channel) {
+	refresh(storage);
+	std::vector<std::string> logins;
+	auto it = channels_.find(channel);
+	if (it == channels_.end()) {
+		return logins;
+	}
+	logins.reserve(it->second.members.size());
+	for (auto id: it->second.members) {
+		logins.push_back(logins_.at(id));
+	}
+	return logins;
+}
+
+std::vector<unsigned> ChannelIndex::memberIds(Storage &storage, const std::string &channel) {
+	refresh(storage);
+	auto it = channels_.find(channel);
+	return it == channels_.end() ? std::vector<unsigned>{} : it->second.members;
+}
+
+std::vector<unsigned long long> ChannelIndex::channelsOf(Storage &storage, const unsigned user_id) {
+	refresh(storage);
+	std::vector<unsigned long long> ids;
+	for (const auto &[name, channel]: channels_) {
+		if (std::binary_search(channel.members.begin(), channel.members.end(), user_id)) {
+			ids.push_back(channel.id);
+		}
+	}
+	std::sort(ids.begin(), ids.end());
+	return ids;
+}
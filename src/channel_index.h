@@ -0,0 +1,48 @@
+#pragma once
+
+#include "shared_memory.h"
+#include "storage.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Channel membership: channel name to ids of its members, loaded from the storage.
+// Every process keeps its own copy and reloads it after membership has been changed
+// by any process of the server. Must be created before fork()
+class ChannelIndex final {
+public:
+	ChannelIndex();
+	ChannelIndex(const ChannelIndex &) = delete;
+	ChannelIndex &operator=(const ChannelIndex &) = delete;
+
+	void join(Storage &storage, const std::string &channel, unsigned user_id);
+	// false if the user is not a member of the channel
+	bool leave(Storage &storage, const std::string &channel, unsigned user_id);
+
+	bool isMember(Storage &storage, const std::string &channel, unsigned user_id);
+	// logins of the channel members, empty if the channel does not exist
+	std::vector<std::string> members(Storage &storage, const std::string &channel);
+	// sorted ids of the channel members
+	std::vector<unsigned> memberIds(Storage &storage, const std::string &channel);
+	// sorted ids of the channels the user is a member of
+	std::vector<unsigned long long> channelsOf(Storage &storage, unsigned user_id);
+
+private:
+	struct Channel {
+		unsigned long long id;
+		std::vector<unsigned> members; // sorted user ids
+	};
+
+	void refresh(Storage &storage); // reload if another process has changed membership
+	void changed(); // tell all processes to reload
+
+	std::unique_ptr<SharedMemory> memory_;
+	std::atomic<uint64_t> *generation_; // incremented on every membership change
+	uint64_t loaded_{ UINT64_MAX }; // generation of the local copy
+	std::unordered_map<std::string, Channel> channels_;
+	std::unordered_map<unsigned, std::string> logins_;
+};
@@ -0,0 +1,61 @@
+#include "channel_message.h"
+
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+
+ChannelMessage::ChannelMessage(
+	const std::string &sender,
+	const std::string &channel,
+	const std::string &text,
+	const std::vector<std::string> &members
+	) :
+	channel_{ channel },
+	users_unread_{ members.begin(), members.end() } {
+	sender_ = sender;
+	text_ = text;
+}
+
+void ChannelMessage::print() const {
+	std::cout << sender_ << ": #" << channel_ << ' ' << text_ << std::endl;
+}
+
+void ChannelMessage::printIfUnreadByUser(const std::string &user) {
+	if (users_unread_.erase(user) > 0) {
+		print();
+	}
+}
+
+bool ChannelMessage::isRead() const {
+	return users_unread_.empty();
+}
+
+void ChannelMessage::save(const std::string &filename) const {
+	std::ofstream file(filename, std::ios::out | std::ios::app);
+	if (!file.is_open()) {
+		throw std::runtime_error{ "Error: cannot open file" + filename + " for append" };
+	}
+	file << "CHANNEL\n"
+		<< sender_ << '\n'
+		<< channel_ << '\n';
+	for (auto it = users_unread_.begin(); it != users_unread_.end(); ++it) {
+		file << (it == users_unread_.begin() ? "" : ",") << *it;
+	}
+	file << '\n' << text_ << std::endl;
+	file.close();
+}
+
+void ChannelMessage::save(Storage &storage) const {
+	storage.saveChannelMessage(sender_, channel_, text_, { users_unread_.begin(), users_unread_.end() }, sent_);
+}
+
+void ChannelMessage::save(MessageJournal &journal) const {
+	MessageJournal::Record record;
+	record.type = MessageJournal::CHANNEL;
+	record.sent = sent_;
+	record.sender = sender_;
+	record.channel = channel_;
+	record.text = text_;
+	record.recipients.assign(users_unread_.begin(), users_unread_.end());
+	journal.append(record);
+}
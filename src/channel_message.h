@@ -0,0 +1,34 @@
+#pragma once
+#include "chat_message.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+// message to the members of a channel
+class ChannelMessage final : public ChatMessage {
+public:
+	ChannelMessage(const std::string &sender, const std::string &channel, const std::string &text, const std::vector<std::string> &members);
+
+	// print the message
+	void print() const override;
+
+	// print the message if it is unread by user
+	void printIfUnreadByUser(const std::string &) override;
+
+	// check if message is read
+	bool isRead() const override;
+
+	// save message to database
+	void save(Storage &storage) const override;
+
+	// append message to the write-ahead journal
+	void save(MessageJournal &journal) const override;
+
+	// save message to file
+	void save(const std::string &) const override;
+
+private:
+	std::string channel_;
+	std::set<std::string> users_unread_;
+};
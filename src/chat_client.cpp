@@ -1,5 +1,6 @@
 #include "chat_client.h"
 #include "project_lib.h"
+#include "wire_format.h"
 
 #include <string>
 #include <fstream>
@@ -37,10 +38,19 @@ ChatClient::ChatClient() {
 	std::cout <<
 		"Welcome to the chat,\n"
 		"to view help, type /help" << std::endl;
-	std::cout << "Connecting to " << config_["ServerAddress"] << ':' << config_["ServerPort"] << "..." << std::endl;
+	connectToServer(config_["ServerAddress"], stoi(config_["ServerPort"]));
 
-	server_.sin_addr.s_addr = inet_addr(config_["ServerAddress"].c_str());
-	server_.sin_port = htons(stoi(config_["ServerPort"]));
+	signal(SIGCHLD, SIG_IGN);
+}
+
+void ChatClient::connectToServer(const std::string &address, const unsigned short port) {
+	std::cout << "Connecting to " << address << ':' << port << "..." << std::endl;
+	if (sockFd_ != -1) {
+		close(sockFd_);
+	}
+
+	server_.sin_addr.s_addr = inet_addr(address.c_str());
+	server_.sin_port = htons(port);
 	server_.sin_family = AF_INET;
 
 	sockFd_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -55,8 +65,6 @@ ChatClient::ChatClient() {
 		}
 		throw std::runtime_error{ "Could not connect to server" };
 	}
-
-	signal(SIGCHLD, SIG_IGN);
 }
 
 ChatClient::~ChatClient() {
@@ -70,8 +78,13 @@ void ChatClient::displayHelp() const {
 		" /signin - authorization, only a registered user can authorize\n"
 		" /logout - user logout\n"
 		" /remove - delete registered user\n"
+		" /join channel - join a channel, it is created if not exists\n"
+		" /leave channel - leave a channel\n"
+		" /history [#channel|@login] - show older messages, repeat for the previous page\n"
+		" /search words - show the newest messages containing all the words\n"
 		" /exit - close the program\n"
 		" Start your message with @login if you want to send a private message,\n"
+		"   with #channel if you want to send it to the channel members,\n"
 		"   otherwise your message will be broadcasted to all users.\n"
 		"User will receive new messages after login\n"
 		<< std::endl;
@@ -167,10 +180,26 @@ void ChatClient::signIn() {
 	std::cout << "Enter password: ";
 	getline(std::cin, password);
 	std::string cmd{ std::string{"/signin:"} + login + ":" + password };
-	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
-	strcpy(message_, cmd.c_str());
-	sendRequest();
-	receiveResponse();
+	for (unsigned short redirects = 0; ; ++redirects) {
+		std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+		strcpy(message_, cmd.c_str());
+		sendRequest();
+		receiveResponse();
+		// a node of the cluster sends the user to the node the user belongs to
+		if (strncmp(message_, "/response:redirect:", 19) != 0) {
+			break;
+		}
+		if (redirects == MAX_REDIRECTS) {
+			std::cout << "Login failed: too many redirects" << std::endl;
+			return;
+		}
+		std::string address{ message_ + 19 };
+		auto colon = address.rfind(':');
+		if (colon == std::string::npos) {
+			throw std::invalid_argument{ "invalid redirect address " + address };
+		}
+		connectToServer(address.substr(0, colon), static_cast<unsigned short>(std::stoul(address.substr(colon + 1))));
+	}
 	if (strncmp(message_, "/response:success", 17) == 0) {
 		std::cout << "Login successful" << std::endl;
 		auto tokens = Chat::split(std::string{ message_ }, ":");
@@ -192,6 +221,7 @@ void ChatClient::signIn() {
 }
 
 void ChatClient::startPoller() {
+	receivedSeq_ = ackedSeq_ = 0;
 	pollerPid_ = fork();
 	if (pollerPid_ < 0) {
 		throw std::invalid_argument{ "Fatal error: fork() failed" };
@@ -206,21 +236,59 @@ void ChatClient::startPoller() {
 			writeResponseToFile();
 			continue;
 		}
-		auto tokens = Chat::split(message_, "\n");
-		if (tokens.size() != 3) {
+		std::string_view frame{ message_, MESSAGE_LENGTH };
+		Chat::WireRecord record;
+		auto size = Chat::decodeRecord(frame, record);
+		if (size == 0) {
 			continue; // Wrong message
 		}
 		std::stringstream ss;
-		clearPrompt();
-		ss << tokens[1] << ": ";
-		if (tokens[0] == "PRIVATE") {
-			ss << '@' << loggedUser_ << ' ';
+		ss << record.sender << ": ";
+		if (record.type == Chat::WireRecord::PRIVATE) {
+			// the receiver is set in stored messages only
+			ss << '@' << (record.target.empty() ? loggedUser_ : record.target) << ' ';
+		}
+		else if (record.type == Chat::WireRecord::CHANNEL) {
+			ss << '#' << record.target << ' ';
+		}
+		ss << record.text;
+		if (record.flags & Chat::WireRecord::STORED) {
+			clearPrompt();
+			std::cout << ss.str() << std::endl;
+			printPrompt();
+			continue;
+		}
+		// the server sends unacknowledged messages again after reconnect or upgrade
+		uint64_t seq;
+		if (Chat::decodeVarint(frame.substr(size), seq) == 0) {
+			continue;
 		}
-		ss << tokens[2];
+		if (seq <= receivedSeq_) {
+			acknowledge();
+			continue;
+		}
+		receivedSeq_ = seq;
+		clearPrompt();
 		std::cout << ss.str() << std::endl;
 		*logger_ << ss.str();
 		printPrompt();
+		acknowledge();
+	}
+}
+
+void ChatClient::acknowledge() {
+	if (receivedSeq_ == ackedSeq_) {
+		return;
+	}
+	// one cumulative acknowledgement for a burst of messages
+	pollfd pending{ sockFd_, POLLIN, 0 };
+	if (receivedSeq_ - ackedSeq_ < ACK_BATCH && poll(&pending, 1, 0) > 0) {
+		return;
 	}
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	strcpy(message_, ("/ack:" + std::to_string(receivedSeq_)).c_str());
+	sendRequest();
+	ackedSeq_ = receivedSeq_;
 }
 
 void ChatClient::writeResponseToFile() const {
@@ -273,6 +341,7 @@ void ChatClient::signOut() {
 	strcpy(message_, "/logout");
 	sendRequest();
 	loggedUser_.clear();
+	historyScope_.clear();
 	kill(pollerPid_, SIGTERM);
 }
 
@@ -295,6 +364,111 @@ void ChatClient::removeUser() {
 	}
 }
 
+void ChatClient::changeChannel() {
+	if (loggedUser_.empty()) {
+		std::cout << "You are not logged in\n" << std::endl;
+		return;
+	}
+	// "/join name" or "/join #name"
+	std::string input{ message_ };
+	auto pos = input.find(' ');
+	std::string command{ input.substr(0, pos) };
+	std::string channel{ pos == std::string::npos ? "" : input.substr(pos + 1) };
+	std::erase(channel, ' ');
+	if (!channel.empty() && channel[0] == '#') {
+		channel.erase(0, 1);
+	}
+	if (channel.empty()) {
+		std::cout << "Channel name cannot be empty\n" << std::endl;
+		return;
+	}
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	strcpy(message_, (command + ":" + channel).c_str());
+	sendRequest();
+	while (!readResponseFromFile()) {
+		sleep(1);
+	}
+	if (strncmp(message_, "/response:success", 17) != 0) {
+		std::cout << "Can not " << command.substr(1) << " channel #" << channel << "\n" << std::endl;
+	}
+	else if (command == "/join") {
+		std::cout << "You have joined channel #" << channel << "\n" << std::endl;
+	}
+	else {
+		std::cout << "You have left channel #" << channel << "\n" << std::endl;
+	}
+}
+
+void ChatClient::showHistory() {
+	if (loggedUser_.empty()) {
+		std::cout << "You are not logged in\n" << std::endl;
+		return;
+	}
+	// "/history", "/history #channel" or "/history @login"
+	std::string input{ message_ };
+	auto pos = input.find(' ');
+	std::string scope{ pos == std::string::npos ? "all" : input.substr(pos + 1) };
+	std::erase(scope, ' ');
+	if (scope.empty()) {
+		scope = "all";
+	}
+	if (scope != historyScope_) {
+		historyScope_ = scope;
+		historyBefore_ = 0;
+	}
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	strcpy(message_, ("/history:" + historyScope_ + ":" + std::to_string(historyBefore_)).c_str());
+	sendRequest();
+	// messages are printed by the poller before the response arrives
+	while (!readResponseFromFile()) {
+		sleep(1);
+	}
+	if (strncmp(message_, "/response:history:", 18) != 0) {
+		std::cout << "Can not load history of " << historyScope_ << "\n" << std::endl;
+		historyScope_.clear();
+		return;
+	}
+	historyBefore_ = std::stoull(message_ + 18);
+	if (historyBefore_ == 0) {
+		std::cout << "No older messages\n" << std::endl;
+		historyScope_.clear();
+	}
+	else {
+		std::cout << "Enter /history again for older messages\n" << std::endl;
+	}
+}
+
+void ChatClient::searchMessages() {
+	if (loggedUser_.empty()) {
+		std::cout << "You are not logged in\n" << std::endl;
+		return;
+	}
+	// "/search words"
+	std::string input{ message_ };
+	auto pos = input.find(' ');
+	std::string query{ pos == std::string::npos ? "" : input.substr(pos + 1) };
+	if (query.find_first_not_of(' ') == std::string::npos) {
+		std::cout << "Enter words to search for\n" << std::endl;
+		return;
+	}
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	strcpy(message_, ("/search:" + query).substr(0, MESSAGE_LENGTH - 1).c_str());
+	sendRequest();
+	// messages are printed by the poller before the response arrives
+	while (!readResponseFromFile()) {
+		sleep(1);
+	}
+	if (strncmp(message_, "/response:search:", 17) != 0) {
+		std::cout << "Search is not available\n" << std::endl;
+	}
+	else if (strcmp(message_ + 17, "0") == 0) {
+		std::cout << "Nothing found\n" << std::endl;
+	}
+	else {
+		std::cout << "Found messages: " << message_ + 17 << "\n" << std::endl;
+	}
+}
+
 ssize_t ChatClient::sendRequest() const {
 	if (*message_ == '\0') {
 		// invalid argument passed
@@ -313,9 +487,15 @@ ssize_t ChatClient::receiveResponse() const {
 			std::string{ strerror(errno) } 
 		};
 	}
-	if (bytes == 0 || strncmp(message_, "/response:kick", 14) == 0) {
+	bool shutdown = bytes > 0 && strncmp(message_, "/response:shutdown", 18) == 0;
+	if (bytes == 0 || shutdown || strncmp(message_, "/response:kick", 14) == 0) {
 		clearPrompt();
-		std::cout << "\nError: connection with server was lost\n" << std::endl;
+		if (shutdown) {
+			std::cout << "\nServer is shutting down, please connect later\n" << std::endl;
+		}
+		else {
+			std::cout << "\nError: connection with server was lost\n" << std::endl;
+		}
 		if (getpid() == mainPid_) {
 			cleanExit();
 		}
@@ -361,6 +541,15 @@ void ChatClient::work() {
 					removeUser();
 				}
 			}
+			else if (strncmp(message_, "/join", 5) == 0 || strncmp(message_, "/leave", 6) == 0) {
+				changeChannel();
+			}
+			else if (strncmp(message_, "/history", 8) == 0) {
+				showHistory();
+			}
+			else if (strncmp(message_, "/search", 7) == 0) {
+				searchMessages();
+			}
 			else if (!loggedUser_.empty() && *message_ != '/') {
 				*logger_ << std::string{ message_ };
 				sendRequest();
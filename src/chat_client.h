@@ -24,6 +24,7 @@ struct WindowsVersion {
 #include <arpa/inet.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <poll.h>
 #endif
 
 class ChatClient final {
@@ -38,9 +39,13 @@ private:
 	bool isLoginAvailable(const std::string& login) const; // login availability
 	void signUp(); // registration
 	bool isValidLogin(const std::string& login) const; // login verification
-	void signIn(); // authorization
+	void signIn(); // authorization, follows redirects to the node of the user
+	void connectToServer(const std::string &address, unsigned short port); // replaces the current connection
 	void signOut(); // user logout
 	void removeUser(); // deleting a user
+	void changeChannel(); // joining or leaving a channel
+	void showHistory(); // page of older messages, the next call continues from it
+	void searchMessages(); // newest messages containing the words
 	ssize_t sendRequest() const; // sending a message
 	ssize_t receiveResponse() const; // receiving a response
 	void sendPrivateMessage(const std::string &senderName, const std::string& receiverName, const std::string& messageText); // sending a private message
@@ -50,11 +55,14 @@ private:
 	void writeResponseToFile() const;
 	bool readResponseFromFile() const;
 	void startPoller();
+	void acknowledge(); // tell the server which messages have been received
 	void clearPrompt() const;
 	void cleanExit() const;
 	void displayHelp() const;
 	
 	static const unsigned short MESSAGE_LENGTH{ 1024 };
+	static const unsigned short ACK_BATCH{ 64 }; // messages received without acknowledgement while more are coming
+	static const unsigned short MAX_REDIRECTS{ 3 }; // nodes may disagree for a moment which one is up
 	const std::string USER_CONFIG{ "users.cfg" };
 	const std::string MESSAGES_LOG{ "messages.log" };
 	const std::string CONFIG_FILE{ "client.cfg" };
@@ -71,7 +79,11 @@ private:
 	sockaddr_in server_;
 	pid_t mainPid_;
 	pid_t pollerPid_;
-	int sockFd_;
+	int sockFd_{ -1 };
+	unsigned long long receivedSeq_{ 0 }; // last message shown, repeated ones are skipped
+	unsigned long long ackedSeq_{ 0 };
+	std::string historyScope_; // all, @login or #channel
+	unsigned long long historyBefore_{ 0 }; // older messages are shown next, 0 for the newest
 	std::unique_ptr<Logger> logger_;
 	mutable char message_[MESSAGE_LENGTH];
 };
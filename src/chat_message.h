@@ -1,5 +1,7 @@
 #pragma once
-#include "chat_user.h"
+#include "storage.h"
+#include "message_journal.h"
+#include <ctime>
 #include <memory>
 #include <string>
 
@@ -14,11 +16,11 @@ public:
 	// check if message is read
 	virtual bool isRead() const = 0;
 
-	// pack string with message information for transferring it through a network
-	virtual std::string createTransferString() const = 0;
-
 	// save message to database
-	virtual void save(Mysql &) const = 0;
+	virtual void save(Storage &) const = 0;
+
+	// append message to the write-ahead journal
+	virtual void save(MessageJournal &) const = 0;
 	
 	// save message to file
 	virtual void save(const std::string &) const = 0;
@@ -26,4 +28,5 @@ public:
 protected:
 	std::string text_;
 	std::string sender_;
+	time_t sent_{ std::time(nullptr) };
 };
@@ -6,12 +6,18 @@
 #include <string>
 #include <fstream>
 #include <filesystem>
+#include <chrono>
+#include <optional>
 #if defined(__linux__)
 #include <cstdlib>
+#include <climits>
 extern "C" {
 	#include <sys/utsname.h>
 	#include <errno.h>
 	#include <sys/select.h>
+	#include <poll.h>
+	#include <sys/eventfd.h>
+	#include <sys/resource.h>
 }
 #elif defined(_WIN64) or defined(_WIN32)
 #pragma comment(lib, "ntdll")
@@ -22,9 +28,11 @@ extern "C" NTSTATUS __stdcall RtlGetVersion(OSVERSIONINFOEXW * lpVersionInformat
 namespace fs = std::filesystem;
 
 // constructor
-ChatServer::ChatServer() {
+ChatServer::ChatServer(const bool takeover) {
 	mainPid_ = getpid();
+	instancePid_ = mainPid_;
 	printSystemInformation();
+	Metrics::init();
 
 	try {
 		logger_ = std::make_unique<Logger>(config_["LogFile"]);
@@ -38,66 +46,370 @@ ChatServer::ChatServer() {
 		throw std::runtime_error{ ss.str() };
 	}
 
-	if (fs::exists(TEMP_DIR)) {
-		throw std::runtime_error{
-			std::string{ "Temporary directory " } +
-			TEMP_DIR +
-			" exists. Maybe server is already running? "
-			"If server is not running, please delete temporary directory before start"
-		};
+	if (config_.contains("SlowQueryLog")) {
+		try {
+			Mysql::setSlowQueryLog(config_["SlowQueryLog"], std::stod(config_.get("SlowQueryThreshold", "100")));
+		}
+		catch (const std::exception &e) {
+			std::stringstream ss;
+			ss << "Can not open slow query log: " << std::quoted(config_["SlowQueryLog"]) << " (" << e.what() << ')';
+			throw std::runtime_error{ ss.str() };
+		}
+	}
+
+	if (takeover) {
+		takeOver();
+	}
+	else {
+		if (fs::exists(TEMP_DIR)) {
+			throw std::runtime_error{
+				std::string{ "Temporary directory " } +
+				TEMP_DIR +
+				" exists. Maybe server is already running? "
+				"If server is not running, please delete temporary directory before start"
+			};
+		}
+		fs::create_directory(TEMP_DIR);
+	}
+	upgradeFd_ = Chat::listenUnix(UPGRADE_SOCKET);
+
+	try {
+		auto slots = std::stoul(config_.get("FrameCacheSlots", "1024"));
+		if (slots > 0) {
+			frameCache_ = std::make_unique<FrameCache>(slots, MESSAGE_LENGTH);
+		}
+	}
+	catch (const std::exception &e) {
+		throw std::runtime_error{ std::string{ "Can not create frame cache (" } + e.what() + ')' };
+	}
+
+	channels_ = std::make_unique<ChannelIndex>();
+	sessions_ = std::make_unique<SessionRegistry>(SESSION_SLOTS);
+
+	try {
+		nodeId_ = std::stoul(config_.get("NodeId", "0"));
+		if (config_.contains("ClusterNodes")) {
+			cluster_ = std::make_unique<ClusterBus>(nodeId_, ClusterBus::parseNodes(config_["ClusterNodes"]), CLUSTER_SOCKET);
+		}
+		if (config_.contains("ClusterEndpoints")) {
+			if (!cluster_) {
+				throw std::invalid_argument{ "ClusterEndpoints requires ClusterNodes" };
+			}
+			std::vector<unsigned> ids;
+			for (const auto &node: ClusterBus::parseNodes(config_["ClusterEndpoints"])) {
+				endpoints_[node.id] = node.host + ':' + std::to_string(node.port);
+				ids.push_back(node.id);
+			}
+			if (endpoints_.count(nodeId_) == 0) {
+				throw std::invalid_argument{ "Node " + std::to_string(nodeId_) + " is not in ClusterEndpoints" };
+			}
+			ring_ = std::make_unique<HashRing>(ids);
+		}
+	}
+	catch (const std::exception &e) {
+		throw std::runtime_error{ std::string{ "Invalid cluster settings (" } + e.what() + ')' };
+	}
+
+	try {
+		presence_ = std::make_unique<PresenceDirectory>(std::stoul(config_.get("PresenceCapacity", std::to_string(DEFAULT_PRESENCE_CAPACITY))), nodeId_);
+		snapshotInterval_ = std::chrono::seconds{ std::stoul(config_.get("PresenceSnapshotInterval", std::to_string(DEFAULT_PRESENCE_SNAPSHOT_INTERVAL))) };
+	}
+	catch (const std::exception &e) {
+		throw std::runtime_error{ std::string{ "Invalid presence settings (" } + e.what() + ')' };
+	}
+
+	try {
+		retention_.age = std::chrono::hours{ 24 } * std::stoul(config_.get("RetentionDays", "0"));
+		retention_.keep = std::stoul(config_.get("RetentionMaxMessages", "0"));
+		retention_.interval = std::chrono::seconds{ std::stoul(config_.get("RetentionInterval", std::to_string(DEFAULT_RETENTION_INTERVAL))) };
+		retention_.chunk = std::stoul(config_.get("RetentionChunk", std::to_string(DEFAULT_RETENTION_CHUNK)));
+		retention_.pause = std::chrono::milliseconds{ std::stoul(config_.get("RetentionPause", std::to_string(DEFAULT_RETENTION_PAUSE))) };
+		retention_.archiveSegmentSize = std::stoull(config_.get("ArchiveSegmentSize", std::to_string(DEFAULT_ARCHIVE_SEGMENT_SIZE)));
+		if (retention_.chunk == 0 || retention_.archiveSegmentSize == 0) {
+			throw std::invalid_argument{ "RetentionChunk and ArchiveSegmentSize must be positive" };
+		}
+	}
+	catch (const std::exception &e) {
+		throw std::runtime_error{ std::string{ "Invalid retention settings (" } + e.what() + ')' };
+	}
+
+	// the index itself is loaded by the indexer process
+	if (config_.contains("SearchIndexDir")) {
+		searchEvent_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (searchEvent_ == -1) {
+			throw std::runtime_error{ std::string{ "Can not create search index notification (" } + strerror(errno) + ')' };
+		}
+	}
+
+	try {
+		ids_ = std::make_unique<IdAllocator>(std::stoul(config_.get("IdBlockSize", std::to_string(DEFAULT_ID_BLOCK_SIZE))));
+	}
+	catch (const std::exception &e) {
+		throw std::runtime_error{ std::string{ "Invalid IdBlockSize (" } + e.what() + ')' };
+	}
+
+	try {
+		auto cacheSize = std::stoul(config_.get("UserCacheSize", "0"));
+		if (cacheSize >= UserTable::NONE) {
+			throw std::out_of_range{ config_["UserCacheSize"] };
+		}
+		users_ = std::make_unique<UserDirectory>(cacheSize, [this]() -> Storage & { return storage(); });
+	}
+	catch (const std::exception &e) {
+		throw std::runtime_error{ std::string{ "Invalid UserCacheSize (" } + e.what() + ')' };
+	}
+
+	try {
+		auto threshold = std::stoul(config_.get("BreakerThreshold", std::to_string(DEFAULT_BREAKER_THRESHOLD)));
+		breakerCooldown_ = std::chrono::seconds{ std::stoul(config_.get("BreakerCooldown", std::to_string(DEFAULT_BREAKER_COOLDOWN))) };
+		if (threshold > 0) {
+			breaker_ = std::make_unique<CircuitBreaker>(threshold, breakerCooldown_);
+		}
+	}
+	catch (const std::exception &e) {
+		throw std::runtime_error{ std::string{ "Invalid circuit breaker settings (" } + e.what() + ')' };
+	}
+
+	// opened after the previous server has stopped appending to the journal
+	if (config_.contains("JournalDir") && config_.contains("SpoolDir")) {
+		throw std::runtime_error{ "JournalDir and SpoolDir are exclusive, the journal spools messages itself" };
+	}
+	spool_ = config_.contains("SpoolDir");
+	if (spool_ || config_.contains("JournalDir")) {
+		auto directory = config_[spool_ ? "SpoolDir" : "JournalDir"];
+		try {
+			journal_ = std::make_unique<MessageJournal>(directory, std::stoull(config_.get("JournalSegmentSize", "16777216")),
+				std::stoull(config_.get("SpoolMaxBytes", std::to_string(DEFAULT_SPOOL_MAX_BYTES))), std::stol(config_.get("SpoolMaxAge", "0")));
+		}
+		catch (const std::exception &e) {
+			std::stringstream ss;
+			ss << "Can not open message " << (spool_ ? "spool" : "journal") << ": " << std::quoted(directory) << " (" << e.what() << ')';
+			throw std::runtime_error{ ss.str() };
+		}
 	}
-	fs::create_directory(TEMP_DIR);
+
 	try {
 		loadUsers();
-		setUsersInactive();
+		if (!takeover) {
+			// after takeover the sessions of the previous server stay active
+			setUsersInactive();
+		}
 	}
 	catch (const std::runtime_error &e) {
 		std::cerr << e.what() << std::endl;
 	}
 
-	sockFd_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (sockFd_ == -1) {
-		throw std::runtime_error{ "Error while creating socket!" };
-	}
-
 	int trueVal = 1;
-	if (setsockopt(sockFd_, SOL_SOCKET, SO_REUSEADDR, &trueVal, sizeof(trueVal)) == -1) {
-		throw std::runtime_error{ std::string{ "Can not set socket options: " } + std::string{ strerror(errno) } };	
-	}
+	if (!takeover) {
+		sockFd_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (sockFd_ == -1) {
+			throw std::runtime_error{ "Error while creating socket!" };
+		}
+
+		if (setsockopt(sockFd_, SOL_SOCKET, SO_REUSEADDR, &trueVal, sizeof(trueVal)) == -1) {
+			throw std::runtime_error{ std::string{ "Can not set socket options: " } + std::string{ strerror(errno) } };	
+		}
+
+		server_.sin_addr.s_addr = htonl(INADDR_ANY);
+		server_.sin_port = htons(stoi(config_["ListenPort"]));
+		server_.sin_family = AF_INET;
 
-	server_.sin_addr.s_addr = htonl(INADDR_ANY);
-	server_.sin_port = htons(stoi(config_["ListenPort"]));
-	server_.sin_family = AF_INET;
+		auto bindStatus = bind(sockFd_, reinterpret_cast<sockaddr *>(&server_), sizeof(server_));
+		if (bindStatus == -1) {
+			throw std::runtime_error{ std::string{ "Can not bind socket: " } + std::string{ strerror(errno) } };
+		}
 
-	auto bindStatus = bind(sockFd_, reinterpret_cast<sockaddr *>(&server_), sizeof(server_));
-	if (bindStatus == -1) {
-		throw std::runtime_error{ std::string{ "Can not bind socket: " } + std::string{ strerror(errno) } };
+		auto connectionStatus = listen(sockFd_, BACKLOG);
+		if (connectionStatus == -1) {
+			throw std::runtime_error{ "Error: could not listen the specified TCP port" };
+		}
 	}
 
-	auto connectionStatus = listen(sockFd_, BACKLOG);
-	if (connectionStatus == -1) {
-		throw std::runtime_error{ "Error: could not listen the specified TCP port" };
+	if (config_.contains("MetricsPort")) {
+		metricsFd_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (metricsFd_ == -1) {
+			throw std::runtime_error{ "Error while creating metrics socket!" };
+		}
+		if (setsockopt(metricsFd_, SOL_SOCKET, SO_REUSEADDR, &trueVal, sizeof(trueVal)) == -1) {
+			throw std::runtime_error{ std::string{ "Can not set metrics socket options: " } + std::string{ strerror(errno) } };
+		}
+		sockaddr_in metrics;
+		metrics.sin_addr.s_addr = inet_addr(config_.get("MetricsAddress", "127.0.0.1").c_str());
+		metrics.sin_port = htons(stoi(config_["MetricsPort"]));
+		metrics.sin_family = AF_INET;
+		if (bind(metricsFd_, reinterpret_cast<sockaddr *>(&metrics), sizeof(metrics)) == -1) {
+			throw std::runtime_error{ std::string{ "Can not bind metrics socket: " } + std::string{ strerror(errno) } };
+		}
+		if (listen(metricsFd_, BACKLOG) == -1) {
+			throw std::runtime_error{ "Error: could not listen the metrics TCP port" };
+		}
+	}
+	// handled in the main loop, children restore the mask in spawn()
+	sigemptyset(&signals_);
+	sigaddset(&signals_, SIGCHLD);
+	sigaddset(&signals_, SIGINT);
+	sigaddset(&signals_, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &signals_, nullptr) == -1) {
+		throw std::runtime_error{ std::string{ "Can not block signals: " } + strerror(errno) };
+	}
+	signalFd_ = signalfd(-1, &signals_, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signalFd_ == -1) {
+		throw std::runtime_error{ std::string{ "Can not create signalfd: " } + strerror(errno) };
 	}
+
 	std::cout <<
 		"Welcome to the chat admin console. "
 		"This chat server supports multiple client login and creates own process for each one.\n"
 		"Type /help to view help" << std::endl;
 
-	if(!users_.empty()) {
-		std::cout << "Registered users: ";
-		for (const auto &it: users_) {
-			std::cout << std::quoted(it.first) << ' ';
+	// users loaded on demand are not listed, there may be millions of them
+	if (!users_->lazy()) {
+		std::string list;
+		users_->forEachLogin([&list](std::string_view login) {
+			std::stringstream ss;
+			ss << std::quoted(login) << ' ';
+			list += ss.str();
+		});
+		if (!list.empty()) {
+			std::cout << "Registered users: " << list;
 		}
 	}
 
 	std::cout << "\n\nServer has been started and listening port TCP/" << config_["ListenPort"] << std::endl;
+	if (cluster_) {
+		std::cout << "Running as cluster node " << nodeId_ << std::endl;
+	}
+	if (metricsFd_ != -1) {
+		std::cout << "Metrics are available at http://" << config_.get("MetricsAddress", "127.0.0.1") << ':' << config_["MetricsPort"] << "/metrics" << std::endl;
+	}
 	printPrompt();
 }
 
 void ChatServer::setUsersInactive() const {
-	Mysql mysql;
-	mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-	mysql.query("DELETE FROM active_sessions");
+	// empty snapshot of this node
+	storage().saveSessions({});
+}
+
+Storage &ChatServer::storage() const {
+	// connection is owned by one process and reopened when lost
+	if (storage_ == nullptr || !storage_->isConnected()) {
+		storage_.reset();
+		// during an outage requests fail at once instead of waiting for the connect timeout
+		if (breaker_ && !breaker_->allow()) {
+			throw std::runtime_error{ "database is unavailable" };
+		}
+		try {
+			storage_ = Storage::create(config_, instancePid_);
+			storage_->setIdAllocator(ids_.get());
+		}
+		catch (const std::runtime_error &e) {
+			if (breaker_ && breaker_->failure()) {
+				clearPrompt();
+				std::cout << "Error: database is unavailable (" << e.what() << "), next attempt in " << breakerCooldown_.count() << " s" << std::endl;
+				printPrompt();
+			}
+			throw;
+		}
+		if (breaker_ && breaker_->success()) {
+			clearPrompt();
+			std::cout << "Database is available again" << std::endl;
+			printPrompt();
+		}
+	}
+	return *storage_;
+}
+
+bool ChatServer::isStorageLost() const {
+	return storage_ == nullptr || !storage_->isConnected();
+}
+
+bool ChatServer::useJournal() const {
+	if (!journal_) {
+		return false;
+	}
+	// spooled records are applied in order, newer ones wait behind them
+	return !spool_ || journal_->pendingBytes() > 0 || (breaker_ && breaker_->isOpen());
+}
+
+pid_t ChatServer::spawn() {
+	// child must not share the database connection of the parent
+	storage_.reset();
+	auto pid = fork();
+	if (pid == 0 && signalFd_ != -1) {
+		// children handle signals in the usual way
+		close(signalFd_);
+		signalFd_ = -1;
+		sigprocmask(SIG_UNBLOCK, &signals_, nullptr);
+	}
+	return pid;
+}
+
+void ChatServer::handleSignals() {
+	signalfd_siginfo info;
+	bool exited{ false };
+	while (read(signalFd_, &info, sizeof(info)) == sizeof(info)) {
+		if (info.ssi_signo == SIGCHLD) {
+			exited = true;
+		}
+		else if (info.ssi_signo == SIGINT) {
+			std::cout << "\nCaught interrupt signal!" << std::endl;
+			cleanExit();
+		}
+		else if (info.ssi_signo == SIGTERM) {
+			std::cout << "\nCaught terminate signal!" << std::endl;
+			cleanExit();
+		}
+	}
+	if (exited) {
+		reapChildren();
+	}
+}
+
+void ChatServer::reapChildren() {
+	// SIGCHLD is not queued, one signal may stand for many exited children
+	std::vector<pid_t> clients;
+	bool consoleExited{ false };
+	pid_t pid;
+	while ((pid = waitpid(-1, nullptr, WNOHANG)) > 0) {
+		Metrics::release(pid);
+		// message ids of an unfinished transaction are never committed
+		ids_->release(pid);
+		if (pid == consolePid_) {
+			consolePid_ = 0;
+			consoleExited = true;
+		}
+		else if (pid == metricsPid_) {
+			metricsPid_ = 0;
+		}
+		else if (pid == journalPid_) {
+			// unapplied records are replayed on the next start
+			journalPid_ = 0;
+		}
+		else if (pid == searchPid_) {
+			// messages indexed after the last saved segment are read from the database again
+			searchPid_ = 0;
+		}
+		else if (pid == retentionPid_) {
+			// the next server continues from the oldest message left
+			retentionPid_ = 0;
+		}
+		else if (pid == clusterPid_) {
+			// peers wake all their sessions when the connections are back
+			clusterPid_ = 0;
+		}
+		else {
+			Metrics::add(Metrics::CONNECTIONS_ACTIVE, -1);
+			children_.erase(pid);
+			sessions_->release(pid);
+			clients.push_back(pid);
+		}
+	}
+	if (!clients.empty()) {
+		endSessions(clients);
+	}
+	if (consoleExited && !upgrading_) {
+		cleanExit();
+	}
 }
 
 // destructor
@@ -115,13 +427,20 @@ void ChatServer::displayHelp() const {
 		" /log: print one line from log\n"
 		" /kick <username>: kick connected user\n"
 		" /remove: delete inactive user\n"
+		" /slowlog [N]: top N queries by total execution time\n"
 		" /exit, /quit, Ctrl-C: close the program\n"
 		<< std::endl;
 }
 
 // login availability
 bool ChatServer::isLoginAvailable(const std::string& login) const {
-	return users_.find(login) == users_.end();
+	try {
+		return !users_->find(login);
+	}
+	catch (const std::runtime_error &e) {
+		// the user is not cached and the database can not tell
+		return false;
+	}
 }
 
 void ChatServer::checkLogin() const {
@@ -137,7 +456,7 @@ void ChatServer::checkLogin() const {
 		strcat(message_, "available");
 	}
 	
-	auto bytes = write(connection_, message_, MESSAGE_LENGTH);
+	sendResponse();
 	printPrompt();
 }
 
@@ -154,36 +473,33 @@ void ChatServer::signUp() {
 		return;
 	}
 	try {
-		Mysql mysql;
-		try {
-			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-			mysql.query("SELECT COALESCE (MAX(`id`), -1) FROM `users`");
-			auto rows = mysql.fetchAll();
-			int new_id{ std::stoi(rows.front().at(0)) };
-			++new_id;
-	
-			SHA256 sha;
-			sha.update(tokens[2]);
-			uint8_t *digest = sha.digest();
-			hash = SHA256::toString(digest);
-			delete[] digest;
-
-			users_.emplace(tokens[1], ChatUser(new_id, tokens[1], hash, tokens[3]));
-			strcpy(message_, "/response:success");
-			auto bytes = write(connection_, message_, MESSAGE_LENGTH);
-			clearPrompt();
-			std::cout << "User '" << tokens[1] << "' has been registered" << std::endl;
-			printPrompt();
-			users_.at(tokens[1]).save(mysql);
-		}
-		catch (const std::runtime_error &e) {
-			clearPrompt();
-			std::cout << "Error: can not save user information to database (" << e.what() << ")" << std::endl;
+		int new_id = storage().nextUserId();
+
+		SHA256 sha;
+		sha.update(tokens[2]);
+		uint8_t *digest = sha.digest();
+		hash = SHA256::toString(digest);
+		delete[] digest;
+
+		// the login may be taken after the availability check, success is sent once the user is saved
+		auto added = users_->add(new_id, tokens[1], hash, tokens[3]);
+		strcpy(message_, added ? "/response:success" : "/response:busy");
+		sendResponse();
+		clearPrompt();
+		if (!added) {
+			std::cout << "Login '" << tokens[1] << "' is already registered" << std::endl;
 			printPrompt();
+			return;
 		}
+		std::cout << "User '" << tokens[1] << "' has been registered" << std::endl;
+		printPrompt();
 	}
 	catch (const std::runtime_error &e) {
-		std::cerr << e.what() << std::endl;
+		strcpy(message_, "/response:fail");
+		sendResponse();
+		clearPrompt();
+		std::cout << "Error: can not save user information to database (" << e.what() << ")" << std::endl;
+		printPrompt();
 	}
 }
 
@@ -203,136 +519,201 @@ void ChatServer::signIn() {
 		return;
 	}
 
-	loadUsers();
 	std::string login, password, hash;
 	
 	auto tokens = Chat::split(message_, ":");
 	login = tokens[1];
 	password = tokens[2];
 
+	try {
+		users_->refresh(login);
+	}
+	catch (const std::runtime_error &e) {
+		// while the database is unavailable the users known before can sign in, their messages are spooled
+	}
+	// copied, the views of the directory change with its next call
+	std::optional<unsigned> user_id;
+	std::string name, stored;
+	try {
+		if (auto user = users_->find(login)) {
+			user_id = user->id;
+			name = user->name;
+			stored = user->password_hash;
+		}
+	}
+	catch (const std::runtime_error &e) {
+		// not cached and the database is unavailable, the login fails
+	}
+
 	SHA256 sha;
 	sha.update(password);
 	uint8_t *digest = sha.digest();
 	hash = SHA256::toString(digest);
 	delete[] digest;
 
-	auto it = users_.find(login);
-	if (it == users_.end() || 
-		it->second.getLogin() != login || 
-		it->second.getPassword() != hash) {
+	if (!user_id || stored != hash) {
 		// invalid argument passed
 		clearPrompt();
 		std::cout << "Login failed for user " << std::quoted(login) << " from " << getClientIpAndPort() << std::endl;
 		strcpy(message_, "/response:fail");
-		auto bytes = write(connection_, message_, MESSAGE_LENGTH);
+		sendResponse();
 	}
 	else {
-		updateActiveUsers();
-		if (users_.at(login).isLoggedIn()) {
-			strcpy(message_, "/response:loggedin");
+		// unread state and caches of a user stay on one node, nodes that are down are skipped
+		auto owner = ring_ ? ring_->owner(*user_id, [this](unsigned node) { return cluster_->reachable(node); }) : nodeId_;
+		if (owner != nodeId_) {
+			strcpy(message_, "/response:redirect:");
+			strcat(message_, endpoints_.at(owner).c_str());
 			clearPrompt();
-			std::cout << "User " << std::quoted(login) << " is already logged in" << std::endl;
-			std::cout << "Sending response: " << message_ << std::endl;
-			auto bytes = write(connection_, message_, MESSAGE_LENGTH);
+			std::cout << "User " << std::quoted(login) << " is redirected to node " << owner << std::endl;
+			sendResponse();
 			printPrompt();
+			Metrics::add(Metrics::CLIENTS_REDIRECTED);
 			return;
 		}
 
+		bool started{ false };
 		try {
-			Mysql mysql;
-			try {
-				mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-				users_.at(login).login(mysql, getClientIp(), getClientPort(), getpid());
-			}
-			catch (const std::runtime_error &e) {
-				clearPrompt();
-				std::cout << "Error: can not save user information to database (" << e.what() << ")" << std::endl;
-				printPrompt();
-			}
+			started = startSession(*user_id, client_.sin_addr.s_addr, getClientPort());
 		}
 		catch (const std::runtime_error &e) {
+			// the session is not registered, so the login fails
+			clearPrompt();
+			std::cout << "Error: can not register user session (" << e.what() << ")" << std::endl;
+			strcpy(message_, "/response:fail");
+			sendResponse();
+			printPrompt();
+			return;
+		}
+		if (!started) {
+			strcpy(message_, "/response:loggedin");
 			clearPrompt();
-			std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
+			std::cout << "User " << std::quoted(login) << " is already logged in" << std::endl;
+			std::cout << "Sending response: " << message_ << std::endl;
+			sendResponse();
 			printPrompt();
+			return;
 		}
 		clearPrompt();
 		std::cout << "User " << std::quoted(login) << " successfully logged in" << std::endl;
 		strcpy(message_, "/response:success:");
-		strcat(message_, users_.at(login).getName().c_str());
+		strcat(message_, name.c_str());
 		strcat(message_, ":");
-		strcat(message_, std::to_string(users_.at(login).getUserId()).c_str());
-		auto bytes = write(connection_, message_, MESSAGE_LENGTH);
+		strcat(message_, std::to_string(*user_id).c_str());
+		sendResponse();
 		loggedUser_ = login;
+		// delivery resumes after the last acknowledged message
+		sentSeq_ = ackedSeq_ = savedSeq_ = 0;
+		sessions_->setUser(*user_id);
+		deliveryPending_ = true;
 	}
 	printPrompt();
 }
 
-void ChatServer::removeSessionByPid(const pid_t pid) const {
+void ChatServer::sendResponse() const {
+	if (outbound_ == nullptr) {
+		write(connection_, message_, MESSAGE_LENGTH);
+		return;
+	}
+	// queued behind pending messages, so the client receives everything in order
+	outbound_->pushResponse(message_);
+	outbound_->flush();
+}
+
+bool ChatServer::startSession(const unsigned user_id, const uint32_t ip, const unsigned short port) const {
+	auto entry = presence_->login(user_id, getpid(), ip, port);
+	if (!entry) {
+		return false;
+	}
+	if (cluster_) {
+		cluster_->publishPresence({ *entry });
+	}
+	return true;
+}
+
+void ChatServer::endSession(const unsigned user_id) const {
+	auto entry = presence_->logout(user_id, getpid());
+	if (entry && cluster_) {
+		cluster_->publishPresence({ *entry });
+	}
+}
+
+void ChatServer::endSessions(const std::vector<pid_t> &pids) const {
+	auto entries = presence_->logout(pids);
+	if (!entries.empty() && cluster_) {
+		cluster_->publishPresence(entries);
+	}
+}
+
+void ChatServer::saveMessageHorizon() const {
 	try {
-		Mysql mysql;
-		try {
-			std::stringstream ss;
+		storage().saveMessageHorizon(ID_BLOCK_IDLE);
+	}
+	catch (const std::runtime_error &e) {
+		// the saved one holds the readers of the other nodes back until it is old enough
+		clearPrompt();
+		std::cout << "Error: can not save message id horizon to database (" << e.what() << ")" << std::endl;
+		printPrompt();
+	}
+}
 
-			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-			ss << "DELETE FROM `active_sessions` WHERE `pid` = " << pid;
-			mysql.query(ss.str());
-		}
-		catch (const std::runtime_error &e) {
-			clearPrompt();
-			std::cout << "Error: can not remove user session from database (" << e.what() << ")" << std::endl;
-			printPrompt();
+bool ChatServer::saveSessions() const {
+	std::vector<Storage::Session> sessions;
+	presence_->forEach([&](const PresenceDirectory::Entry &entry) {
+		if (entry.node == nodeId_) {
+			in_addr addr{ entry.ip };
+			sessions.push_back(Storage::Session{ entry.user_id, inet_ntoa(addr), entry.port, entry.pid, entry.started, entry.active });
 		}
+	});
+	try {
+		storage().saveSessions(sessions);
+		Metrics::add(Metrics::PRESENCE_SNAPSHOTS);
+		return true;
 	}
 	catch (const std::runtime_error &e) {
 		clearPrompt();
-		std::cerr << "Error: cannot connect to database (" << e.what() << ")" << std::endl;
+		std::cout << "Error: can not save user sessions to database (" << e.what() << ")" << std::endl;
 		printPrompt();
+		return false;
+	}
+}
+
+unsigned ChatServer::userId(const std::string &login) const {
+	auto user = users_->find(login);
+	if (!user) {
+		throw std::out_of_range{ "User " + login + " is not registered" };
 	}
+	return user->id;
 }
 
 void ChatServer::signOut() {
+	saveAcknowledgements(true);
 	clearPrompt();
 	std::cout << "User '" << loggedUser_ << "' logged out at " << getClientIpAndPort() << std::endl;
 	printPrompt();
 	try {
-		try {
-			Mysql mysql;
-            try {
-				mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-				users_.at(loggedUser_).logout(mysql);
-			}
-			catch (const std::runtime_error &e) {
-                clearPrompt();
-                std::cout << "Error: can not save user information to database (" << e.what() << ")" << std::endl;
-                printPrompt();
-            }
-		}
-		catch (const std::runtime_error &e) {
-			clearPrompt();
-			std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
-			printPrompt();
-		}
+		endSession(userId(loggedUser_));
 	}
 	catch (const std::out_of_range &e) {
 		clearPrompt();
 		std::cout << "Error: can not log out (" << e.what() << std::endl;
 		printPrompt();
 	}
+	sessions_->clearUser();
 	loggedUser_.clear();
 }
 
 void ChatServer::removeUser(const std::string &cmd) {
 	std::string removingUser{ cmd.substr(7, cmd.length() - 7) };
 	std::erase(removingUser, ' ');
-	loadUsers();
-	updateActiveUsers();
-	auto it = users_.find(removingUser);
-	if (it == users_.end()) {
+	users_->refresh(removingUser);
+	auto user = users_->find(removingUser);
+	if (!user) {
 		clearPrompt();
 		std::cout << "User " << std::quoted(removingUser) << " does not exist" << std::endl;
 		return;
 	}
-	if (it->second.isLoggedIn()) {
+	if (presence_->find(user->id)) {
 		clearPrompt();
 		std::cout << "Can not remove user " << std::quoted(removingUser) << " because he/she is logged in now. Kick him/her first" << std::endl;
 		return;
@@ -345,14 +726,14 @@ void ChatServer::removeUser(const std::string &cmd) {
 
 void ChatServer::removeUser() {
 	std::string removingUser{ loggedUser_ };
-	if (!users_.at(removingUser).isLoggedIn()) {
+	if (!presence_->find(userId(removingUser))) {
 		strcpy(message_, "/response:fail");
-		write(connection_, message_, MESSAGE_LENGTH);
+		sendResponse();
 		return;
 	}
 		
 	strcpy(message_, "/response:success");
-	write(connection_, message_, MESSAGE_LENGTH);
+	sendResponse();
 	signOut();
 	removeUserFromDb(removingUser);
 	loggedUser_.clear();
@@ -368,31 +749,14 @@ void ChatServer::sendMessage() {
 		return;
 	}
 
-	loadUsers();
 	try {
-		Mysql mysql;
-		try {
-			std::stringstream ss;
-			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-			ss << "UPDATE `active_sessions` SET `last_activity` = CURRENT_TIMESTAMP WHERE "
-				"`user_id` = " << users_.at(loggedUser_).getUserId();
-			if (!mysql.query(ss.str())) {
-				ss.str(std::string{});
-				ss << "MySQL error: " << mysql.getError();
-				throw std::runtime_error{ ss.str() };
-			}
-		}
-		catch (const std::runtime_error &e) {
-			clearPrompt();
-			std::cout << "Error: can not update last activity field in the database (" << e.what() << ")" << std::endl;
-			printPrompt();
-		}
+		loadUsers();
 	}
 	catch (const std::runtime_error &e) {
-		clearPrompt();
-		std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
-		printPrompt();
+		// the list inherited from the main process
 	}
+	// saved to the database with the next snapshot
+	presence_->touch(userId(loggedUser_));
 	
 	if (message[0] == '@') {
 		size_t pos = message.find(' ');
@@ -402,7 +766,7 @@ void ChatServer::sendMessage() {
 			printPrompt();
 			std::string messageText = message.substr(pos + 1);
 			try {
-				sendPrivateMessage(users_.at(loggedUser_), receiverName, messageText);
+				sendPrivateMessage(loggedUser_, receiverName, messageText);
 			}
 			catch (const std::out_of_range &e) {
 				clearPrompt();
@@ -411,9 +775,22 @@ void ChatServer::sendMessage() {
 			}
 		}
 	}
+	else if (message[0] == '#') {
+		size_t pos = message.find(' ');
+		if (pos != std::string::npos) {
+			try {
+				sendChannelMessage(loggedUser_, message.substr(1, pos - 1), message.substr(pos + 1));
+			}
+			catch (const std::out_of_range &e) {
+				clearPrompt();
+				std::cout << "Error: can not send channel message (" << e.what() << ")" << std::endl;
+				printPrompt();
+			}
+		}
+	}
 	else {
 		try {
-			sendBroadcastMessage(users_.at(loggedUser_), message);
+			sendBroadcastMessage(loggedUser_, message);
 		}
 		catch (const std::out_of_range &e) {
 			clearPrompt();
@@ -423,97 +800,322 @@ void ChatServer::sendMessage() {
 	}
 }
 
-void ChatServer::sendPrivateMessage(ChatUser& sender, const std::string& receiverName, const std::string& messageText) {
-	if (users_.find(receiverName) == users_.end()) {
+void ChatServer::sendPrivateMessage(const std::string &sender, const std::string& receiverName, const std::string& messageText) {
+	auto receiver = users_->find(receiverName);
+	if (!receiver) {
 		throw std::invalid_argument("RECEIVER_DOES_NOT_EXIST");
 	}
 
 	std::stringstream ss;
 
-	ss << sender.getLogin() << ": @" << receiverName << ' ' << messageText;
-	*logger_ << ss.str();
+	ss << sender << ": @" << receiverName << ' ' << messageText;
+	writeLog(ss.str());
+	Metrics::add(Metrics::MESSAGES_PRIVATE);
 
-	auto newMessage = std::make_shared<PrivateMessage>(sender.getLogin(), receiverName, messageText);
-	
+	auto newMessage = std::make_shared<PrivateMessage>(sender, receiverName, messageText);
+	auto receiverId = receiver->id;
+	saveMessage(*newMessage, [&] { notifyRecipients({ receiverId }); });
+}
+
+void ChatServer::sendBroadcastMessage(const std::string &sender, const std::string& message) {
+	std::stringstream ss;
+
+	ss << sender << ": " << message;
+	writeLog(ss.str());
+	Metrics::add(Metrics::MESSAGES_BROADCAST);
+
+	// Dynamically allocate memory for new message
+	auto newMessage = std::make_shared<BroadcastMessage>(sender, message, *users_);
+	saveMessage(*newMessage, [&] { notifyAllRecipients(); });
+}
+
+void ChatServer::sendChannelMessage(const std::string &sender, const std::string &channel, const std::string &messageText) {
+	std::vector<std::string> members;
+	std::vector<unsigned> memberIds;
 	try {
-		Mysql mysql;
-		try {
-			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-			newMessage->save(mysql);
-		}
-		catch (const std::runtime_error &e) {
-			clearPrompt();
-			std::cout << "Error: can not save massage to database (" << e.what() << ")" << std::endl;
-			printPrompt();
+		if (!channels_->isMember(storage(), channel, userId(sender))) {
+			throw std::invalid_argument("NOT_A_CHANNEL_MEMBER");
 		}
+		// fan-out is limited to the members, not to all registered users
+		members = channels_->members(storage(), channel);
+		memberIds = channels_->memberIds(storage(), channel);
 	}
 	catch (const std::runtime_error &e) {
 		clearPrompt();
-		std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
+		std::cout << "Error: can not load channel members from database (" << e.what() << ")" << std::endl;
 		printPrompt();
+		return;
 	}
-}
 
-void ChatServer::sendBroadcastMessage(ChatUser& sender, const std::string& message) {
 	std::stringstream ss;
+	ss << sender << ": #" << channel << ' ' << messageText;
+	writeLog(ss.str());
+	Metrics::add(Metrics::MESSAGES_CHANNEL);
 
-	ss << sender.getLogin() << ": " << message;
-	*logger_ << ss.str();
+	auto newMessage = std::make_shared<ChannelMessage>(sender, channel, messageText, members);
+	saveMessage(*newMessage, [&] { notifyRecipients(memberIds); });
+}
 
-	// Dynamically allocate memory for new message
-	auto newMessage = std::make_shared<BroadcastMessage>(sender.getLogin(), message, users_);
+void ChatServer::saveMessage(const ChatMessage &message, const std::function<void()> &notify) {
+	const char *target = journal_ && !spool_ ? "journal" : "database";
 	try {
-		Mysql mysql;
-		try {
-			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-			newMessage->save(mysql);
+		// with the journal the message is acknowledged without waiting for the database
+		if (useJournal()) {
+			target = spool_ ? "spool" : "journal";
+			message.save(*journal_);
+			if (spool_) {
+				Metrics::add(Metrics::SPOOL_RECORDS);
+			}
+			return;
+		}
+		try {
+			message.save(storage());
 		}
 		catch (const std::runtime_error &e) {
-			clearPrompt();
-			std::cout << "Error: can not save massage to database (" << e.what() << ")" << std::endl;
-			printPrompt();
+			// only the messages the database has not got are spooled, not the rejected ones
+			if (!spool_ || !isStorageLost()) {
+				throw;
+			}
+			target = "spool";
+			message.save(*journal_);
+			Metrics::add(Metrics::SPOOL_RECORDS);
+			return;
 		}
+		notifySearchIndexer();
+		notify();
 	}
 	catch (const std::runtime_error &e) {
 		clearPrompt();
-		std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
+		std::cout << "Error: can not save massage to " << target << " (" << e.what() << ")" << std::endl;
 		printPrompt();
 	}
 }
 
-void ChatServer::listActiveUsers() {
-	try {
-		Mysql mysql;
+void ChatServer::joinChannel() {
+	auto tokens = Chat::split(message_, ":");
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	strcpy(message_, "/response:fail");
+	// channel names consist of the same characters as logins
+	if (!loggedUser_.empty() && tokens.size() == 2 && !tokens[1].empty() && isValidLogin(tokens[1])) {
 		try {
-			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-			mysql.query("SELECT "
-					"`users`.`login`, "
-					"INET_NTOA(`active_sessions`.`ip`), "
-					"`active_sessions`.`port`, "
-					"`active_sessions`.`pid`, "
-					"`active_sessions`.`session_start` "
-				"FROM "
-					"`active_sessions` "
-				"JOIN "
-					"`users` ON `users`.`id` = `active_sessions`.`user_id` "
-				"ORDER BY "
-					"session_start DESC "
-			);
-			auto rows = mysql.fetchAll();
-			for (const auto &row: rows) {
-				std::cout << "Login: " << std::setw(8) << row[0] << "; Address: " << std::setw(24) << (row[1] + ":" + row[2]) << "; Pid: " << std::setw(4) << row[3] << "; Started: " << row[4] << std::endl;
+			channels_->join(storage(), tokens[1], userId(loggedUser_));
+			strcpy(message_, "/response:success");
+			clearPrompt();
+			std::cout << "User " << std::quoted(loggedUser_) << " joined channel #" << tokens[1] << std::endl;
+			printPrompt();
+		}
+		catch (const std::runtime_error &e) {
+			clearPrompt();
+			std::cout << "Error: can not save channel membership to database (" << e.what() << ")" << std::endl;
+			printPrompt();
+		}
+	}
+	sendResponse();
+}
+
+void ChatServer::leaveChannel() {
+	auto tokens = Chat::split(message_, ":");
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	strcpy(message_, "/response:fail");
+	if (!loggedUser_.empty() && tokens.size() == 2) {
+		try {
+			if (channels_->leave(storage(), tokens[1], userId(loggedUser_))) {
+				strcpy(message_, "/response:success");
+				clearPrompt();
+				std::cout << "User " << std::quoted(loggedUser_) << " left channel #" << tokens[1] << std::endl;
+				printPrompt();
 			}
 		}
 		catch (const std::runtime_error &e) {
 			clearPrompt();
-			std::cout << "Error: can not load active user list from database (" << e.what() << ")" << std::endl;
+			std::cout << "Error: can not save channel membership to database (" << e.what() << ")" << std::endl;
 			printPrompt();
 		}
 	}
+	sendResponse();
+}
+
+void ChatServer::sendHistory() {
+	auto tokens = Chat::split(message_, ":");
+	std::string scope{ tokens.size() > 1 ? tokens[1] : "all" };
+	unsigned long long before{ 0 };
+	unsigned limit{ DEFAULT_HISTORY_PAGE_SIZE };
+	try {
+		if (tokens.size() > 2) {
+			before = std::stoull(tokens[2]);
+		}
+		limit = std::clamp<unsigned long>(std::stoul(config_.get("HistoryPageSize", std::to_string(DEFAULT_HISTORY_PAGE_SIZE))), 1, MAX_HISTORY_PAGE_SIZE);
+	}
+	catch (const std::exception &e) {
+		scope.clear();
+	}
+
+	unsigned count{ 0 };
+	unsigned long long oldest{ 0 };
+	std::string channel{ scope.size() > 1 && scope[0] == '#' ? scope.substr(1) : "" };
+	// every message is written to the socket as it is read, the page is not collected
+	char frame[MESSAGE_LENGTH];
+	auto send = [&](const Storage::HistoryEntry &entry) {
+		outbound_->pushResponse({ frame, historyFrame(entry, frame) });
+		if (count++ == 0) {
+			oldest = entry.id;
+		}
+	};
+
+	bool found{ true };
+	try {
+		if (loggedUser_.empty()) {
+			found = false;
+		}
+		else if (scope == "all") {
+			storage().forEachBroadcastHistory(before, limit, send);
+		}
+		else if (!channel.empty() && channels_->isMember(storage(), channel, userId(loggedUser_))) {
+			storage().forEachChannelHistory(channel, before, limit, send);
+		}
+		else if (scope.size() > 1 && scope[0] == '@' && isValidLogin(scope.substr(1))) {
+			storage().forEachPrivateHistory(loggedUser_, scope.substr(1), before, limit, send);
+		}
+		else {
+			found = false;
+		}
+	}
 	catch (const std::runtime_error &e) {
 		clearPrompt();
-		std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
+		std::cout << "Error: can not load message history from database (" << e.what() << ")" << std::endl;
 		printPrompt();
+		found = false;
+	}
+
+	// id to continue from, 0 if there are no older messages
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	if (found) {
+		strcpy(message_, ("/response:history:" + std::to_string(count < limit ? 0 : oldest)).c_str());
+	}
+	else {
+		strcpy(message_, "/response:fail");
+	}
+	sendResponse();
+}
+
+size_t ChatServer::historyFrame(const Storage::HistoryEntry &entry, char *frame) const {
+	Chat::WireRecord record{
+		!entry.receiver.empty() ? Chat::WireRecord::PRIVATE : !entry.channel.empty() ? Chat::WireRecord::CHANNEL : Chat::WireRecord::BROADCAST,
+		Chat::WireRecord::STORED,
+		entry.id,
+		static_cast<uint64_t>(entry.sent),
+		entry.sender_id,
+		entry.sender,
+		!entry.receiver.empty() ? entry.receiver : entry.channel,
+		entry.text
+	};
+	return Chat::encodeRecord(record, frame, MESSAGE_LENGTH);
+}
+
+void ChatServer::sendSearchResults() {
+	std::string query{ message_ + std::min<size_t>(strlen(message_), 8) };
+	unsigned limit{ DEFAULT_SEARCH_RESULTS };
+	try {
+		limit = std::clamp<unsigned long>(std::stoul(config_.get("SearchResultLimit", std::to_string(DEFAULT_SEARCH_RESULTS))), 1, MAX_HISTORY_PAGE_SIZE);
+	}
+	catch (const std::exception &e) {
+		limit = DEFAULT_SEARCH_RESULTS;
+	}
+
+	bool found{ false };
+	unsigned count{ 0 };
+	if (!loggedUser_.empty() && searchEvent_ != -1 && !SearchIndex::terms(query).empty()) {
+		int fd{ -1 };
+		try {
+			auto user_id = userId(loggedUser_);
+			// the indexer knows message scopes, membership is checked here
+			std::stringstream request;
+			request << user_id << '\n' << limit << '\n';
+			for (auto channel: channels_->channelsOf(storage(), user_id)) {
+				request << channel << ' ';
+			}
+			request << '\n' << query;
+
+			fd = Chat::connectUnix(SEARCH_SOCKET);
+			timeval tv{ SEARCH_TIMEOUT, 0 };
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+			auto data = request.str();
+			if (write(fd, data.data(), data.size()) != static_cast<ssize_t>(data.size())) {
+				throw std::runtime_error{ "can not send query to the search index" };
+			}
+			shutdown(fd, SHUT_WR);
+
+			std::string response;
+			char buffer[MESSAGE_LENGTH];
+			ssize_t bytes;
+			while ((bytes = read(fd, buffer, sizeof(buffer))) > 0) {
+				response.append(buffer, bytes);
+			}
+			close(fd);
+			fd = -1;
+			// ids are terminated by the line end, a timed out response has none
+			if (bytes == -1 || response.empty() || response.back() != '\n') {
+				throw std::runtime_error{ "no response from the search index" };
+			}
+
+			std::vector<unsigned long long> ids;
+			std::stringstream ss{ response };
+			unsigned long long id;
+			while (ss >> id) {
+				ids.push_back(id);
+			}
+			char frame[MESSAGE_LENGTH];
+			storage().forEachMessageById(ids, [&](const Storage::HistoryEntry &entry) {
+				outbound_->pushResponse({ frame, historyFrame(entry, frame) });
+				++count;
+			});
+			found = true;
+		}
+		catch (const std::runtime_error &e) {
+			if (fd != -1) {
+				close(fd);
+			}
+			clearPrompt();
+			std::cout << "Error: can not search messages (" << e.what() << ")" << std::endl;
+			printPrompt();
+		}
+	}
+
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	if (found) {
+		strcpy(message_, ("/response:search:" + std::to_string(count)).c_str());
+	}
+	else {
+		strcpy(message_, "/response:fail");
+	}
+	sendResponse();
+}
+
+void ChatServer::listActiveUsers() {
+	loadUsers();
+	std::vector<PresenceDirectory::Entry> sessions;
+	presence_->forEach([&](const PresenceDirectory::Entry &entry) {
+		sessions.push_back(entry);
+	});
+	// newest sessions first
+	std::sort(sessions.begin(), sessions.end(), [](const auto &a, const auto &b) { return a.started > b.started; });
+	std::vector<unsigned> user_ids;
+	for (const auto &session: sessions) {
+		user_ids.push_back(session.user_id);
+	}
+	users_->preload(user_ids);
+	for (const auto &session: sessions) {
+		auto user = users_->find(session.user_id);
+		in_addr addr{ session.ip };
+		time_t started = session.started;
+		char time[32];
+		strftime(time, sizeof(time), "%Y-%m-%d %H:%M:%S", localtime(&started));
+		std::cout << "Login: " << std::setw(8) << (user ? std::string{ user->login } : "#" + std::to_string(session.user_id)) <<
+			"; Address: " << std::setw(24) << (std::string{ inet_ntoa(addr) } + ":" + std::to_string(session.port)) <<
+			"; Pid: " << std::setw(4) << session.pid <<
+			"; Node: " << session.node <<
+			"; Started: " << time << std::endl;
 	}
 	std::cout << std::endl;
 }
@@ -523,47 +1125,101 @@ void ChatServer::kickClient(const std::string &cmd) {
 	if (tokens.size() != 2) {
 		throw std::invalid_argument{ "Error: invalid format" };
 	}
-	updateActiveUsers();
-	auto it = users_.find(tokens[1]);
-	if (it == users_.end()) {
+	users_->refresh(tokens[1]);
+	auto user = users_->find(tokens[1]);
+	if (!user) {
 		throw std::invalid_argument{ "Error: user not exist" };
 	}
-	if (!it->second.isLoggedIn()) {
+	auto session = presence_->find(user->id);
+	if (!session) {
 		throw std::invalid_argument{ "Error: user is not logged in" };
 	}
-	for (const auto &user: activeUsers_) {
-		if (user == tokens[1]) {
-			kill(users_.at(user).getPid(), SIGTERM);
-			try {
-				Mysql mysql;
-            	try {
-					mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-					users_.at(tokens[1]).logout(mysql);
-				}
-				catch (const std::runtime_error &e) {
-                	clearPrompt();
-                	std::cout << "Error: can not save user information to database (" << e.what() << ")" << std::endl;
-                	printPrompt();
-            	}
-			}
-			catch (const std::runtime_error &e) {
-				clearPrompt();
-				std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
-				printPrompt();
-			}
-		}
+	if (session->node != nodeId_) {
+		// the pid belongs to another host
+		throw std::invalid_argument{ "Error: user is connected to node " + std::to_string(session->node) };
 	}
+	// the session ends when the process exits
+	kill(session->pid, SIGTERM);
 }
 
 void ChatServer::work() {
 	socklen_t length = sizeof(client_);
-	consolePid_ = fork();
+	// before the first message of this node, so the readers of the other nodes wait for it
+	saveMessageHorizon();
+	consolePid_ = spawn();
 	if (consolePid_ == 0) {
 		startConsole();
 	}
 	else {
+		if (metricsFd_ != -1) {
+			metricsPid_ = spawn();
+			if (metricsPid_ == 0) {
+				startMetricsServer();
+			}
+			close(metricsFd_);
+		}
+		if (journal_) {
+			journalPid_ = spawn();
+			if (journalPid_ == 0) {
+				startJournalReplicator();
+			}
+		}
+		if (searchEvent_ != -1) {
+			searchPid_ = spawn();
+			if (searchPid_ == 0) {
+				startSearchIndexer();
+			}
+		}
+		if (retention_.age.count() > 0 || retention_.keep > 0) {
+			retentionPid_ = spawn();
+			if (retentionPid_ == 0) {
+				startRetentionJob();
+			}
+		}
+		if (cluster_) {
+			clusterPid_ = spawn();
+			if (clusterPid_ == 0) {
+				startClusterBus();
+			}
+		}
+		resumeSessions();
 		int clientPid;
 		while (mainLoopActive_) {
+			pollfd fds[]{ { sockFd_, POLLIN, 0 }, { upgradeFd_, POLLIN, 0 }, { signalFd_, POLLIN, 0 } };
+			auto timeout = static_cast<int>(std::chrono::milliseconds{ ID_HORIZON_INTERVAL }.count());
+			if (snapshotInterval_.count() > 0) {
+				timeout = std::min(timeout, static_cast<int>(std::chrono::milliseconds{ snapshotInterval_ }.count()));
+			}
+			if (poll(fds, 3, timeout) == -1) {
+				continue;
+			}
+			auto now = std::chrono::steady_clock::now();
+			if (now - horizonSaved_ >= ID_HORIZON_INTERVAL) {
+				horizonSaved_ = now;
+				saveMessageHorizon();
+			}
+			// the snapshot is written only if the sessions have changed since the last one
+			if (snapshotInterval_.count() > 0 && now - snapshotSaved_ >= snapshotInterval_ && presence_->changes() != snapshotChanges_) {
+				// the directory keeps the sessions while the database is unavailable, a failed snapshot is repeated
+				auto changes = presence_->changes();
+				snapshotSaved_ = now;
+				if (saveSessions()) {
+					snapshotChanges_ = changes;
+				}
+			}
+			if (fds[2].revents & POLLIN) {
+				handleSignals();
+			}
+			if (fds[1].revents & POLLIN) {
+				int upgradeConnection = accept(upgradeFd_, nullptr, nullptr);
+				if (upgradeConnection != -1) {
+					handOver(upgradeConnection);
+				}
+				continue;
+			}
+			if (!(fds[0].revents & POLLIN)) {
+				continue;
+			}
 			socklen_t length = sizeof(client_);
 			try {
 				connection_ = accept(sockFd_, reinterpret_cast<sockaddr *>(&client_), &length);
@@ -573,18 +1229,214 @@ void ChatServer::work() {
 				std::cout << "Error: out of range while trying to call accept() (" << e.what() << ')' << std::endl;
 				printPrompt();
 			}
-			clientPid = fork();
+			if (connection_ == -1) {
+				continue;
+			}
+			Metrics::add(Metrics::CONNECTIONS_ACCEPTED);
+			Metrics::add(Metrics::CONNECTIONS_ACTIVE, 1);
+			clientPid = spawn();
 			if (clientPid == 0) {
 				processNewClient();
 			}
 			else {
 				children_.insert(clientPid);
+				close(connection_);
+				connection_ = 0; // only client processes have a connection
 			}
 		}
 	}
 }
 
+void ChatServer::resumeSessions() {
+	for (const auto &session: handedOver_) {
+		connection_ = session.fd;
+		loggedUser_ = session.login;
+		client_.sin_family = AF_INET;
+		client_.sin_addr.s_addr = inet_addr(session.ip.c_str());
+		client_.sin_port = htons(session.port);
+		Metrics::add(Metrics::CONNECTIONS_ACTIVE, 1);
+		auto clientPid = spawn();
+		if (clientPid == 0) {
+			if (!loggedUser_.empty()) {
+				try {
+					// presence of the previous server has gone with it
+					startSession(userId(loggedUser_), client_.sin_addr.s_addr, session.port);
+				}
+				catch (const std::out_of_range &e) {
+					loggedUser_.clear();
+				}
+				catch (const std::runtime_error &e) {
+					clearPrompt();
+					std::cout << "Error: can not register user session (" << e.what() << ")" << std::endl;
+					printPrompt();
+				}
+			}
+			processNewClient();
+		}
+		children_.insert(clientPid);
+		close(session.fd);
+	}
+	connection_ = 0;
+	handedOver_.clear();
+	loggedUser_.clear();
+}
+
+void ChatServer::takeOver() {
+	// must be ready before the running server asks its clients to move
+	int handoffFd = Chat::listenUnix(HANDOFF_SOCKET);
+	int upgradeConnection;
+	std::string state;
+	try {
+		upgradeConnection = Chat::connectUnix(UPGRADE_SOCKET);
+		sockFd_ = Chat::receiveDescriptor(upgradeConnection, state);
+	}
+	catch (const std::runtime_error &e) {
+		close(handoffFd);
+		fs::remove(HANDOFF_SOCKET);
+		throw std::runtime_error{ std::string{ "Can not take over the running server (" } + e.what() + ")" };
+	}
+	auto tokens = Chat::split(state, "\n");
+	instancePid_ = std::stoi(tokens.at(0));
+	size_t expected = std::stoul(tokens.at(1));
+	std::cout << "Listening socket has been received, waiting for " << expected << " client sessions..." << std::endl;
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{ HANDOFF_TIMEOUT };
+	auto timeLeft = [&deadline] {
+		return std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+	};
+	while (handedOver_.size() < expected && timeLeft() > 0) {
+		pollfd fds{ handoffFd, POLLIN, 0 };
+		if (poll(&fds, 1, timeLeft()) <= 0) {
+			continue;
+		}
+		int connection = accept(handoffFd, nullptr, nullptr);
+		if (connection == -1) {
+			continue;
+		}
+		try {
+			std::string data;
+			int fd = Chat::receiveDescriptor(connection, data);
+			// 0: ip, 1: port, 2: login, empty if the client is not logged in
+			auto fields = Chat::split(data, "\n");
+			handedOver_.push_back(HandedOverSession{
+				fd,
+				fields.size() > 2 ? fields[2] : std::string{},
+				fields.at(0),
+				static_cast<unsigned short>(std::stoi(fields.at(1)))
+			});
+		}
+		catch (const std::exception &e) {
+			std::cerr << "Error: can not receive client session (" << e.what() << ")" << std::endl;
+		}
+		close(connection);
+	}
+	close(handoffFd);
+	fs::remove(HANDOFF_SOCKET);
+	std::cout << handedOver_.size() << " of " << expected << " client sessions have been received" << std::endl;
+
+	// the previous server closes the connection when all its processes are gone,
+	// so its helpers do not run together with the new ones
+	deadline = std::chrono::steady_clock::now() + std::chrono::seconds{ HANDOFF_TIMEOUT };
+	while (timeLeft() > 0) {
+		pollfd fds{ upgradeConnection, POLLIN, 0 };
+		auto ready = poll(&fds, 1, timeLeft());
+		if (ready == -1) {
+			continue;
+		}
+		char byte;
+		if (ready == 0 || read(upgradeConnection, &byte, 1) <= 0) {
+			break;
+		}
+	}
+	close(upgradeConnection);
+}
+
+void ChatServer::handOver(const int upgradeConnection) {
+	clearPrompt();
+	std::cout << "Upgrade has been requested, handing over " << children_.size() << " client sessions..." << std::endl;
+	std::stringstream state;
+	state << instancePid_ << '\n' << children_.size() << '\n';
+	try {
+		Chat::sendDescriptor(upgradeConnection, sockFd_, state.str());
+	}
+	catch (const std::runtime_error &e) {
+		close(upgradeConnection);
+		std::cout << "Error: upgrade failed (" << e.what() << ")" << std::endl;
+		printPrompt();
+		return;
+	}
+	// the new server accepts from now on and listens the upgrade socket when this one exits
+	close(sockFd_);
+	close(upgradeFd_);
+	upgrading_ = true;
+	for (auto pid: { consolePid_, metricsPid_, journalPid_, clusterPid_ }) {
+		if (pid > 0) {
+			kill(pid, SIGTERM);
+		}
+	}
+	if (searchPid_ > 0) {
+		// saves what it has indexed
+		kill(searchPid_, SIGUSR1);
+	}
+	if (retentionPid_ > 0) {
+		// finishes the current chunk
+		kill(retentionPid_, SIGUSR1);
+	}
+	auto children = children_;
+	for (auto child: children) {
+		kill(child, SIGUSR2);
+	}
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{ HANDOFF_TIMEOUT };
+	while ((!children_.empty() || consolePid_ > 0 || metricsPid_ > 0 || journalPid_ > 0 || searchPid_ > 0 || retentionPid_ > 0 || clusterPid_ > 0) &&
+		std::chrono::steady_clock::now() < deadline) {
+		reapChildren();
+		usleep(10000);
+	}
+	children = children_;
+	for (auto child: children) {
+		// did not move in time
+		kill(child, SIGTERM);
+	}
+	std::cout << "Server has been handed over, exiting from main process..." << std::endl;
+	close(upgradeConnection);
+	exit(EXIT_SUCCESS);
+}
+
+void ChatServer::handOverClient() {
+	handOverRequested_ = false;
+	if (!outbound_->flush(FINAL_FLUSH_TIMEOUT) || !outbound_->empty()) {
+		// the new server can not continue a partially sent frame
+		disconnectReason_ = "slow consumer";
+		return;
+	}
+	// the new server continues after the acknowledged messages, the client skips repeated ones
+	saveAcknowledgements(true);
+	try {
+		int fd = Chat::connectUnix(HANDOFF_SOCKET);
+		std::stringstream data;
+		data << getClientIp() << '\n' << getClientPort() << '\n' << loggedUser_ << '\n';
+		Chat::sendDescriptor(fd, connection_, data.str());
+		close(fd);
+	}
+	catch (const std::runtime_error &e) {
+		clearPrompt();
+		std::cout << "Error: can not hand over client " << getClientIpAndPort() << " (" << e.what() << ")" << std::endl;
+		printPrompt();
+		return;
+	}
+	// session stays active in the database until the new server registers it
+	exit(EXIT_SUCCESS);
+}
+
+void ChatServer::handOverHandler(int) {
+	if (mainPid_ != getpid()) {
+		handOverRequested_ = true;
+	}
+}
+
 void ChatServer::startConsole() {
+	Metrics::attach();
 	std::string cmd;
 	while(mainLoopActive_) {
 		getline(std::cin, cmd);
@@ -608,6 +1460,19 @@ void ChatServer::startConsole() {
 		else if (cmd == "/log") {
 			printLineFromLog();
 		}
+		else if (cmd.substr(0, 8) == "/slowlog") {
+			auto tokens = Chat::split(cmd, " ");
+			size_t n{ 10 };
+			try {
+				if (tokens.size() > 1) {
+					n = std::stoul(tokens[1]);
+				}
+			}
+			catch (const std::exception &e) {
+				std::cout << "Error: invalid number of queries" << std::endl;
+			}
+			Mysql::printSlowQuerySummary(std::cout, n);
+		}
 		else if (cmd.substr(0, 7) == "/remove") {
 			removeUser(cmd);
 		}
@@ -615,163 +1480,820 @@ void ChatServer::startConsole() {
 	}
 }
 
-void ChatServer::printLineFromLog() const {
-	clearPrompt();
-	if (logger_->isEof()) {
-		std::cout << "Error: EOF has been reached" << std::endl;
-		return;
+void ChatServer::startMetricsServer() {
+	Metrics::attach();
+	close(sockFd_);
+	while (mainLoopActive_) {
+		int fd = accept(metricsFd_, nullptr, nullptr);
+		if (fd == -1) {
+			continue;
+		}
+		serveMetricsRequest(fd);
+		close(fd);
 	}
-	std::cout << logger_->readline() << std::endl;
+	exit(EXIT_SUCCESS);
 }
 
-void ChatServer::updateActiveUsers() {
-	loadUsers();
+void ChatServer::startJournalReplicator() {
+	Metrics::attach();
+	drainable_ = true;
+	close(sockFd_);
+	unsigned backoff{ 0 };
+	int64_t pending{ 0 };
+	while (mainLoopActive_) {
+		// gauges of the processes are summed, so only this one reports the journal
+		Metrics::add(Metrics::JOURNAL_PENDING_BYTES, static_cast<int64_t>(journal_->pendingBytes()) - pending);
+		pending = journal_->pendingBytes();
+		// recipients of the applied records, a broadcast reaches everybody
+		std::vector<std::string> recipients;
+		bool broadcast{ false };
+		auto collect = [&](const MessageJournal::Record &record) {
+			if (record.type == MessageJournal::PRIVATE) {
+				recipients.push_back(record.receiver);
+			}
+			else if (record.type == MessageJournal::CHANNEL) {
+				recipients.insert(recipients.end(), record.recipients.begin(), record.recipients.end());
+			}
+			else if (record.type == MessageJournal::BROADCAST) {
+				broadcast = true;
+			}
+		};
+		try {
+			// the spool is empty most of the time, the database is not asked for its position then
+			if ((spool_ && journal_->pendingBytes() == 0) || journal_->replay(storage(), JOURNAL_BATCH, collect) == 0) {
+				if (drainRequested_) {
+					// everything durable is in the database
+					break;
+				}
+				usleep(JOURNAL_IDLE_INTERVAL * 1000);
+			}
+			else {
+				notifySearchIndexer();
+				notifyJournalRecipients(recipients, broadcast);
+			}
+			backoff = 0;
+		}
+		catch (const std::runtime_error &e) {
+			// records wait in the journal until the database is back
+			backoff = std::min(backoff == 0 ? JOURNAL_IDLE_INTERVAL : backoff * 2, JOURNAL_MAX_BACKOFF);
+			clearPrompt();
+			std::cout << "Error: can not replicate message journal to database (" << e.what() << "), retry in " << backoff << " ms" << std::endl;
+			printPrompt();
+			usleep(backoff * 1000);
+		}
+	}
+	exit(EXIT_SUCCESS);
+}
+
+void ChatServer::startSearchIndexer() {
+	Metrics::attach();
+	drainable_ = true;
+	close(sockFd_);
+	std::unique_ptr<SearchIndex> index;
+	int listenFd{ -1 };
 	try {
-		Mysql mysql;
+		index = std::make_unique<SearchIndex>(config_["SearchIndexDir"]);
+		listenFd = Chat::listenUnix(SEARCH_SOCKET);
+	}
+	catch (const std::exception &e) {
+		clearPrompt();
+		std::cout << "Error: can not open search index: " << std::quoted(config_["SearchIndexDir"]) << " (" << e.what() << ")" << std::endl;
+		printPrompt();
+		exit(EXIT_FAILURE);
+	}
+
+	auto saved = std::chrono::steady_clock::now();
+	while (mainLoopActive_ && !drainRequested_) {
+		pollfd fds[]{ { listenFd, POLLIN, 0 }, { searchEvent_, POLLIN, 0 } };
+		if (poll(fds, 2, SEARCH_IDLE_INTERVAL) == -1 && errno != EINTR) {
+			break;
+		}
+		if (fds[1].revents & POLLIN) {
+			eventfd_t pending;
+			eventfd_read(searchEvent_, &pending);
+		}
 		try {
-			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-			if (!mysql.query("SELECT "
-					"`users`.`login`, "
-					"`active_sessions`.`ip`, "
-					"`active_sessions`.`port`, "
-					"`active_sessions`.`pid` "
-				"FROM "
-					"`active_sessions` "
-				"JOIN "
-					"`users` ON `users`.`id` = `active_sessions`.`user_id`"
-			)) {
-				std::stringstream ss;
-				ss << "MySQL error: " << mysql.getError();
-				throw std::runtime_error{ ss.str() };
-			}
-			auto rows = mysql.fetchAll();
-			activeUsers_.clear();
-			for (const auto &row: rows) {
-				activeUsers_.insert(row[0]);
-				users_.at(row[0]).setIp(row[1]);
-				users_.at(row[0]).setPort(std::stoi(row[2]));
-				users_.at(row[0]).setPid(std::stoi(row[3]));
-				users_.at(row[0]).setLoggedIn();
+			// a query sees the messages stored before it, unless a transaction with lower ids is still writing
+			indexMessages(*index);
+			if (index->unsaved() >= SEARCH_SEGMENT_MESSAGES ||
+				(index->unsaved() > 0 && std::chrono::steady_clock::now() - saved >= SEARCH_SAVE_INTERVAL)) {
+				index->save();
+				saved = std::chrono::steady_clock::now();
+			}
+		}
+		catch (const std::exception &e) {
+			// the database may be back on the next check
+			clearPrompt();
+			std::cout << "Error: can not update search index (" << e.what() << ")" << std::endl;
+			printPrompt();
+		}
+		if (fds[0].revents & POLLIN) {
+			int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+			if (fd != -1) {
+				serveSearchRequest(fd, *index);
+				close(fd);
+			}
+		}
+	}
+	close(listenFd);
+	try {
+		index->save();
+	}
+	catch (const std::exception &e) {
+		std::cout << "Error: can not save search index (" << e.what() << ")" << std::endl;
+	}
+	exit(EXIT_SUCCESS);
+}
+
+void ChatServer::indexMessages(SearchIndex &index) {
+	// messages are added in id order, the ones above an unfinished transaction wait for it
+	auto horizon = storage().messageHorizon(ID_HORIZON_AGE);
+	unsigned count;
+	do {
+		if (index.next() >= horizon) {
+			return;
+		}
+		count = 0;
+		storage().forEachMessage(index.next(), horizon, SEARCH_BATCH, [&](const Storage::StoredMessage &message) {
+			SearchIndex::Scope scope{ SearchIndex::BROADCAST, message.sender_id, 0 };
+			if (message.channel_id != 0) {
+				scope = { SearchIndex::CHANNEL, message.sender_id, message.channel_id };
+			}
+			else if (message.is_private) {
+				scope = { SearchIndex::PRIVATE, message.sender_id, message.receiver_id };
+			}
+			index.add(message.id, scope, message.text);
+			++count;
+		});
+		Metrics::add(Metrics::SEARCH_INDEXED, count);
+	} while (count == SEARCH_BATCH);
+}
+
+void ChatServer::serveSearchRequest(const int fd, const SearchIndex &index) {
+	// a client process must not hang the indexer
+	timeval tv{ SEARCH_TIMEOUT, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	// "user_id\nlimit\nchannel ids\nquery" up to the end of input
+	std::string request;
+	char buffer[MESSAGE_LENGTH];
+	ssize_t bytes;
+	while ((bytes = read(fd, buffer, sizeof(buffer))) > 0 && request.size() < 64 * MESSAGE_LENGTH) {
+		request.append(buffer, bytes);
+	}
+	auto lines = Chat::split(request, "\n");
+	if (bytes != 0 || lines.size() < 4) {
+		return;
+	}
+	std::vector<unsigned long long> channels;
+	std::string response;
+	try {
+		auto user_id = std::stoul(lines[0]);
+		auto limit = std::stoul(lines[1]);
+		for (const auto &channel: Chat::split(lines[2], " ")) {
+			if (!channel.empty()) {
+				channels.push_back(std::stoull(channel));
+			}
+		}
+		std::sort(channels.begin(), channels.end());
+		for (auto id: index.search(request.substr(lines[0].size() + lines[1].size() + lines[2].size() + 3), user_id, channels, limit)) {
+			response.append(std::to_string(id)).append(1, ' ');
+		}
+	}
+	catch (const std::exception &e) {
+		return;
+	}
+	response.append(1, '\n');
+	Metrics::add(Metrics::SEARCH_QUERIES);
+	size_t sent{ 0 };
+	while (sent < response.length()) {
+		auto written = write(fd, response.data() + sent, response.length() - sent);
+		if (written <= 0) {
+			return;
+		}
+		sent += written;
+	}
+}
+
+void ChatServer::notifySearchIndexer() const {
+	if (searchEvent_ != -1) {
+		eventfd_write(searchEvent_, 1);
+	}
+}
+
+void ChatServer::startRetentionJob() {
+	Metrics::attach();
+	drainable_ = true;
+	close(sockFd_);
+	setpriority(PRIO_PROCESS, 0, RETENTION_NICE);
+	std::unique_ptr<MessageArchive> archive;
+	if (config_.contains("ArchiveDir")) {
+		try {
+			archive = std::make_unique<MessageArchive>(config_["ArchiveDir"], retention_.archiveSegmentSize);
+		}
+		catch (const std::exception &e) {
+			clearPrompt();
+			std::cout << "Error: can not open message archive: " << std::quoted(config_["ArchiveDir"]) << " (" << e.what() << ")" << std::endl;
+			printPrompt();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	while (mainLoopActive_ && !drainRequested_) {
+		auto started = std::chrono::steady_clock::now();
+		size_t removed{ 0 };
+		try {
+			if (retention_.age.count() > 0) {
+				removed += removeExpired(archive.get());
+			}
+			if (retention_.keep > 0) {
+				removed += trimConversations(archive.get());
 			}
 		}
 		catch (const std::runtime_error &e) {
+			// removed chunks stay removed, the rest waits for the next pass
 			clearPrompt();
+			std::cout << "Error: retention job failed (" << e.what() << "), retry in " << retention_.interval.count() << " s" << std::endl;
 			printPrompt();
 		}
+		setRetentionLag(0);
+		if (removed > 0) {
+			std::chrono::duration<double> elapsed{ std::chrono::steady_clock::now() - started };
+			clearPrompt();
+			std::cout << "Retention: " << removed << " messages removed in " << std::fixed << std::setprecision(1) << elapsed.count() << " s ("
+				<< static_cast<unsigned long long>(removed / std::max(elapsed.count(), 0.001)) << " rows/s)" << std::endl;
+			printPrompt();
+		}
+		// signals cut the sleep short
+		while (mainLoopActive_ && !drainRequested_ && std::chrono::steady_clock::now() - started < retention_.interval) {
+			sleep(1);
+		}
 	}
-	catch (const std::runtime_error &e) {
+	exit(EXIT_SUCCESS);
+}
+
+size_t ChatServer::removeExpired(MessageArchive *archive) {
+	auto cutoff = static_cast<double>(time(nullptr) - retention_.age.count());
+	unsigned long long from{ 0 };
+	size_t removed{ 0 };
+	bool expired{ true };
+	while (expired && mainLoopActive_ && !drainRequested_) {
+		auto start = std::chrono::steady_clock::now();
+		std::vector<MessageArchive::Message> messages;
+		unsigned count{ 0 };
+		storage().forEachReadMessage(nullptr, from, 0, retention_.chunk, [&](const Storage::StoredMessage &message) {
+			++count;
+			// ids follow the time of sending but for the blocks of the nodes, the first message young enough ends the pass
+			if (!expired || message.sent >= cutoff) {
+				expired = false;
+				return;
+			}
+			from = message.id + 1;
+			messages.push_back(MessageArchive::Message{
+				message.id, message.sent, message.sender_id, message.is_private ? message.receiver_id : 0, message.channel_id, std::string{ message.text }
+			});
+		});
+		if (count < retention_.chunk) {
+			expired = false;
+		}
+		if (!messages.empty()) {
+			setRetentionLag(static_cast<int64_t>(cutoff - messages.front().sent));
+		}
+		removed += removeChunk(messages, archive, start);
+	}
+	return removed;
+}
+
+size_t ChatServer::trimConversations(MessageArchive *archive) {
+	// reads of the indexes, they give way to the clients all the same
+	auto backOff = [this](const std::chrono::steady_clock::time_point start) {
+		usleep(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() * RETENTION_BACKOFF);
+	};
+	size_t removed{ 0 };
+	std::vector<Storage::Conversation> conversations;
+	bool more{ true };
+	// the conversations are walked a chunk at a time from the last one of the previous chunk
+	while (more && mainLoopActive_ && !drainRequested_) {
+		auto start = std::chrono::steady_clock::now();
+		auto after = conversations.empty() ? std::nullopt : std::optional<Storage::Conversation>{ conversations.back() };
+		conversations.clear();
+		storage().forEachConversation(after ? &*after : nullptr, retention_.chunk, [&](const Storage::Conversation &conversation) {
+			conversations.push_back(conversation);
+		});
+		more = conversations.size() == retention_.chunk;
+		backOff(start);
+		for (const auto &conversation: conversations) {
+			if (!mainLoopActive_ || drainRequested_) {
+				break;
+			}
+			start = std::chrono::steady_clock::now();
+			auto floor = storage().conversationFloor(conversation, retention_.keep);
+			if (floor == 0) {
+				backOff(start);
+				continue;
+			}
+			unsigned long long from{ 0 };
+			unsigned count;
+			do {
+				std::vector<MessageArchive::Message> messages;
+				count = 0;
+				storage().forEachReadMessage(&conversation, from, floor, retention_.chunk, [&](const Storage::StoredMessage &message) {
+					++count;
+					from = message.id + 1;
+					messages.push_back(MessageArchive::Message{
+						message.id, message.sent, message.sender_id, message.is_private ? message.receiver_id : 0, message.channel_id, std::string{ message.text }
+					});
+				});
+				removed += removeChunk(messages, archive, start);
+				start = std::chrono::steady_clock::now();
+			} while (count == retention_.chunk && mainLoopActive_ && !drainRequested_);
+		}
+	}
+	return removed;
+}
+
+size_t ChatServer::removeChunk(const std::vector<MessageArchive::Message> &messages, MessageArchive *archive, const std::chrono::steady_clock::time_point start) {
+	size_t removed{ 0 };
+	if (!messages.empty()) {
+		// the messages are on disk before they leave the database
+		if (archive != nullptr) {
+			archive->append(messages);
+			Metrics::add(Metrics::RETENTION_ARCHIVED, messages.size());
+		}
+		std::vector<unsigned long long> ids;
+		for (const auto &message: messages) {
+			ids.push_back(message.id);
+		}
+		removed = storage().removeMessages(ids);
+		Metrics::add(Metrics::RETENTION_DELETED, removed);
+	}
+	std::chrono::duration<double> elapsed{ std::chrono::steady_clock::now() - start };
+	Metrics::observe(Metrics::RETENTION_CHUNK_SECONDS, elapsed.count());
+	// every statement is short, the pause lets the clients have the locks and the disk
+	auto pause = std::max(std::chrono::duration_cast<std::chrono::microseconds>(retention_.pause),
+		std::chrono::duration_cast<std::chrono::microseconds>(elapsed * RETENTION_BACKOFF));
+	usleep(pause.count());
+	return removed;
+}
+
+void ChatServer::setRetentionLag(const int64_t seconds) {
+	Metrics::add(Metrics::RETENTION_LAG_SECONDS, seconds - retention_.lag);
+	retention_.lag = seconds;
+}
+
+void ChatServer::startClusterBus() {
+	Metrics::attach();
+	close(sockFd_);
+	try {
+		cluster_->open(*presence_, [this](const ClusterBus::Notice &notice) {
+			// messages stored by another node
+			Metrics::add(Metrics::SESSION_WAKEUPS, notice.all ? sessions_->wakeAll() : sessions_->wake(notice.users));
+			notifySearchIndexer();
+		}, [this](const std::string &event) {
+			clearPrompt();
+			std::cout << "Cluster: " << event << std::endl;
+			printPrompt();
+		});
+	}
+	catch (const std::exception &e) {
 		clearPrompt();
-		std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
+		std::cout << "Error: can not start cluster bus (" << e.what() << ")" << std::endl;
 		printPrompt();
+		exit(EXIT_FAILURE);
 	}
+	while (mainLoopActive_) {
+		cluster_->poll(CLUSTER_POLL_INTERVAL);
+	}
+	exit(EXIT_SUCCESS);
+}
+
+void ChatServer::notifyRecipients(const std::vector<unsigned> &user_ids) const {
+	Metrics::add(Metrics::SESSION_WAKEUPS, sessions_->wake(user_ids));
+	if (cluster_) {
+		cluster_->publish(user_ids);
+	}
+}
+
+void ChatServer::notifyJournalRecipients(std::vector<std::string> &recipients, const bool broadcast) const {
+	if (broadcast) {
+		notifyAllRecipients();
+		return;
+	}
+	std::sort(recipients.begin(), recipients.end());
+	recipients.erase(std::unique(recipients.begin(), recipients.end()), recipients.end());
+	std::vector<unsigned> user_ids;
+	std::vector<std::string> missing;
+	for (const auto &login: recipients) {
+		if (auto user = users_->find(login)) {
+			user_ids.push_back(user->id);
+		}
+		else {
+			missing.push_back(login);
+		}
+	}
+	if (!missing.empty() && !users_->lazy()) {
+		// signed up after the table was loaded, a user removed meanwhile has nobody to wake
+		users_->load();
+		for (const auto &login: missing) {
+			if (auto user = users_->find(login)) {
+				user_ids.push_back(user->id);
+			}
+		}
+	}
+	if (!user_ids.empty()) {
+		notifyRecipients(user_ids);
+	}
+}
+
+void ChatServer::notifyAllRecipients() const {
+	Metrics::add(Metrics::SESSION_WAKEUPS, sessions_->wakeAll());
+	if (cluster_) {
+		cluster_->publishAll();
+	}
+}
+
+void ChatServer::serveMetricsRequest(const int fd) const {
+	// Scraper must not hang the metrics process
+	timeval tv;
+	tv.tv_sec = 2;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	char request[MESSAGE_LENGTH];
+	auto bytes = read(fd, request, sizeof(request) - 1);
+	if (bytes <= 0) {
+		return;
+	}
+	request[bytes] = '\0';
+
+	std::string status, body;
+	if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics?", 13) == 0) {
+		status = "200 OK";
+		body = Metrics::render();
+	}
+	else {
+		status = "404 Not Found";
+		body = "Not found\n";
+	}
+	std::stringstream ss;
+	ss << "HTTP/1.1 " << status << "\r\n"
+		"Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+		"Content-Length: " << body.length() << "\r\n"
+		"Connection: close\r\n\r\n" << body;
+	auto response = ss.str();
+	size_t sent{ 0 };
+	while (sent < response.length()) {
+		auto written = write(fd, response.data() + sent, response.length() - sent);
+		if (written <= 0) {
+			return;
+		}
+		sent += written;
+	}
+}
+
+void ChatServer::writeLog(const std::string &line) const {
+	Metrics::add(Metrics::LOG_QUEUE_DEPTH, 1);
+	*logger_ << line;
+	Metrics::add(Metrics::LOG_QUEUE_DEPTH, -1);
+}
+
+void ChatServer::printLineFromLog() const {
+	clearPrompt();
+	if (logger_->isEof()) {
+		std::cout << "Error: EOF has been reached" << std::endl;
+		return;
+	}
+	std::cout << logger_->readline() << std::endl;
 }
 
 void ChatServer::cleanExit() {
 	if (mainPid_ != getpid()) {
+		saveAcknowledgements(true);
 		terminateChild();
 	}
-	mainLoopActive_ = false;
-	clearPrompt();
-	std::cout << "Killing all children..." << std::endl;
-	for (auto child: children_) {
-		kill(child, SIGTERM);
+	if (!mainLoopActive_.exchange(false)) {
+		// already shutting down
+		return;
 	}
-	sleep(2); // Waiting 2 seconds for all children will die
 	clearPrompt();
 	std::cout << "Closing socket..." << std::endl;
 	close(sockFd_);
+	close(upgradeFd_);
+	drainChildren();
+	try {
+		setUsersInactive();
+	}
+	catch (const std::runtime_error &e) {
+		std::cout << "Error: can not clear user sessions in database (" << e.what() << ")" << std::endl;
+	}
+	for (auto pid: { consolePid_, metricsPid_, clusterPid_ }) {
+		if (pid > 0) {
+			kill(pid, SIGTERM);
+			waitpid(pid, nullptr, 0);
+		}
+	}
 	std::cout << "Removing temporary directory..." << std::endl;
 	fs::remove_all(TEMP_DIR);
+	storage_.reset();
+	Storage::cleanup(config_, instancePid_);
 	std::cout << "Exiting from main process..." << std::endl;
 	
 	exit(EXIT_SUCCESS);	
 }
 
-void ChatServer::terminateChild() const {
-	if (connection_ != 0) {
-		removeSessionByPid(getpid());
-		strcpy(message_, "/response:kick");
-		if (write(connection_, message_, MESSAGE_LENGTH) == -1) {
-			std::cerr << "Error while calling write: " << strerror(errno) << std::endl;
+void ChatServer::drainChildren() {
+	unsigned timeout{ DEFAULT_SHUTDOWN_TIMEOUT };
+	try {
+		timeout = std::stoul(config_.get("ShutdownTimeout", std::to_string(DEFAULT_SHUTDOWN_TIMEOUT)));
+	}
+	catch (const std::exception &e) {
+		std::cout << "Error: invalid ShutdownTimeout, using " << timeout << " s" << std::endl;
+	}
+	std::cout << "Draining " << children_.size() << " clients..." << std::endl;
+	for (auto child: children_) {
+		kill(child, SIGUSR1);
+	}
+	for (auto pid: { journalPid_, searchPid_, retentionPid_ }) {
+		if (pid > 0) {
+			kill(pid, SIGUSR1);
 		}
-		close(connection_);
 	}
 
-	exit(EXIT_SUCCESS);
+	// reaped here, the main loop does not run any more
+	size_t drained{ 0 };
+	size_t dropped{ 0 };
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{ timeout };
+	while ((!children_.empty() || journalPid_ > 0 || searchPid_ > 0 || retentionPid_ > 0) && std::chrono::steady_clock::now() < deadline) {
+		int status;
+		auto pid = waitpid(-1, &status, WNOHANG);
+		if (pid <= 0) {
+			usleep(10000);
+			continue;
+		}
+		Metrics::release(pid);
+		if (children_.erase(pid) > 0) {
+			Metrics::add(Metrics::CONNECTIONS_ACTIVE, -1);
+			bool clean = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+			Metrics::add(clean ? Metrics::CLIENTS_DRAINED : Metrics::CLIENTS_DROPPED);
+			++(clean ? drained : dropped);
+		}
+		else if (pid == journalPid_) {
+			journalPid_ = 0;
+		}
+		else if (pid == searchPid_) {
+			searchPid_ = 0;
+		}
+		else if (pid == retentionPid_) {
+			retentionPid_ = 0;
+		}
+		else if (pid == consolePid_) {
+			consolePid_ = 0;
+		}
+		else if (pid == metricsPid_) {
+			metricsPid_ = 0;
+		}
+		else if (pid == clusterPid_) {
+			clusterPid_ = 0;
+		}
+	}
+
+	// did not finish in time
+	for (auto child: children_) {
+		kill(child, SIGKILL);
+		waitpid(child, nullptr, 0);
+		Metrics::release(child);
+		Metrics::add(Metrics::CONNECTIONS_ACTIVE, -1);
+		Metrics::add(Metrics::CLIENTS_DROPPED);
+		++dropped;
+	}
+	children_.clear();
+	if (journalPid_ > 0) {
+		kill(journalPid_, SIGKILL);
+		waitpid(journalPid_, nullptr, 0);
+		Metrics::release(journalPid_);
+		journalPid_ = 0;
+		std::cout << "Message journal is not fully applied, the rest is replayed on the next start" << std::endl;
+	}
+	for (auto pid: { searchPid_, retentionPid_ }) {
+		if (pid > 0) {
+			kill(pid, SIGKILL);
+			waitpid(pid, nullptr, 0);
+			Metrics::release(pid);
+		}
+	}
+	searchPid_ = 0;
+	retentionPid_ = 0;
+	std::cout << "Clients drained: " << drained << ", dropped: " << dropped << std::endl;
 }
 
-void ChatServer::childDeathHandler(int signum) {
-	pid_t pid;
-	while ((pid = waitpid(-1, nullptr, WNOHANG)) > 0) {
-		if (pid == consolePid_) {
-			cleanExit();
+void ChatServer::drainClient() {
+	if (!loggedUser_.empty()) {
+		// deliver what is already stored before the notice
+		Metrics::add(Metrics::MESSAGES_FLUSHED, checkUnreadMessages());
+		saveAcknowledgements(true);
+		try {
+			endSession(userId(loggedUser_));
 		}
-		else {
-			updateActiveUsers();
-			removeSessionByPid(pid);
-			auto it = children_.find(pid);
-			if (it != children_.end()) {
-				children_.erase(it);
-			}
+		catch (const std::exception &e) {
+			clearPrompt();
+			std::cout << "Error: can not log out (" << e.what() << ")" << std::endl;
+			printPrompt();
 		}
 	}
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	strcpy(message_, "/response:shutdown");
+	sendResponse();
+	if (outbound_ != nullptr && !outbound_->flush(FINAL_FLUSH_TIMEOUT)) {
+		std::cerr << "Error while calling write: " << strerror(errno) << std::endl;
+	}
+	close(connection_);
+	exit(EXIT_SUCCESS);
 }
 
-void ChatServer::sigIntHandler(int signum) {
+void ChatServer::drainHandler(int) {
 	if (mainPid_ != getpid()) {
-		terminateChild();
+		drainRequested_ = true;
 	}
-	else {
-		std::cout << "\nCaught interrupt signal!" << std::endl;
-		kill(consolePid_, SIGTERM);
-		cleanExit();
+}
+
+void ChatServer::wakeHandler(int) {
+	deliveryPending_ = true;
+}
+
+void ChatServer::terminateChild() const {
+	if (connection_ != 0) {
+		endSessions({ getpid() });
+		std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+		strcpy(message_, "/response:kick");
+		if (!disconnectReason_.empty()) {
+			strcat(message_, ":");
+			strncat(message_, disconnectReason_.c_str(), MESSAGE_LENGTH - strlen(message_) - 1);
+		}
+		if (outbound_ != nullptr) {
+			// the client is leaving, only a partially sent frame is finished before the notice
+			outbound_->discardMessages();
+		}
+		sendResponse();
+		if (outbound_ != nullptr && !outbound_->flush(FINAL_FLUSH_TIMEOUT)) {
+			std::cerr << "Error while calling write: " << strerror(errno) << std::endl;
+		}
+		close(connection_);
 	}
+
+	exit(EXIT_SUCCESS);
 }
 
-void ChatServer::sigTermHandler(int signum) {
-	if (mainPid_ != getpid()) {
-		terminateChild();
+// signal handlers run in children only, the main process reads signals from signalfd
+void ChatServer::sigIntHandler(int) {
+	if (drainable_) {
+		// Ctrl-C reaches the whole process group, the main process drains this one
+		return;
 	}
-	else {
-		std::cout << "\nCaught terminate signal!" << std::endl;
-		kill(consolePid_, SIGTERM);
-		cleanExit();
+	terminateChild();
+}
+
+void ChatServer::sigTermHandler(int) {
+	if (connection_ != 0) {
+		// the session is ended by the main loop, the handler may interrupt a change of the presence directory
+		terminateRequested_ = true;
+		return;
 	}
+	terminateChild();
 }
 
 void ChatServer::processNewClient() {
+	Metrics::attach();
+	drainable_ = true;
 	clearPrompt();
 	std::cout << "Client connected from " << getClientIpAndPort() << std::endl;
 	printPrompt();
+	try {
+		auto high = std::stoul(config_.get("OutboundHighWatermark", std::to_string(DEFAULT_HIGH_WATERMARK)));
+		auto low = std::stoul(config_.get("OutboundLowWatermark", std::to_string(DEFAULT_LOW_WATERMARK)));
+		std::chrono::seconds stall{ std::stoul(config_.get("SlowConsumerTimeout", std::to_string(DEFAULT_SLOW_CONSUMER_TIMEOUT))) };
+		outbound_ = std::make_unique<OutboundQueue>(connection_, MESSAGE_LENGTH, high, low, OutboundQueue::policy(config_.get("SlowConsumerPolicy", "disconnect")), stall);
+	}
+	catch (const std::exception &e) {
+		clearPrompt();
+		std::cout << "Error: invalid outbound queue settings, defaults are used (" << e.what() << ")" << std::endl;
+		printPrompt();
+		outbound_ = std::make_unique<OutboundQueue>(connection_, MESSAGE_LENGTH, DEFAULT_HIGH_WATERMARK, DEFAULT_LOW_WATERMARK, OutboundQueue::DISCONNECT,
+			std::chrono::seconds{ DEFAULT_SLOW_CONSUMER_TIMEOUT });
+	}
+
+	// the wake signal and SIGTERM are blocked outside pselect(), so they are never lost between the check and the wait
+	sigset_t waitSignals;
+	sigset_t waitMask;
+	sigemptyset(&waitSignals);
+	sigaddset(&waitSignals, SessionRegistry::WAKE_SIGNAL);
+	sigaddset(&waitSignals, SIGTERM);
+	sigprocmask(SIG_BLOCK, &waitSignals, &waitMask);
+	sigdelset(&waitMask, SessionRegistry::WAKE_SIGNAL);
+	sigdelset(&waitMask, SIGTERM);
+	bool wakeable = sessions_->attach();
+	const std::chrono::milliseconds recheck{ wakeable ? DELIVERY_RECHECK_INTERVAL : DELIVERY_POLL_INTERVAL };
+	if (!wakeable) {
+		clearPrompt();
+		std::cout << "Error: session registry is full, unread messages of " << getClientIpAndPort() << " are polled" << std::endl;
+		printPrompt();
+	}
+	if (!loggedUser_.empty()) {
+		// session received from the previous server
+		sessions_->setUser(userId(loggedUser_));
+		deliveryPending_ = true;
+	}
 
 	fd_set rfds;
+	fd_set wfds;
 	while (true) {
 		try {	
+			if (terminateRequested_) {
+				saveAcknowledgements(true);
+				terminateChild();
+			}
 			if (!loggedUser_.empty()) {
-				try {
-					checkUnreadMessages();
+				auto now = std::chrono::steady_clock::now();
+				// a paused queue keeps the request until the client catches up
+				if ((deliveryPending_ || now - deliveryChecked_ >= recheck) && !outbound_->paused()) {
+					try {
+						if (deliveryPending_) {
+							// woken by the sender, its message may not have reached the replicas yet
+							storage().observeWrite();
+						}
+					}
+					catch (const std::runtime_error &e) {
+						// the database is unavailable, the unread check below reports it
+					}
+					deliveryPending_ = false;
+					deliveryChecked_ = now;
+					try {
+						checkUnreadMessages();
+					}
+					catch (const std::logic_error &e) {
+						std::cout << "Logic error: " << e.what() << std::endl;
+					}
 				}
-				catch (const std::logic_error &e) {
-					std::cout << "Logic error: " << e.what() << std::endl;
+				saveAcknowledgements();
+			}
+
+			if (outbound_->stalled() && !outbound_->relieve()) {
+				disconnectReason_ = "slow consumer";
+			}
+			if (!disconnectReason_.empty()) {
+				clearPrompt();
+				std::cout << "Client with address " << getClientIpAndPort() << " has been disconnected: " << disconnectReason_ << std::endl;
+				printPrompt();
+				Metrics::add(Metrics::SLOW_CONSUMERS_DISCONNECTED);
+				break;
+			}
+			if (handOverRequested_) {
+				handOverClient();
+			}
+			if (drainRequested_) {
+				// requests already received are served before the notice
+				pollfd pending{ connection_, POLLIN, 0 };
+				if (outbound_->paused() || poll(&pending, 1, 0) == 0) {
+					drainClient();
 				}
 			}
 
 			int bytes;
-			struct timeval tv;
-			tv.tv_sec = 0;
-			tv.tv_usec = 500000; // half second
+			struct timespec ts;
+			ts.tv_sec = 0;
+			ts.tv_nsec = 500000000; // half second
 			FD_ZERO(&rfds);
-			FD_SET(connection_, &rfds);
-			auto retval = select(connection_ + 1, &rfds, nullptr, nullptr, &tv);
+			FD_ZERO(&wfds);
+			if (!outbound_->paused()) {
+				// new requests are not read until the client takes its responses
+				FD_SET(connection_, &rfds);
+			}
+			if (!outbound_->empty()) {
+				FD_SET(connection_, &wfds);
+			}
+			auto retval = pselect(connection_ + 1, &rfds, &wfds, nullptr, &ts, &waitMask);
+			if (retval == -1 && errno == EINTR) {
+				continue;
+			}
 			if (retval == -1) {
 				clearPrompt();
-				std::cout << "An error occured while trying to call select(): " << strerror(errno) << std::endl;
+				std::cout << "An error occured while trying to call pselect(): " << strerror(errno) << std::endl;
 				printPrompt();
 				continue;
 			}
 			if (retval == 0) { // select() timed out
 				continue;
 			}
+			if (FD_ISSET(connection_, &wfds) && !outbound_->flush()) {
+				clearPrompt();
+				std::cout << "Client with address " << getClientIpAndPort() << " has been disconnected\n" << std::endl;
+				printPrompt();
+				break;
+			}
+			if (!FD_ISSET(connection_, &rfds)) {
+				continue;
+			}
 
 			std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
 			bytes = read(connection_, message_, MESSAGE_LENGTH);
@@ -788,6 +2310,11 @@ void ChatServer::processNewClient() {
 				break;
 			}
 
+			if (strncmp(message_, "/ack:", 5) == 0) {
+				// sent after every burst of messages, not worth a console line
+				acknowledge();
+				continue;
+			}
 			clearPrompt();
 			std::cout << "Received " << bytes << " bytes: " << message_ << std::endl;
 			printPrompt();
@@ -812,6 +2339,18 @@ void ChatServer::processNewClient() {
 					removeUser();
 				}
 			}
+			else if (strncmp(message_, "/join", 5) == 0) {
+				joinChannel();
+			}
+			else if (strncmp(message_, "/leave", 6) == 0) {
+				leaveChannel();
+			}
+			else if (strncmp(message_, "/history", 8) == 0) {
+				sendHistory();
+			}
+			else if (strncmp(message_, "/search", 7) == 0) {
+				sendSearchResults();
+			}
 			else if (
 				strncmp(message_, "/exit", 5) == 0 ||
 				strncmp(message_, "/quit", 5) == 0) {
@@ -831,100 +2370,121 @@ void ChatServer::processNewClient() {
 	cleanExit();
 }
 
-void ChatServer::checkUnreadMessages() {	
+size_t ChatServer::checkUnreadMessages() {
+	size_t count{ 0 };
+	if (outbound_->paused() || outbound_->room() == 0) {
+		// the client does not keep up, messages wait in the database
+		return count;
+	}
+	// no more than fit below the high watermark, the rest is read from sentSeq_ once the queue drains
+	auto limit = static_cast<unsigned>(std::min<size_t>(outbound_->room(), UINT_MAX));
 	try {
-		Mysql mysql;
-		try {
-			std::stringstream ss;
-			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-			ss << 
-				"SELECT "
-					"`receiver_users`.`login`, "
-					"`messages`.`text`, "
-					"`unread_users`.`id`, "
-					"`messages`.`id`, "
-					"`sender_users`.`login`"
-				"FROM "
-					"`unread_messages` "
-				"JOIN "
-					"`messages` ON `messages`.`id` = `unread_messages`.`message_id` "
-				"JOIN "
-					"`users` AS `unread_users` ON `unread_messages`.`user_id` = `unread_users`.`id` "
-				"JOIN "
-					"`users` AS `sender_users` ON `messages`.`sender` = `sender_users`.`id` "
-				"LEFT JOIN "
-					"`users` AS `receiver_users` ON `messages`.`receiver` = `receiver_users`.`id` "
-				"WHERE "
-					"`unread_users`.`login` = '" << loggedUser_ << "' "
-				"ORDER BY `messages`.`sent`";
-			mysql.query(ss.str());
-			auto rows = mysql.fetchAll();
-			for (const auto &row: rows) {
-				if (row[0].empty()) {
-					strcpy(message_, (std::string{ "BROADCAST\n" } + row[4] + "\n" + row[1] + "\n").c_str());
-				}
-				else {
-					strcpy(message_, (std::string{ "PRIVATE\n" } + row[4] + "\n" + row[1] + "\n").c_str());
+		// messages already queued are not read again, the client acknowledges them later
+		storage().forEachUnread(userId(loggedUser_), sentSeq_, limit, [&](const Storage::Delivery &delivery) {
+			// broadcast frame is the same for every recipient, so it is encoded by the first one only
+			bool shared{ !delivery.is_private && frameCache_ != nullptr };
+			if (shared && frameCache_->visit(delivery.message_id, [&](std::string_view frame) { outbound_->pushMessage(frame, delivery.seq); })) {
+				Metrics::add(Metrics::FRAME_CACHE_HITS);
+			}
+			else {
+				Chat::WireRecord record{
+					!delivery.channel.empty() ? Chat::WireRecord::CHANNEL : delivery.is_private ? Chat::WireRecord::PRIVATE : Chat::WireRecord::BROADCAST,
+					0,
+					delivery.message_id,
+					static_cast<uint64_t>(delivery.sent),
+					delivery.sender_id,
+					delivery.sender,
+					delivery.channel,
+					delivery.text
+				};
+				// the seq of the recipient follows the record
+				char buffer[MESSAGE_LENGTH];
+				std::string_view frame{ buffer, Chat::encodeRecord(record, buffer, MESSAGE_LENGTH - Chat::MAX_VARINT - 1) };
+				if (shared) {
+					frameCache_->store(delivery.message_id, frame);
+					Metrics::add(Metrics::FRAME_CACHE_MISSES);
 				}
-				write(connection_, message_, MESSAGE_LENGTH);
-				ss.str(std::string{});
-				ss << "DELETE FROM `unread_messages` WHERE "
-					"`user_id` = " << row[2] << " AND "
-					"`message_id` = " << row[3];
-				mysql.query(ss.str());
+				outbound_->pushMessage(frame, delivery.seq);
 			}
-		}
-		catch (const std::runtime_error &e) {
-			clearPrompt();
-			std::cout << "Error: can not load unread messages from database (" << e.what() << ")" << std::endl;
-			printPrompt();
+			Metrics::add(Metrics::MESSAGES_DELIVERED);
+			if (delivery.sent > 0) {
+				Metrics::observe(Metrics::DELIVERY_LAG_SECONDS, std::max(0.0, std::time(nullptr) - delivery.sent));
+			}
+			sentSeq_ = delivery.seq;
+			++count;
+		});
+		if (count == limit) {
+			// more may be waiting, they are read as soon as the queue is not paused
+			deliveryPending_ = true;
 		}
 	}
 	catch (const std::runtime_error &e) {
 		clearPrompt();
-		std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
+		std::cout << "Error: can not load unread messages from database (" << e.what() << ")" << std::endl;
 		printPrompt();
 	}
-
+	return count;
 }
 
-void ChatServer::loadUsers() {
-	Mysql mysql;
-	mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-	if (!mysql.query("SELECT `id`, `login`, `password_hash`, `name` FROM `users` ORDER BY `id`")) {
-		std::stringstream ss;
-		ss << "MySQL error: " << mysql.getError() << std::endl;
-		throw std::runtime_error{ ss.str() };
+void ChatServer::acknowledge() {
+	auto tokens = Chat::split(message_, ":");
+	unsigned long long seq{ 0 };
+	try {
+		seq = std::stoull(tokens.at(1));
 	}
-	auto users_list = mysql.fetchAll();
-	users_.clear();
-	for (auto &user_data: users_list) {
-		users_.emplace(user_data[1], ChatUser(std::stoi(user_data[0]), user_data[1], user_data[2], user_data[3]));
+	catch (const std::exception &e) {
+		return;
+	}
+	// nothing beyond what has been queued can be acknowledged
+	seq = std::min(seq, sentSeq_);
+	if (seq > ackedSeq_) {
+		Metrics::add(Metrics::MESSAGES_ACKNOWLEDGED, seq - ackedSeq_);
+		ackedSeq_ = seq;
 	}
 }
 
-void ChatServer::saveUsers() const {
+void ChatServer::saveAcknowledgements(const bool force) {
+	if (loggedUser_.empty() || ackedSeq_ == savedSeq_) {
+		return;
+	}
+	auto now = std::chrono::steady_clock::now();
+	if (!force && now - ackSaved_ < ACK_SAVE_INTERVAL) {
+		return;
+	}
 	try {
-		Mysql mysql;
+		auto user_id = userId(loggedUser_);
 		try {
-			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-			for (auto it = users_.begin(); it != users_.end(); ++it) {
-				it->second.save(mysql);		
-			}
+			storage().acknowledge(user_id, ackedSeq_);
+			Metrics::add(Metrics::DELIVERY_CURSOR_UPDATES);
 		}
 		catch (const std::runtime_error &e) {
-			clearPrompt();
-			std::cout << "Error: can not save user information to database (" << e.what() << ")" << std::endl;
-			printPrompt();
+			if (!journal_ || !isStorageLost()) {
+				throw;
+			}
+			// the cursor is moved forward only, so the record may be applied after newer acknowledgements
+			MessageJournal::Record record;
+			record.type = MessageJournal::ACKNOWLEDGE;
+			record.sent = std::time(nullptr);
+			record.sender = loggedUser_;
+			record.user_id = user_id;
+			record.seq = ackedSeq_;
+			journal_->append(record);
+			Metrics::add(Metrics::SPOOL_RECORDS);
 		}
+		savedSeq_ = ackedSeq_;
+		ackSaved_ = now;
 	}
-	catch (const std::runtime_error &e) {
+	catch (const std::exception &e) {
 		clearPrompt();
-		std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
+		std::cout << "Error: can not save delivery cursor to database (" << e.what() << ")" << std::endl;
 		printPrompt();
 	}
 }
 
+void ChatServer::loadUsers() {
+	users_->load();
+}
+
 void ChatServer::printPrompt() const {
 	std::cout << PROMPT << ' ';
 	std::cout.flush();
@@ -955,25 +2515,11 @@ unsigned short ChatServer::getClientPort() const {
 
 void ChatServer::removeUserFromDb(const std::string &removedUser) const {
 	try {
-		Mysql mysql;
-		try {
-			std::stringstream ss;
-
-			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-			ss << "DELETE FROM `users` WHERE `login` = '" << removedUser << "'";
-			if (!mysql.query(ss.str())) {
-				throw std::runtime_error{ mysql.getError() };
-			}
-		}
-		catch (const std::runtime_error &e) {
-			clearPrompt();
-			std::cout << "Error: can not remove user from database (" << e.what() << ")" << std::endl;
-			printPrompt();
-		}
+		users_->remove(removedUser);
 	}
 	catch (const std::runtime_error &e) {
 		clearPrompt();
-		std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
+		std::cout << "Error: can not remove user from database (" << e.what() << ")" << std::endl;
 		printPrompt();
 	}
 }
@@ -1,12 +1,29 @@
 #pragma once
 
 #include "mysql.h"
-#include "chat_user.h"
+#include "storage.h"
+#include "user_directory.h"
 #include "chat_message.h"
 #include "broadcast_message.h"
 #include "private_message.h"
+#include "channel_message.h"
+#include "channel_index.h"
 #include "config_file.h"
 #include "logger.h"
+#include "metrics.h"
+#include "message_journal.h"
+#include "circuit_breaker.h"
+#include "id_allocator.h"
+#include "message_archive.h"
+#include "frame_cache.h"
+#include "outbound_queue.h"
+#include "search_index.h"
+#include "session_registry.h"
+#include "presence_directory.h"
+#include "cluster_bus.h"
+#include "hash_ring.h"
+#include "wire_format.h"
+#include "unix_socket.h"
 
 #include <iostream>
 #include <string>
@@ -18,6 +35,8 @@
 #include <algorithm>
 #include <stdexcept>
 #include <atomic>
+#include <chrono>
+#include <functional>
 
 #if defined(_WIN64) or defined(_WIN32)
 #include <Windows.h>
@@ -30,6 +49,8 @@ extern "C" {
 	#include <sys/socket.h>
 	#include <sys/types.h>
 	#include <sys/wait.h>
+	#include <sys/signalfd.h>
+	#include <signal.h>
 	#include <netinet/in.h>
 	#include <arpa/inet.h>
 }
@@ -37,12 +58,14 @@ extern "C" {
 
 class ChatServer final {
 public:
-	ChatServer(); // constructor
+	ChatServer(bool takeover = false); // constructor, takeover: receive sockets and sessions of the running server
 	~ChatServer(); // destructor
 	void work(); // main work
-	void childDeathHandler(int signum);
-	void sigIntHandler(int signum);
-	void sigTermHandler(int signum);
+	void sigIntHandler(int);
+	void sigTermHandler(int);
+	void handOverHandler(int);
+	void drainHandler(int);
+	void wakeHandler(int);
 
 private:	
 	bool isLoginAvailable(const std::string& login) const; // login availability
@@ -53,12 +76,20 @@ private:
 	void removeUser(); // deleting a user
 	void removeUser(const std::string &cmd); // deleting a user
 	void sendMessage(); // sending a message
-	void sendPrivateMessage(ChatUser& sender, const std::string& receiverName, const std::string& messageText); // sending a private message
-	void sendBroadcastMessage(ChatUser& sender, const std::string& message); // sending a shared message
-	void checkUnreadMessages(); // check unread messages
-	void saveUsers() const;
+	void sendPrivateMessage(const std::string &sender, const std::string& receiverName, const std::string& messageText); // sending a private message
+	void sendBroadcastMessage(const std::string &sender, const std::string& message); // sending a shared message
+	void sendChannelMessage(const std::string &sender, const std::string &channel, const std::string &messageText); // sending a message to channel members
+	void saveMessage(const ChatMessage &message, const std::function<void()> &notify); // to the database, journal or spool, notify if saved to the database
+	void joinChannel(); // subscribe the user to a channel, created if not exists
+	void leaveChannel(); // unsubscribe the user from a channel
+	void sendHistory(); // page of "/history:scope[:before_id]", scope is all, @login or #channel
+	void sendSearchResults(); // newest messages visible to the user matching "/search:words"
+	size_t historyFrame(const Storage::HistoryEntry &entry, char *frame) const; // encodes a stored message for the client, returns the size
+	size_t checkUnreadMessages(); // check unread messages, returns number of delivered ones
+	void acknowledge(); // cumulative acknowledgement "/ack:seq" from the client
+	void saveAcknowledgements(bool force = false); // move the delivery cursor, at most once per ACK_SAVE_INTERVAL unless forced
 	void saveMessages() const; // save all messages to file
-	void loadUsers(); // load user list from file
+	void loadUsers(); // whole users table, nothing is loaded in lazy mode
 	void setUsersInactive() const;
 	void loadMessages(const std::string &filename); // load message list from file
 	void printSystemInformation() const; // print information about process and OS
@@ -67,6 +98,23 @@ private:
 	void clearPrompt() const;
 	void processNewClient();
 	void startConsole();
+	void startMetricsServer();
+	void serveMetricsRequest(int fd) const;
+	void startJournalReplicator();
+	void startSearchIndexer();
+	void indexMessages(SearchIndex &index); // add messages stored since the last call
+	void serveSearchRequest(int fd, const SearchIndex &index);
+	void notifySearchIndexer() const; // a message has been saved
+	void startRetentionJob();
+	size_t removeExpired(MessageArchive *archive); // messages older than the retention age, returns the number of removed ones
+	size_t trimConversations(MessageArchive *archive); // messages beyond the newest ones kept in every conversation
+	size_t removeChunk(const std::vector<MessageArchive::Message> &messages, MessageArchive *archive, std::chrono::steady_clock::time_point start); // archive, delete and pause
+	void setRetentionLag(int64_t seconds); // chat_retention_lag_seconds of the job process
+	void startClusterBus();
+	void notifyRecipients(const std::vector<unsigned> &user_ids) const; // wake the sessions of the users on every node
+	void notifyAllRecipients() const;
+	void notifyJournalRecipients(std::vector<std::string> &recipients, bool broadcast) const; // of the records applied from the journal
+	void writeLog(const std::string &line) const;
 	void checkLogin() const;
 	void terminateChild() const;
 	void cleanExit();
@@ -75,38 +123,156 @@ private:
 	unsigned short getClientPort() const;
 	void removeUserFromDb(const std::string &) const;
 	void displayHelp() const;
-	void removeSessionByPid(pid_t pid) const;
-	void updateActiveUsers();
+	bool startSession(unsigned user_id, uint32_t ip, unsigned short port) const; // false if the user is online on any node
+	void endSession(unsigned user_id) const; // session of this process
+	void endSessions(const std::vector<pid_t> &pids) const; // sessions of exited client processes
+	bool saveSessions() const; // snapshot of the sessions of this node to the database, false if failed
+	void saveMessageHorizon() const; // lowest message id the node may still commit, for the readers of the other nodes
+	unsigned userId(const std::string &login) const; // throws std::out_of_range if the user is not registered
 	void listActiveUsers();
 	void printLineFromLog() const;
 	void kickClient(const std::string &cmd);
+	Storage &storage() const; // database connection of the current process, throws std::runtime_error at once while the breaker is open
+	bool isStorageLost() const; // the last storage() call has not connected or the connection has been lost since
+	bool useJournal() const; // messages go to the journal, or to the spool while the database is unavailable
+	pid_t spawn(); // fork() without sharing the database connection and signalfd
+	void handleSignals(); // signals of the main process, read from signalfd
+	void reapChildren(); // wait for all exited children at once
+	void takeOver(); // receive listening socket and client sessions from the running server
+	void handOver(int upgradeConnection); // pass everything to the new server and exit
+	void handOverClient(); // pass own client connection to the new server and exit
+	void resumeSessions(); // start client processes for the received sessions
+	void drainChildren(); // let children finish their work within ShutdownTimeout, kill the rest
+	void drainClient(); // deliver pending messages, notify client about shutdown and exit
+	void sendResponse() const; // queue message_ for the client and write what the socket accepts
 
-	static const unsigned short MESSAGE_LENGTH{ 1024 };
-	const std::string TEMP_DIR { "/tmp/chat_server" };
+	static constexpr unsigned short MESSAGE_LENGTH{ 1024 };
 	const std::string CONFIG_FILE{ "server.cfg" };
+	ConfigFile config_{ CONFIG_FILE };
+	const std::string TEMP_DIR{ config_.get("TempDir", "/tmp/chat_server") }; // one per node, several nodes may run on one host
 	const std::string PROMPT{ "server>" };
 	//const std::string USERLIST_LOCK{ TEMP_DIR + "/userlist.lock" };
+	const std::string UPGRADE_SOCKET{ TEMP_DIR + "/upgrade.sock" };
+	const std::string HANDOFF_SOCKET{ TEMP_DIR + "/handoff.sock" };
 	const int BACKLOG{ 5 };
+	const unsigned HANDOFF_TIMEOUT{ 5 }; // seconds to wait for client sessions during upgrade
+	const unsigned DEFAULT_SHUTDOWN_TIMEOUT{ 5 }; // seconds
+	const size_t JOURNAL_BATCH{ 256 }; // records applied in one transaction
+	const unsigned JOURNAL_IDLE_INTERVAL{ 20 }; // ms between polls of the journal when nothing to apply
+	const unsigned JOURNAL_MAX_BACKOFF{ 5000 }; // ms between attempts when the database is unavailable
+	const uint64_t DEFAULT_SPOOL_MAX_BYTES{ 1024 * 1024 * 1024 }; // unapplied records of the journal or the spool
+	const unsigned DEFAULT_BREAKER_THRESHOLD{ 3 }; // failed connection attempts in a row which open the circuit breaker
+	const unsigned DEFAULT_BREAKER_COOLDOWN{ 5 }; // seconds before the next attempt
+	const unsigned DEFAULT_ID_BLOCK_SIZE{ 1000 }; // ids of users and messages reserved in the database at once
+	const std::chrono::seconds ID_HORIZON_INTERVAL{ 1 }; // between saves of the lowest message id the node may still commit
+	const std::chrono::seconds ID_HORIZON_AGE{ 30 }; // older horizons are of stopped nodes
+	const std::chrono::seconds ID_BLOCK_IDLE{ 5 }; // a message block unused for so long is given up if another node has reserved a later one
+	const size_t DEFAULT_HIGH_WATERMARK{ 256 }; // frames queued for a client before delivery pauses
+	const size_t DEFAULT_LOW_WATERMARK{ 64 }; // frames queued for a client when delivery resumes
+	const unsigned DEFAULT_SLOW_CONSUMER_TIMEOUT{ 10 }; // seconds a paused client takes nothing before the slow consumer policy is applied
+	const int FINAL_FLUSH_TIMEOUT{ 1000 }; // ms to write the last frames before closing the connection
+	const std::chrono::milliseconds ACK_SAVE_INTERVAL{ 1000 }; // acknowledgements received meanwhile are saved with one update
+	const unsigned DEFAULT_HISTORY_PAGE_SIZE{ 50 }; // messages in one history response
+	const unsigned MAX_HISTORY_PAGE_SIZE{ 1000 };
+	const std::string SEARCH_SOCKET{ TEMP_DIR + "/search.sock" };
+	const unsigned DEFAULT_SEARCH_RESULTS{ 20 }; // messages in one search response
+	const unsigned SEARCH_BATCH{ 1000 }; // messages read from the database at once while indexing
+	const int SEARCH_IDLE_INTERVAL{ 1000 }; // ms between checks for messages stored without notification
+	const std::chrono::seconds SEARCH_SAVE_INTERVAL{ 10 }; // indexed messages are saved to a segment at least so often
+	const size_t SEARCH_SEGMENT_MESSAGES{ 10000 }; // or when so many are waiting
+	const unsigned SEARCH_TIMEOUT{ 2 }; // seconds for a query to the indexer process
+	const size_t SESSION_SLOTS{ 1024 }; // client processes woken up on new messages, the others poll
+	const std::chrono::milliseconds DELIVERY_POLL_INTERVAL{ 500 }; // unread messages check of a process without wakeups
+	const std::chrono::seconds DELIVERY_RECHECK_INTERVAL{ 30 }; // check of a woken process, in case a notice has been lost
+	const std::string CLUSTER_SOCKET{ TEMP_DIR + "/cluster.sock" };
+	const int CLUSTER_POLL_INTERVAL{ 1000 }; // ms
+	const size_t DEFAULT_PRESENCE_CAPACITY{ 65536 }; // users ever logged in since the start of the node
+	const unsigned DEFAULT_PRESENCE_SNAPSHOT_INTERVAL{ 10 }; // seconds between snapshots of the sessions in the database
+	const unsigned DEFAULT_RETENTION_INTERVAL{ 3600 }; // seconds between passes of the retention job
+	const unsigned DEFAULT_RETENTION_CHUNK{ 500 }; // messages archived and deleted at once
+	const unsigned DEFAULT_RETENTION_PAUSE{ 100 }; // ms between chunks at least
+	const unsigned RETENTION_BACKOFF{ 4 }; // and so many times the time of the chunk, the job slows down with the database
+	const int RETENTION_NICE{ 10 }; // compression and queries of the job give way to client processes
+	const uint64_t DEFAULT_ARCHIVE_SEGMENT_SIZE{ 64 * 1024 * 1024 }; // bytes
 
 #if defined(_WIN64) or defined(_WIN32)
 	std::string getLiteralOSName(OSVERSIONINFOEX &osv) const; // Get literal version, i.e. 5.0 is Windows 2000
 #endif
 
-	std::map<std::string, ChatUser> users_;
+	std::unique_ptr<UserDirectory> users_;
 	std::vector<std::shared_ptr<ChatMessage>> messages_;
-	std::set<std::string> activeUsers_;
 	std::string loggedUser_;
-	ConfigFile config_{ CONFIG_FILE };
+	unsigned nodeId_{ 0 };
 	sockaddr_in server_;
 	sockaddr_in client_;
 	int sockFd_;
 	pid_t mainPid_;
 	pid_t consolePid_;
+	pid_t metricsPid_{ 0 };
+	int metricsFd_{ -1 };
+	pid_t journalPid_{ 0 };
+	pid_t searchPid_{ 0 };
+	int searchEvent_{ -1 }; // eventfd signalled when a message is saved, read by the indexer process
+	pid_t retentionPid_{ 0 };
+	// retention policy, the job runs if any limit is set
+	struct Retention {
+		std::chrono::seconds age{ 0 }; // 0 keeps messages of any age
+		unsigned keep{ 0 }; // newest messages kept in every conversation, 0 keeps all
+		std::chrono::seconds interval{ 0 };
+		unsigned chunk{ 0 };
+		std::chrono::milliseconds pause{ 0 };
+		uint64_t archiveSegmentSize{ 0 };
+		int64_t lag{ 0 }; // seconds, reported by the job process
+	} retention_;
+	pid_t clusterPid_{ 0 };
+	std::unique_ptr<ClusterBus> cluster_; // notices to the other nodes, null without ClusterNodes
+	std::unique_ptr<HashRing> ring_; // node of every user, null without ClusterEndpoints
+	std::map<unsigned, std::string> endpoints_; // address of every node for the clients
+	std::unique_ptr<SessionRegistry> sessions_; // client processes of this node to wake up
+	std::unique_ptr<PresenceDirectory> presence_; // users online on every node
+	std::chrono::seconds snapshotInterval_{ 0 }; // 0 if the sessions are not saved to the database
+	std::chrono::steady_clock::time_point snapshotSaved_;
+	std::chrono::steady_clock::time_point horizonSaved_;
+	uint64_t snapshotChanges_{ 0 }; // presence changes saved by the last snapshot
+	std::unique_ptr<MessageJournal> journal_; // journal or spool
+	bool spool_{ false }; // journal_ is used only while the database is unavailable and until the spooled records are applied
+	std::unique_ptr<CircuitBreaker> breaker_; // null if BreakerThreshold is 0
+	std::chrono::seconds breakerCooldown_{ 0 };
+	std::unique_ptr<IdAllocator> ids_; // new users and messages of all processes of the node
+	std::unique_ptr<FrameCache> frameCache_; // encoded broadcast frames shared by client processes
+	std::unique_ptr<ChannelIndex> channels_; // channel membership
+	pid_t instancePid_; // main process of the first server in the upgrade chain, owns temporary data
+	int upgradeFd_{ -1 };
+	bool upgrading_{ false };
+	std::atomic_bool handOverRequested_{ false };
+	std::atomic_bool drainRequested_{ false };
+	std::atomic_bool terminateRequested_{ false }; // SIGTERM to a client process, served by its main loop
+	bool drainable_{ false }; // process finishes its work on drain request, Ctrl-C is ignored
+
+	// client session received from the previous server
+	struct HandedOverSession {
+		int fd;
+		std::string login;
+		std::string ip;
+		unsigned short port;
+	};
+	std::vector<HandedOverSession> handedOver_;
 	std::set<pid_t> children_;
 	mutable char message_[MESSAGE_LENGTH];
 	std::atomic_bool mainLoopActive_{ true };
 	std::unique_ptr<Logger> logger_;
-	int connection_;
-	Mysql mysql_;
+	int connection_{ 0 };
+	std::unique_ptr<OutboundQueue> outbound_; // frames for the client of this process
+	std::string disconnectReason_; // set when the client has to be disconnected
+	// delivery stream of the logged user: queued to the socket, acknowledged by the client, saved to the database
+	unsigned long long sentSeq_{ 0 };
+	unsigned long long ackedSeq_{ 0 };
+	unsigned long long savedSeq_{ 0 };
+	std::chrono::steady_clock::time_point ackSaved_;
+	std::atomic_bool deliveryPending_{ false }; // set by WAKE_SIGNAL, unread messages have to be read
+	std::chrono::steady_clock::time_point deliveryChecked_;
+	int signalFd_{ -1 };
+	sigset_t signals_; // blocked in the main process and read from signalFd_
+	mutable std::unique_ptr<Storage> storage_;
 };
 
@@ -0,0 +1,57 @@
+#include "circuit_breaker.h"
+#include "metrics.h"
+
+#include <stdexcept>
+
+CircuitBreaker::CircuitBreaker(const unsigned threshold, const std::chrono::milliseconds cooldown) :
+	threshold_{ threshold },
+	cooldown_{ cooldown } {
+	if (threshold_ == 0 || cooldown_.count() <= 0) {
+		throw std::invalid_argument{ "Circuit breaker needs a threshold and a cooldown" };
+	}
+	// anonymous mapping is zero filled, the breaker starts closed
+	memory_ = std::make_unique<SharedMemory>(sizeof(Shared));
+	shared_ = memory_->as<Shared>();
+}
+
+int64_t CircuitBreaker::now() {
+	// CLOCK_MONOTONIC is the same in every process
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool CircuitBreaker::allow() {
+	auto until = shared_->openUntil.load();
+	if (until == 0) {
+		return true;
+	}
+	auto current = now();
+	// the first process after the cooldown probes, the others wait for another cooldown.
+	// If the probing process dies without a result, the next cooldown lets another one through
+	if (current >= until && shared_->openUntil.compare_exchange_strong(until, current + std::chrono::nanoseconds{ cooldown_ }.count())) {
+		return true;
+	}
+	Metrics::add(Metrics::DB_BREAKER_REJECTED);
+	return false;
+}
+
+bool CircuitBreaker::success() {
+	shared_->failures.store(0);
+	return shared_->openUntil.exchange(0) != 0;
+}
+
+bool CircuitBreaker::failure() {
+	if (shared_->failures.fetch_add(1) + 1 < threshold_) {
+		return false;
+	}
+	auto until = now() + std::chrono::nanoseconds{ cooldown_ }.count();
+	auto previous = shared_->openUntil.exchange(until);
+	if (previous != 0) {
+		return false;
+	}
+	Metrics::add(Metrics::DB_BREAKER_OPENED);
+	return true;
+}
+
+bool CircuitBreaker::isOpen() const {
+	return shared_->openUntil.load() != 0;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "shared_memory.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+// Database availability shared by all server processes. After threshold failed connection
+// attempts in a row the breaker opens and the attempts are refused without waiting for
+// the connect timeout. When the cooldown is over one attempt is let through as a probe,
+// its result closes the breaker or opens it for another cooldown. Must be created before fork()
+class CircuitBreaker final {
+public:
+	CircuitBreaker(unsigned threshold, std::chrono::milliseconds cooldown);
+	CircuitBreaker(const CircuitBreaker &) = delete;
+	CircuitBreaker &operator=(const CircuitBreaker &) = delete;
+
+	bool allow(); // false if the attempt must fail fast
+	bool success(); // true if the breaker has been closed by this call
+	bool failure(); // true if the breaker has been opened by this call
+	bool isOpen() const;
+
+private:
+	struct Shared {
+		std::atomic<uint32_t> failures; // in a row
+		std::atomic<int64_t> openUntil; // steady clock nanoseconds, 0 if closed
+	};
+
+	static int64_t now();
+
+	const unsigned threshold_;
+	const std::chrono::milliseconds cooldown_;
+	std::unique_ptr<SharedMemory> memory_;
+	Shared *shared_;
+};
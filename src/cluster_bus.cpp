@@ -0,0 +1,629 @@
+#include "cluster_bus.h"
+#include "metrics.h"
+#include "project_lib.h"
+#include "wire_format.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+extern "C" {
+	#include <arpa/inet.h>
+	#include <errno.h>
+	#include <netinet/in.h>
+	#include <netinet/tcp.h>
+	#include <poll.h>
+	#include <sys/socket.h>
+	#include <sys/un.h>
+	#include <unistd.h>
+}
+
+namespace {
+	const size_t MAX_NOTICE_USERS{ 1024 }; // more users are sent as a notice for all
+	const size_t MAX_PRESENCE_ENTRIES{ 128 }; // per frame, more go in several
+	const size_t MAX_FRAME{ 16 + MAX_NOTICE_USERS * Chat::MAX_VARINT };
+	static_assert(MAX_PRESENCE_ENTRIES * 8 * Chat::MAX_VARINT < MAX_FRAME);
+	const size_t MAX_OUTPUT{ 1 << 20 }; // bytes queued for a peer that does not read
+	const unsigned MIN_BACKOFF{ 100 }; // ms before reconnecting to a peer
+	const unsigned MAX_BACKOFF{ 5000 };
+	const std::chrono::milliseconds LISTEN_RETRY{ 1000 }; // the port may be held by the previous server during upgrade
+
+	sockaddr_un localAddress(const std::string &path) {
+		sockaddr_un addr{};
+		if (path.size() >= sizeof(addr.sun_path)) {
+			throw std::runtime_error{ "Socket path is too long: " + path };
+		}
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, path.c_str());
+		return addr;
+	}
+
+	std::string systemError(const std::string &what) {
+		return what + ": " + strerror(errno);
+	}
+
+	std::string trim(const std::string &value) {
+		auto first = value.find_first_not_of(" \t");
+		if (first == std::string::npos) {
+			return {};
+		}
+		return value.substr(first, value.find_last_not_of(" \t") - first + 1);
+	}
+
+	void putVarint(std::string &output, const uint64_t value) {
+		char buffer[Chat::MAX_VARINT];
+		output.append(buffer, Chat::encodeVarint(value, buffer));
+	}
+
+	bool getVarint(const std::string_view data, size_t &pos, uint64_t &value) {
+		auto size = Chat::decodeVarint(data.substr(pos), value);
+		pos += size;
+		return size > 0;
+	}
+}
+
+std::vector<ClusterBus::Node> ClusterBus::parseNodes(const std::string &list) {
+	std::vector<Node> nodes;
+	for (const auto &item: Chat::split(list, ",")) {
+		auto entry = trim(item);
+		if (entry.empty()) {
+			continue;
+		}
+		auto at = entry.find('@');
+		auto colon = entry.rfind(':');
+		if (at == std::string::npos || colon == std::string::npos || colon < at) {
+			throw std::invalid_argument{ "Invalid cluster node: " + entry };
+		}
+		Node node;
+		try {
+			size_t end;
+			auto id = std::stoul(entry.substr(0, at), &end);
+			if (end != at || id == 0 || id > UINT32_MAX) {
+				throw std::invalid_argument{ entry };
+			}
+			auto port = std::stoul(entry.substr(colon + 1), &end);
+			if (end != entry.size() - colon - 1 || port == 0 || port > UINT16_MAX) {
+				throw std::invalid_argument{ entry };
+			}
+			node = Node{ static_cast<unsigned>(id), entry.substr(at + 1, colon - at - 1), static_cast<unsigned short>(port) };
+		}
+		catch (const std::logic_error &e) {
+			throw std::invalid_argument{ "Invalid cluster node: " + entry };
+		}
+		in_addr addr;
+		if (inet_pton(AF_INET, node.host.c_str(), &addr) != 1) {
+			throw std::invalid_argument{ "Cluster node address must be IPv4: " + entry };
+		}
+		if (std::any_of(nodes.begin(), nodes.end(), [&](const Node &other) { return other.id == node.id; })) {
+			throw std::invalid_argument{ "Duplicate cluster node id: " + entry };
+		}
+		nodes.push_back(std::move(node));
+	}
+	return nodes;
+}
+
+ClusterBus::ClusterBus(const unsigned nodeId, const std::vector<Node> &nodes, const std::string &localSocket) :
+	nodeId_{ nodeId },
+	localSocket_{ localSocket } {
+	bool found{ false };
+	for (const auto &node: nodes) {
+		if (node.id == nodeId_) {
+			port_ = node.port;
+			found = true;
+		}
+		else {
+			peers_.push_back(Peer{ node, -1, false, {}, {}, false, {}, 0, {} });
+		}
+	}
+	if (!found) {
+		throw std::invalid_argument{ "Node " + std::to_string(nodeId_) + " is not in the cluster node list" };
+	}
+	// anonymous mapping is zero filled, no peer is connected
+	state_ = std::make_unique<SharedMemory>(std::max<size_t>(peers_.size(), 1) * sizeof(std::atomic<bool>));
+	connected_ = state_->as<std::atomic<bool>>();
+	localAddress(localSocket_);
+	sendFd_ = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sendFd_ == -1) {
+		throw std::runtime_error{ systemError("Can not create cluster bus socket") };
+	}
+}
+
+ClusterBus::~ClusterBus() {
+	for (auto fd: { sendFd_, localFd_, listenFd_ }) {
+		if (fd != -1) {
+			close(fd);
+		}
+	}
+	for (const auto &peer: peers_) {
+		if (peer.fd != -1) {
+			close(peer.fd);
+		}
+	}
+	for (const auto &link: links_) {
+		close(link.fd);
+	}
+}
+
+std::string ClusterBus::encodeNotice(const bool all, const std::vector<unsigned> &user_ids) {
+	std::string payload;
+	if (all || user_ids.size() > MAX_NOTICE_USERS) {
+		putVarint(payload, ALL);
+		return payload;
+	}
+	putVarint(payload, USERS);
+	putVarint(payload, user_ids.size());
+	for (auto id: user_ids) {
+		putVarint(payload, id);
+	}
+	return payload;
+}
+
+bool ClusterBus::decodeNotice(const std::string_view payload, Notice &notice) {
+	size_t pos{ 0 };
+	uint64_t type;
+	if (!getVarint(payload, pos, type)) {
+		return false;
+	}
+	notice.all = type == ALL;
+	notice.users.clear();
+	if (type == ALL) {
+		return pos == payload.size();
+	}
+	uint64_t count;
+	if (type != USERS || !getVarint(payload, pos, count) || count > MAX_NOTICE_USERS) {
+		return false;
+	}
+	notice.users.reserve(count);
+	for (uint64_t i = 0; i < count; ++i) {
+		uint64_t id;
+		if (!getVarint(payload, pos, id) || id > UINT32_MAX) {
+			return false;
+		}
+		notice.users.push_back(static_cast<unsigned>(id));
+	}
+	return pos == payload.size();
+}
+
+std::string ClusterBus::encodePresence(const PresenceDirectory::Entry *entries, const size_t count) {
+	std::string payload;
+	putVarint(payload, PRESENCE);
+	putVarint(payload, count);
+	for (size_t i = 0; i < count; ++i) {
+		const auto &entry = entries[i];
+		// the last activity stays on the node of the session
+		for (uint64_t field: { static_cast<uint64_t>(entry.user_id), entry.version.clock, static_cast<uint64_t>(entry.version.node),
+			static_cast<uint64_t>(entry.node), static_cast<uint64_t>(entry.pid), static_cast<uint64_t>(entry.ip),
+			static_cast<uint64_t>(entry.port), static_cast<uint64_t>(entry.started) }) {
+			putVarint(payload, field);
+		}
+	}
+	return payload;
+}
+
+bool ClusterBus::decodePresence(const std::string_view payload, std::vector<PresenceDirectory::Entry> &entries) {
+	size_t pos{ 0 };
+	uint64_t type, count;
+	if (!getVarint(payload, pos, type) || type != PRESENCE || !getVarint(payload, pos, count) || count > MAX_PRESENCE_ENTRIES) {
+		return false;
+	}
+	entries.clear();
+	for (uint64_t i = 0; i < count; ++i) {
+		uint64_t fields[8];
+		for (auto &field: fields) {
+			if (!getVarint(payload, pos, field)) {
+				return false;
+			}
+		}
+		if (fields[0] > UINT32_MAX || fields[2] > UINT32_MAX || fields[3] > UINT32_MAX || fields[4] > INT32_MAX ||
+			fields[5] > UINT32_MAX || fields[6] > UINT16_MAX || fields[7] > INT64_MAX) {
+			return false;
+		}
+		entries.push_back(PresenceDirectory::Entry{ static_cast<unsigned>(fields[0]),
+			PresenceDirectory::Version{ fields[1], static_cast<uint32_t>(fields[2]) },
+			static_cast<unsigned>(fields[3]), static_cast<pid_t>(fields[4]), static_cast<uint32_t>(fields[5]),
+			static_cast<unsigned short>(fields[6]), static_cast<int64_t>(fields[7]), 0 });
+	}
+	return pos == payload.size();
+}
+
+void ClusterBus::appendPresence(std::string &output, const std::vector<PresenceDirectory::Entry> &entries) {
+	for (size_t i = 0; i < entries.size(); i += MAX_PRESENCE_ENTRIES) {
+		appendFrame(output, encodePresence(entries.data() + i, std::min(MAX_PRESENCE_ENTRIES, entries.size() - i)));
+	}
+}
+
+void ClusterBus::appendFrame(std::string &output, const std::string_view payload) {
+	putVarint(output, payload.size());
+	output.append(payload);
+}
+
+void ClusterBus::send(const std::string_view datagram) const {
+	auto addr = localAddress(localSocket_);
+	// never blocks the sender, a full or missing bus loses the notice
+	sendto(sendFd_, datagram.data(), datagram.size(), MSG_DONTWAIT, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+}
+
+void ClusterBus::publish(const std::vector<unsigned> &user_ids) const {
+	if (!peers_.empty() && !user_ids.empty()) {
+		send(encodeNotice(false, user_ids));
+	}
+}
+
+void ClusterBus::publishAll() const {
+	if (!peers_.empty()) {
+		send(encodeNotice(true, {}));
+	}
+}
+
+void ClusterBus::publishPresence(const std::vector<PresenceDirectory::Entry> &entries) const {
+	if (peers_.empty()) {
+		return;
+	}
+	for (size_t i = 0; i < entries.size(); i += MAX_PRESENCE_ENTRIES) {
+		send(encodePresence(entries.data() + i, std::min(MAX_PRESENCE_ENTRIES, entries.size() - i)));
+	}
+}
+
+bool ClusterBus::reachable(const unsigned node) const {
+	if (node == nodeId_) {
+		return true;
+	}
+	for (size_t i = 0; i < peers_.size(); ++i) {
+		if (peers_[i].node.id == node) {
+			return connected_[i].load();
+		}
+	}
+	return false;
+}
+
+void ClusterBus::open(PresenceDirectory &presence, const Deliver &deliver, const Report &report) {
+	presence_ = &presence;
+	deliver_ = deliver;
+	report_ = report;
+	auto addr = localAddress(localSocket_);
+	localFd_ = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (localFd_ == -1) {
+		throw std::runtime_error{ systemError("Can not create cluster bus socket") };
+	}
+	unlink(localSocket_.c_str());
+	if (bind(localFd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1) {
+		throw std::runtime_error{ systemError("Can not bind " + localSocket_) };
+	}
+	auto now = std::chrono::steady_clock::now();
+	listenRetry_ = now;
+	for (auto &peer: peers_) {
+		peer.retry = now;
+	}
+}
+
+void ClusterBus::listen() {
+	listenFd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (listenFd_ == -1) {
+		listenRetry_ = std::chrono::steady_clock::now() + LISTEN_RETRY;
+		return;
+	}
+	int trueVal = 1;
+	setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &trueVal, sizeof(trueVal));
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port_);
+	if (bind(listenFd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1 || ::listen(listenFd_, SOMAXCONN) == -1) {
+		auto error = systemError("Can not listen cluster port " + std::to_string(port_));
+		close(listenFd_);
+		listenFd_ = -1;
+		// reported once, then retried quietly
+		if (!listenFailed_) {
+			report_(error + ", retrying");
+			listenFailed_ = true;
+		}
+		listenRetry_ = std::chrono::steady_clock::now() + LISTEN_RETRY;
+		return;
+	}
+	listenFailed_ = false;
+	report_("Listening cluster port " + std::to_string(port_));
+}
+
+void ClusterBus::connect(Peer &peer) {
+	peer.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (peer.fd == -1) {
+		disconnect(peer, systemError("can not create socket"));
+		return;
+	}
+	// notices are small and should not wait for more data
+	int trueVal = 1;
+	setsockopt(peer.fd, IPPROTO_TCP, TCP_NODELAY, &trueVal, sizeof(trueVal));
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	inet_pton(AF_INET, peer.node.host.c_str(), &addr.sin_addr);
+	addr.sin_port = htons(peer.node.port);
+	if (::connect(peer.fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1 && errno != EINPROGRESS) {
+		disconnect(peer, systemError("can not connect"));
+		return;
+	}
+	// a connection starts with a notice for all users, nothing queued before it matters
+	peer.output.clear();
+	std::string hello;
+	putVarint(hello, HELLO);
+	putVarint(hello, nodeId_);
+	appendFrame(peer.output, hello);
+	appendFrame(peer.output, encodeNotice(true, {}));
+	// changes made while connecting are queued after the ones read here, the newer version wins anyway
+	appendPresence(peer.output, presence_->changedHere());
+	peer.users.clear();
+	peer.all = false;
+	peer.presence.clear();
+}
+
+void ClusterBus::disconnect(Peer &peer, const std::string &reason) {
+	if (peer.connected) {
+		report_("Connection to node " + std::to_string(peer.node.id) + " has been lost: " + reason);
+		Metrics::add(Metrics::CLUSTER_PEERS_CONNECTED, -1);
+		connected_[&peer - peers_.data()] = false;
+	}
+	else if (peer.backoff == 0) {
+		report_("Can not connect to node " + std::to_string(peer.node.id) + ": " + reason);
+	}
+	if (peer.fd != -1) {
+		close(peer.fd);
+		peer.fd = -1;
+	}
+	peer.connected = false;
+	peer.output.clear();
+	peer.users.clear();
+	peer.all = false;
+	peer.presence.clear();
+	peer.backoff = std::min(peer.backoff == 0 ? MIN_BACKOFF : peer.backoff * 2, MAX_BACKOFF);
+	peer.retry = std::chrono::steady_clock::now() + std::chrono::milliseconds{ peer.backoff };
+}
+
+void ClusterBus::queue(const Notice &notice) {
+	for (auto &peer: peers_) {
+		// a peer without connection gets a notice for all users when it is back
+		if (peer.fd == -1) {
+			continue;
+		}
+		if (notice.all) {
+			peer.all = true;
+			peer.users.clear();
+		}
+		else if (!peer.all) {
+			peer.users.insert(notice.users.begin(), notice.users.end());
+			if (peer.users.size() > MAX_NOTICE_USERS) {
+				peer.all = true;
+				peer.users.clear();
+			}
+		}
+	}
+}
+
+void ClusterBus::queue(const std::vector<PresenceDirectory::Entry> &entries) {
+	for (auto &peer: peers_) {
+		// a peer without connection gets the online users when it is back
+		if (peer.fd == -1) {
+			continue;
+		}
+		for (const auto &entry: entries) {
+			auto [it, inserted] = peer.presence.emplace(entry.user_id, entry);
+			if (!inserted && it->second.version < entry.version) {
+				it->second = entry;
+			}
+		}
+	}
+}
+
+void ClusterBus::receiveLocal() {
+	char datagram[MAX_FRAME];
+	ssize_t size;
+	while ((size = recv(localFd_, datagram, sizeof(datagram), 0)) > 0) {
+		std::string_view payload{ datagram, static_cast<size_t>(size) };
+		Notice notice;
+		std::vector<PresenceDirectory::Entry> entries;
+		if (decodeNotice(payload, notice)) {
+			queue(notice);
+		}
+		else if (decodePresence(payload, entries)) {
+			queue(entries);
+		}
+	}
+}
+
+void ClusterBus::flush(Peer &peer) {
+	if (peer.all || !peer.users.empty()) {
+		// everything published since the last frame goes as one notice
+		appendFrame(peer.output, encodeNotice(peer.all, { peer.users.begin(), peer.users.end() }));
+		Metrics::add(Metrics::CLUSTER_NOTICES_SENT);
+		peer.users.clear();
+		peer.all = false;
+	}
+	if (!peer.presence.empty()) {
+		std::vector<PresenceDirectory::Entry> entries;
+		entries.reserve(peer.presence.size());
+		for (const auto &[user_id, entry]: peer.presence) {
+			entries.push_back(entry);
+		}
+		appendPresence(peer.output, entries);
+		Metrics::add(Metrics::PRESENCE_UPDATES_SENT, entries.size());
+		peer.presence.clear();
+	}
+	if (!peer.connected || peer.output.empty()) {
+		return;
+	}
+	auto sent = ::send(peer.fd, peer.output.data(), peer.output.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		disconnect(peer, systemError("write failed"));
+		return;
+	}
+	if (sent > 0) {
+		peer.output.erase(0, sent);
+	}
+	if (peer.output.size() > MAX_OUTPUT) {
+		disconnect(peer, "peer does not read");
+	}
+}
+
+bool ClusterBus::receive(Link &link) {
+	char buffer[4096];
+	auto size = recv(link.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+	if (size == 0 || (size == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+		return false;
+	}
+	if (size > 0) {
+		link.input.append(buffer, size);
+	}
+	size_t pos{ 0 };
+	while (pos < link.input.size()) {
+		uint64_t length;
+		auto start = pos;
+		if (!getVarint(link.input, pos, length)) {
+			// the length itself may be incomplete
+			if (link.input.size() - start >= Chat::MAX_VARINT) {
+				return false;
+			}
+			pos = start;
+			break;
+		}
+		if (length > MAX_FRAME) {
+			return false;
+		}
+		if (link.input.size() - pos < length) {
+			pos = start;
+			break;
+		}
+		std::string_view payload{ link.input.data() + pos, length };
+		pos += length;
+		if (link.node == 0) {
+			size_t field{ 0 };
+			uint64_t type, node;
+			if (!getVarint(payload, field, type) || type != HELLO || !getVarint(payload, field, node) ||
+				std::none_of(peers_.begin(), peers_.end(), [&](const Peer &peer) { return peer.node.id == node; })) {
+				report_("Connection from an unknown node has been refused");
+				return false;
+			}
+			link.node = static_cast<unsigned>(node);
+			// a new connection of the node replaces the previous one, which may be stale,
+			// and brings everything the node has
+			for (auto &other: links_) {
+				if (&other != &link && other.node == link.node) {
+					other.node = 0;
+					shutdown(other.fd, SHUT_RDWR);
+				}
+			}
+			presence_->dropNode(link.node);
+			continue;
+		}
+		std::vector<PresenceDirectory::Entry> entries;
+		if (decodePresence(payload, entries)) {
+			for (const auto &entry: entries) {
+				if (presence_->apply(entry)) {
+					Metrics::add(Metrics::PRESENCE_UPDATES_APPLIED);
+				}
+			}
+			continue;
+		}
+		Notice notice;
+		if (!decodeNotice(payload, notice)) {
+			report_("Invalid notice from node " + std::to_string(link.node));
+			return false;
+		}
+		Metrics::add(Metrics::CLUSTER_NOTICES_RECEIVED);
+		deliver_(notice);
+	}
+	link.input.erase(0, pos);
+	return true;
+}
+
+void ClusterBus::poll(const int timeout) {
+	auto now = std::chrono::steady_clock::now();
+	if (listenFd_ == -1 && now >= listenRetry_) {
+		listen();
+	}
+	auto wait = timeout;
+	auto until = [&](std::chrono::steady_clock::time_point time) {
+		auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(time - now).count();
+		wait = static_cast<int>(std::min<long long>(wait, std::max<long long>(ms, 0)));
+	};
+	for (auto &peer: peers_) {
+		if (peer.fd == -1 && now >= peer.retry) {
+			connect(peer);
+		}
+		if (peer.fd == -1) {
+			until(peer.retry);
+		}
+	}
+	if (listenFd_ == -1) {
+		until(listenRetry_);
+	}
+
+	// local socket, listening socket, peers, links
+	std::vector<pollfd> fds;
+	fds.push_back({ localFd_, POLLIN, 0 });
+	fds.push_back({ listenFd_, POLLIN, 0 });
+	for (const auto &peer: peers_) {
+		short events = !peer.connected || !peer.output.empty() ? POLLOUT : 0;
+		// only a closed connection is readable, peers do not send on it
+		fds.push_back({ peer.fd, static_cast<short>(events | POLLIN), 0 });
+	}
+	for (const auto &link: links_) {
+		fds.push_back({ link.fd, POLLIN, 0 });
+	}
+	if (::poll(fds.data(), fds.size(), wait) == -1) {
+		return;
+	}
+
+	if (fds[0].revents & POLLIN) {
+		receiveLocal();
+	}
+	if (fds[1].revents & POLLIN) {
+		int fd = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd != -1) {
+			links_.push_back(Link{ fd, 0, {} });
+		}
+	}
+	for (size_t i = 0; i < peers_.size(); ++i) {
+		auto &peer = peers_[i];
+		auto revents = fds[2 + i].revents;
+		if (peer.fd == -1 || fds[2 + i].fd != peer.fd) {
+			continue;
+		}
+		if (!peer.connected && (revents & (POLLOUT | POLLERR | POLLHUP))) {
+			int error{ 0 };
+			socklen_t length = sizeof(error);
+			getsockopt(peer.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+			if (error != 0) {
+				errno = error;
+				disconnect(peer, systemError("can not connect"));
+				continue;
+			}
+			peer.connected = true;
+			connected_[i] = true;
+			peer.backoff = 0;
+			Metrics::add(Metrics::CLUSTER_PEERS_CONNECTED, 1);
+			report_("Connected to node " + std::to_string(peer.node.id));
+		}
+		else if (peer.connected && (revents & (POLLIN | POLLERR | POLLHUP))) {
+			char byte;
+			auto size = recv(peer.fd, &byte, 1, MSG_DONTWAIT);
+			if (size == 0 || (size == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+				disconnect(peer, "closed by peer");
+				continue;
+			}
+		}
+	}
+	for (size_t i = 0, index = 2 + peers_.size(); i < links_.size(); ++index) {
+		if ((fds[index].revents & (POLLIN | POLLERR | POLLHUP)) && !receive(links_[i])) {
+			if (links_[i].node != 0) {
+				presence_->dropNode(links_[i].node);
+			}
+			close(links_[i].fd);
+			links_.erase(links_.begin() + i);
+			continue;
+		}
+		++i;
+	}
+	for (auto &peer: peers_) {
+		if (peer.fd != -1) {
+			flush(peer);
+		}
+	}
+}
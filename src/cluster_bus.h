@@ -0,0 +1,125 @@
+#pragma once
+
+#include "presence_directory.h"
+#include "shared_memory.h"
+
+#include <chrono>
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Internal bus of the server nodes sharing one database. Messages are stored by the node of
+// the sender, the bus tells the other nodes whose unread messages have changed, so they wake
+// the sessions of these users instead of polling the database.
+// Any process of the node publishes notices to the bus process over a local datagram socket.
+// The bus process keeps a TCP connection to every peer and sends the notices received meanwhile
+// in one frame. A lost connection is reopened with growing delays and starts with a notice
+// for all users, the ones published while it was down are not kept.
+// Changes of the presence directory go the same way. A connection also starts with the online
+// users of this node, and the peer forgets what it had from this node when the connection is lost
+// or replaced, so nothing is kept for a node that is down. Must be created before fork()
+class ClusterBus final {
+public:
+	struct Node {
+		unsigned id;
+		std::string host;
+		unsigned short port;
+	};
+
+	struct Notice {
+		bool all; // every user may have new messages
+		std::vector<unsigned> users;
+	};
+
+	using Deliver = std::function<void(const Notice &)>; // notice from a peer
+	using Report = std::function<void(const std::string &)>; // connection state changes
+
+	// "id@host:port" entries separated by commas, throws std::invalid_argument
+	static std::vector<Node> parseNodes(const std::string &list);
+
+	// nodeId must be in nodes, its port is listened by the bus process
+	ClusterBus(unsigned nodeId, const std::vector<Node> &nodes, const std::string &localSocket);
+	ClusterBus(const ClusterBus &) = delete;
+	ClusterBus &operator=(const ClusterBus &) = delete;
+	~ClusterBus();
+
+	// dropped if the bus process does not take them, the peers recheck later anyway
+	void publish(const std::vector<unsigned> &user_ids) const;
+	void publishAll() const;
+	void publishPresence(const std::vector<PresenceDirectory::Entry> &entries) const;
+	// true if the bus process is connected to the node, always true for this node
+	bool reachable(unsigned node) const;
+
+	// in the bus process: receive published notices and apply presence changes of the peers
+	// to the directory, throws std::runtime_error
+	void open(PresenceDirectory &presence, const Deliver &deliver, const Report &report);
+	// waits up to timeout ms for sockets, then sends and receives what is ready
+	void poll(int timeout);
+
+private:
+	enum FrameType : uint8_t {
+		HELLO = 1, // node id, first frame of a connection
+		USERS = 2, // count, user ids
+		ALL = 3,
+		PRESENCE = 4 // count, entries
+	};
+
+	// outgoing connection, notices of this node to the peer
+	struct Peer {
+		Node node;
+		int fd{ -1 };
+		bool connected{ false };
+		std::string output; // frames not taken by the socket yet
+		std::set<unsigned> users; // notices waiting for the next frame
+		bool all{ false };
+		std::map<unsigned, PresenceDirectory::Entry> presence; // by user, latest change only
+		unsigned backoff{ 0 }; // ms
+		std::chrono::steady_clock::time_point retry;
+	};
+
+	// incoming connection, notices of the peer to this node
+	struct Link {
+		int fd;
+		unsigned node{ 0 }; // 0 until HELLO
+		std::string input;
+	};
+
+	static void appendFrame(std::string &output, std::string_view payload);
+	static std::string encodeNotice(bool all, const std::vector<unsigned> &user_ids);
+	static bool decodeNotice(std::string_view payload, Notice &notice); // false if malformed
+	static void appendPresence(std::string &output, const std::vector<PresenceDirectory::Entry> &entries); // as frames
+	static std::string encodePresence(const PresenceDirectory::Entry *entries, size_t count);
+	static bool decodePresence(std::string_view payload, std::vector<PresenceDirectory::Entry> &entries);
+
+	void send(std::string_view datagram) const;
+	void listen();
+	void connect(Peer &peer);
+	void disconnect(Peer &peer, const std::string &reason);
+	void flush(Peer &peer);
+	void receiveLocal();
+	bool receive(Link &link); // false if the link has to be closed
+	void queue(const Notice &notice);
+	void queue(const std::vector<PresenceDirectory::Entry> &entries);
+
+	const unsigned nodeId_;
+	const std::string localSocket_;
+	unsigned short port_{ 0 };
+	int sendFd_{ -1 }; // unbound datagram socket shared by all processes
+	int localFd_{ -1 }; // bus process: published notices
+	int listenFd_{ -1 }; // bus process: connections of the peers
+	std::chrono::steady_clock::time_point listenRetry_;
+	bool listenFailed_{ false };
+	std::vector<Peer> peers_;
+	std::unique_ptr<SharedMemory> state_;
+	std::atomic<bool> *connected_; // by peer index, written by the bus process
+	std::vector<Link> links_;
+	PresenceDirectory *presence_{ nullptr };
+	Deliver deliver_;
+	Report report_;
+};
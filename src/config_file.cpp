@@ -30,3 +30,14 @@ const std::string &ConfigFile::operator[](const std::string &index) const {
 	return options_.at(index);
 }
 
+bool ConfigFile::contains(const std::string &index) const {
+	return options_.find(index) != options_.end();
+}
+
+std::string ConfigFile::get(const std::string &index, const std::string &defaultValue) const {
+	auto it = options_.find(index);
+	if (it == options_.end()) {
+		return defaultValue;
+	}
+	return it->second;
+}
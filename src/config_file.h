@@ -12,6 +12,8 @@ public:
 	ConfigFile(const std::string &);
 	ConfigFile() = delete;
 	const std::string &operator[](const std::string &) const;
+	bool contains(const std::string &) const;
+	std::string get(const std::string &, const std::string &) const; // value or default
 
 private:
 	std::map<std::string, std::string> options_;
@@ -0,0 +1,59 @@
+#include "frame_cache.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+FrameCache::FrameCache(const size_t slots, const size_t frameLength) :
+	slots_{ slots },
+	frameLength_{ frameLength },
+	stride_{ (sizeof(Slot) + frameLength + 63) / 64 * 64 } {
+	if (slots_ == 0) {
+		throw std::invalid_argument{ "Frame cache must have at least one slot" };
+	}
+	// anonymous mapping is zero filled, so every slot is empty and unpinned
+	memory_ = std::make_unique<SharedMemory>(slots_ * stride_);
+}
+
+FrameCache::Slot &FrameCache::slot(const unsigned long long messageId) const {
+	return *reinterpret_cast<Slot *>(memory_->as<char>() + messageId % slots_ * stride_);
+}
+
+char *FrameCache::frame(const Slot &slot) const {
+	return const_cast<char *>(reinterpret_cast<const char *>(&slot)) + sizeof(Slot);
+}
+
+bool FrameCache::visit(const unsigned long long messageId, const std::function<void(std::string_view)> &callback) {
+	auto &cached = slot(messageId);
+	auto pins = cached.pins.load(std::memory_order_relaxed);
+	do {
+		if (pins & STORING) {
+			return false;
+		}
+	} while (!cached.pins.compare_exchange_weak(pins, pins + 1, std::memory_order_acquire));
+
+	// the frame can not be replaced while pinned
+	bool found{ false };
+	if (cached.key.load(std::memory_order_relaxed) == messageId + 1) {
+		callback({ frame(cached), cached.length });
+		found = true;
+	}
+	cached.pins.fetch_sub(1, std::memory_order_release);
+	return found;
+}
+
+void FrameCache::store(const unsigned long long messageId, const std::string_view frame) {
+	auto &cached = slot(messageId);
+	uint32_t unpinned{ 0 };
+	if (frame.size() > frameLength_ || !cached.pins.compare_exchange_strong(unpinned, STORING, std::memory_order_acquire)) {
+		return;
+	}
+	if (cached.key.load(std::memory_order_relaxed) == messageId + 1) {
+		// already stored by another recipient
+		cached.pins.store(0, std::memory_order_release);
+		return;
+	}
+	std::copy(frame.begin(), frame.end(), this->frame(cached));
+	cached.length = frame.size();
+	cached.key.store(messageId + 1, std::memory_order_relaxed);
+	cached.pins.store(0, std::memory_order_release);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "shared_memory.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string_view>
+
+// Encoded broadcast frames shared by all client processes. The first recipient process
+// encodes the frame of a message, the others send the same bytes to their clients
+// without building it again. Slots are selected by message id and
+// replaced when another message needs them. Must be created before fork()
+class FrameCache final {
+public:
+	FrameCache(size_t slots, size_t frameLength);
+	FrameCache(const FrameCache &) = delete;
+	FrameCache &operator=(const FrameCache &) = delete;
+
+	// calls back with the cached frame, which is not replaced until the callback returns.
+	// False if the message is not cached
+	bool visit(unsigned long long messageId, const std::function<void(std::string_view)> &callback);
+
+	// publishes the frame of the message, skipped while the slot is in use
+	void store(unsigned long long messageId, std::string_view frame);
+
+private:
+	static const uint32_t STORING{ 0x80000000 }; // set in pins while a frame is stored
+
+	struct Slot {
+		std::atomic<uint32_t> pins; // processes writing the frame to their sockets
+		std::atomic<unsigned long long> key; // message id + 1, 0 if empty
+		uint32_t length;
+	};
+
+	Slot &slot(unsigned long long messageId) const;
+	char *frame(const Slot &slot) const;
+
+	const size_t slots_;
+	const size_t frameLength_;
+	const size_t stride_; // slot header with frame bytes, cache line aligned
+	std::unique_ptr<SharedMemory> memory_;
+};
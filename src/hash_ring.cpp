@@ -0,0 +1,47 @@
+#include "hash_ring.h"
+
+#include <algorithm>
+#include <set>
+
+HashRing::HashRing(const std::vector<unsigned> &nodes) {
+	std::set<unsigned> unique{ nodes.begin(), nodes.end() };
+	nodes_ = unique.size();
+	points_.reserve(nodes_ * VIRTUAL_NODES);
+	for (auto node: unique) {
+		for (uint64_t i = 0; i < VIRTUAL_NODES; ++i) {
+			points_.emplace_back(hash(static_cast<uint64_t>(node) << 32 | i), node);
+		}
+	}
+	std::sort(points_.begin(), points_.end());
+}
+
+uint64_t HashRing::hash(uint64_t value) {
+	// splitmix64 finalizer, neighbouring ids land far apart
+	value += 0x9e3779b97f4a7c15ULL;
+	value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+	return value ^ (value >> 31);
+}
+
+unsigned HashRing::owner(const unsigned user_id) const {
+	return owner(user_id, [](unsigned) { return true; });
+}
+
+unsigned HashRing::owner(const unsigned user_id, const std::function<bool(unsigned)> &accept) const {
+	if (points_.empty()) {
+		return 0;
+	}
+	auto start = std::lower_bound(points_.begin(), points_.end(), std::make_pair(hash(user_id), 0u)) - points_.begin();
+	std::set<unsigned> rejected;
+	for (size_t i = 0; i < points_.size() && rejected.size() < nodes_; ++i) {
+		auto node = points_[(start + i) % points_.size()].second;
+		if (rejected.count(node) != 0) {
+			continue;
+		}
+		if (accept(node)) {
+			return node;
+		}
+		rejected.insert(node);
+	}
+	return 0;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+// Consistent hashing of users to the nodes of the cluster. Every node takes VIRTUAL_NODES points
+// on a ring of 64-bit hashes, a user belongs to the first node clockwise from the hash of the user id.
+// Adding or removing a node moves only the users next to its points, about 1/N of all
+class HashRing final {
+public:
+	static const unsigned VIRTUAL_NODES{ 128 };
+
+	explicit HashRing(const std::vector<unsigned> &nodes);
+
+	// node of the user, 0 if the ring is empty
+	unsigned owner(unsigned user_id) const;
+	// first node clockwise accepted by the filter, so the users of a node that is down
+	// are spread over the others. 0 if no node is accepted
+	unsigned owner(unsigned user_id, const std::function<bool(unsigned)> &accept) const;
+
+private:
+	static uint64_t hash(uint64_t value);
+
+	std::vector<std::pair<uint64_t, unsigned>> points_; // hash and node, sorted
+	size_t nodes_{ 0 };
+};
@@ -0,0 +1,114 @@
+#include "id_allocator.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+extern "C" {
+	#include <unistd.h>
+}
+
+const char *IdAllocator::name(const Sequence sequence) {
+	switch (sequence) {
+	case USERS: return "users";
+	case MESSAGES: return "messages";
+	case CHANNELS: return "channels";
+	default: throw std::invalid_argument{ "Unknown id sequence " + std::to_string(sequence) };
+	}
+}
+
+IdAllocator::IdAllocator(const unsigned blockSize) : blockSize_{ blockSize } {
+	if (blockSize_ == 0 || blockSize_ > USED_MASK) {
+		throw std::invalid_argument{ "Id block size must be from 1 to " + std::to_string(USED_MASK) };
+	}
+	// anonymous mapping is zero filled, so there are no blocks yet
+	memory_ = std::make_unique<SharedMemory>(sizeof(Shared));
+	shared_ = memory_->as<Shared>();
+}
+
+std::optional<unsigned long long> IdAllocator::take(const Sequence sequence) {
+	auto &slot = shared_->state[sequence];
+	auto state = slot.load();
+	while (!usedUp(state)) {
+		if (slot.compare_exchange_weak(state, state + 1)) {
+			shared_->taken[sequence].store(now());
+			return start(state) + (state & USED_MASK);
+		}
+	}
+	return std::nullopt;
+}
+
+void IdAllocator::publish(const Sequence sequence, const unsigned long long start, const unsigned long long used) {
+	auto block = start / blockSize_ + 1;
+	if (start % blockSize_ != 0 || used >= blockSize_ || block > (UINT64_MAX >> USED_BITS)) {
+		// not a block of this size or nothing left in it
+		return;
+	}
+	auto fresh = (block << USED_BITS) | used;
+	auto &slot = shared_->state[sequence];
+	auto state = slot.load();
+	// the block of another process which has been quicker stays, this one is lost
+	while (usedUp(state)) {
+		if (slot.compare_exchange_weak(state, fresh)) {
+			shared_->taken[sequence].store(now());
+			return;
+		}
+	}
+}
+
+bool IdAllocator::retire(const Sequence sequence, const std::chrono::steady_clock::duration idle, const unsigned long long next) {
+	auto &slot = shared_->state[sequence];
+	auto state = slot.load();
+	if (usedUp(state) || next <= start(state) + blockSize_ || now() - shared_->taken[sequence].load() < idle.count()) {
+		return false;
+	}
+	// fails if an id has been taken meanwhile
+	return slot.compare_exchange_strong(state, (state & ~USED_MASK) | blockSize_);
+}
+
+size_t IdAllocator::enter() {
+	// writers of one process stay together
+	auto first = static_cast<size_t>(getpid()) % WRITERS;
+	for (size_t i = 0; i < WRITERS; ++i) {
+		auto &writer = shared_->writers[(first + i) % WRITERS];
+		uint64_t free{ 0 };
+		// id 0 until the first one is taken
+		if (writer.held.compare_exchange_strong(free, 1)) {
+			writer.pid.store(getpid());
+			return (first + i) % WRITERS;
+		}
+	}
+	throw std::runtime_error{ "Too many messages are being written" };
+}
+
+void IdAllocator::hold(const size_t writer, const unsigned long long id) {
+	shared_->writers[writer].held.store(id + 1);
+}
+
+void IdAllocator::leave(const size_t writer) {
+	shared_->writers[writer].pid.store(0);
+	shared_->writers[writer].held.store(0);
+}
+
+void IdAllocator::release(const pid_t pid) {
+	for (size_t i = 0; i < WRITERS; ++i) {
+		if (shared_->writers[i].pid.load() == pid) {
+			leave(i);
+		}
+	}
+}
+
+unsigned long long IdAllocator::horizon(const unsigned long long next) const {
+	// the block is read first: an id taken afterwards is held by its writer already
+	auto lowest = next;
+	auto state = shared_->state[MESSAGES].load();
+	if (!usedUp(state)) {
+		lowest = std::min(lowest, start(state) + (state & USED_MASK));
+	}
+	for (const auto &writer: shared_->writers) {
+		if (auto held = writer.held.load(); held != 0) {
+			lowest = std::min<unsigned long long>(lowest, held - 1);
+		}
+	}
+	return lowest;
+}
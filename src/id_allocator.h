@@ -0,0 +1,81 @@
+#pragma once
+
+#include "shared_memory.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+
+extern "C" {
+	#include <sys/types.h>
+}
+
+// Ids of the id_sequences rows handed out by the processes of one node. A block of ids
+// is reserved in the database with one statement, the ids inside it are taken with a
+// compare-and-swap of shared memory. Blocks reserved by other nodes never overlap,
+// the rest of the current block is lost when the node stops. Message ids are committed
+// out of order, the writers hold the lowest id they may still commit and the readers
+// in id order stop below horizon(). Must be created before fork()
+class IdAllocator final {
+public:
+	enum Sequence : unsigned {
+		USERS,
+		MESSAGES,
+		CHANNELS, // reserved one by one, channels are rare
+		SEQUENCES_TOTAL
+	};
+
+	static const size_t WRITERS{ 1024 }; // transactions writing messages at once on the node
+
+	static const char *name(Sequence sequence); // of the id_sequences row
+
+	IdAllocator(unsigned blockSize);
+	IdAllocator(const IdAllocator &) = delete;
+	IdAllocator &operator=(const IdAllocator &) = delete;
+
+	unsigned blockSize() const { return blockSize_; }
+	// next id of the current block, nothing if it is used up
+	std::optional<unsigned long long> take(Sequence sequence);
+	// block of blockSize() ids from start, the first used ones are taken by the caller.
+	// Kept only if the current block is used up, so the caller reserves the blocks in the database first
+	void publish(Sequence sequence, unsigned long long start, unsigned long long used);
+	// gives up the rest of the current block if no id has been taken from it for idle and a later block
+	// has been reserved, next is the next_id of the sequence. Returns true if the block is given up
+	bool retire(Sequence sequence, std::chrono::steady_clock::duration idle, unsigned long long next);
+
+	// a transaction writing messages enters before its first message id is taken and holds every id back
+	// until hold() gives the lowest one, leave() ends it
+	size_t enter();
+	void hold(size_t writer, unsigned long long id);
+	void leave(size_t writer);
+	void release(pid_t pid); // writers of an exited process
+	// lowest message id the processes of the node may still commit, next is the next_id of the sequence
+	// read before the call
+	unsigned long long horizon(unsigned long long next) const;
+
+private:
+	// block number plus one in the high bits, 0 if there is no block, and the number of used ids in the low ones
+	static const unsigned USED_BITS{ 24 };
+	static const uint64_t USED_MASK{ (1ULL << USED_BITS) - 1 };
+
+	struct Writer {
+		std::atomic<uint64_t> held; // lowest message id plus one, 0 if the writer is free
+		std::atomic<pid_t> pid;
+	};
+
+	struct Shared {
+		std::atomic<uint64_t> state[SEQUENCES_TOTAL];
+		std::atomic<int64_t> taken[SEQUENCES_TOTAL]; // steady clock of the last id taken from the current block
+		Writer writers[WRITERS];
+	};
+
+	bool usedUp(uint64_t state) const { return (state >> USED_BITS) == 0 || (state & USED_MASK) >= blockSize_; }
+	unsigned long long start(uint64_t state) const { return ((state >> USED_BITS) - 1) * blockSize_; }
+	static int64_t now() { return std::chrono::steady_clock::now().time_since_epoch().count(); }
+
+	const unsigned blockSize_;
+	std::unique_ptr<SharedMemory> memory_;
+	Shared *shared_;
+};
@@ -0,0 +1,137 @@
+#include "message_archive.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+
+extern "C" {
+	#include <fcntl.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+	#include <zlib.h>
+}
+
+namespace fs = std::filesystem;
+
+namespace {
+	const std::string SUFFIX{ ".archive.gz" };
+
+	std::string systemError(const std::string &what) {
+		return what + ": " + strerror(errno);
+	}
+
+	void escape(std::string &line, const std::string &text) {
+		for (auto c: text) {
+			switch (c) {
+			case '\\': line += "\\\\"; break;
+			case '\t': line += "\\t"; break;
+			case '\n': line += "\\n"; break;
+			case '\r': line += "\\r"; break;
+			default: line += c;
+			}
+		}
+	}
+
+	// one gzip member, segments are concatenations of them
+	std::string compress(const std::string &data) {
+		z_stream stream{};
+		// 16 added to the window bits selects the gzip wrapper
+		if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			throw std::runtime_error{ "Can not initialize compression" };
+		}
+		std::string result(deflateBound(&stream, data.size()), '\0');
+		stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+		stream.avail_in = static_cast<uInt>(data.size());
+		stream.next_out = reinterpret_cast<Bytef *>(result.data());
+		stream.avail_out = static_cast<uInt>(result.size());
+		auto rc = deflate(&stream, Z_FINISH);
+		result.resize(stream.total_out);
+		deflateEnd(&stream);
+		if (rc != Z_STREAM_END) {
+			throw std::runtime_error{ "Can not compress archived messages" };
+		}
+		return result;
+	}
+}
+
+MessageArchive::MessageArchive(const std::string &directory, const uint64_t segmentSize) :
+	directory_{ directory },
+	segmentSize_{ segmentSize } {
+	if (segmentSize_ == 0) {
+		throw std::runtime_error{ "Invalid archive segment size: 0" };
+	}
+	fs::create_directories(directory_);
+	if (access(directory_.c_str(), W_OK) == -1) {
+		throw std::runtime_error{ systemError("Can not write to " + directory_) };
+	}
+}
+
+MessageArchive::~MessageArchive() {
+	if (fd_ != -1) {
+		close(fd_);
+	}
+}
+
+void MessageArchive::open(const unsigned long long first) {
+	if (fd_ != -1) {
+		close(fd_);
+		fd_ = -1;
+	}
+	char name[32];
+	std::snprintf(name, sizeof(name), "%020llu", first);
+	auto path = (fs::path{ directory_ } / (name + SUFFIX)).string();
+	// the messages of a failed removal are archived again into the segment of the same name
+	fd_ = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	struct stat st;
+	if (fd_ == -1 || fstat(fd_, &st) == -1) {
+		throw std::runtime_error{ systemError("Can not open archive segment " + path) };
+	}
+	size_ = st.st_size;
+	// new file must survive a crash too
+	int dirFd = ::open(directory_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirFd != -1) {
+		fsync(dirFd);
+		close(dirFd);
+	}
+}
+
+void MessageArchive::append(const std::vector<Message> &messages) {
+	if (messages.empty()) {
+		return;
+	}
+	std::string lines;
+	char fields[96];
+	for (const auto &message: messages) {
+		std::snprintf(fields, sizeof(fields), "%llu\t%.0f\t%u\t%u\t%llu\t", message.id, message.sent, message.sender_id, message.receiver_id, message.channel_id);
+		lines += fields;
+		escape(lines, message.text);
+		lines += '\n';
+	}
+	auto member = compress(lines);
+	if (fd_ == -1 || size_ >= segmentSize_) {
+		open(messages.front().id);
+	}
+	size_t written{ 0 };
+	while (written < member.size()) {
+		auto count = ::write(fd_, member.data() + written, member.size() - written);
+		if (count == -1 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			break;
+		}
+		written += count;
+	}
+	if (written != member.size() || fsync(fd_) == -1) {
+		auto error = systemError("Can not write to archive segment");
+		// a torn member would hide the ones appended after it from zcat
+		if (ftruncate(fd_, size_) == -1) {
+			close(fd_);
+			fd_ = -1;
+		}
+		throw std::runtime_error{ error };
+	}
+	size_ += member.size();
+}
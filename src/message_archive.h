@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Messages removed by the retention policy, kept in gzip segment files in a local directory.
+// A segment is named after the first message id in it and holds one line per message:
+// id, unix time, sender id, receiver id, channel id and text separated by tabs, with tabs,
+// newlines and backslashes of the text escaped. Every append is a complete gzip member
+// on disk when it returns, so zcat reads all segments even after a crash
+class MessageArchive final {
+public:
+	struct Message {
+		unsigned long long id;
+		double sent; // unix time
+		unsigned sender_id;
+		unsigned receiver_id; // 0 if not a private message
+		unsigned long long channel_id; // 0 if not a channel message
+		std::string text;
+	};
+
+	// a segment is closed when it grows over segmentSize bytes, throws std::runtime_error if the directory is not usable
+	MessageArchive(const std::string &directory, uint64_t segmentSize);
+	MessageArchive(const MessageArchive &) = delete;
+	MessageArchive &operator=(const MessageArchive &) = delete;
+	~MessageArchive();
+
+	// returns when the messages are durable, throws std::runtime_error
+	void append(const std::vector<Message> &messages);
+
+private:
+	void open(unsigned long long first); // new segment starting with the message
+
+	const std::string directory_;
+	const uint64_t segmentSize_;
+	int fd_{ -1 }; // segment open for appending, the segments of the previous runs are not appended to
+	uint64_t size_{ 0 };
+};
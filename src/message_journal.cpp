@@ -0,0 +1,549 @@
+#include "message_journal.h"
+#include "metrics.h"
+#include "project_lib.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+extern "C" {
+	#include <fcntl.h>
+	#include <sys/file.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+}
+
+namespace fs = std::filesystem;
+
+namespace {
+	const uint32_t MAGIC{ 0x4C4E524A }; // "JRNL"
+	const uint32_t MAX_RECORD{ 16 * 1024 * 1024 };
+	const unsigned MAX_ATTEMPTS{ 5 }; // a record failing so many times while the database is up is dropped
+	const std::string SUFFIX{ ".journal" };
+
+	struct Header {
+		uint32_t magic;
+		uint32_t length; // of the payload
+		uint32_t crc; // of the payload
+		uint32_t reserved;
+	};
+
+	std::string systemError(const std::string &what) {
+		return what + ": " + strerror(errno);
+	}
+
+	// flock() held for the scope, released when the process dies
+	class FileLock final {
+	public:
+		FileLock(int fd, int operation) : fd_{ fd } {
+			while (flock(fd_, operation) == -1) {
+				if (errno != EINTR) {
+					throw std::runtime_error{ systemError("Can not lock message journal") };
+				}
+			}
+		}
+		FileLock(const FileLock &) = delete;
+		FileLock &operator=(const FileLock &) = delete;
+		~FileLock() {
+			flock(fd_, LOCK_UN);
+		}
+
+	private:
+		int fd_;
+	};
+
+	void putInt(std::string &buffer, uint64_t value, size_t bytes) {
+		for (size_t i = 0; i < bytes; ++i) {
+			buffer.push_back(static_cast<char>(value & 0xFF));
+			value >>= 8;
+		}
+	}
+
+	void putString(std::string &buffer, const std::string &value) {
+		putInt(buffer, value.size(), 4);
+		buffer += value;
+	}
+
+	// payload decoder, fails softly on malformed data
+	class Decoder final {
+	public:
+		Decoder(const std::string &buffer) : buffer_{ buffer } {}
+
+		uint64_t getInt(size_t bytes) {
+			if (!ok_ || buffer_.size() - pos_ < bytes) {
+				ok_ = false;
+				return 0;
+			}
+			uint64_t value{ 0 };
+			for (size_t i = 0; i < bytes; ++i) {
+				value |= static_cast<uint64_t>(static_cast<uint8_t>(buffer_[pos_ + i])) << (8 * i);
+			}
+			pos_ += bytes;
+			return value;
+		}
+
+		std::string getString() {
+			auto length = getInt(4);
+			if (!ok_ || buffer_.size() - pos_ < length) {
+				ok_ = false;
+				return std::string{};
+			}
+			std::string value{ buffer_.substr(pos_, length) };
+			pos_ += length;
+			return value;
+		}
+
+		bool good() const { return ok_; }
+		bool finished() const { return ok_ && pos_ == buffer_.size(); }
+
+	private:
+		const std::string &buffer_;
+		size_t pos_{ 0 };
+		bool ok_{ true };
+	};
+}
+
+MessageJournal::MessageJournal(const std::string &directory, const uint64_t segmentSize, const uint64_t maxBytes, const time_t maxAge) :
+	directory_{ directory },
+	segmentSize_{ segmentSize },
+	maxBytes_{ maxBytes },
+	maxAge_{ maxAge } {
+	if (segmentSize_ == 0 || segmentSize_ > 0xFFFFFFFF - MAX_RECORD) {
+		throw std::runtime_error{ "Invalid journal segment size: " + std::to_string(segmentSize_) };
+	}
+	fs::create_directories(directory_);
+
+	memory_ = std::make_unique<SharedMemory>(sizeof(Shared));
+	shared_ = memory_->as<Shared>();
+	// segments left by the previous run are sealed, appending starts in a new one
+	auto existing = segments();
+	uint64_t current = existing.empty() ? 1 : existing.back() + 1;
+	shared_->segment = current;
+	shared_->synced = position(current, 0);
+	// which of them are applied is known after the position is read from the storage
+	int64_t pending{ 0 };
+	for (auto segment: existing) {
+		std::error_code ec;
+		auto size = fs::file_size(segmentPath(segment), ec);
+		pending += ec ? 0 : static_cast<int64_t>(size);
+	}
+	shared_->pending = pending;
+	shared_->counted = false;
+}
+
+MessageJournal::~MessageJournal() {
+	if (owner_ != getpid()) {
+		return;
+	}
+	if (segmentFd_ != -1) {
+		close(segmentFd_);
+	}
+	if (lockFd_ != -1) {
+		close(lockFd_);
+	}
+}
+
+std::string MessageJournal::segmentPath(const uint64_t segment) const {
+	std::stringstream ss;
+	ss << std::setw(10) << std::setfill('0') << segment << SUFFIX;
+	return (fs::path{ directory_ } / ss.str()).string();
+}
+
+std::vector<uint64_t> MessageJournal::segments() const {
+	std::vector<uint64_t> result;
+	for (const auto &entry: fs::directory_iterator{ directory_ }) {
+		auto name = entry.path().filename().string();
+		if (name.size() <= SUFFIX.size() || !name.ends_with(SUFFIX)) {
+			continue;
+		}
+		auto digits = name.substr(0, name.size() - SUFFIX.size());
+		if (!std::all_of(digits.begin(), digits.end(), ::isdigit)) {
+			continue;
+		}
+		result.push_back(std::stoull(digits));
+	}
+	std::sort(result.begin(), result.end());
+	return result;
+}
+
+void MessageJournal::attach() {
+	if (owner_ == getpid()) {
+		return;
+	}
+	// descriptors inherited from the parent share file offsets and locks with it
+	if (segmentFd_ != -1) {
+		close(segmentFd_);
+		segmentFd_ = -1;
+	}
+	if (lockFd_ != -1) {
+		close(lockFd_);
+	}
+	auto path = (fs::path{ directory_ } / "journal.lock").string();
+	lockFd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lockFd_ == -1) {
+		throw std::runtime_error{ systemError("Can not open " + path) };
+	}
+	owner_ = getpid();
+}
+
+int MessageJournal::openSegment(const uint64_t segment) {
+	attach();
+	if (segmentFd_ != -1 && openedSegment_ == segment) {
+		return segmentFd_;
+	}
+	if (segmentFd_ != -1) {
+		close(segmentFd_);
+	}
+	auto path = segmentPath(segment);
+	segmentFd_ = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (segmentFd_ != -1) {
+		// new file must survive a crash too
+		int dirFd = open(directory_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dirFd != -1) {
+			fsync(dirFd);
+			close(dirFd);
+		}
+	}
+	else if (errno == EEXIST) {
+		segmentFd_ = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+	}
+	if (segmentFd_ == -1) {
+		throw std::runtime_error{ systemError("Can not open " + path) };
+	}
+	openedSegment_ = segment;
+	return segmentFd_;
+}
+
+void MessageJournal::advanceSynced(const uint64_t to) {
+	auto synced = shared_->synced.load();
+	while (synced < to && !shared_->synced.compare_exchange_weak(synced, to)) {
+	}
+}
+
+void MessageJournal::append(const Record &record) {
+	std::string payload;
+	putInt(payload, record.type, 1);
+	putInt(payload, record.read ? 1 : 0, 1);
+	putInt(payload, static_cast<uint64_t>(record.sent), 8);
+	putString(payload, record.sender);
+	if (record.type == PRIVATE) {
+		putString(payload, record.receiver);
+	}
+	else if (record.type == ACKNOWLEDGE) {
+		putInt(payload, record.user_id, 4);
+		putInt(payload, record.seq, 8);
+	}
+	else {
+		if (record.type == CHANNEL) {
+			putString(payload, record.channel);
+		}
+		putInt(payload, record.recipients.size(), 4);
+		for (const auto &recipient: record.recipients) {
+			putString(payload, recipient);
+		}
+	}
+	putString(payload, record.text);
+	if (payload.size() > MAX_RECORD) {
+		throw std::runtime_error{ "Message is too large for the journal" };
+	}
+
+	Header header{ MAGIC, static_cast<uint32_t>(payload.size()), Chat::crc32(payload.data(), payload.size()), 0 };
+	std::string frame{ reinterpret_cast<const char *>(&header), sizeof(header) };
+	frame += payload;
+	if (maxBytes_ > 0 && pendingBytes() + frame.size() > maxBytes_) {
+		throw std::runtime_error{ "Message journal is full" };
+	}
+
+	uint64_t segment;
+	uint64_t end{ 0 };
+	ssize_t written{ -1 };
+	int error{ 0 };
+	while (true) {
+		segment = shared_->segment.load();
+		int fd = openSegment(segment);
+		// shared lock keeps the segment from being sealed while the record is written
+		FileLock writing{ fd, LOCK_SH };
+		if (shared_->segment.load() != segment) {
+			continue;
+		}
+		written = write(fd, frame.data(), frame.size());
+		error = errno;
+		// offset of own descriptor is the end of own record even with concurrent appenders
+		end = lseek(fd, 0, SEEK_CUR);
+		break;
+	}
+	if (written != static_cast<ssize_t>(frame.size())) {
+		// a torn record must stay at the tail of a sealed segment, where replay skips it
+		rotate(segment);
+		throw std::runtime_error{ std::string{ "Can not write message journal: " } + (written == -1 ? strerror(error) : "short write") };
+	}
+	Metrics::add(Metrics::JOURNAL_APPENDS);
+	shared_->pending.fetch_add(frame.size());
+
+	sync(segment, end);
+	if (end >= segmentSize_) {
+		rotate(segment);
+	}
+}
+
+void MessageJournal::sync(const uint64_t segment, const uint64_t until) {
+	if (shared_->synced.load() >= position(segment, until)) {
+		return;
+	}
+	// group commit: the first waiter flushes records of everybody who has written before it,
+	// the others find their records already synced when they get the lock
+	FileLock leader{ lockFd_, LOCK_EX };
+	if (shared_->synced.load() >= position(segment, until)) {
+		return;
+	}
+	int fd = openSegment(segment);
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		throw std::runtime_error{ systemError("Can not stat message journal") };
+	}
+	if (fdatasync(fd) == -1) {
+		throw std::runtime_error{ systemError("Can not flush message journal") };
+	}
+	Metrics::add(Metrics::JOURNAL_FSYNCS);
+	advanceSynced(position(segment, st.st_size));
+}
+
+void MessageJournal::rotate(const uint64_t segment) {
+	attach();
+	// under the sync lock, so nobody claims the next segment synced before this one is
+	FileLock leader{ lockFd_, LOCK_EX };
+	auto expected = segment;
+	if (!shared_->segment.compare_exchange_strong(expected, segment + 1)) {
+		return;
+	}
+	int fd = openSegment(segment);
+	{
+		// wait for writers which have seen the segment as current
+		FileLock sealing{ fd, LOCK_EX };
+	}
+	if (fdatasync(fd) == -1) {
+		throw std::runtime_error{ systemError("Can not flush message journal") };
+	}
+	Metrics::add(Metrics::JOURNAL_FSYNCS);
+	advanceSynced(position(segment + 1, 0));
+}
+
+std::optional<MessageJournal::Record> MessageJournal::read(const int fd, const uint64_t offset, const uint64_t limit, uint64_t &next) const {
+	Header header;
+	if (offset + sizeof(header) > limit || pread(fd, &header, sizeof(header), offset) != sizeof(header)) {
+		return std::nullopt;
+	}
+	if (header.magic != MAGIC || header.length > MAX_RECORD || offset + sizeof(header) + header.length > limit) {
+		return std::nullopt;
+	}
+	std::string payload(header.length, '\0');
+	if (pread(fd, payload.data(), payload.size(), offset + sizeof(header)) != static_cast<ssize_t>(payload.size())) {
+		return std::nullopt;
+	}
+	if (Chat::crc32(payload.data(), payload.size()) != header.crc) {
+		return std::nullopt;
+	}
+
+	Decoder decoder{ payload };
+	Record record;
+	record.type = static_cast<RecordType>(decoder.getInt(1));
+	record.read = decoder.getInt(1) != 0;
+	record.sent = static_cast<time_t>(decoder.getInt(8));
+	record.sender = decoder.getString();
+	if (record.type == PRIVATE) {
+		record.receiver = decoder.getString();
+	}
+	else if (record.type == ACKNOWLEDGE) {
+		record.user_id = static_cast<unsigned>(decoder.getInt(4));
+		record.seq = decoder.getInt(8);
+	}
+	else if (record.type == BROADCAST || record.type == CHANNEL) {
+		if (record.type == CHANNEL) {
+			record.channel = decoder.getString();
+		}
+		auto count = decoder.getInt(4);
+		for (uint64_t i = 0; i < count && decoder.good(); ++i) {
+			record.recipients.push_back(decoder.getString());
+		}
+	}
+	else {
+		return std::nullopt;
+	}
+	record.text = decoder.getString();
+	if (!decoder.finished()) {
+		return std::nullopt;
+	}
+	next = offset + sizeof(header) + header.length;
+	return record;
+}
+
+void MessageJournal::apply(Storage &storage, const Record &record) const {
+	storage.setRecordPosition(record.end);
+	if (record.type == PRIVATE) {
+		storage.savePrivateMessage(record.sender, record.receiver, record.text, record.read, record.sent);
+	}
+	else if (record.type == CHANNEL) {
+		storage.saveChannelMessage(record.sender, record.channel, record.text, record.recipients, record.sent);
+	}
+	else if (record.type == ACKNOWLEDGE) {
+		storage.acknowledge(record.user_id, record.seq);
+	}
+	else {
+		storage.saveBroadcastMessage(record.sender, record.text, record.recipients, record.sent);
+	}
+}
+
+uint64_t MessageJournal::pendingBytes() const {
+	// a damaged tail skipped by replay has not been counted by append
+	return static_cast<uint64_t>(std::max<int64_t>(shared_->pending.load(), 0));
+}
+
+void MessageJournal::countApplied() {
+	if (shared_->counted.exchange(true)) {
+		return;
+	}
+	// segments of this run come after the applied position of the previous ones
+	auto current = segmentOf(applied_);
+	int64_t applied{ 0 };
+	for (auto segment: segments()) {
+		if (segment > current) {
+			break;
+		}
+		std::error_code ec;
+		auto size = fs::file_size(segmentPath(segment), ec);
+		if (!ec) {
+			applied += segment < current ? static_cast<int64_t>(size) : std::min<int64_t>(size, offsetOf(applied_));
+		}
+	}
+	shared_->pending.fetch_sub(applied);
+}
+
+size_t MessageJournal::replay(Storage &storage, const size_t limit, const std::function<void(const Record &)> &applied) {
+	if (!appliedLoaded_) {
+		applied_ = storage.journalPosition();
+		appliedLoaded_ = true;
+		countApplied();
+	}
+	auto segment = segmentOf(applied_);
+	uint64_t offset = offsetOf(applied_);
+	auto existing = segments();
+	if (!std::binary_search(existing.begin(), existing.end(), segment)) {
+		// applied segments are deleted, continue from the next one
+		auto it = std::upper_bound(existing.begin(), existing.end(), segment);
+		if (it == existing.end()) {
+			return 0;
+		}
+		segment = *it;
+		offset = 0;
+	}
+	// applied segments are removed, the newest file is kept to continue numbering after restart
+	for (auto applied: existing) {
+		if (applied < segment && applied != existing.back()) {
+			std::error_code ec;
+			fs::remove(segmentPath(applied), ec);
+		}
+	}
+
+	auto path = segmentPath(segment);
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		throw std::runtime_error{ systemError("Can not open " + path) };
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		throw std::runtime_error{ systemError("Can not stat " + path) };
+	}
+	// only durable records are applied. A segment is complete when the synced position is past it
+	auto synced = shared_->synced.load();
+	bool sealed = segmentOf(synced) > segment;
+	uint64_t end = sealed ? static_cast<uint64_t>(st.st_size) : offsetOf(synced);
+
+	std::vector<Record> records;
+	size_t expired{ 0 };
+	const auto start = offset;
+	const auto now = std::time(nullptr);
+	uint64_t next = offset;
+	while (records.size() + expired < limit) {
+		auto record = read(fd, offset, end, next);
+		if (!record) {
+			break;
+		}
+		offset = next;
+		record->end = position(segment, offset);
+		// messages waiting so long are not delivered any more, acknowledgements are still applied
+		if (maxAge_ > 0 && record->type != ACKNOWLEDGE && record->sent + maxAge_ < now) {
+			++expired;
+			continue;
+		}
+		records.push_back(std::move(*record));
+	}
+	close(fd);
+
+	if (records.empty() && expired == 0) {
+		if (!sealed) {
+			return 0;
+		}
+		if (offset < end) {
+			std::cerr << "Message journal: skipping damaged tail of " << path << " at offset " << offset << std::endl;
+		}
+		auto it = std::upper_bound(existing.begin(), existing.end(), segment);
+		auto following = it != existing.end() ? *it : shared_->segment.load();
+		storage.setJournalPosition(position(following, 0));
+		applied_ = position(following, 0);
+		shared_->pending.fetch_sub(end - offset);
+		return replay(storage, limit, applied);
+	}
+
+	try {
+		storage.beginTransaction();
+		for (const auto &record: records) {
+			apply(storage, record);
+		}
+		// the checkpoint goes to every database the records are written to. Databases are committed one
+		// by one, so after a failed commit the ones committed before skip the records they already have
+		storage.setJournalPosition(position(segment, offset));
+		storage.commitTransaction();
+	}
+	catch (const std::runtime_error &e) {
+		storage.rollbackTransaction();
+		appliedLoaded_ = false;
+		if (!storage.isConnected()) {
+			throw;
+		}
+		if (records.size() + expired > 1) {
+			// find the failing record
+			return replay(storage, 1, applied);
+		}
+		if (records.empty() || ++failures_ < MAX_ATTEMPTS) {
+			throw;
+		}
+		std::cerr << "Message journal: dropping record from " << records.front().sender <<
+			" at " << path << ':' << start << " (" << e.what() << ")" << std::endl;
+		failures_ = 0;
+		storage.setJournalPosition(position(segment, offset));
+		applied_ = position(segment, offset);
+		appliedLoaded_ = true;
+		shared_->pending.fetch_sub(offset - start);
+		return 0;
+	}
+	failures_ = 0;
+	applied_ = position(segment, offset);
+	shared_->pending.fetch_sub(offset - start);
+	Metrics::add(Metrics::JOURNAL_REPLAYED, records.size());
+	if (applied) {
+		for (const auto &record: records) {
+			applied(record);
+		}
+	}
+	if (expired > 0) {
+		Metrics::add(Metrics::JOURNAL_EXPIRED, expired);
+		std::cerr << "Message journal: dropped " << expired << " messages older than " << maxAge_ << " seconds" << std::endl;
+	}
+	return records.size() + expired;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "shared_memory.h"
+#include "storage.h"
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+extern "C" {
+	#include <sys/types.h>
+}
+
+// Write-ahead journal of chat messages: append-only segment files in a local directory.
+// Any server process may append, a record is acknowledged after it is flushed to disk
+// by a group fsync. Records are applied to the storage asynchronously by replay(),
+// the applied position is kept in the storage itself, so unapplied records survive restart.
+// Unapplied records are limited by size on append and by age on replay. Must be created before fork()
+class MessageJournal final {
+public:
+	enum RecordType : uint8_t {
+		PRIVATE = 1,
+		BROADCAST = 2,
+		CHANNEL = 3,
+		ACKNOWLEDGE = 4 // delivery cursor of a user
+	};
+
+	struct Record {
+		RecordType type;
+		time_t sent;
+		std::string sender;
+		std::string receiver; // private message only
+		std::string channel; // channel message only
+		std::vector<std::string> recipients; // broadcast and channel messages
+		std::string text;
+		bool read{ false };
+		unsigned user_id{ 0 }; // acknowledgement only
+		unsigned long long seq{ 0 }; // acknowledgement only
+		uint64_t end{ 0 }; // journal position after the record, set when it is read back
+	};
+
+	// maxBytes of unapplied records and maxAge of unapplied messages in seconds, 0 is unlimited
+	MessageJournal(const std::string &directory, uint64_t segmentSize, uint64_t maxBytes = 0, time_t maxAge = 0);
+	MessageJournal(const MessageJournal &) = delete;
+	MessageJournal &operator=(const MessageJournal &) = delete;
+	~MessageJournal();
+
+	// returns when the record is durable, throws std::runtime_error if the journal is full
+	void append(const Record &record);
+
+	// applies up to limit durable records to the storage in one transaction, messages older
+	// than maxAge are dropped instead. Every applied record is passed to the callback after the commit.
+	// Returns number of applied and dropped records. Throws std::runtime_error if the storage fails
+	size_t replay(Storage &storage, size_t limit, const std::function<void(const Record &)> &applied = nullptr);
+
+	uint64_t pendingBytes() const; // appended and not applied yet, by all processes
+
+private:
+	// position is a segment number in the high half and an offset in the low half
+	static uint64_t position(uint64_t segment, uint64_t offset) { return (segment << 32) | offset; }
+	static uint64_t segmentOf(uint64_t position) { return position >> 32; }
+	static uint64_t offsetOf(uint64_t position) { return position & 0xFFFFFFFF; }
+
+	struct Shared {
+		std::atomic<uint64_t> segment; // segment open for appending
+		std::atomic<uint64_t> synced; // everything before this position is on disk
+		std::atomic<int64_t> pending; // bytes of unapplied records, estimated until the applied position is loaded
+		std::atomic<bool> counted; // records applied by the previous runs are not pending
+	};
+
+	std::string segmentPath(uint64_t segment) const;
+	std::vector<uint64_t> segments() const; // existing segment numbers in ascending order
+	void attach(); // reopen per-process descriptors after fork()
+	int openSegment(uint64_t segment);
+	void sync(uint64_t segment, uint64_t until);
+	void rotate(uint64_t segment);
+	void advanceSynced(uint64_t to);
+	std::optional<Record> read(int fd, uint64_t offset, uint64_t limit, uint64_t &next) const;
+	void apply(Storage &storage, const Record &record) const;
+	void countApplied(); // leave only the unapplied part of the previous runs pending
+
+	const std::string directory_;
+	const uint64_t segmentSize_;
+	const uint64_t maxBytes_;
+	const time_t maxAge_;
+	std::unique_ptr<SharedMemory> memory_;
+	Shared *shared_;
+
+	// descriptors of the current process
+	pid_t owner_{ 0 };
+	int lockFd_{ -1 };
+	int segmentFd_{ -1 };
+	uint64_t openedSegment_{ 0 };
+
+	// replay state
+	uint64_t applied_{ 0 };
+	bool appliedLoaded_{ false };
+	unsigned failures_{ 0 };
+};
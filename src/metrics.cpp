@@ -0,0 +1,270 @@
+#include "metrics.h"
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+extern "C" {
+	#include <unistd.h>
+}
+
+namespace {
+	struct Description {
+		const char *name;
+		const char *labels;
+		const char *help;
+	};
+
+	// Entries with the same name are rendered as one metric family with different labels
+	const Description COUNTERS[Metrics::COUNTERS_TOTAL] = {
+		{ "chat_connections_accepted_total", "", "Accepted client connections" },
+		{ "chat_messages_total", "type=\"private\"", "Messages sent by users" },
+		{ "chat_messages_total", "type=\"broadcast\"", "Messages sent by users" },
+		{ "chat_messages_total", "type=\"channel\"", "Messages sent by users" },
+		{ "chat_messages_delivered_total", "", "Messages delivered to recipients" },
+		{ "chat_messages_acknowledged_total", "", "Delivered messages acknowledged by clients" },
+		{ "chat_delivery_cursor_updates_total", "", "Acknowledgements saved to the database" },
+		{ "chat_db_queries_total", "", "Database queries executed" },
+		{ "chat_db_errors_total", "", "Database queries failed" },
+		{ "chat_journal_appends_total", "", "Records appended to the message journal" },
+		{ "chat_journal_fsyncs_total", "", "Message journal flushes to disk" },
+		{ "chat_journal_replayed_total", "", "Journal records applied to the database" },
+		{ "chat_shutdown_clients_total", "result=\"drained\"", "Clients disconnected on shutdown" },
+		{ "chat_shutdown_clients_total", "result=\"dropped\"", "Clients disconnected on shutdown" },
+		{ "chat_shutdown_messages_flushed_total", "", "Pending messages delivered while draining" },
+		{ "chat_frame_cache_lookups_total", "result=\"hit\"", "Broadcast frames looked up in the shared frame cache" },
+		{ "chat_frame_cache_lookups_total", "result=\"miss\"", "Broadcast frames looked up in the shared frame cache" },
+		{ "chat_outbound_messages_total", "result=\"dropped\"", "Queued messages removed by the slow consumer policy" },
+		{ "chat_outbound_messages_total", "result=\"coalesced\"", "Queued messages removed by the slow consumer policy" },
+		{ "chat_slow_consumers_disconnected_total", "", "Clients disconnected because they did not read their messages" },
+		{ "chat_search_queries_total", "", "Full-text searches answered by the search index" },
+		{ "chat_search_indexed_total", "", "Messages added to the search index" },
+		{ "chat_session_wakeups_total", "", "Client processes woken up to read new messages" },
+		{ "chat_cluster_notices_total", "direction=\"sent\"", "Notices about new messages exchanged with other nodes" },
+		{ "chat_cluster_notices_total", "direction=\"received\"", "Notices about new messages exchanged with other nodes" },
+		{ "chat_presence_updates_total", "direction=\"sent\"", "Presence changes sent to other nodes and applied from them" },
+		{ "chat_presence_updates_total", "direction=\"applied\"", "Presence changes sent to other nodes and applied from them" },
+		{ "chat_presence_snapshots_total", "", "Snapshots of the sessions written to the database" },
+		{ "chat_clients_redirected_total", "", "Sign-ins sent to the node the user belongs to" },
+		{ "chat_db_reads_total", "endpoint=\"primary\"", "Read-only statements by the database endpoint serving them" },
+		{ "chat_db_reads_total", "endpoint=\"replica\"", "Read-only statements by the database endpoint serving them" },
+		{ "chat_retention_messages_total", "action=\"archived\"", "Messages archived and deleted by the retention policy" },
+		{ "chat_retention_messages_total", "action=\"deleted\"", "Messages archived and deleted by the retention policy" },
+		{ "chat_db_breaker_opened_total", "", "Times the database circuit breaker has opened" },
+		{ "chat_db_breaker_rejected_total", "", "Database connection attempts refused by the open circuit breaker" },
+		{ "chat_spool_records_total", "", "Messages and acknowledgements spooled while the database was unavailable" },
+		{ "chat_journal_expired_total", "", "Journal records dropped as older than SpoolMaxAge" },
+	};
+
+	const Description GAUGES[Metrics::GAUGES_TOTAL] = {
+		{ "chat_connections_active", "", "Currently connected clients" },
+		{ "chat_db_connections_open", "", "Open database connections over all server processes" },
+		{ "chat_log_queue_depth", "", "Log records waiting for the log file lock" },
+		{ "chat_outbound_queue_depth", "", "Frames waiting to be written to client sockets" },
+		{ "chat_cluster_peers_connected", "", "Other nodes this node is connected to" },
+		{ "chat_retention_lag_seconds", "", "How long the oldest message to be removed by the retention policy is overdue" },
+		{ "chat_journal_pending_bytes", "", "Journal records not applied to the database yet" },
+	};
+
+	const Description HISTOGRAMS[Metrics::HISTOGRAMS_TOTAL] = {
+		{ "chat_db_query_duration_seconds", "", "Database query latency" },
+		{ "chat_delivery_lag_seconds", "", "Time between sending and delivering a message" },
+		{ "chat_retention_chunk_duration_seconds", "", "Time of one chunk of the retention job in the database" },
+		{ "chat_db_endpoint_query_duration_seconds", "endpoint=\"primary\"", "Database query latency by endpoint" },
+		{ "chat_db_endpoint_query_duration_seconds", "endpoint=\"replica1\"", "Database query latency by endpoint" },
+		{ "chat_db_endpoint_query_duration_seconds", "endpoint=\"replica2\"", "Database query latency by endpoint" },
+		{ "chat_db_endpoint_query_duration_seconds", "endpoint=\"replica3\"", "Database query latency by endpoint" },
+		{ "chat_db_endpoint_query_duration_seconds", "endpoint=\"replica4\"", "Database query latency by endpoint" },
+	};
+	static_assert(Metrics::MAX_DB_REPLICAS == 4, "one histogram description per replica");
+
+	// Upper bounds of histogram buckets in seconds, +Inf is implied
+	const std::vector<double> BOUNDS[Metrics::HISTOGRAMS_TOTAL] = {
+		{ 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0 },
+		{ 0.01, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0, 300.0, 3600.0 },
+		{ 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0 },
+		{ 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0 },
+		{ 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0 },
+		{ 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0 },
+		{ 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0 },
+		{ 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0 },
+	};
+
+	void printHeader(std::stringstream &ss, const Description &d, const char *type, const char *previous) {
+		if (previous == nullptr || std::string{ previous } != d.name) {
+			ss << "# HELP " << d.name << ' ' << d.help << '\n';
+			ss << "# TYPE " << d.name << ' ' << type << '\n';
+		}
+	}
+
+	void printSample(std::stringstream &ss, const std::string &name, const std::string &labels, const auto value) {
+		ss << name;
+		if (!labels.empty()) {
+			ss << '{' << labels << '}';
+		}
+		ss << ' ' << value << '\n';
+	}
+}
+
+std::unique_ptr<SharedMemory> Metrics::memory_;
+Metrics::Slot *Metrics::slots_{ nullptr };
+unsigned Metrics::slotIndex_{ 0 };
+
+void Metrics::init() {
+	if (slots_ != nullptr) {
+		return;
+	}
+	memory_ = std::make_unique<SharedMemory>(sizeof(Slot) * MAX_SLOTS);
+	// Anonymous mapping is zero-filled, that is a valid initial state for lock-free atomics
+	slots_ = memory_->as<Slot>();
+	attach();
+}
+
+void Metrics::attach() {
+	if (slots_ == nullptr) {
+		return;
+	}
+	pid_t pid{ getpid() };
+	// Slot 0 is shared by processes that could not get own slot
+	for (unsigned i = 1; i < MAX_SLOTS; ++i) {
+		pid_t expected{ 0 };
+		if (slots_[i].pid.compare_exchange_strong(expected, pid)) {
+			slotIndex_ = i;
+			return;
+		}
+	}
+	slotIndex_ = 0;
+}
+
+void Metrics::release(const pid_t pid) {
+	if (slots_ == nullptr) {
+		return;
+	}
+	for (unsigned i = 1; i < MAX_SLOTS; ++i) {
+		if (slots_[i].pid.load() == pid) {
+			// Counters are kept to stay monotonic, gauges of the dead process are no longer valid
+			for (auto &gauge: slots_[i].gauges) {
+				gauge.store(0);
+			}
+			slots_[i].pid.store(0);
+			return;
+		}
+	}
+}
+
+Metrics::Slot &Metrics::slot() {
+	return slots_[slotIndex_];
+}
+
+void Metrics::add(const Counter counter, const uint64_t value) {
+	if (slots_ == nullptr) {
+		return;
+	}
+	slot().counters[counter].fetch_add(value, std::memory_order_relaxed);
+}
+
+void Metrics::add(const Gauge gauge, const int64_t value) {
+	if (slots_ == nullptr) {
+		return;
+	}
+	slot().gauges[gauge].fetch_add(value, std::memory_order_relaxed);
+}
+
+void Metrics::observe(const Histogram histogram, const double seconds) {
+	if (slots_ == nullptr) {
+		return;
+	}
+	auto &data = slot().histograms[histogram];
+	const auto &bounds = BOUNDS[histogram];
+	unsigned bucket{ 0 };
+	while (bucket < bounds.size() && seconds > bounds[bucket]) {
+		++bucket;
+	}
+	data.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	data.count.fetch_add(1, std::memory_order_relaxed);
+	data.sum_us.fetch_add(static_cast<uint64_t>(seconds * 1e6), std::memory_order_relaxed);
+}
+
+std::string Metrics::render() {
+	std::stringstream ss;
+	if (slots_ == nullptr) {
+		return ss.str();
+	}
+
+	uint64_t counters[COUNTERS_TOTAL]{};
+	int64_t gauges[GAUGES_TOTAL]{};
+	uint64_t buckets[HISTOGRAMS_TOTAL][MAX_BUCKETS]{};
+	uint64_t counts[HISTOGRAMS_TOTAL]{};
+	uint64_t sums[HISTOGRAMS_TOTAL]{};
+	unsigned processes{ 0 };
+	uint64_t rss{ 0 };
+	const long page_size{ sysconf(_SC_PAGESIZE) };
+
+	for (unsigned i = 0; i < MAX_SLOTS; ++i) {
+		const auto &s = slots_[i];
+		for (unsigned c = 0; c < COUNTERS_TOTAL; ++c) {
+			counters[c] += s.counters[c].load(std::memory_order_relaxed);
+		}
+		for (unsigned g = 0; g < GAUGES_TOTAL; ++g) {
+			gauges[g] += s.gauges[g].load(std::memory_order_relaxed);
+		}
+		for (unsigned h = 0; h < HISTOGRAMS_TOTAL; ++h) {
+			for (unsigned b = 0; b < MAX_BUCKETS; ++b) {
+				buckets[h][b] += s.histograms[h].buckets[b].load(std::memory_order_relaxed);
+			}
+			counts[h] += s.histograms[h].count.load(std::memory_order_relaxed);
+			sums[h] += s.histograms[h].sum_us.load(std::memory_order_relaxed);
+		}
+
+		pid_t pid{ s.pid.load() };
+		if (pid == 0) {
+			continue;
+		}
+		++processes;
+		// statm: size resident shared ... (in pages)
+		std::ifstream statm{ "/proc/" + std::to_string(pid) + "/statm" };
+		unsigned long size{ 0 }, resident{ 0 };
+		if (statm >> size >> resident) {
+			rss += resident * page_size;
+		}
+	}
+
+	const char *previous{ nullptr };
+	for (unsigned c = 0; c < COUNTERS_TOTAL; ++c) {
+		printHeader(ss, COUNTERS[c], "counter", previous);
+		printSample(ss, COUNTERS[c].name, COUNTERS[c].labels, counters[c]);
+		previous = COUNTERS[c].name;
+	}
+	for (unsigned g = 0; g < GAUGES_TOTAL; ++g) {
+		printHeader(ss, GAUGES[g], "gauge", nullptr);
+		printSample(ss, GAUGES[g].name, GAUGES[g].labels, gauges[g]);
+	}
+	previous = nullptr;
+	for (unsigned h = 0; h < HISTOGRAMS_TOTAL; ++h) {
+		const std::string name{ HISTOGRAMS[h].name };
+		const std::string labels{ HISTOGRAMS[h].labels };
+		const std::string prefix{ labels.empty() ? labels : labels + ',' };
+		printHeader(ss, HISTOGRAMS[h], "histogram", previous);
+		previous = HISTOGRAMS[h].name;
+		uint64_t cumulative{ 0 };
+		for (unsigned b = 0; b < BOUNDS[h].size(); ++b) {
+			cumulative += buckets[h][b];
+			std::stringstream le;
+			le << prefix << "le=\"" << BOUNDS[h][b] << '"';
+			printSample(ss, name + "_bucket", le.str(), cumulative);
+		}
+		cumulative += buckets[h][BOUNDS[h].size()];
+		printSample(ss, name + "_bucket", prefix + "le=\"+Inf\"", cumulative);
+		printSample(ss, name + "_sum", labels, static_cast<double>(sums[h]) / 1e6);
+		printSample(ss, name + "_count", labels, counts[h]);
+	}
+
+	ss << "# HELP chat_processes Server processes attached to metrics\n"
+		"# TYPE chat_processes gauge\n"
+		"chat_processes " << processes << '\n';
+	ss << "# HELP chat_resident_memory_bytes Resident set size of all server processes\n"
+		"# TYPE chat_resident_memory_bytes gauge\n"
+		"chat_resident_memory_bytes " << rss << '\n';
+
+	return ss.str();
+}
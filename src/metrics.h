@@ -0,0 +1,111 @@
+#pragma once
+
+#include "shared_memory.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+extern "C" {
+	#include <sys/types.h>
+}
+
+// Process-wide counters shared by the whole server tree.
+// Every process writes only to its own slot with relaxed atomics, slots are summed at scrape time
+class Metrics final {
+public:
+	static const unsigned MAX_DB_REPLICAS{ 4 }; // database endpoints with own latency histogram besides the primary
+
+	enum Counter : unsigned {
+		CONNECTIONS_ACCEPTED,
+		MESSAGES_PRIVATE,
+		MESSAGES_BROADCAST,
+		MESSAGES_CHANNEL,
+		MESSAGES_DELIVERED,
+		MESSAGES_ACKNOWLEDGED,
+		DELIVERY_CURSOR_UPDATES,
+		DB_QUERIES,
+		DB_ERRORS,
+		JOURNAL_APPENDS,
+		JOURNAL_FSYNCS,
+		JOURNAL_REPLAYED,
+		CLIENTS_DRAINED,
+		CLIENTS_DROPPED,
+		MESSAGES_FLUSHED,
+		FRAME_CACHE_HITS,
+		FRAME_CACHE_MISSES,
+		OUTBOUND_DROPPED,
+		OUTBOUND_COALESCED,
+		SLOW_CONSUMERS_DISCONNECTED,
+		SEARCH_QUERIES,
+		SEARCH_INDEXED,
+		SESSION_WAKEUPS,
+		CLUSTER_NOTICES_SENT,
+		CLUSTER_NOTICES_RECEIVED,
+		PRESENCE_UPDATES_SENT,
+		PRESENCE_UPDATES_APPLIED,
+		PRESENCE_SNAPSHOTS,
+		CLIENTS_REDIRECTED,
+		DB_READS_PRIMARY,
+		DB_READS_REPLICA,
+		RETENTION_ARCHIVED,
+		RETENTION_DELETED,
+		DB_BREAKER_OPENED,
+		DB_BREAKER_REJECTED,
+		SPOOL_RECORDS,
+		JOURNAL_EXPIRED,
+		COUNTERS_TOTAL
+	};
+
+	enum Gauge : unsigned {
+		CONNECTIONS_ACTIVE,
+		DB_CONNECTIONS_OPEN,
+		LOG_QUEUE_DEPTH,
+		OUTBOUND_QUEUE_DEPTH,
+		CLUSTER_PEERS_CONNECTED,
+		RETENTION_LAG_SECONDS,
+		JOURNAL_PENDING_BYTES,
+		GAUGES_TOTAL
+	};
+
+	enum Histogram : unsigned {
+		DB_QUERY_SECONDS,
+		DELIVERY_LAG_SECONDS,
+		RETENTION_CHUNK_SECONDS,
+		DB_PRIMARY_SECONDS,
+		DB_REPLICA_SECONDS, // first replica, the others follow
+		HISTOGRAMS_TOTAL = DB_REPLICA_SECONDS + MAX_DB_REPLICAS
+	};
+
+	static void init(); // must be called once in the main process before any fork()
+	static void attach(); // take own slot in a freshly forked process
+	static void release(pid_t pid); // free slot of the exited process
+	static void add(Counter counter, uint64_t value = 1);
+	static void add(Gauge gauge, int64_t value);
+	static void observe(Histogram histogram, double seconds);
+	static std::string render(); // Prometheus text exposition format
+
+private:
+	static const unsigned MAX_SLOTS{ 512 };
+	static const unsigned MAX_BUCKETS{ 16 };
+
+	struct HistogramData {
+		std::atomic<uint64_t> buckets[MAX_BUCKETS];
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> sum_us;
+	};
+
+	struct Slot {
+		std::atomic<pid_t> pid;
+		std::atomic<uint64_t> counters[COUNTERS_TOTAL];
+		std::atomic<int64_t> gauges[GAUGES_TOTAL];
+		HistogramData histograms[HISTOGRAMS_TOTAL];
+	};
+
+	static Slot &slot();
+
+	static std::unique_ptr<SharedMemory> memory_;
+	static Slot *slots_;
+	static unsigned slotIndex_;
+};
@@ -1,10 +1,17 @@
 #include "mysql.h"
+#include "metrics.h"
+#include "query_stats.h"
 
+#include <charconv>
+#include <chrono>
 #include <sstream>
 #include <stdexcept>
 #include <iostream>
 #include <iomanip>
 
+std::unique_ptr<Logger> Mysql::slowLog_;
+double Mysql::slowThresholdMs_{ 100.0 };
+
 Mysql::Mysql() {
 	mysql_init(&connfd_);
 	if (&connfd_ == nullptr) {
@@ -16,59 +23,300 @@ void Mysql::open(
 	const std::string &dbname,
 	const std::string &dbhost,
 	const std::string &dbuser,
-	const std::string &dbpassword
+	const std::string &dbpassword,
+	const unsigned short port
 	) {
 	std::string charset{ "utf8mb4" };
-	connection_active_ = mysql_real_connect(&connfd_, dbhost.c_str(), dbuser.c_str(), dbpassword.c_str(), dbname.c_str(), 0, nullptr, 0);
+	connection_active_ = mysql_real_connect(&connfd_, dbhost.c_str(), dbuser.c_str(), dbpassword.c_str(), dbname.c_str(), port, nullptr, 0);
 	if (!connection_active_) {
 		std::stringstream ss;
 		ss << "can't connect to database (" << mysql_error(&connfd_);
-		mysql_close(&connfd_);
+		reset();
 		throw std::runtime_error{ ss.str() };
 	}
 	mysql_set_character_set(&connfd_, charset.c_str());
 	auto actual_charset = mysql_character_set_name(&connfd_);
 	if (charset != actual_charset) {
-		mysql_close(&connfd_);
+		connection_active_ = false;
+		reset();
 		throw std::runtime_error{ "can't set charset" };
 	}
-	
+	Metrics::add(Metrics::DB_CONNECTIONS_OPEN, 1);
+}
+
+void Mysql::reset() {
+	// the destructor closes the descriptor again, so it is initialized anew
+	mysql_close(&connfd_);
+	mysql_init(&connfd_);
 }
 
-bool Mysql::query(const std::string &req) {
+void Mysql::setEndpoint(const Metrics::Histogram histogram) {
+	endpoint_ = histogram;
+}
+
+bool Mysql::query(const std::string &req, const std::source_location &location) {
 	error_.clear();
-	mysql_query(&connfd_, req.c_str());
-	result_ = mysql_store_result(&connfd_);
-	if (mysql_error(&connfd_)) {
+	auto start = std::chrono::steady_clock::now();
+	unsigned long long rows{ 0 };
+	if (mysql_query(&connfd_, req.c_str()) == 0) {
+		// statements producing a result set are not expected here, but the result must be consumed anyway
+		auto result = mysql_store_result(&connfd_);
+		if (result != nullptr) {
+			rows = mysql_num_rows(result);
+			mysql_free_result(result);
+		}
+		else {
+			rows = mysql_affected_rows(&connfd_);
+		}
+	}
+	if (mysql_errno(&connfd_) != 0) {
 		error_ = mysql_error(&connfd_);
+		rows = 0;
+		checkConnection();
 	}
+	account(req, location, start, rows);
 	return error_.empty();
 }
 
+MysqlCursor Mysql::select(const std::string &req, const std::source_location &location) {
+	error_.clear();
+	auto start = std::chrono::steady_clock::now();
+	MYSQL_RES *result{ nullptr };
+	if (mysql_query(&connfd_, req.c_str()) == 0) {
+		result = mysql_use_result(&connfd_);
+	}
+	if (result == nullptr) {
+		error_ = mysql_errno(&connfd_) != 0 ? mysql_error(&connfd_) : "statement returned no result set";
+		checkConnection();
+		account(req, location, start, 0);
+		throw std::runtime_error{ "MySQL error: " + error_ };
+	}
+	return MysqlCursor{ this, result, req, location, start };
+}
+
+void Mysql::account(
+	const std::string &req,
+	const std::source_location &location,
+	const std::chrono::steady_clock::time_point start,
+	const unsigned long long rows
+	) {
+	std::chrono::duration<double> elapsed{ std::chrono::steady_clock::now() - start };
+	Metrics::add(Metrics::DB_QUERIES);
+	Metrics::observe(Metrics::DB_QUERY_SECONDS, elapsed.count());
+	Metrics::observe(endpoint_, elapsed.count());
+	if (!error_.empty()) {
+		Metrics::add(Metrics::DB_ERRORS);
+	}
+	if (!QueryStats::enabled()) {
+		return;
+	}
+
+	auto fingerprint = QueryStats::fingerprint(req);
+	QueryStats::record(fingerprint, static_cast<uint64_t>(elapsed.count() * 1e6), rows);
+	double elapsedMs{ elapsed.count() * 1e3 };
+	if (slowLog_ == nullptr || (error_.empty() && elapsedMs < slowThresholdMs_)) {
+		return;
+	}
+	std::stringstream ss;
+	ss << (error_.empty() ? "SLOW " : "ERROR ")
+		<< std::fixed << std::setprecision(3) << elapsedMs << " ms; "
+		<< "rows: " << rows << "; "
+		<< "at " << location.file_name() << ':' << location.line() << " (" << location.function_name() << "); "
+		<< "fingerprint: " << fingerprint;
+	if (!error_.empty()) {
+		ss << "; error: " << error_;
+	}
+	slowLog_->write(ss.str());
+}
+
+void Mysql::setSlowQueryLog(const std::string &filename, const double thresholdMs) {
+	QueryStats::init();
+	slowLog_ = std::make_unique<Logger>(filename);
+	slowThresholdMs_ = thresholdMs;
+}
+
+void Mysql::printSlowQuerySummary(std::ostream &os, const size_t n) {
+	if (!QueryStats::enabled()) {
+		os << "Query timing is disabled. Set SlowQueryLog in the configuration file to enable it" << std::endl;
+		return;
+	}
+	os << std::setw(8) << "count" << std::setw(12) << "total ms" << std::setw(10) << "avg ms"
+		<< std::setw(10) << "max ms" << std::setw(10) << "rows" << "  query" << std::endl;
+	for (const auto &entry: QueryStats::top(n)) {
+		os << std::fixed << std::setprecision(1)
+			<< std::setw(8) << entry.count
+			<< std::setw(12) << entry.total_us / 1e3
+			<< std::setw(10) << entry.total_us / 1e3 / entry.count
+			<< std::setw(10) << entry.max_us / 1e3
+			<< std::setw(10) << entry.rows
+			<< "  " << entry.fingerprint << std::endl;
+	}
+}
+
 const std::string &Mysql::getError() const {
 	return error_;
 }
-std::list<std::vector<std::string>> &Mysql::fetchAll() {
-	fields_.clear();
+
+unsigned long long Mysql::insertId() {
+	return mysql_insert_id(&connfd_);
+}
+
+unsigned long long Mysql::affectedRows() {
+	return mysql_affected_rows(&connfd_);
+}
+
+std::string Mysql::escape(const std::string &value) {
+	std::string result(value.length() * 2 + 1, '\0');
+	auto length = mysql_real_escape_string(&connfd_, result.data(), value.c_str(), value.length());
+	result.resize(length);
+	return result;
+}
+
+bool Mysql::isOpen() const {
+	return connection_active_ && !connection_lost_;
+}
+
+void Mysql::checkConnection() {
+	auto code = mysql_errno(&connfd_);
+	if (code == CR_SERVER_GONE_ERROR || code == CR_SERVER_LOST) {
+		connection_lost_ = true;
+	}
+}
+
+Mysql::~Mysql() {
+	if (connection_active_) {
+		Metrics::add(Metrics::DB_CONNECTIONS_OPEN, -1);
+	}
+	mysql_close(&connfd_);
+}
+
+MysqlCursor::MysqlCursor(
+	Mysql *mysql,
+	MYSQL_RES *result,
+	const std::string &req,
+	const std::source_location &location,
+	const std::chrono::steady_clock::time_point start
+	) :
+	mysql_{ mysql },
+	result_{ result },
+	req_{ req },
+	location_{ location },
+	start_{ start } {
+	row_.columns_ = mysql_num_fields(result_);
+}
+
+MysqlCursor::MysqlCursor(MysqlCursor &&other) noexcept :
+	mysql_{ other.mysql_ },
+	result_{ other.result_ },
+	row_{ other.row_ },
+	rows_{ other.rows_ },
+	req_{ std::move(other.req_) },
+	location_{ other.location_ },
+	start_{ other.start_ } {
+	other.result_ = nullptr;
+}
+
+MysqlCursor::~MysqlCursor() {
+	finish();
+}
+
+bool MysqlCursor::next() {
 	if (result_ == nullptr) {
-		return fields_;
-	}
-	while (auto row = mysql_fetch_row(result_)) {
-		std::vector<std::string> row_array;
-		for (unsigned i = 0; i < mysql_num_fields(result_); ++i) {
-			if (row[i] == nullptr) {
-				row_array.emplace_back(std::string{});
-			}
-			else {
-				row_array.emplace_back(row[i]);
-			}
+		return false;
+	}
+	row_.row_ = mysql_fetch_row(result_);
+	if (row_.row_ == nullptr) {
+		if (mysql_errno(&mysql_->connfd_) != 0) {
+			mysql_->error_ = mysql_error(&mysql_->connfd_);
+			mysql_->checkConnection();
 		}
-		fields_.push_back(std::move(row_array));
+		finish();
+		if (!mysql_->error_.empty()) {
+			throw std::runtime_error{ "MySQL error: " + mysql_->error_ };
+		}
+		return false;
+	}
+	row_.lengths_ = mysql_fetch_lengths(result_);
+	++rows_;
+	return true;
+}
+
+void MysqlCursor::finish() {
+	if (result_ == nullptr) {
+		return;
 	}
+	// mysql_free_result() reads and discards the rest of an unbuffered result
+	mysql_free_result(result_);
+	result_ = nullptr;
+	row_.row_ = nullptr;
+	mysql_->account(req_, location_, start_, rows_);
+}
 
-	return fields_;
+const MysqlRow &MysqlCursor::row() const {
+	return row_;
 }
 
-Mysql::~Mysql() {
-	mysql_close(&connfd_);
+unsigned long long MysqlCursor::rowsFetched() const {
+	return rows_;
+}
+
+size_t MysqlCursor::columnIndex(const std::string &name) const {
+	if (result_ == nullptr) {
+		return std::string::npos;
+	}
+	auto fields = mysql_fetch_fields(result_);
+	for (unsigned i = 0; i < row_.columns_; ++i) {
+		if (name == fields[i].name) {
+			return i;
+		}
+	}
+	return std::string::npos;
+}
+
+size_t MysqlRow::size() const {
+	return columns_;
+}
+
+bool MysqlRow::isNull(const size_t column) const {
+	if (row_ == nullptr || column >= columns_) {
+		throw std::out_of_range{ "MySQL row column " + std::to_string(column) + " is out of range" };
+	}
+	return row_[column] == nullptr;
+}
+
+std::string_view MysqlRow::operator[](const size_t column) const {
+	if (isNull(column)) {
+		return std::string_view{};
+	}
+	return std::string_view{ row_[column], lengths_[column] };
+}
+
+std::string MysqlRow::getString(const size_t column) const {
+	return std::string{ (*this)[column] };
+}
+
+namespace {
+	template<typename T>
+	T parseNumber(const std::string_view cell, const size_t column) {
+		T value{};
+		auto [ptr, ec] = std::from_chars(cell.data(), cell.data() + cell.size(), value);
+		if (ec != std::errc{} || ptr != cell.data() + cell.size()) {
+			throw std::runtime_error{
+				"MySQL row column " + std::to_string(column) + " is not a number: " + std::string{ cell }
+			};
+		}
+		return value;
+	}
+}
+
+long long MysqlRow::getInt(const size_t column) const {
+	return parseNumber<long long>((*this)[column], column);
+}
+
+unsigned long long MysqlRow::getUInt(const size_t column) const {
+	return parseNumber<unsigned long long>((*this)[column], column);
+}
+
+double MysqlRow::getDouble(const size_t column) const {
+	return parseNumber<double>((*this)[column], column);
 }
@@ -1,13 +1,68 @@
 #pragma once
 
+#include "logger.h"
+#include "metrics.h"
+
+#include <chrono>
 #include <string>
-#include <vector>
-#include <list>
+#include <string_view>
+#include <memory>
+#include <source_location>
 
 extern "C" {
 	#include <mysql.h>
+	#include <errmsg.h>
 }
 
+class Mysql;
+
+// Read-only view of the current cursor row. Cells are valid until the next fetch
+class MysqlRow {
+public:
+	size_t size() const;
+	bool isNull(size_t column) const;
+	std::string_view operator[](size_t column) const;
+	std::string getString(size_t column) const;
+	long long getInt(size_t column) const;
+	unsigned long long getUInt(size_t column) const;
+	double getDouble(size_t column) const;
+
+private:
+	friend class MysqlCursor;
+
+	MYSQL_ROW row_{ nullptr };
+	unsigned long *lengths_{ nullptr };
+	unsigned columns_{ 0 };
+};
+
+// Forward-only unbuffered result (mysql_use_result). No other statement can be
+// executed on the same connection until the cursor is exhausted or destroyed
+class MysqlCursor {
+public:
+	MysqlCursor(MysqlCursor &&other) noexcept;
+	MysqlCursor(const MysqlCursor &) = delete;
+	MysqlCursor &operator=(const MysqlCursor &) = delete;
+	~MysqlCursor();
+
+	bool next(); // fetch next row, false when there are no more rows
+	const MysqlRow &row() const;
+	unsigned long long rowsFetched() const;
+	size_t columnIndex(const std::string &name) const; // npos if the result has no such column
+
+private:
+	friend class Mysql;
+	MysqlCursor(Mysql *mysql, MYSQL_RES *result, const std::string &req, const std::source_location &location, std::chrono::steady_clock::time_point start);
+	void finish();
+
+	Mysql *mysql_;
+	MYSQL_RES *result_;
+	MysqlRow row_;
+	unsigned long long rows_{ 0 };
+	std::string req_;
+	std::source_location location_;
+	std::chrono::steady_clock::time_point start_;
+};
+
 class Mysql {
 public:
 	Mysql();
@@ -15,17 +70,40 @@ public:
 		const std::string &dbname,
 		const std::string &dbhost,
 		const std::string &dbuser,
-		const std::string &dbpassword);
-	bool query(const std::string &req);
+		const std::string &dbpassword,
+		unsigned short port = 0); // 0 for the default port
+	void setEndpoint(Metrics::Histogram histogram); // latency of every statement is observed for the endpoint too
+	bool query(const std::string &req, const std::source_location &location = std::source_location::current());
+	MysqlCursor select(const std::string &req, const std::source_location &location = std::source_location::current());
 	const std::string &getError() const;
-	std::list<std::vector<std::string>> &fetchAll();
+	unsigned long long insertId(); // LAST_INSERT_ID() of the last statement, also set by LAST_INSERT_ID(expr)
+	unsigned long long affectedRows(); // rows changed by the last statement
+	std::string escape(const std::string &value); // for use inside quotes
+	bool isOpen() const; // false if never opened or connection to server is lost
+
+	// enables per-query timing, statements slower than threshold are written to the log
+	static void setSlowQueryLog(const std::string &filename, double thresholdMs);
+	static void printSlowQuerySummary(std::ostream &os, size_t n);
 
 	~Mysql();
 
 private:
+	friend class MysqlCursor;
+	void account(
+		const std::string &req,
+		const std::source_location &location,
+		std::chrono::steady_clock::time_point start,
+		unsigned long long rows);
+
+	void checkConnection();
+	void reset(); // closes the descriptor of a failed open()
+
 	bool connection_active_{ false };
+	bool connection_lost_{ false };
 	MYSQL connfd_;
-	MYSQL_RES *result_;
 	std::string error_;
-	std::list<std::vector<std::string>> fields_;
+	Metrics::Histogram endpoint_{ Metrics::DB_PRIMARY_SECONDS };
+
+	static std::unique_ptr<Logger> slowLog_;
+	static double slowThresholdMs_;
 };
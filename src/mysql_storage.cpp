@@ -0,0 +1,1028 @@
+#include "mysql_storage.h"
+#include "project_lib.h"
+
+#include <algorithm>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+extern "C" {
+	#include <unistd.h>
+}
+
+namespace {
+	// newest messages before the key, the caller puts them in chronological order
+	// logins and channel names are stored with the message, a shard has no users and channels
+	const char *HISTORY_PAGE =
+		"SELECT `messages`.`id`, `messages`.`sender_login` AS `sender`, `messages`.`receiver_login` AS `receiver`, `messages`.`text`, "
+			"UNIX_TIMESTAMP(`messages`.`sent`) AS `sent`, `messages`.`channel_name` AS `channel`, `messages`.`sender` AS `sender_id` "
+		"FROM `messages` ";
+
+	// columns of Storage::StoredMessage
+	const char *STORED_MESSAGE =
+		"SELECT `id`, `sender`, `receiver`, COALESCE(`channel_id`, 0), `text`, UNIX_TIMESTAMP(`sent`) FROM `messages` ";
+
+	// the retention policy removes messages without unread deliveries on their shard,
+	// copies go away with the deliveries they are kept for
+	const char *READ_MESSAGE =
+		"NOT `messages`.`is_copy` AND NOT EXISTS (SELECT 1 FROM `unread_messages` WHERE `unread_messages`.`message_id` = `messages`.`id`) ";
+
+	// no cursor means the newest page
+	std::string historyKey(const unsigned long long before_id) {
+		return before_id == 0 ? std::string{} : "AND `messages`.`id` < " + std::to_string(before_id) + ' ';
+	}
+
+	std::string trim(const std::string &value) {
+		auto first = value.find_first_not_of(" \t");
+		if (first == std::string::npos) {
+			return {};
+		}
+		return value.substr(first, value.find_last_not_of(" \t") - first + 1);
+	}
+
+	// rows of several shards are merged before they are visited
+	struct OwnedHistoryEntry {
+		unsigned long long id;
+		std::string sender;
+		std::string receiver;
+		std::string text;
+		double sent;
+		std::string channel;
+		unsigned sender_id;
+	};
+
+	struct OwnedMessage {
+		unsigned long long id;
+		unsigned sender_id;
+		bool is_private;
+		unsigned receiver_id;
+		unsigned long long channel_id;
+		std::string text;
+		double sent;
+	};
+
+	std::string idList(const auto &ids) {
+		std::stringstream ss;
+		for (auto it = ids.begin(); it != ids.end(); ++it) {
+			ss << (it == ids.begin() ? "" : ", ") << *it;
+		}
+		return ss.str();
+	}
+
+	// rows selected by STORED_MESSAGE, read from the primary or a shard itself
+	void collectMessages(Mysql &mysql, const std::string &sql, std::vector<OwnedMessage> &messages) {
+		auto cursor = mysql.select(sql);
+		while (cursor.next()) {
+			const auto &row = cursor.row();
+			messages.push_back(OwnedMessage{
+				row.getUInt(0),
+				static_cast<unsigned>(row.getUInt(1)),
+				!row.isNull(2),
+				row.isNull(2) ? 0 : static_cast<unsigned>(row.getUInt(2)),
+				row.getUInt(3),
+				row.getString(4),
+				row.isNull(5) ? 0.0 : row.getDouble(5)
+			});
+		}
+	}
+
+	// the first messages of several shards in id order
+	void visitMessages(std::vector<OwnedMessage> &messages, const unsigned limit, const std::function<void(const Storage::StoredMessage &)> &callback) {
+		std::sort(messages.begin(), messages.end(), [](const auto &a, const auto &b) { return a.id < b.id; });
+		if (messages.size() > limit) {
+			messages.resize(limit);
+		}
+		for (const auto &message: messages) {
+			callback(Storage::StoredMessage{ message.id, message.sender_id, message.is_private, message.receiver_id, message.channel_id, message.text, message.sent });
+		}
+	}
+
+	// broadcast or channel messages
+	std::string channelFilter(const Storage::Conversation &conversation) {
+		return (conversation.channel_id == 0 ? std::string{ "`channel_id` IS NULL" } : "`channel_id` = " + std::to_string(conversation.channel_id)) +
+			" AND `receiver` IS NULL ";
+	}
+}
+
+MysqlStorage::MysqlStorage(const ConfigFile &config) :
+	dbname_{ config["DBName"] },
+	dbuser_{ config["DBUser"] },
+	dbpassword_{ config["DBPassword"] } {
+	try {
+		for (const auto &item: Chat::split(config.get("DBReplicas", ""), ",")) {
+			auto entry = trim(item);
+			if (entry.empty()) {
+				continue;
+			}
+			if (replicas_.size() == Metrics::MAX_DB_REPLICAS) {
+				throw std::invalid_argument{ "more than " + std::to_string(Metrics::MAX_DB_REPLICAS) + " replicas" };
+			}
+			Replica replica{ entry, 0, static_cast<Metrics::Histogram>(Metrics::DB_REPLICA_SECONDS + replicas_.size()), nullptr, {}, {} };
+			auto colon = entry.rfind(':');
+			if (colon != std::string::npos) {
+				size_t end;
+				auto port = std::stoul(entry.substr(colon + 1), &end);
+				if (end != entry.size() - colon - 1 || port == 0 || port > UINT16_MAX) {
+					throw std::invalid_argument{ entry };
+				}
+				replica.host = entry.substr(0, colon);
+				replica.port = static_cast<unsigned short>(port);
+			}
+			replicas_.push_back(std::move(replica));
+		}
+		maxLag_ = std::chrono::seconds{ std::stoul(config.get("DBReplicaMaxLag", std::to_string(DEFAULT_REPLICA_MAX_LAG))) };
+	}
+	catch (const std::logic_error &e) {
+		throw std::runtime_error{ std::string{ "Invalid database replica settings (" } + e.what() + ')' };
+	}
+	unsigned long port;
+	try {
+		port = std::stoul(config.get("DBPort", "0"));
+	}
+	catch (const std::logic_error &e) {
+		throw std::runtime_error{ "Invalid DBPort: " + config["DBPort"] };
+	}
+	if (port > UINT16_MAX) {
+		throw std::runtime_error{ "Invalid DBPort: " + config["DBPort"] };
+	}
+	if (config.contains("DBShards")) {
+		try {
+			shardMap_ = std::make_unique<ShardMap>(config["DBShards"]);
+		}
+		catch (const std::invalid_argument &e) {
+			throw std::runtime_error{ std::string{ "Invalid DBShards (" } + e.what() + ')' };
+		}
+		shards_.resize(shardMap_->size());
+	}
+	// client processes spread over the replicas
+	replicaIndex_ = replicas_.empty() ? 0 : getpid() % replicas_.size();
+	mysql_.open(dbname_, config["DBHost"], dbuser_, dbpassword_, static_cast<unsigned short>(port));
+}
+
+void MysqlStorage::observeWrite() {
+	written_ = std::chrono::steady_clock::now();
+}
+
+MysqlCursor MysqlStorage::select(Mysql &mysql, const std::string &req, const std::source_location &location) {
+	if (auto replica = &mysql == &mysql_ ? this->replica() : nullptr; replica != nullptr) {
+		try {
+			auto cursor = replica->select(req, location);
+			Metrics::add(Metrics::DB_READS_REPLICA);
+			return cursor;
+		}
+		catch (const std::runtime_error &e) {
+			// the primary answers, the replica is checked again later
+			replicas_[replicaIndex_].checked = {};
+			replicas_[replicaIndex_].retry = std::chrono::steady_clock::now() + REPLICA_CHECK_INTERVAL;
+		}
+	}
+	Metrics::add(Metrics::DB_READS_PRIMARY);
+	return mysql.select(req, location);
+}
+
+Mysql *MysqlStorage::replica() {
+	auto now = std::chrono::steady_clock::now();
+	// a replica may miss own writes until it is at most maxLag_ behind, the lag is reported in whole seconds
+	if (replicas_.empty() || transactionDepth_ != 0 || now - written_ < maxLag_ + std::chrono::seconds{ 1 }) {
+		return nullptr;
+	}
+	for (size_t i = 0; i < replicas_.size(); ++i) {
+		auto index = (replicaIndex_ + i) % replicas_.size();
+		if (isFresh(replicas_[index], now)) {
+			// reads of the process stay on one replica so they do not go back in time
+			replicaIndex_ = index;
+			return replicas_[index].connection.get();
+		}
+	}
+	return nullptr;
+}
+
+bool MysqlStorage::isFresh(Replica &replica, const std::chrono::steady_clock::time_point now) {
+	if (now < replica.retry) {
+		return false;
+	}
+	if (replica.connection != nullptr && replica.connection->isOpen() && now - replica.checked < REPLICA_CHECK_INTERVAL) {
+		return true;
+	}
+	replica.checked = {};
+	replica.retry = now + REPLICA_CHECK_INTERVAL;
+	try {
+		if (replica.connection == nullptr || !replica.connection->isOpen()) {
+			replica.connection.reset();
+			auto connection = std::make_unique<Mysql>();
+			connection->setEndpoint(replica.histogram);
+			connection->open(dbname_, replica.host, dbuser_, dbpassword_, replica.port);
+			replica.connection = std::move(connection);
+		}
+		auto cursor = replica.connection->select("SHOW REPLICA STATUS");
+		if (!cursor.next()) {
+			return false; // not a replica
+		}
+		auto column = cursor.columnIndex("Seconds_Behind_Source");
+		if (column == std::string::npos) {
+			column = cursor.columnIndex("Seconds_Behind_Master");
+		}
+		// NULL while replication is stopped
+		if (column == std::string::npos || cursor.row().isNull(column) || cursor.row().getUInt(column) > static_cast<unsigned long long>(maxLag_.count())) {
+			return false;
+		}
+	}
+	catch (const std::runtime_error &e) {
+		return false;
+	}
+	replica.checked = now;
+	replica.retry = {};
+	return true;
+}
+
+bool MysqlStorage::isConnected() const {
+	for (const auto &shard: shards_) {
+		if (shard != nullptr && !shard->isOpen()) {
+			return false;
+		}
+	}
+	return mysql_.isOpen();
+}
+
+void MysqlStorage::beginTransaction() {
+	++transactionDepth_;
+}
+
+void MysqlStorage::commitTransaction() {
+	if (transactionDepth_ == 0) {
+		return;
+	}
+	if (--transactionDepth_ != 0) {
+		return;
+	}
+	auto connections = std::move(transaction_);
+	transaction_.clear();
+	// shards commit one after another and the primary last, the ones after a failed commit are rolled back
+	std::stable_partition(connections.begin(), connections.end(), [this](const Mysql *mysql) { return mysql != &mysql_; });
+	std::string error;
+	for (auto mysql: connections) {
+		if (!error.empty()) {
+			mysql->query("ROLLBACK");
+		}
+		else if (!mysql->query("COMMIT")) {
+			error = mysql->getError();
+		}
+	}
+	recordPosition_ = 0;
+	shardPositions_.clear();
+	finishTransaction(error.empty());
+	if (!error.empty()) {
+		throw std::runtime_error{ "MySQL error: " + error };
+	}
+}
+
+void MysqlStorage::rollbackTransaction() {
+	if (transactionDepth_ == 0) {
+		return;
+	}
+	transactionDepth_ = 0;
+	for (auto mysql: transaction_) {
+		mysql->query("ROLLBACK");
+	}
+	transaction_.clear();
+	recordPosition_ = 0;
+	shardPositions_.clear();
+	finishTransaction(false);
+}
+
+void MysqlStorage::execute(Mysql &mysql, const std::string &req, const std::source_location &location) {
+	written_ = std::chrono::steady_clock::now();
+	if (transactionDepth_ != 0 && std::find(transaction_.begin(), transaction_.end(), &mysql) == transaction_.end()) {
+		if (!mysql.query("START TRANSACTION", location)) {
+			throw std::runtime_error{ "MySQL error: " + mysql.getError() };
+		}
+		transaction_.push_back(&mysql);
+	}
+	if (!mysql.query(req, location)) {
+		throw std::runtime_error{ "MySQL error: " + mysql.getError() };
+	}
+}
+
+size_t MysqlStorage::shards() const {
+	return shardMap_ == nullptr ? 1 : shardMap_->size();
+}
+
+Mysql &MysqlStorage::shard(const size_t shard) {
+	if (shardMap_ == nullptr) {
+		return mysql_;
+	}
+	auto &connection = shards_.at(shard);
+	if (connection == nullptr) {
+		const auto &endpoint = (*shardMap_)[shard];
+		auto mysql = std::make_unique<Mysql>();
+		mysql->open(endpoint.dbname, endpoint.host, dbuser_, dbpassword_, endpoint.port);
+		connection = std::move(mysql);
+	}
+	return *connection;
+}
+
+size_t MysqlStorage::shardOf(const unsigned long long key) const {
+	return shardMap_ == nullptr ? 0 : shardMap_->shardOf(key);
+}
+
+std::map<std::string, unsigned> MysqlStorage::userIds(const std::vector<std::string> &logins) {
+	std::map<std::string, unsigned> ids;
+	if (logins.empty()) {
+		return ids;
+	}
+	std::stringstream ss;
+	ss << "SELECT `id`, `login` FROM `users` WHERE `login` IN (";
+	for (size_t i = 0; i < logins.size(); ++i) {
+		ss << (i == 0 ? "'" : ", '") << mysql_.escape(logins[i]) << '\'';
+	}
+	ss << ')';
+	// the primary has every user signed up a moment ago
+	auto cursor = mysql_.select(ss.str());
+	while (cursor.next()) {
+		ids.emplace(cursor.row().getString(1), static_cast<unsigned>(cursor.row().getUInt(0)));
+	}
+	return ids;
+}
+
+unsigned long long MysqlStorage::channelId(const std::string &name) {
+	auto cursor = mysql_.select("SELECT `id` FROM `channels` WHERE `name` = '" + mysql_.escape(name) + "'");
+	if (!cursor.next()) {
+		return 0;
+	}
+	return cursor.row().getUInt(0);
+}
+
+void MysqlStorage::forEachUser(const std::function<void(const User &)> &callback) {
+	forEachUserRow("ORDER BY `id`", callback);
+}
+
+void MysqlStorage::forEachUserById(const std::vector<unsigned> &ids, const std::function<void(const User &)> &callback) {
+	if (ids.empty()) {
+		return;
+	}
+	forEachUserRow("WHERE `id` IN (" + idList(ids) + ')', callback);
+}
+
+void MysqlStorage::forEachUserByLogin(const std::vector<std::string> &logins, const std::function<void(const User &)> &callback) {
+	if (logins.empty()) {
+		return;
+	}
+	std::stringstream ss;
+	ss << "WHERE `login` IN (";
+	for (size_t i = 0; i < logins.size(); ++i) {
+		ss << (i == 0 ? "'" : ", '") << mysql_.escape(logins[i]) << '\'';
+	}
+	ss << ')';
+	forEachUserRow(ss.str(), callback);
+}
+
+void MysqlStorage::forEachUserRow(const std::string &condition, const std::function<void(const User &)> &callback) {
+	auto cursor = select(mysql_, "SELECT `id`, `login`, `password_hash`, `name` FROM `users` " + condition);
+	while (cursor.next()) {
+		const auto &row = cursor.row();
+		callback(User{ static_cast<unsigned>(row.getUInt(0)), row[1], row[2], row[3] });
+	}
+}
+
+void MysqlStorage::saveUser(const unsigned id, const std::string &login, const std::string &password_hash, const std::string &name) {
+	std::stringstream ss;
+	ss << "INSERT INTO `users` "
+		"(`id`, `login`, `password_hash`, `name`)"
+		"VALUES"
+		"(" << id << ", '" << mysql_.escape(login) << "', '" << mysql_.escape(password_hash) << "', '" << mysql_.escape(name) << "');";
+	execute(mysql_, ss.str());
+}
+
+void MysqlStorage::removeUser(const std::string &login) {
+	beginTransaction();
+	try {
+		// the primary removes messages of the user by foreign keys, shards have none
+		if (auto ids = userIds({ login }); shardMap_ != nullptr && !ids.empty()) {
+			auto id = std::to_string(ids.begin()->second);
+			for (size_t i = 0; i < shards(); ++i) {
+				auto &mysql = shard(i);
+				execute(mysql, "DELETE FROM `unread_messages` WHERE `user_id` = " + id);
+				execute(mysql, "DELETE FROM `delivery_cursors` WHERE `user_id` = " + id);
+				execute(mysql, "DELETE FROM `messages` WHERE `sender` = " + id);
+				execute(mysql, "DELETE FROM `messages` WHERE `receiver` = " + id);
+			}
+		}
+		execute(mysql_, "DELETE FROM `users` WHERE `login` = '" + mysql_.escape(login) + "'");
+		commitTransaction();
+	}
+	catch (const std::runtime_error &e) {
+		rollbackTransaction();
+		throw;
+	}
+}
+
+void MysqlStorage::saveSessions(const std::vector<Session> &sessions) {
+	beginTransaction();
+	try {
+		execute(mysql_, "DELETE FROM `active_sessions` WHERE `node` = " + std::to_string(node_));
+		if (!sessions.empty()) {
+			std::stringstream ss;
+			// a user may be online on two nodes for a moment, the newer snapshot shows it
+			ss << "REPLACE INTO `active_sessions` (`user_id`, `ip`, `pid`, `port`, `session_start`, `last_activity`, `node`) VALUES ";
+			for (size_t i = 0; i < sessions.size(); ++i) {
+				const auto &session = sessions[i];
+				ss << (i == 0 ? "(" : ", (")
+					<< session.user_id << ", "
+					"INET_ATON('" << mysql_.escape(session.ip) << "'), "
+					<< session.pid << ", "
+					<< session.port << ", "
+					"FROM_UNIXTIME(" << session.started << "), "
+					"FROM_UNIXTIME(" << session.active << "), "
+					<< node_ << ')';
+			}
+			execute(mysql_, ss.str());
+			execute(mysql_, "UPDATE `users` JOIN `active_sessions` ON `active_sessions`.`user_id` = `users`.`id` "
+				"SET `users`.`last_login` = `active_sessions`.`session_start` WHERE `active_sessions`.`node` = " + std::to_string(node_));
+		}
+		commitTransaction();
+	}
+	catch (const std::runtime_error &e) {
+		rollbackTransaction();
+		throw;
+	}
+}
+
+unsigned long long MysqlStorage::reserveIds(const IdAllocator::Sequence sequence, const unsigned long long count) {
+	std::string name{ IdAllocator::name(sequence) };
+	auto size = std::to_string(count);
+	// the block starts at a multiple of its size
+	auto update = "UPDATE `id_sequences` SET `next_id` = LAST_INSERT_ID((`next_id` + " + size + " - 1) DIV " + size + " * " + size + ") + " + size +
+		" WHERE `name` = '" + name + '\'';
+	written_ = std::chrono::steady_clock::now();
+	// a statement of its own unless the primary is in a transaction, so the sequence row is not locked while a message is written to a shard
+	if (!mysql_.query(update)) {
+		throw std::runtime_error{ "MySQL error: " + mysql_.getError() };
+	}
+	if (mysql_.affectedRows() == 0) {
+		// databases created before the sequence, ids were the maximum plus one. Messages may be on every shard,
+		// channel 0 stands for the broadcast
+		unsigned long long next{ sequence == IdAllocator::CHANNELS ? 1ULL : 0 };
+		for (size_t i = 0; i < (sequence == IdAllocator::MESSAGES ? shards() : 1); ++i) {
+			auto cursor = (sequence == IdAllocator::MESSAGES ? shard(i) : mysql_).select("SELECT MAX(`id`) + 1 FROM `" + name + '`');
+			if (cursor.next() && !cursor.row().isNull(0)) {
+				next = std::max(next, cursor.row().getUInt(0));
+			}
+		}
+		if (!mysql_.query("INSERT IGNORE INTO `id_sequences` (`name`, `next_id`) VALUES ('" + name + "', " + std::to_string(next) + ')') ||
+			!mysql_.query(update)) {
+			throw std::runtime_error{ "MySQL error: " + mysql_.getError() };
+		}
+	}
+	if (mysql_.affectedRows() == 0) {
+		throw std::runtime_error{ "MySQL error: no id sequence " + name };
+	}
+	return mysql_.insertId();
+}
+
+bool MysqlStorage::sequenceInTransaction() const {
+	return std::find(transaction_.begin(), transaction_.end(), &mysql_) != transaction_.end();
+}
+
+unsigned long long MysqlStorage::sequenceNext(const IdAllocator::Sequence sequence) {
+	auto cursor = mysql_.select("SELECT `next_id` FROM `id_sequences` WHERE `name` = '" + std::string{ IdAllocator::name(sequence) } + '\'');
+	return cursor.next() ? cursor.row().getUInt(0) : 0;
+}
+
+void MysqlStorage::saveHorizon(const IdAllocator::Sequence sequence, const unsigned long long horizon) {
+	std::stringstream ss;
+	ss << "REPLACE INTO `id_horizons` (`node`, `name`, `next_id`, `updated`) VALUES (" << node_ << ", '" << IdAllocator::name(sequence) << "', "
+		<< horizon << ", NOW())";
+	execute(mysql_, ss.str());
+}
+
+std::optional<unsigned long long> MysqlStorage::savedHorizon(const IdAllocator::Sequence sequence, const std::chrono::seconds age) {
+	std::stringstream ss;
+	ss << "SELECT MIN(`next_id`) FROM `id_horizons` WHERE `name` = '" << IdAllocator::name(sequence) << "' AND `node` <> " << node_
+		<< " AND `updated` >= NOW() - INTERVAL " << age.count() << " SECOND";
+	auto cursor = mysql_.select(ss.str());
+	if (!cursor.next() || cursor.row().isNull(0)) {
+		return std::nullopt;
+	}
+	return cursor.row().getUInt(0);
+}
+
+void MysqlStorage::savePrivateMessage(
+	const std::string &sender,
+	const std::string &receiver,
+	const std::string &text,
+	const bool read,
+	const time_t sent
+	) {
+	auto ids = userIds({ sender, receiver });
+	if (ids.count(sender) == 0 || ids.count(receiver) == 0) {
+		throw std::runtime_error{ "MySQL error: unknown user " + (ids.count(sender) == 0 ? sender : receiver) };
+	}
+	auto index = shardOf(ids[receiver]);
+	if (hasRecord(index)) {
+		return;
+	}
+	auto &mysql = shard(index);
+	std::stringstream ss;
+	beginTransaction();
+	try {
+		auto new_id = nextId(IdAllocator::MESSAGES);
+		ss << "INSERT INTO `messages` (`id`, `type`, `sender`, `sender_login`, `receiver`, `receiver_login`, `text`, `sent`) VALUES (" <<
+			new_id << ", 'PRIVATE', " <<
+			ids[sender] << ", '" << mysql.escape(sender) << "', " <<
+			ids[receiver] << ", '" << mysql.escape(receiver) << "', "
+			"'" << mysql.escape(text) << "', FROM_UNIXTIME(" << sent << "))";
+		execute(mysql, ss.str());
+		if (!read) {
+			addUnread(mysql, new_id, { ids[receiver] });
+		}
+		commitTransaction();
+	}
+	catch (const std::runtime_error &e) {
+		rollbackTransaction();
+		throw;
+	}
+}
+
+void MysqlStorage::saveBroadcastMessage(
+	const std::string &sender,
+	const std::string &text,
+	const std::vector<std::string> &recipients,
+	const time_t sent
+	) {
+	// there is no channel with empty name, so channel_id is NULL
+	saveChannelMessage(sender, std::string{}, text, recipients, sent);
+}
+
+void MysqlStorage::saveChannelMessage(
+	const std::string &sender,
+	const std::string &channel,
+	const std::string &text,
+	const std::vector<std::string> &recipients,
+	const time_t sent
+	) {
+	auto logins = recipients;
+	logins.push_back(sender);
+	auto ids = userIds(logins);
+	if (ids.count(sender) == 0) {
+		throw std::runtime_error{ "MySQL error: unknown user " + sender };
+	}
+	auto channel_id = channel.empty() ? 0 : channelId(channel);
+	if (!channel.empty() && channel_id == 0) {
+		throw std::runtime_error{ "MySQL error: unknown channel " + channel };
+	}
+	// the message is kept on the shard of the channel, every other shard with recipients gets a copy
+	// for their unread messages. Recipients removed meanwhile are skipped
+	auto home = shardOf(channel_id == 0 ? ShardMap::BROADCAST_KEY : channel_id);
+	std::map<size_t, std::vector<unsigned>> recipientsByShard{ { home, {} } };
+	for (const auto &recipient: recipients) {
+		if (auto it = ids.find(recipient); it != ids.end()) {
+			recipientsByShard[shardOf(it->second)].push_back(it->second);
+		}
+	}
+	std::erase_if(recipientsByShard, [this](const auto &entry) { return hasRecord(entry.first); });
+	if (recipientsByShard.empty()) {
+		return;
+	}
+	std::stringstream ss;
+	beginTransaction();
+	try {
+		auto new_id = nextId(IdAllocator::MESSAGES);
+		for (const auto &[index, user_ids]: recipientsByShard) {
+			auto &mysql = shard(index);
+			ss.str(std::string{});
+			ss << "INSERT INTO `messages` (`id`, `type`, `sender`, `sender_login`, `channel_id`, `channel_name`, `text`, `sent`, `is_copy`) VALUES (" <<
+				new_id << ", 'BROADCAST', " <<
+				ids[sender] << ", '" << mysql.escape(sender) << "', " <<
+				(channel_id == 0 ? std::string{ "NULL, NULL" } : std::to_string(channel_id) + ", '" + mysql.escape(channel) + '\'') << ", "
+				"'" << mysql.escape(text) << "', FROM_UNIXTIME(" << sent << "), " << (index == home ? "FALSE" : "TRUE") << ')';
+			execute(mysql, ss.str());
+			addUnread(mysql, new_id, user_ids);
+		}
+		commitTransaction();
+	}
+	catch (const std::runtime_error &e) {
+		rollbackTransaction();
+		throw;
+	}
+}
+
+void MysqlStorage::addUnread(Mysql &mysql, const unsigned long long message_id, const std::vector<unsigned> &user_ids) {
+	if (user_ids.empty()) {
+		return;
+	}
+	// two statements for all recipients: cursor rows are locked and advanced, then the message takes their seq
+	std::stringstream ss;
+	ss << "INSERT INTO `delivery_cursors` (`user_id`, `last_seq`, `acked_seq`) VALUES ";
+	for (size_t i = 0; i < user_ids.size(); ++i) {
+		ss << (i == 0 ? "(" : ", (") << user_ids[i] << ", 1, 0)";
+	}
+	ss << " ON DUPLICATE KEY UPDATE `last_seq` = `last_seq` + 1";
+	execute(mysql, ss.str());
+	ss.str(std::string{});
+	ss << "INSERT INTO `unread_messages` (`message_id`, `user_id`, `seq`) "
+		"SELECT " << message_id << ", `user_id`, `last_seq` FROM `delivery_cursors` "
+		"WHERE `user_id` IN (" << idList(user_ids) << ')';
+	execute(mysql, ss.str());
+}
+
+void MysqlStorage::forEachHistory(Mysql &mysql, const std::string &sql, const std::function<void(const HistoryEntry &)> &callback) {
+	auto cursor = select(mysql, sql);
+	while (cursor.next()) {
+		const auto &row = cursor.row();
+		callback(HistoryEntry{ row.getUInt(0), row[1], row[2], row[3], row.isNull(4) ? 0.0 : row.getDouble(4), row[5], static_cast<unsigned>(row.getUInt(6)) });
+	}
+}
+
+void MysqlStorage::forEachMessageById(const std::vector<unsigned long long> &ids, const std::function<void(const HistoryEntry &)> &callback) {
+	if (ids.empty()) {
+		return;
+	}
+	std::stringstream ss;
+	ss << HISTORY_PAGE << "WHERE `messages`.`id` IN (" << idList(ids) << ") AND NOT `messages`.`is_copy` ORDER BY `messages`.`id` DESC";
+	if (shards() == 1) {
+		forEachHistory(shard(0), ss.str(), callback);
+		return;
+	}
+	// the id does not tell the shard, every shard is asked
+	std::vector<OwnedHistoryEntry> entries;
+	for (size_t i = 0; i < shards(); ++i) {
+		forEachHistory(shard(i), ss.str(), [&](const HistoryEntry &entry) {
+			entries.push_back(OwnedHistoryEntry{
+				entry.id, std::string{ entry.sender }, std::string{ entry.receiver }, std::string{ entry.text }, entry.sent, std::string{ entry.channel }, entry.sender_id
+			});
+		});
+	}
+	std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) { return a.id > b.id; });
+	for (const auto &entry: entries) {
+		callback(HistoryEntry{ entry.id, entry.sender, entry.receiver, entry.text, entry.sent, entry.channel, entry.sender_id });
+	}
+}
+
+void MysqlStorage::forEachMessage(
+	const unsigned long long from_id,
+	const unsigned long long before_id,
+	const unsigned limit,
+	const std::function<void(const StoredMessage &)> &callback
+	) {
+	std::stringstream ss;
+	ss << STORED_MESSAGE << "WHERE `id` >= " << from_id;
+	if (before_id != 0) {
+		ss << " AND `id` < " << before_id;
+	}
+	ss << " AND NOT `is_copy` ORDER BY `id` LIMIT " << limit;
+	// every shard gives its first messages, the first of all of them make the batch
+	std::vector<OwnedMessage> messages;
+	for (size_t i = 0; i < shards(); ++i) {
+		collectMessages(shard(i), ss.str(), messages);
+	}
+	visitMessages(messages, limit, callback);
+}
+
+void MysqlStorage::forEachConversation(const Conversation *after, const unsigned limit, const std::function<void(const Conversation &)> &callback) {
+	std::vector<Conversation> conversations;
+	if (after == nullptr) {
+		conversations.push_back(Conversation{ false, 0, 0, 0 });
+	}
+	std::stringstream ss;
+	if ((after == nullptr || !after->is_private) && conversations.size() < limit) {
+		ss << "SELECT `id` FROM `channels` WHERE `id` > " << (after == nullptr ? 0 : after->channel_id) << " ORDER BY `id` LIMIT " << limit - conversations.size();
+		auto channels = mysql_.select(ss.str());
+		while (channels.next()) {
+			conversations.push_back(Conversation{ false, 0, 0, channels.row().getUInt(0) });
+		}
+	}
+	if (conversations.size() < limit) {
+		// a keyset range of the pair index. A direction is kept on the shard of its receiver, the other one may be elsewhere:
+		// every shard gives its first pairs, the first of all of them make the chunk
+		ss.str(std::string{});
+		ss << "SELECT DISTINCT LEAST(`receiver`, `sender`), GREATEST(`receiver`, `sender`) FROM `messages` WHERE `receiver` IS NOT NULL ";
+		if (after != nullptr && after->is_private) {
+			ss << "AND LEAST(`receiver`, `sender`) >= " << after->user_id <<
+				" AND (LEAST(`receiver`, `sender`) > " << after->user_id << " OR GREATEST(`receiver`, `sender`) > " << after->peer_id << ") ";
+		}
+		ss << "ORDER BY 1, 2 LIMIT " << limit - conversations.size();
+		std::set<std::pair<unsigned, unsigned>> pairs;
+		for (size_t i = 0; i < shards(); ++i) {
+			auto cursor = shard(i).select(ss.str());
+			while (cursor.next()) {
+				pairs.emplace(static_cast<unsigned>(cursor.row().getUInt(0)), static_cast<unsigned>(cursor.row().getUInt(1)));
+			}
+		}
+		for (auto it = pairs.begin(); it != pairs.end() && conversations.size() < limit; ++it) {
+			conversations.push_back(Conversation{ true, it->first, it->second, 0 });
+		}
+	}
+	for (const auto &conversation: conversations) {
+		callback(conversation);
+	}
+}
+
+unsigned long long MysqlStorage::conversationFloor(const Conversation &conversation, const unsigned keep) {
+	if (keep == 0) {
+		return 0;
+	}
+	std::stringstream ss;
+	if (!conversation.is_private) {
+		ss << "SELECT `id` FROM `messages` WHERE " << channelFilter(conversation) << "ORDER BY `id` DESC LIMIT 1 OFFSET " << keep - 1;
+		auto cursor = shard(shardOf(conversation.channel_id == 0 ? ShardMap::BROADCAST_KEY : conversation.channel_id)).select(ss.str());
+		return cursor.next() ? cursor.row().getUInt(0) : 0;
+	}
+	// every direction gives its newest messages, the floor is among them
+	std::vector<unsigned long long> ids;
+	auto direction = [&](const unsigned sender, const unsigned receiver) {
+		ss.str(std::string{});
+		ss << "SELECT `id` FROM `messages` WHERE `receiver` = " << receiver << " AND `sender` = " << sender << " ORDER BY `id` DESC LIMIT " << keep;
+		auto cursor = shard(shardOf(receiver)).select(ss.str());
+		while (cursor.next()) {
+			ids.push_back(cursor.row().getUInt(0));
+		}
+	};
+	direction(conversation.user_id, conversation.peer_id);
+	if (conversation.user_id != conversation.peer_id) {
+		direction(conversation.peer_id, conversation.user_id);
+	}
+	if (ids.size() < keep) {
+		return 0;
+	}
+	std::nth_element(ids.begin(), ids.begin() + (keep - 1), ids.end(), std::greater<>{});
+	return ids[keep - 1];
+}
+
+void MysqlStorage::forEachReadMessage(
+	const Conversation *conversation,
+	const unsigned long long from_id,
+	const unsigned long long before_id,
+	const unsigned limit,
+	const std::function<void(const StoredMessage &)> &callback
+	) {
+	std::stringstream range;
+	range << "`id` >= " << from_id << ' ' << historyKey(before_id) << "AND " << READ_MESSAGE << "ORDER BY `id` LIMIT " << limit;
+	// the read state is taken from the primary and the shards, replicas may lag behind it
+	std::vector<OwnedMessage> messages;
+	if (conversation == nullptr) {
+		for (size_t i = 0; i < shards(); ++i) {
+			collectMessages(shard(i), STORED_MESSAGE + std::string{ "WHERE " } + range.str(), messages);
+		}
+	}
+	else if (!conversation->is_private) {
+		auto home = shardOf(conversation->channel_id == 0 ? ShardMap::BROADCAST_KEY : conversation->channel_id);
+		collectMessages(shard(home), STORED_MESSAGE + std::string{ "WHERE " } + channelFilter(*conversation) + "AND " + range.str(), messages);
+	}
+	else {
+		// a direction is kept on the shard of its receiver
+		auto direction = [&](const unsigned sender, const unsigned receiver) {
+			std::stringstream ss;
+			ss << STORED_MESSAGE << "WHERE `receiver` = " << receiver << " AND `sender` = " << sender << " AND " << range.str();
+			collectMessages(shard(shardOf(receiver)), ss.str(), messages);
+		};
+		direction(conversation->user_id, conversation->peer_id);
+		if (conversation->user_id != conversation->peer_id) {
+			direction(conversation->peer_id, conversation->user_id);
+		}
+	}
+	visitMessages(messages, limit, callback);
+}
+
+size_t MysqlStorage::removeMessages(const std::vector<unsigned long long> &ids) {
+	if (ids.empty()) {
+		return 0;
+	}
+	// one short statement per shard, the id does not tell the shard
+	std::string sql{ "DELETE FROM `messages` WHERE `id` IN (" + idList(ids) + ") AND " + READ_MESSAGE };
+	size_t removed{ 0 };
+	for (size_t i = 0; i < shards(); ++i) {
+		auto &mysql = shard(i);
+		execute(mysql, sql);
+		removed += mysql.affectedRows();
+	}
+	return removed;
+}
+
+void MysqlStorage::forEachBroadcastHistory(const unsigned long long before_id, const unsigned limit, const std::function<void(const HistoryEntry &)> &callback) {
+	std::stringstream ss;
+	ss << "SELECT * FROM (" << HISTORY_PAGE <<
+			"WHERE `messages`.`channel_id` IS NULL AND `messages`.`receiver` IS NULL " << historyKey(before_id) <<
+			"ORDER BY `messages`.`id` DESC LIMIT " << limit <<
+		") AS `page` ORDER BY `id`";
+	forEachHistory(shard(shardOf(ShardMap::BROADCAST_KEY)), ss.str(), callback);
+}
+
+void MysqlStorage::forEachChannelHistory(const std::string &channel, const unsigned long long before_id, const unsigned limit, const std::function<void(const HistoryEntry &)> &callback) {
+	auto channel_id = channelId(channel);
+	if (channel_id == 0) {
+		return;
+	}
+	std::stringstream ss;
+	ss << "SELECT * FROM (" << HISTORY_PAGE <<
+			"WHERE `messages`.`channel_id` = " << channel_id << " AND `messages`.`receiver` IS NULL " << historyKey(before_id) <<
+			"ORDER BY `messages`.`id` DESC LIMIT " << limit <<
+		") AS `page` ORDER BY `id`";
+	forEachHistory(shard(shardOf(channel_id)), ss.str(), callback);
+}
+
+void MysqlStorage::forEachPrivateHistory(
+	const std::string &login,
+	const std::string &peer,
+	const unsigned long long before_id,
+	const unsigned limit,
+	const std::function<void(const HistoryEntry &)> &callback
+	) {
+	auto ids = userIds({ login, peer });
+	if (ids.count(login) == 0 || ids.count(peer) == 0) {
+		return;
+	}
+	// every direction is a separate range of the conversation index, each limited to the page
+	auto direction = [&](const unsigned sender, const unsigned receiver) {
+		std::stringstream ss;
+		ss << '(' << HISTORY_PAGE <<
+			"WHERE `messages`.`receiver` = " << receiver << " AND `messages`.`sender` = " << sender << ' ' << historyKey(before_id) <<
+			"ORDER BY `messages`.`id` DESC LIMIT " << limit << ')';
+		return ss.str();
+	};
+	// a direction is kept on the shard of its receiver
+	auto toPeer = shardOf(ids[peer]);
+	auto toLogin = shardOf(ids[login]);
+	if (login == peer || toPeer == toLogin) {
+		std::stringstream ss;
+		// a conversation with oneself is read once
+		ss << "SELECT * FROM (" << direction(ids[login], ids[peer]);
+		if (login != peer) {
+			ss << " UNION ALL " << direction(ids[peer], ids[login]);
+		}
+		ss << " ORDER BY `id` DESC LIMIT " << limit << ") AS `page` ORDER BY `id`";
+		forEachHistory(shard(toPeer), ss.str(), callback);
+		return;
+	}
+	std::vector<OwnedHistoryEntry> entries;
+	auto collect = [&](const HistoryEntry &entry) {
+		entries.push_back(OwnedHistoryEntry{
+			entry.id, std::string{ entry.sender }, std::string{ entry.receiver }, std::string{ entry.text }, entry.sent, std::string{ entry.channel }, entry.sender_id
+		});
+	};
+	forEachHistory(shard(toPeer), direction(ids[login], ids[peer]), collect);
+	forEachHistory(shard(toLogin), direction(ids[peer], ids[login]), collect);
+	std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) { return a.id > b.id; });
+	if (entries.size() > limit) {
+		entries.resize(limit);
+	}
+	for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+		callback(HistoryEntry{ it->id, it->sender, it->receiver, it->text, it->sent, it->channel, it->sender_id });
+	}
+}
+
+void MysqlStorage::forEachChannelMember(const std::function<void(const ChannelMember &)> &callback) {
+	auto cursor = select(mysql_,
+		"SELECT "
+			"`channels`.`id`, "
+			"`channels`.`name`, "
+			"`users`.`id`, "
+			"`users`.`login` "
+		"FROM "
+			"`channel_members` "
+		"JOIN "
+			"`channels` ON `channels`.`id` = `channel_members`.`channel_id` "
+		"JOIN "
+			"`users` ON `users`.`id` = `channel_members`.`user_id` "
+		"ORDER BY `channels`.`id`, `users`.`id`"
+	);
+	while (cursor.next()) {
+		const auto &row = cursor.row();
+		callback(ChannelMember{ row.getUInt(0), row[1], static_cast<unsigned>(row.getUInt(2)), row[3] });
+	}
+}
+
+void MysqlStorage::joinChannel(const std::string &channel, const unsigned user_id) {
+	std::stringstream ss;
+	beginTransaction();
+	try {
+		if (channelId(channel) == 0) {
+			// the id is reserved by a statement of its own, a concurrent join of the same new channel wastes it
+			ss << "INSERT IGNORE INTO `channels` (`id`, `name`) VALUES (" << reserveIds(IdAllocator::CHANNELS, 1) << ", '" << mysql_.escape(channel) << "')";
+			execute(mysql_, ss.str());
+			ss.str(std::string{});
+		}
+		ss << "INSERT IGNORE INTO `channel_members` (`channel_id`, `user_id`) "
+			"SELECT `id`, " << user_id << " FROM `channels` WHERE `name` = '" << mysql_.escape(channel) << "'";
+		execute(mysql_, ss.str());
+		commitTransaction();
+	}
+	catch (const std::runtime_error &e) {
+		rollbackTransaction();
+		throw;
+	}
+}
+
+void MysqlStorage::leaveChannel(const std::string &channel, const unsigned user_id) {
+	std::stringstream ss;
+	ss << "DELETE `channel_members` FROM `channel_members` "
+		"JOIN `channels` ON `channels`.`id` = `channel_members`.`channel_id` "
+		"WHERE `channel_members`.`user_id` = " << user_id << " AND `channels`.`name` = '" << mysql_.escape(channel) << "'";
+	execute(mysql_, ss.str());
+}
+
+unsigned long long MysqlStorage::journalPosition() {
+	auto cursor = mysql_.select("SELECT `position` FROM `journal_checkpoint` WHERE `id` = 1");
+	if (!cursor.next()) {
+		return 0;
+	}
+	return cursor.row().getUInt(0);
+}
+
+void MysqlStorage::setJournalPosition(const unsigned long long position) {
+	auto req = "REPLACE INTO `journal_checkpoint` (`id`, `position`) VALUES (1, " + std::to_string(position) + ")";
+	// shards are committed before the primary, each of them keeps the position of the records it has
+	for (auto mysql: std::vector<Mysql *>{ transaction_ }) {
+		if (mysql != &mysql_) {
+			execute(*mysql, req);
+		}
+	}
+	execute(mysql_, req);
+}
+
+bool MysqlStorage::hasRecord(const size_t shard) {
+	if (shardMap_ == nullptr || recordPosition_ == 0) {
+		// the primary alone is committed at once
+		return false;
+	}
+	auto it = shardPositions_.find(shard);
+	if (it == shardPositions_.end()) {
+		auto cursor = this->shard(shard).select("SELECT `position` FROM `journal_checkpoint` WHERE `id` = 1");
+		it = shardPositions_.emplace(shard, cursor.next() ? cursor.row().getUInt(0) : 0).first;
+	}
+	return recordPosition_ <= it->second;
+}
+
+void MysqlStorage::forEachUnread(const unsigned user_id, const unsigned long long after_seq, const unsigned limit, const std::function<void(const Delivery &)> &callback) {
+	std::stringstream ss;
+	ss <<
+		"SELECT "
+			"`messages`.`receiver`, "
+			"`messages`.`text`, "
+			"`unread_messages`.`user_id`, "
+			"`messages`.`id`, "
+			"`messages`.`sender_login`, "
+			"UNIX_TIMESTAMP(`messages`.`sent`), "
+			"`messages`.`channel_name`, "
+			"`unread_messages`.`seq`, "
+			"`messages`.`sender` "
+		"FROM "
+			"`unread_messages` "
+		"JOIN "
+			"`messages` ON `messages`.`id` = `unread_messages`.`message_id` "
+		"WHERE "
+			"`unread_messages`.`user_id` = " << user_id << " AND "
+			"`unread_messages`.`seq` > " << after_seq << " "
+		"ORDER BY `unread_messages`.`seq` LIMIT " << limit;
+	auto cursor = select(shard(shardOf(user_id)), ss.str());
+	while (cursor.next()) {
+		const auto &row = cursor.row();
+		callback(Delivery{
+			row.getUInt(3),
+			static_cast<unsigned>(row.getUInt(2)),
+			!row.isNull(0),
+			row[4],
+			row[1],
+			row.isNull(5) ? 0.0 : row.getDouble(5),
+			row[6],
+			row.getUInt(7),
+			static_cast<unsigned>(row.getUInt(8))
+		});
+	}
+}
+
+void MysqlStorage::acknowledge(const unsigned user_id, const unsigned long long seq) {
+	auto &mysql = shard(shardOf(user_id));
+	beginTransaction();
+	try {
+		// the cursor is moved forward only, acknowledgements may come out of order after reconnect
+		std::stringstream ss;
+		ss << "UPDATE `delivery_cursors` SET `acked_seq` = GREATEST(`acked_seq`, " << seq << ") WHERE `user_id` = " << user_id;
+		execute(mysql, ss.str());
+		// copies are kept while they are unread on the shard
+		std::vector<unsigned long long> copies;
+		if (shards() > 1) {
+			ss.str(std::string{});
+			ss << "SELECT `unread_messages`.`message_id` FROM `unread_messages` "
+				"JOIN `messages` ON `messages`.`id` = `unread_messages`.`message_id` "
+				"WHERE `unread_messages`.`user_id` = " << user_id << " AND `unread_messages`.`seq` <= " << seq << " AND `messages`.`is_copy`";
+			auto cursor = mysql.select(ss.str());
+			while (cursor.next()) {
+				copies.push_back(cursor.row().getUInt(0));
+			}
+		}
+		ss.str(std::string{});
+		ss << "DELETE FROM `unread_messages` WHERE `user_id` = " << user_id << " AND `seq` <= " << seq;
+		execute(mysql, ss.str());
+		if (!copies.empty()) {
+			ss.str(std::string{});
+			ss << "DELETE FROM `messages` WHERE `id` IN (" << idList(copies) << ") AND `is_copy` "
+				"AND NOT EXISTS (SELECT 1 FROM `unread_messages` WHERE `unread_messages`.`message_id` = `messages`.`id`)";
+			execute(mysql, ss.str());
+		}
+		commitTransaction();
+	}
+	catch (const std::runtime_error &e) {
+		rollbackTransaction();
+		throw;
+	}
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "storage.h"
+#include "mysql.h"
+#include "shard_map.h"
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <vector>
+
+// Storage on a MySQL server, see sql/schema.sql. Read-only statements outside transactions
+// may go to the replicas of the DBReplicas option, writes always go to the primary.
+// With the DBShards option messages and delivery state are kept on the shard databases
+// (sql/shard_schema.sql) placed by ShardMap, the primary keeps users, channels, sessions and ids
+class MysqlStorage final : public Storage {
+public:
+	MysqlStorage(const ConfigFile &config);
+
+	bool isConnected() const override;
+	void observeWrite() override;
+
+	void beginTransaction() override;
+	void commitTransaction() override;
+	void rollbackTransaction() override;
+
+	void forEachUser(const std::function<void(const User &)> &callback) override;
+	void forEachUserById(const std::vector<unsigned> &ids, const std::function<void(const User &)> &callback) override;
+	void forEachUserByLogin(const std::vector<std::string> &logins, const std::function<void(const User &)> &callback) override;
+	void saveUser(unsigned id, const std::string &login, const std::string &password_hash, const std::string &name) override;
+	void removeUser(const std::string &login) override;
+
+	void saveSessions(const std::vector<Session> &sessions) override;
+
+	void savePrivateMessage(const std::string &sender, const std::string &receiver, const std::string &text, bool read, time_t sent) override;
+	void saveBroadcastMessage(const std::string &sender, const std::string &text, const std::vector<std::string> &recipients, time_t sent) override;
+	void saveChannelMessage(const std::string &sender, const std::string &channel, const std::string &text, const std::vector<std::string> &recipients, time_t sent) override;
+
+	void forEachBroadcastHistory(unsigned long long before_id, unsigned limit, const std::function<void(const HistoryEntry &)> &callback) override;
+	void forEachChannelHistory(const std::string &channel, unsigned long long before_id, unsigned limit, const std::function<void(const HistoryEntry &)> &callback) override;
+	void forEachPrivateHistory(const std::string &login, const std::string &peer, unsigned long long before_id, unsigned limit, const std::function<void(const HistoryEntry &)> &callback) override;
+	void forEachMessageById(const std::vector<unsigned long long> &ids, const std::function<void(const HistoryEntry &)> &callback) override;
+	void forEachMessage(unsigned long long from_id, unsigned long long before_id, unsigned limit, const std::function<void(const StoredMessage &)> &callback) override;
+
+	void forEachConversation(const Conversation *after, unsigned limit, const std::function<void(const Conversation &)> &callback) override;
+	unsigned long long conversationFloor(const Conversation &conversation, unsigned keep) override;
+	void forEachReadMessage(const Conversation *conversation, unsigned long long from_id, unsigned long long before_id, unsigned limit, const std::function<void(const StoredMessage &)> &callback) override;
+	size_t removeMessages(const std::vector<unsigned long long> &ids) override;
+
+	void forEachChannelMember(const std::function<void(const ChannelMember &)> &callback) override;
+	void joinChannel(const std::string &channel, unsigned user_id) override;
+	void leaveChannel(const std::string &channel, unsigned user_id) override;
+
+	unsigned long long journalPosition() override;
+	void setJournalPosition(unsigned long long position) override;
+	void setRecordPosition(unsigned long long position) override { recordPosition_ = position; }
+
+	void forEachUnread(unsigned user_id, unsigned long long after_seq, unsigned limit, const std::function<void(const Delivery &)> &callback) override;
+	void acknowledge(unsigned user_id, unsigned long long seq) override;
+
+protected:
+	unsigned long long reserveIds(IdAllocator::Sequence sequence, unsigned long long count) override;
+	bool sequenceInTransaction() const override;
+	unsigned long long sequenceNext(IdAllocator::Sequence sequence) override;
+	void saveHorizon(IdAllocator::Sequence sequence, unsigned long long horizon) override;
+	std::optional<unsigned long long> savedHorizon(IdAllocator::Sequence sequence, std::chrono::seconds age) override;
+
+private:
+	static constexpr unsigned DEFAULT_REPLICA_MAX_LAG{ 2 }; // seconds
+	static constexpr std::chrono::seconds REPLICA_CHECK_INTERVAL{ 5 }; // lag is measured again, a failed replica is retried
+
+	struct Replica {
+		std::string host;
+		unsigned short port;
+		Metrics::Histogram histogram;
+		std::unique_ptr<Mysql> connection; // opened on first use
+		std::chrono::steady_clock::time_point checked; // lag was within the limit at this time
+		std::chrono::steady_clock::time_point retry; // not used before this time after a failure
+	};
+
+	// read-only statement, on a replica if the connection is the primary and a replica is fresh enough
+	MysqlCursor select(Mysql &mysql, const std::string &req, const std::source_location &location = std::source_location::current());
+	Mysql *replica(); // replica fresh enough for the next read, nullptr if the primary must answer
+	bool isFresh(Replica &replica, std::chrono::steady_clock::time_point now);
+	// the connection joins the current transaction with its first statement
+	void execute(Mysql &mysql, const std::string &req, const std::source_location &location = std::source_location::current());
+	size_t shards() const; // 1 without DBShards
+	Mysql &shard(size_t shard); // the primary without DBShards, shards are connected on first use
+	size_t shardOf(unsigned long long key) const; // shard of a user or channel id
+	std::map<std::string, unsigned> userIds(const std::vector<std::string> &logins); // unknown logins are skipped
+	unsigned long long channelId(const std::string &name); // 0 if there is no such channel
+	void forEachUserRow(const std::string &condition, const std::function<void(const User &)> &callback); // rows of the users table matching the condition
+	void forEachHistory(Mysql &mysql, const std::string &sql, const std::function<void(const HistoryEntry &)> &callback); // rows of a history page
+	void addUnread(Mysql &mysql, unsigned long long message_id, const std::vector<unsigned> &user_ids); // numbered by delivery cursors
+	bool hasRecord(size_t shard); // the journal record being applied has been committed to the shard
+
+	Mysql mysql_;
+	unsigned transactionDepth_{ 0 };
+	std::vector<Mysql *> transaction_; // connections with an open transaction
+	unsigned long long recordPosition_{ 0 }; // of the journal record being applied, 0 outside the journal
+	std::map<size_t, unsigned long long> shardPositions_; // journal checkpoints of the shards read in the transaction
+	std::unique_ptr<ShardMap> shardMap_;
+	std::vector<std::unique_ptr<Mysql>> shards_; // by shard number, nullptr until used
+	std::string dbname_;
+	std::string dbuser_;
+	std::string dbpassword_;
+	std::vector<Replica> replicas_;
+	size_t replicaIndex_{ 0 }; // replica of this process, others are used while it lags behind
+	std::chrono::seconds maxLag_{ DEFAULT_REPLICA_MAX_LAG };
+	std::chrono::steady_clock::time_point written_; // reads stay on the primary until replicas have caught up
+};
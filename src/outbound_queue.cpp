@@ -0,0 +1,249 @@
+#include "outbound_queue.h"
+#include "metrics.h"
+#include "wire_format.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <stdexcept>
+
+extern "C" {
+	#include <poll.h>
+	#include <sys/socket.h>
+	#include <sys/uio.h>
+}
+
+namespace {
+	const size_t MAX_BATCH{ 64 }; // frames sent with one system call
+	const size_t PARTS{ 3 }; // data, trailer and padding of a frame
+	const std::string SEPARATOR{ " | " }; // between texts of coalesced messages
+}
+
+OutboundQueue::Policy OutboundQueue::policy(const std::string &name) {
+	if (name == "drop_oldest") {
+		return DROP_OLDEST;
+	}
+	if (name == "coalesce") {
+		return COALESCE;
+	}
+	if (name == "disconnect") {
+		return DISCONNECT;
+	}
+	throw std::invalid_argument{ "Unknown slow consumer policy: " + name };
+}
+
+OutboundQueue::OutboundQueue(
+	const int fd,
+	const size_t frameLength,
+	const size_t highWatermark,
+	const size_t lowWatermark,
+	const Policy policy,
+	const std::chrono::milliseconds stallTimeout
+	) :
+	fd_{ fd },
+	frameLength_{ frameLength },
+	highWatermark_{ highWatermark },
+	lowWatermark_{ std::min(lowWatermark, highWatermark) },
+	policy_{ policy },
+	stallTimeout_{ stallTimeout },
+	padding_(frameLength, '\0') {
+	if (highWatermark_ == 0) {
+		throw std::invalid_argument{ "High watermark of the outbound queue must be positive" };
+	}
+}
+
+OutboundQueue::~OutboundQueue() {
+	Metrics::add(Metrics::OUTBOUND_QUEUE_DEPTH, -static_cast<int64_t>(reportedDepth_));
+}
+
+void OutboundQueue::pushMessage(const std::string_view frame, const unsigned long long seq) {
+	char trailer[Chat::MAX_VARINT];
+	push(frame, std::string(trailer, Chat::encodeVarint(seq, trailer)), true);
+	if (frames_.size() >= highWatermark_ && !paused_) {
+		paused_ = true;
+		progress_ = std::chrono::steady_clock::now();
+	}
+}
+
+bool OutboundQueue::stalled() const {
+	return paused_ && std::chrono::steady_clock::now() - progress_ >= stallTimeout_;
+}
+
+bool OutboundQueue::relieve() {
+	if (policy_ == DISCONNECT) {
+		return false;
+	}
+	if (policy_ == COALESCE) {
+		coalesce();
+	}
+	if (frames_.size() >= highWatermark_) {
+		dropOldest();
+	}
+	paused_ = frames_.size() > lowWatermark_;
+	progress_ = std::chrono::steady_clock::now();
+	return true;
+}
+
+void OutboundQueue::pushResponse(const std::string_view frame) {
+	push(frame, std::string{}, false);
+}
+
+void OutboundQueue::push(std::string_view frame, std::string trailer, const bool message) {
+	// the trailer is never cut, zero byte after it terminates the frame
+	trailer = trailer.substr(0, frameLength_ - 1);
+	frame = frame.substr(0, frameLength_ - trailer.size() - (trailer.empty() ? 0 : 1));
+	size_t written{ 0 };
+	if (frames_.empty()) {
+		// nothing is waiting, so the frame is sent without copying it
+		Part part{ frame, trailer };
+		auto sent = send(&part, 1, 0);
+		written = sent > 0 ? sent : 0;
+		if (written == frameLength_) {
+			return;
+		}
+	}
+	frames_.push_back({ std::string{ frame }, std::move(trailer), message, written });
+	updateDepth();
+}
+
+ssize_t OutboundQueue::send(const Part *frames, const size_t count, size_t offset) const {
+	iovec iov[PARTS * MAX_BATCH];
+	size_t parts{ 0 };
+	for (size_t i = 0; i < count && i < MAX_BATCH; ++i) {
+		const auto &frame = frames[i];
+		size_t length = frame.data.size() + frame.trailer.size();
+		if (offset < frame.data.size()) {
+			iov[parts++] = { const_cast<char *>(frame.data.data() + offset), frame.data.size() - offset };
+			offset = frame.data.size();
+		}
+		if (offset < length) {
+			auto skip = offset - frame.data.size();
+			iov[parts++] = { const_cast<char *>(frame.trailer.data() + skip), frame.trailer.size() - skip };
+			offset = length;
+		}
+		if (offset < frameLength_) {
+			iov[parts++] = { const_cast<char *>(padding_.data()), frameLength_ - offset };
+		}
+		offset = 0;
+	}
+	msghdr message{};
+	message.msg_iov = iov;
+	message.msg_iovlen = parts;
+	while (true) {
+		// never blocks and does not raise SIGPIPE if the client has gone
+		auto sent = sendmsg(fd_, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent >= 0) {
+			return sent;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+bool OutboundQueue::flush(const int timeout) {
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds{ timeout };
+	Part batch[MAX_BATCH];
+	while (!frames_.empty()) {
+		size_t count = std::min(frames_.size(), MAX_BATCH);
+		for (size_t i = 0; i < count; ++i) {
+			batch[i] = { frames_[i].data, frames_[i].trailer };
+		}
+		auto sent = send(batch, count, frames_.front().written);
+		if (sent == -1) {
+			return false;
+		}
+		if (sent == 0) {
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			if (left <= 0) {
+				break;
+			}
+			pollfd writable{ fd_, POLLOUT, 0 };
+			poll(&writable, 1, left);
+			continue;
+		}
+		progress_ = std::chrono::steady_clock::now();
+		size_t bytes = sent;
+		while (bytes > 0) {
+			auto &frame = frames_.front();
+			auto rest = frameLength_ - frame.written;
+			if (bytes < rest) {
+				frame.written += bytes;
+				break;
+			}
+			bytes -= rest;
+			frames_.pop_front();
+		}
+	}
+	if (frames_.size() <= lowWatermark_) {
+		paused_ = false;
+	}
+	updateDepth();
+	return true;
+}
+
+void OutboundQueue::discardMessages() {
+	std::erase_if(frames_, [](const Frame &frame) {
+		return frame.message && !frame.started();
+	});
+	paused_ = false;
+	updateDepth();
+}
+
+void OutboundQueue::dropOldest() {
+	size_t dropped{ 0 };
+	for (auto it = frames_.begin(); it != frames_.end() && frames_.size() > lowWatermark_;) {
+		if (it->message && !it->started()) {
+			it = frames_.erase(it);
+			++dropped;
+		}
+		else {
+			++it;
+		}
+	}
+	Metrics::add(Metrics::OUTBOUND_DROPPED, dropped);
+	updateDepth();
+}
+
+void OutboundQueue::coalesce() {
+	// adjacent messages only, so the order of delivery stays the same
+	size_t merged{ 0 };
+	std::deque<Frame> frames;
+	std::string text;
+	std::string buffer(frameLength_, '\0');
+	for (auto &frame: frames_) {
+		if (!frames.empty()) {
+			auto &last = frames.back();
+			Chat::WireRecord first, second;
+			// messages of one sender to the same recipient or channel
+			if (last.message && frame.message && !last.started() && !frame.started() &&
+				Chat::decodeRecord(last.data, first) > 0 && Chat::decodeRecord(frame.data, second) > 0 &&
+				first.type == second.type && first.sender_id == second.sender_id && first.target == second.target) {
+				text.assign(first.text).append(SEPARATOR).append(second.text);
+				second.text = text;
+				auto size = Chat::encodeRecord(second, buffer.data(), frameLength_ - frame.trailer.size() - 1);
+				// merged only if the text is not cut
+				Chat::WireRecord check;
+				if (size > 0 && Chat::decodeRecord({ buffer.data(), size }, check) > 0 && check.text.size() == text.size()) {
+					last.data.assign(buffer, 0, size);
+					// acknowledgement of the merged frame covers both messages
+					last.trailer = std::move(frame.trailer);
+					++merged;
+					continue;
+				}
+			}
+		}
+		frames.push_back(std::move(frame));
+	}
+	frames_ = std::move(frames);
+	Metrics::add(Metrics::OUTBOUND_COALESCED, merged);
+	updateDepth();
+}
+
+void OutboundQueue::updateDepth() {
+	Metrics::add(Metrics::OUTBOUND_QUEUE_DEPTH, static_cast<int64_t>(frames_.size()) - static_cast<int64_t>(reportedDepth_));
+	reportedDepth_ = frames_.size();
+}
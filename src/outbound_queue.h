@@ -0,0 +1,90 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <string_view>
+
+extern "C" {
+	#include <sys/types.h>
+}
+
+// Frames waiting to be written to a client socket. Frames are kept without padding
+// and padded with zeros to the frame length on write. A chat message record is followed
+// by the varint seq of its recipient, so the record itself can be shared between recipients. The socket is never waited for:
+// what it does not accept stays queued until it is writable again.
+// Responses are always queued. Chat messages are read from the database only while there is room
+// below the high watermark, the queue pauses when it is reached and stays paused until it drains to
+// the low watermark. A paused queue the client takes nothing from for the stall timeout is handled
+// by the slow consumer policy
+class OutboundQueue final {
+public:
+	enum Policy {
+		DROP_OLDEST, // oldest queued messages are dropped down to the low watermark
+		COALESCE, // queued messages of the same sender are merged into one frame, the rest is dropped
+		DISCONNECT // client is disconnected
+	};
+
+	// drop_oldest, coalesce or disconnect, throws std::invalid_argument
+	static Policy policy(const std::string &name);
+
+	OutboundQueue(int fd, size_t frameLength, size_t highWatermark, size_t lowWatermark, Policy policy, std::chrono::milliseconds stallTimeout);
+	OutboundQueue(const OutboundQueue &) = delete;
+	OutboundQueue &operator=(const OutboundQueue &) = delete;
+	~OutboundQueue();
+
+	// queues a chat message frame with the delivery seq of the recipient, pauses at the high watermark
+	void pushMessage(std::string_view frame, unsigned long long seq);
+	void pushResponse(std::string_view frame);
+
+	// writes as much as the socket accepts, waiting up to timeout ms for the rest.
+	// Returns false if the socket is broken
+	bool flush(int timeout = 0);
+
+	// drops queued messages that are not written partially
+	void discardMessages();
+
+	bool empty() const { return frames_.empty(); }
+	size_t depth() const { return frames_.size(); }
+	bool paused() const { return paused_; }
+	size_t room() const { return frames_.size() < highWatermark_ ? highWatermark_ - frames_.size() : 0; } // messages until the high watermark
+	bool stalled() const; // paused and nothing has been written for the stall timeout
+	// applies the slow consumer policy to a stalled queue, false if the client has to be disconnected
+	bool relieve();
+
+private:
+	// frame as written to the socket: data, trailer, then zeros up to the frame length
+	struct Part {
+		std::string_view data;
+		std::string_view trailer;
+	};
+
+	struct Frame {
+		std::string data;
+		std::string trailer; // varint seq of a message, empty for responses
+		bool message;
+		size_t written{ 0 }; // bytes of the padded frame already sent
+
+		bool started() const { return written > 0; } // must be finished, can not be dropped or merged
+	};
+
+	// sends frames starting from offset in the first one, returns sent bytes, 0 if the socket is full, -1 on error
+	ssize_t send(const Part *frames, size_t count, size_t offset) const;
+	void push(std::string_view frame, std::string trailer, bool message);
+	void dropOldest();
+	void coalesce();
+	void updateDepth();
+
+	const int fd_;
+	const size_t frameLength_;
+	const size_t highWatermark_;
+	const size_t lowWatermark_;
+	const Policy policy_;
+	const std::chrono::milliseconds stallTimeout_;
+	const std::string padding_;
+	std::deque<Frame> frames_;
+	bool paused_{ false };
+	std::chrono::steady_clock::time_point progress_; // of the last write while paused
+	size_t reportedDepth_{ 0 };
+};
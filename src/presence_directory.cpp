@@ -0,0 +1,278 @@
+#include "presence_directory.h"
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <stdexcept>
+
+PresenceDirectory::PresenceDirectory(const size_t capacity, const unsigned node) :
+	capacity_{ capacity },
+	node_{ node } {
+	if (capacity_ == 0) {
+		throw std::invalid_argument{ "Presence directory must have at least one slot" };
+	}
+	// anonymous mapping is zero filled, so every slot is free
+	memory_ = std::make_unique<SharedMemory>(sizeof(Header) + capacity_ * sizeof(Slot));
+	header_ = memory_->as<Header>();
+	slots_ = reinterpret_cast<Slot *>(memory_->as<char>() + sizeof(Header));
+}
+
+PresenceDirectory::Slot *PresenceDirectory::slot(const unsigned user_id, const bool create) const {
+	uint64_t key{ static_cast<uint64_t>(user_id) + 1 };
+	auto found = locate(key);
+	if (found != nullptr || !create) {
+		return found;
+	}
+	// one new user at a time, so a user never gets two slots
+	uint32_t expected{ 0 };
+	while (!header_->inserting.compare_exchange_weak(expected, 1, std::memory_order_acquire)) {
+		expected = 0;
+	}
+	found = locate(key);
+	if (found == nullptr) {
+		found = claim(key);
+	}
+	header_->inserting.store(0, std::memory_order_release);
+	return found;
+}
+
+PresenceDirectory::Slot *PresenceDirectory::locate(const uint64_t key) const {
+	// user ids are dense, consecutive ones take consecutive slots. Slots are never given back,
+	// so a lookup ends at a never taken slot or after the longest probe sequence
+	auto probes = std::min<uint64_t>(header_->probes.load(), capacity_);
+	for (size_t i = 0, index = (key - 1) % capacity_; i < probes; ++i, index = (index + 1) % capacity_) {
+		auto current = slots_[index].key.load();
+		if (current == key) {
+			return &slots_[index];
+		}
+		if (current == 0) {
+			return nullptr;
+		}
+	}
+	return nullptr;
+}
+
+PresenceDirectory::Slot *PresenceDirectory::claim(const uint64_t key) const {
+	for (size_t i = 0, index = (key - 1) % capacity_; i < capacity_; ++i, index = (index + 1) % capacity_) {
+		auto &candidate = slots_[index];
+		if (candidate.key.load() != 0) {
+			if (candidate.pid.load(std::memory_order_relaxed) != 0) {
+				continue;
+			}
+			lock(candidate);
+			if (candidate.pid.load(std::memory_order_relaxed) != 0) {
+				candidate.seq.fetch_sub(1, std::memory_order_release);
+				continue;
+			}
+			// the version of the offline user is forgotten, a peer sends its sessions again after a reconnect
+			candidate.key.store(key, std::memory_order_relaxed);
+			write(candidate, Entry{ static_cast<unsigned>(key - 1), Version{ 0, 0 }, 0, 0, 0, 0, 0, 0 });
+		}
+		else {
+			candidate.key.store(key);
+		}
+		auto probes = header_->probes.load();
+		while (probes < i + 1 && !header_->probes.compare_exchange_weak(probes, i + 1)) {
+		}
+		return &candidate;
+	}
+	return nullptr;
+}
+
+PresenceDirectory::Slot *PresenceDirectory::acquire(const unsigned user_id, const bool create) {
+	uint64_t key{ static_cast<uint64_t>(user_id) + 1 };
+	while (auto found = slot(user_id, create)) {
+		lock(*found);
+		if (found->key.load(std::memory_order_relaxed) == key) {
+			return found;
+		}
+		// reused for another user meanwhile
+		found->seq.fetch_sub(1, std::memory_order_release);
+	}
+	return nullptr;
+}
+
+PresenceDirectory::Entry PresenceDirectory::load(const Slot &slot) {
+	return Entry{
+		static_cast<unsigned>(slot.key.load(std::memory_order_relaxed) - 1),
+		Version{ slot.clock.load(std::memory_order_relaxed), slot.versionNode.load(std::memory_order_relaxed) },
+		slot.node.load(std::memory_order_relaxed),
+		slot.pid.load(std::memory_order_relaxed),
+		slot.ip.load(std::memory_order_relaxed),
+		static_cast<unsigned short>(slot.port.load(std::memory_order_relaxed)),
+		slot.started.load(std::memory_order_relaxed),
+		slot.active.load(std::memory_order_relaxed)
+	};
+}
+
+PresenceDirectory::Entry PresenceDirectory::read(const Slot &slot) {
+	Entry entry;
+	uint32_t seq;
+	do {
+		while ((seq = slot.seq.load(std::memory_order_acquire)) & 1) {
+		}
+		entry = load(slot);
+		std::atomic_thread_fence(std::memory_order_acquire);
+	} while (slot.seq.load(std::memory_order_relaxed) != seq);
+	return entry;
+}
+
+void PresenceDirectory::lock(Slot &slot) {
+	auto seq = slot.seq.load(std::memory_order_relaxed);
+	while ((seq & 1) || !slot.seq.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire)) {
+		seq = slot.seq.load(std::memory_order_relaxed);
+	}
+}
+
+void PresenceDirectory::write(Slot &slot, const Entry &entry) {
+	slot.clock.store(entry.version.clock, std::memory_order_relaxed);
+	slot.versionNode.store(entry.version.node, std::memory_order_relaxed);
+	slot.node.store(entry.node, std::memory_order_relaxed);
+	slot.pid.store(entry.pid, std::memory_order_relaxed);
+	slot.ip.store(entry.ip, std::memory_order_relaxed);
+	slot.port.store(entry.port, std::memory_order_relaxed);
+	slot.started.store(entry.started, std::memory_order_relaxed);
+	slot.active.store(entry.active, std::memory_order_relaxed);
+	slot.seq.fetch_add(1, std::memory_order_release);
+}
+
+PresenceDirectory::Version PresenceDirectory::next() {
+	uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	auto clock = header_->clock.load();
+	while (!header_->clock.compare_exchange_weak(clock, std::max(clock + 1, now))) {
+	}
+	return Version{ std::max(clock + 1, now), node_ };
+}
+
+void PresenceDirectory::observe(const Version &version) {
+	auto clock = header_->clock.load();
+	while (clock < version.clock && !header_->clock.compare_exchange_weak(clock, version.clock)) {
+	}
+}
+
+std::optional<PresenceDirectory::Entry> PresenceDirectory::login(const unsigned user_id, const pid_t pid, const uint32_t ip, const unsigned short port) {
+	auto found = acquire(user_id, true);
+	if (found == nullptr) {
+		throw std::runtime_error{ "presence directory is full" };
+	}
+	auto entry = load(*found);
+	if (entry.online()) {
+		// unchanged
+		found->seq.fetch_sub(1, std::memory_order_release);
+		return std::nullopt;
+	}
+	auto now = static_cast<int64_t>(std::time(nullptr));
+	entry = Entry{ user_id, next(), node_, pid, ip, port, now, now };
+	write(*found, entry);
+	header_->changes.fetch_add(1);
+	return entry;
+}
+
+std::optional<PresenceDirectory::Entry> PresenceDirectory::logout(const unsigned user_id, const pid_t pid) {
+	auto found = acquire(user_id, false);
+	if (found == nullptr) {
+		return std::nullopt;
+	}
+	auto entry = load(*found);
+	if (entry.node != node_ || entry.pid != pid) {
+		found->seq.fetch_sub(1, std::memory_order_release);
+		return std::nullopt;
+	}
+	entry.version = next();
+	entry.pid = 0;
+	write(*found, entry);
+	header_->changes.fetch_add(1);
+	return entry;
+}
+
+std::vector<PresenceDirectory::Entry> PresenceDirectory::logout(const std::vector<pid_t> &pids) {
+	std::vector<Entry> changed;
+	for (size_t i = 0; i < capacity_; ++i) {
+		auto &candidate = slots_[i];
+		if (candidate.key.load(std::memory_order_relaxed) == 0 ||
+			candidate.node.load(std::memory_order_relaxed) != node_ ||
+			std::find(pids.begin(), pids.end(), candidate.pid.load(std::memory_order_relaxed)) == pids.end()) {
+			continue;
+		}
+		if (auto entry = logout(static_cast<unsigned>(candidate.key.load() - 1), candidate.pid.load())) {
+			changed.push_back(*entry);
+		}
+	}
+	return changed;
+}
+
+void PresenceDirectory::touch(const unsigned user_id) {
+	// only an online slot, which is never reused, is touched
+	if (auto found = slot(user_id, false); found != nullptr && found->pid.load(std::memory_order_relaxed) != 0) {
+		found->active.store(static_cast<int64_t>(std::time(nullptr)), std::memory_order_relaxed);
+		header_->changes.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+bool PresenceDirectory::apply(const Entry &entry) {
+	observe(entry.version);
+	auto found = acquire(entry.user_id, true);
+	if (found == nullptr) {
+		return false;
+	}
+	if (!(load(*found).version < entry.version)) {
+		found->seq.fetch_sub(1, std::memory_order_release);
+		return false;
+	}
+	write(*found, entry);
+	return true;
+}
+
+void PresenceDirectory::dropNode(const unsigned node) {
+	for (size_t i = 0; i < capacity_; ++i) {
+		auto &candidate = slots_[i];
+		if (candidate.key.load(std::memory_order_relaxed) == 0 || candidate.versionNode.load(std::memory_order_relaxed) != node) {
+			continue;
+		}
+		lock(candidate);
+		auto entry = load(candidate);
+		if (entry.version.node != node) {
+			candidate.seq.fetch_sub(1, std::memory_order_release);
+			continue;
+		}
+		// any version the node sends later replaces this one
+		entry.version = Version{ 0, 0 };
+		entry.pid = 0;
+		write(candidate, entry);
+	}
+}
+
+std::optional<PresenceDirectory::Entry> PresenceDirectory::find(const unsigned user_id) const {
+	auto found = slot(user_id, false);
+	if (found == nullptr) {
+		return std::nullopt;
+	}
+	auto entry = read(*found);
+	// the slot may have been reused for another user after the lookup
+	if (!entry.online() || entry.user_id != user_id) {
+		return std::nullopt;
+	}
+	return entry;
+}
+
+void PresenceDirectory::forEach(const std::function<void(const Entry &)> &callback) const {
+	for (size_t i = 0; i < capacity_; ++i) {
+		if (slots_[i].key.load(std::memory_order_relaxed) == 0 || slots_[i].pid.load(std::memory_order_relaxed) == 0) {
+			continue;
+		}
+		auto entry = read(slots_[i]);
+		if (entry.online()) {
+			callback(entry);
+		}
+	}
+}
+
+std::vector<PresenceDirectory::Entry> PresenceDirectory::changedHere() const {
+	std::vector<Entry> entries;
+	forEach([&](const Entry &entry) {
+		if (entry.version.node == node_) {
+			entries.push_back(entry);
+		}
+	});
+	return entries;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "shared_memory.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <vector>
+
+extern "C" {
+	#include <sys/types.h>
+}
+
+// Users logged in anywhere in the cluster: user id to the node and client process of the session.
+// Every node keeps the whole directory in shared memory, so a presence check is a lookup instead
+// of a query. Each change is stamped with a version of the node that made it, the newer version of
+// an entry wins, so changes from the peers may come in any order and more than once. An offline
+// entry keeps its version until its slot is taken by another user, so the directory holds up to
+// its capacity of online users however many users have logged in.
+// The database only gets a periodic snapshot of the sessions. Must be created before fork()
+class PresenceDirectory final {
+public:
+	struct Version {
+		uint64_t clock; // microseconds of wall time, moved past every version seen
+		uint32_t node; // node that made the change, breaks ties
+
+		bool operator<(const Version &other) const {
+			return clock < other.clock || (clock == other.clock && node < other.node);
+		}
+	};
+
+	struct Entry {
+		unsigned user_id;
+		Version version;
+		unsigned node; // node of the session
+		pid_t pid; // client process, 0 if the user is offline
+		uint32_t ip; // IPv4 address in network byte order
+		unsigned short port;
+		int64_t started; // unix time of the login
+		int64_t active; // unix time of the last message, known on the node of the session only
+
+		bool online() const { return pid != 0; }
+	};
+
+	PresenceDirectory(size_t capacity, unsigned node);
+	PresenceDirectory(const PresenceDirectory &) = delete;
+	PresenceDirectory &operator=(const PresenceDirectory &) = delete;
+
+	// sessions of this node, the changed entries are returned to be sent to the peers.
+	// Nothing is returned if the user is already online. Throws std::runtime_error if the directory is full
+	std::optional<Entry> login(unsigned user_id, pid_t pid, uint32_t ip, unsigned short port);
+	// ends the session of the process only, a newer session of the user stays
+	std::optional<Entry> logout(unsigned user_id, pid_t pid);
+	std::vector<Entry> logout(const std::vector<pid_t> &pids); // exited client processes
+	void touch(unsigned user_id); // last activity, not sent to the peers
+
+	// change made by a peer, false if a newer version is known
+	bool apply(const Entry &entry);
+	// forget the changes of a node that can not be reached, it sends them again when it is back
+	void dropNode(unsigned node);
+
+	std::optional<Entry> find(unsigned user_id) const; // online users only
+	void forEach(const std::function<void(const Entry &)> &callback) const; // online users
+	std::vector<Entry> changedHere() const; // online users whose last change was made by this node
+	uint64_t changes() const { return header_->changes.load(); } // grows with every change of the local sessions and activity
+
+private:
+	struct Header {
+		std::atomic<uint64_t> clock; // last version of this node
+		std::atomic<uint64_t> changes;
+		std::atomic<uint32_t> inserting; // 1 while a slot is given to a new user
+		std::atomic<uint64_t> probes; // longest probe sequence of a taken slot
+	};
+
+	// fields are written under the odd value of seq and read until seq stays the same
+	struct Slot {
+		std::atomic<uint64_t> key; // user id + 1, 0 if never taken. Changed under the lock when an offline slot is reused
+		std::atomic<uint32_t> seq;
+		std::atomic<uint64_t> clock;
+		std::atomic<uint32_t> versionNode;
+		std::atomic<uint32_t> node;
+		std::atomic<int32_t> pid;
+		std::atomic<uint32_t> ip;
+		std::atomic<uint32_t> port;
+		std::atomic<int64_t> started;
+		std::atomic<int64_t> active;
+	};
+
+	Slot *slot(unsigned user_id, bool create) const; // nullptr if not found or full
+	Slot *locate(uint64_t key) const; // without taking a slot
+	Slot *claim(uint64_t key) const; // a never taken or an offline slot, under the insertion lock
+	Slot *acquire(unsigned user_id, bool create); // locked slot of the user, nullptr if not found or full
+	static Entry load(const Slot &slot); // under the lock
+	static Entry read(const Slot &slot);
+	static void lock(Slot &slot);
+	static void write(Slot &slot, const Entry &entry); // unlocks
+	Version next(); // version of a local change
+	void observe(const Version &version);
+
+	const size_t capacity_;
+	const unsigned node_;
+	std::unique_ptr<SharedMemory> memory_;
+	Header *header_;
+	Slot *slots_;
+};
@@ -1,6 +1,5 @@
 #include "private_message.h"
 #include "chat_message.h"
-#include "chat_user.h"
 
 #include <memory>
 #include <iostream>
@@ -44,28 +43,17 @@ void PrivateMessage::save(const std::string &filename) const {
 	file.close();
 }
 
-void PrivateMessage::save(Mysql &mysql) const {
-	std::stringstream ss;
-	mysql.query("SELECT COALESCE(max(`id`), -1) FROM `messages`");
-	auto rows = mysql.fetchAll();
-	unsigned new_id = std::stoi(rows.front().at(0)) + 1;
-	ss << "INSERT INTO `messages` (`id`, `type`, `sender`, `receiver`, `text`) VALUES (" <<
-		new_id << ", 'PRIVATE', "
-		"(SELECT `id` FROM `users` WHERE `login` = '" << sender_ << "'), "
-		"(SELECT `id` FROM `users` WHERE `login` = '" << receiver_ << "')"
-		", '" << text_ << "')";
-	mysql.query(ss.str());
-	if (read_) {
-		return;
-	}
-
-	ss.str(std::string{});
-	ss << "INSERT INTO `unread_messages` (`message_id`, `user_id`)"
-		"VALUES (" << new_id << ", "
-		"(SELECT `id` FROM `users` WHERE `login` = '" << receiver_ << "'))";
-	mysql.query(ss.str());
+void PrivateMessage::save(Storage &storage) const {
+	storage.savePrivateMessage(sender_, receiver_, text_, read_, sent_);
 }
 
-std::string PrivateMessage::createTransferString() const {
-	return std::string{ "PRIVATE\n" } + sender_ + "\n" + text_ + "\n";
+void PrivateMessage::save(MessageJournal &journal) const {
+	MessageJournal::Record record;
+	record.type = MessageJournal::PRIVATE;
+	record.sent = sent_;
+	record.sender = sender_;
+	record.receiver = receiver_;
+	record.text = text_;
+	record.read = read_;
+	journal.append(record);
 }
@@ -17,13 +17,13 @@ public:
 	bool isRead() const override;
 
 	// save message to database
-	void save(Mysql &mysql) const override;
+	void save(Storage &storage) const override;
+
+	// append message to the write-ahead journal
+	void save(MessageJournal &journal) const override;
 	
 	// save message to file
 	void save(const std::string&) const override;
-	
-	// pack string with message information for transferring it through a network
-	std::string createTransferString() const override;
 
 private:
 	bool read_{ false };
@@ -17,3 +17,24 @@ std::vector<std::string> Chat::split(const std::string &src, const std::string &
 	return result;
 }
 
+// CRC-32 (IEEE 802.3), pass previous result as crc to continue calculation
+uint32_t Chat::crc32(const void *data, const size_t length, uint32_t crc) {
+	static const auto table = [] {
+		std::vector<uint32_t> t(256);
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c{ i };
+			for (int k = 0; k < 8; ++k) {
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			}
+			t[i] = c;
+		}
+		return t;
+	}();
+
+	auto bytes = static_cast<const uint8_t *>(data);
+	crc = ~crc;
+	for (size_t i = 0; i < length; ++i) {
+		crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
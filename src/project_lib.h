@@ -1,8 +1,11 @@
 #pragma once
 #include <vector>
 #include <string>
+#include <cstdint>
+#include <cstddef>
 
 namespace Chat {
 	std::vector<std::string> split(const std::string &, const std::string &);
+	uint32_t crc32(const void *data, size_t length, uint32_t crc = 0);
 }
 
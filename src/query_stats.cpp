@@ -0,0 +1,162 @@
+#include "query_stats.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <functional>
+
+std::unique_ptr<SharedMemory> QueryStats::memory_;
+QueryStats::Entry *QueryStats::entries_{ nullptr };
+
+void QueryStats::init() {
+	if (entries_ != nullptr) {
+		return;
+	}
+	memory_ = std::make_unique<SharedMemory>(sizeof(Entry) * MAX_ENTRIES);
+	entries_ = memory_->as<Entry>();
+	// Entry 0 collects statements that did not fit into the table
+	strcpy(entries_[0].text, "(other)");
+	entries_[0].hash.store(1);
+	entries_[0].ready.store(true);
+}
+
+bool QueryStats::enabled() {
+	return entries_ != nullptr;
+}
+
+QueryStats::Entry *QueryStats::find(const std::string &fingerprint) {
+	// Zero marks a free entry, one is reserved for the overflow entry
+	uint64_t hash{ std::max<uint64_t>(std::hash<std::string>{}(fingerprint), 2) };
+	for (unsigned i = 0; i < MAX_ENTRIES - 1; ++i) {
+		auto &entry = entries_[1 + (hash + i) % (MAX_ENTRIES - 1)];
+		uint64_t current{ entry.hash.load() };
+		if (current == hash) {
+			return &entry;
+		}
+		if (current == 0) {
+			if (entry.hash.compare_exchange_strong(current, hash)) {
+				strncpy(entry.text, fingerprint.c_str(), MAX_TEXT - 1);
+				entry.ready.store(true);
+				return &entry;
+			}
+			if (current == hash) {
+				return &entry;
+			}
+		}
+	}
+	return &entries_[0];
+}
+
+void QueryStats::record(const std::string &fingerprint, const uint64_t elapsed_us, const uint64_t rows) {
+	if (entries_ == nullptr) {
+		return;
+	}
+	auto entry = find(fingerprint);
+	entry->count.fetch_add(1, std::memory_order_relaxed);
+	entry->total_us.fetch_add(elapsed_us, std::memory_order_relaxed);
+	entry->rows.fetch_add(rows, std::memory_order_relaxed);
+	uint64_t max{ entry->max_us.load(std::memory_order_relaxed) };
+	while (elapsed_us > max && !entry->max_us.compare_exchange_weak(max, elapsed_us)) {}
+}
+
+std::vector<QueryStats::Summary> QueryStats::top(const size_t n) {
+	std::vector<Summary> result;
+	if (entries_ == nullptr) {
+		return result;
+	}
+	for (unsigned i = 0; i < MAX_ENTRIES; ++i) {
+		const auto &entry = entries_[i];
+		if (!entry.ready.load() || entry.count.load() == 0) {
+			continue;
+		}
+		result.push_back(Summary{
+			std::string{ entry.text, strnlen(entry.text, MAX_TEXT) },
+			entry.count.load(),
+			entry.total_us.load(),
+			entry.max_us.load(),
+			entry.rows.load()
+		});
+	}
+	std::sort(result.begin(), result.end(), [](const Summary &a, const Summary &b) {
+		return a.total_us > b.total_us;
+	});
+	if (result.size() > n) {
+		result.resize(n);
+	}
+	return result;
+}
+
+std::string QueryStats::fingerprint(const std::string &sql) {
+	std::string result;
+	result.reserve(sql.length());
+	size_t i{ 0 };
+	while (i < sql.length()) {
+		char c{ sql[i] };
+		if (c == '\'' || c == '"') {
+			// string literal, quotes are escaped either by backslash or by doubling
+			++i;
+			while (i < sql.length()) {
+				if (sql[i] == '\\') {
+					i += 2;
+					continue;
+				}
+				if (sql[i] == c) {
+					if (i + 1 < sql.length() && sql[i + 1] == c) {
+						i += 2;
+						continue;
+					}
+					break;
+				}
+				++i;
+			}
+			++i;
+			result += '?';
+		}
+		else if (c == '`') {
+			// identifier is kept as is
+			auto end = sql.find('`', i + 1);
+			if (end == std::string::npos) {
+				end = sql.length() - 1;
+			}
+			result.append(sql, i, end - i + 1);
+			i = end + 1;
+		}
+		else if (std::isdigit(static_cast<unsigned char>(c)) &&
+			(result.empty() || (!std::isalnum(static_cast<unsigned char>(result.back())) && result.back() != '_'))) {
+			while (i < sql.length() && (std::isalnum(static_cast<unsigned char>(sql[i])) || sql[i] == '.')) {
+				++i;
+			}
+			result += '?';
+		}
+		else if (std::isspace(static_cast<unsigned char>(c))) {
+			while (i < sql.length() && std::isspace(static_cast<unsigned char>(sql[i]))) {
+				++i;
+			}
+			if (!result.empty() && result.back() != ' ') {
+				result += ' ';
+			}
+		}
+		else {
+			result += c;
+			++i;
+		}
+	}
+	if (!result.empty() && result.back() == ' ') {
+		result.pop_back();
+	}
+
+	// Lists of any length give the same fingerprint: "IN (?, ?, ?)" -> "IN (?+)"
+	size_t pos{ 0 };
+	while ((pos = result.find("(?,", pos)) != std::string::npos) {
+		auto end = pos + 1;
+		while (end < result.length() && (result[end] == '?' || result[end] == ',' || result[end] == ' ')) {
+			++end;
+		}
+		if (end < result.length() && result[end] == ')') {
+			result.replace(pos, end - pos + 1, "(?+)");
+		}
+		++pos;
+	}
+
+	return result;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "shared_memory.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Aggregated per-fingerprint query timings shared by all server processes
+class QueryStats final {
+public:
+	struct Summary {
+		std::string fingerprint;
+		uint64_t count;
+		uint64_t total_us;
+		uint64_t max_us;
+		uint64_t rows;
+	};
+
+	static void init(); // must be called in the main process before any fork()
+	static bool enabled();
+	static void record(const std::string &fingerprint, uint64_t elapsed_us, uint64_t rows);
+	static std::vector<Summary> top(size_t n); // sorted by total time
+	static std::string fingerprint(const std::string &sql); // literals replaced with '?'
+
+private:
+	static const unsigned MAX_ENTRIES{ 512 };
+	static const unsigned MAX_TEXT{ 256 };
+
+	struct Entry {
+		std::atomic<uint64_t> hash;
+		std::atomic<bool> ready;
+		char text[MAX_TEXT];
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> total_us;
+		std::atomic<uint64_t> max_us;
+		std::atomic<uint64_t> rows;
+	};
+
+	static Entry *find(const std::string &fingerprint);
+
+	static std::unique_ptr<SharedMemory> memory_;
+	static Entry *entries_;
+};
@@ -0,0 +1,299 @@
+#include "config_file.h"
+#include "mysql.h"
+#include "shard_map.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+// Offline move of messages and delivery state to a new DBShards list. The servers must be stopped,
+// the new shards must have sql/shard_schema.sql. The current layout is read from server.cfg:
+// DBShards, or the primary database if it is not set. Every step may be repeated, so an interrupted
+// run is finished by running it again with the same list. Message ids do not change, the id
+// sequence stays in the primary database
+namespace {
+	const unsigned BATCH{ 1000 }; // rows read from a shard at once
+	const unsigned INSERT_ROWS{ 100 }; // rows written by one statement
+
+	const char *MESSAGE_COLUMNS =
+		"`id`, `type`, `sender`, `sender_login`, `receiver`, `receiver_login`, `channel_id`, `channel_name`, `text`, `sent`, `is_copy`";
+	const char *SELECT_MESSAGES =
+		"SELECT `id`, `type`, `sender`, `sender_login`, `receiver`, `receiver_login`, `channel_id`, `channel_name`, `text`, "
+			"UNIX_TIMESTAMP(`sent`), `is_copy` FROM `messages` ";
+
+	std::string quoted(Mysql &mysql, const MysqlRow &row, const size_t column) {
+		return row.isNull(column) ? std::string{ "NULL" } : '\'' + mysql.escape(row.getString(column)) + '\'';
+	}
+
+	std::string idList(const auto &ids) {
+		std::stringstream ss;
+		for (auto it = ids.begin(); it != ids.end(); ++it) {
+			ss << (it == ids.begin() ? "" : ", ") << *it;
+		}
+		return ss.str();
+	}
+
+	class Resharder final {
+	public:
+		Resharder(const ConfigFile &config, const std::string &target) :
+			user_{ config["DBUser"] },
+			password_{ config["DBPassword"] },
+			from_{ config.contains("DBShards") ? config["DBShards"] : config["DBHost"] + ':' + config.get("DBPort", std::to_string(ShardMap::DEFAULT_PORT)) + '/' + config["DBName"] },
+			to_{ target } {
+		}
+
+		void run() {
+			// unread messages are moved with their users before the messages leave their old shards
+			for (size_t i = 0; i < from_.size(); ++i) {
+				moveDeliveries(from_[i]);
+			}
+			for (size_t i = 0; i < from_.size(); ++i) {
+				moveMessages(from_[i]);
+			}
+			for (size_t i = 0; i < from_.size(); ++i) {
+				cleanUp(from_[i]);
+			}
+		}
+
+	private:
+		struct Message {
+			unsigned long long id;
+			bool is_private;
+			unsigned receiver_id;
+			unsigned long long channel_id;
+			bool is_copy;
+		};
+
+		Mysql &connect(const ShardMap::Endpoint &endpoint) {
+			auto &connection = connections_[endpoint.name()];
+			if (connection == nullptr) {
+				connection = std::make_unique<Mysql>();
+				connection->open(endpoint.dbname, endpoint.host, user_, password_, endpoint.port);
+			}
+			return *connection;
+		}
+
+		void execute(Mysql &mysql, const std::string &req) {
+			if (!mysql.query(req)) {
+				throw std::runtime_error{ "MySQL error: " + mysql.getError() };
+			}
+		}
+
+		const ShardMap::Endpoint &home(const Message &message) const {
+			return to_[to_.shardOf(message.is_private, message.receiver_id, message.channel_id)];
+		}
+
+		static Message message(const MysqlRow &row, const size_t first) {
+			// id, receiver, channel_id, is_copy
+			return Message{
+				row.getUInt(first),
+				!row.isNull(first + 1),
+				row.isNull(first + 1) ? 0 : static_cast<unsigned>(row.getUInt(first + 1)),
+				row.isNull(first + 2) ? 0 : row.getUInt(first + 2),
+				row.getInt(first + 3) != 0
+			};
+		}
+
+		// row of SELECT_MESSAGES for INSERT INTO `messages` (MESSAGE_COLUMNS)
+		static std::string values(Mysql &target, const MysqlRow &row, const bool is_copy) {
+			std::stringstream ss;
+			ss << '(';
+			for (size_t column = 0; column < 9; ++column) {
+				ss << quoted(target, row, column) << ", ";
+			}
+			ss << "FROM_UNIXTIME(" << row.getString(9) << "), " << (is_copy ? "TRUE" : "FALSE") << ')';
+			return ss.str();
+		}
+
+		// a copy does not replace the message, the message replaces a copy
+		void insertMessages(Mysql &target, const std::vector<std::string> &rows) {
+			for (size_t first = 0; first < rows.size(); first += INSERT_ROWS) {
+				std::stringstream ss;
+				ss << "INSERT INTO `messages` (" << MESSAGE_COLUMNS << ") VALUES ";
+				for (size_t i = first; i < rows.size() && i < first + INSERT_ROWS; ++i) {
+					ss << (i == first ? "" : ", ") << rows[i];
+				}
+				ss << " ON DUPLICATE KEY UPDATE `is_copy` = `is_copy` AND VALUES(`is_copy`)";
+				execute(target, ss.str());
+			}
+		}
+
+		// delivery cursors of the users leaving the shard, their unread messages and copies of the messages
+		void moveDeliveries(const ShardMap::Endpoint &source) {
+			auto &mysql = connect(source);
+			unsigned long long from{ 0 }, moved{ 0 };
+			size_t rows;
+			do {
+				std::map<size_t, std::vector<std::string>> cursors;
+				std::map<size_t, std::vector<unsigned>> users;
+				rows = 0;
+				{
+					auto cursor = mysql.select(
+						"SELECT `user_id`, `last_seq`, `acked_seq` FROM `delivery_cursors` "
+						"WHERE `user_id` >= " + std::to_string(from) + " ORDER BY `user_id` LIMIT " + std::to_string(BATCH));
+					while (cursor.next()) {
+						const auto &row = cursor.row();
+						auto user_id = static_cast<unsigned>(row.getUInt(0));
+						from = user_id + 1ULL;
+						++rows;
+						auto target = to_.shardOf(user_id);
+						if (to_[target] == source) {
+							continue;
+						}
+						cursors[target].push_back("(" + row.getString(0) + ", " + row.getString(1) + ", " + row.getString(2) + ")");
+						users[target].push_back(user_id);
+					}
+				}
+				for (const auto &[target, ids]: users) {
+					auto &shard = connect(to_[target]);
+					execute(shard, "START TRANSACTION");
+					execute(shard,
+						"INSERT INTO `delivery_cursors` (`user_id`, `last_seq`, `acked_seq`) VALUES " + idList(cursors[target]) + " "
+						"ON DUPLICATE KEY UPDATE `last_seq` = GREATEST(`last_seq`, VALUES(`last_seq`)), `acked_seq` = GREATEST(`acked_seq`, VALUES(`acked_seq`))");
+					std::vector<std::string> messages;
+					{
+						auto cursor = mysql.select(std::string{ SELECT_MESSAGES } +
+							"WHERE `id` IN (SELECT `message_id` FROM `unread_messages` WHERE `user_id` IN (" + idList(ids) + "))");
+						while (cursor.next()) {
+							const auto &row = cursor.row();
+							auto home = to_.shardOf(!row.isNull(4), row.isNull(4) ? 0 : static_cast<unsigned>(row.getUInt(4)), row.isNull(6) ? 0 : row.getUInt(6));
+							messages.push_back(values(shard, row, to_[home] != to_[target]));
+						}
+					}
+					insertMessages(shard, messages);
+					std::vector<std::string> unread;
+					{
+						auto cursor = mysql.select("SELECT `message_id`, `user_id`, `seq` FROM `unread_messages` WHERE `user_id` IN (" + idList(ids) + ")");
+						while (cursor.next()) {
+							const auto &row = cursor.row();
+							unread.push_back("(" + row.getString(0) + ", " + row.getString(1) + ", " + row.getString(2) + ")");
+						}
+					}
+					for (size_t first = 0; first < unread.size(); first += INSERT_ROWS) {
+						std::vector<std::string> part{ unread.begin() + first, unread.begin() + std::min(unread.size(), first + INSERT_ROWS) };
+						execute(shard, "INSERT IGNORE INTO `unread_messages` (`message_id`, `user_id`, `seq`) VALUES " + idList(part));
+					}
+					execute(shard, "COMMIT");
+					moved += ids.size();
+				}
+			} while (rows == BATCH);
+			std::cout << source.name() << ": delivery state of " << moved << " users copied" << std::endl;
+		}
+
+		// messages whose shard has changed
+		void moveMessages(const ShardMap::Endpoint &source) {
+			auto &mysql = connect(source);
+			unsigned long long from{ 0 }, moved{ 0 };
+			size_t rows;
+			do {
+				std::map<size_t, std::vector<std::string>> messages;
+				rows = 0;
+				{
+					auto cursor = mysql.select(std::string{ SELECT_MESSAGES } +
+						"WHERE `id` >= " + std::to_string(from) + " AND NOT `is_copy` ORDER BY `id` LIMIT " + std::to_string(BATCH));
+					while (cursor.next()) {
+						const auto &row = cursor.row();
+						from = row.getUInt(0) + 1;
+						++rows;
+						auto target = to_.shardOf(!row.isNull(4), row.isNull(4) ? 0 : static_cast<unsigned>(row.getUInt(4)), row.isNull(6) ? 0 : row.getUInt(6));
+						if (to_[target] == source) {
+							continue;
+						}
+						messages[target].push_back(values(connect(to_[target]), row, false));
+					}
+				}
+				for (const auto &[target, list]: messages) {
+					insertMessages(connect(to_[target]), list);
+					moved += list.size();
+				}
+			} while (rows == BATCH);
+			std::cout << source.name() << ": " << moved << " messages copied" << std::endl;
+		}
+
+		// rows that have been copied to their new shards are removed, a message stays as a copy while it is unread here
+		void cleanUp(const ShardMap::Endpoint &source) {
+			auto &mysql = connect(source);
+			unsigned long long from{ 0 }, users{ 0 }, messages{ 0 };
+			size_t rows;
+			do {
+				std::vector<unsigned> moved;
+				rows = 0;
+				{
+					auto cursor = mysql.select(
+						"SELECT `user_id` FROM `delivery_cursors` "
+						"WHERE `user_id` >= " + std::to_string(from) + " ORDER BY `user_id` LIMIT " + std::to_string(BATCH));
+					while (cursor.next()) {
+						auto user_id = static_cast<unsigned>(cursor.row().getUInt(0));
+						from = user_id + 1ULL;
+						++rows;
+						if (to_[to_.shardOf(user_id)] != source) {
+							moved.push_back(user_id);
+						}
+					}
+				}
+				if (!moved.empty()) {
+					execute(mysql, "DELETE FROM `unread_messages` WHERE `user_id` IN (" + idList(moved) + ")");
+					execute(mysql, "DELETE FROM `delivery_cursors` WHERE `user_id` IN (" + idList(moved) + ")");
+					users += moved.size();
+				}
+			} while (rows == BATCH);
+
+			from = 0;
+			do {
+				std::vector<unsigned long long> batch, moved;
+				{
+					auto cursor = mysql.select(
+						"SELECT `id`, `receiver`, `channel_id`, `is_copy` FROM `messages` "
+						"WHERE `id` >= " + std::to_string(from) + " ORDER BY `id` LIMIT " + std::to_string(BATCH));
+					while (cursor.next()) {
+						auto message = Resharder::message(cursor.row(), 0);
+						from = message.id + 1;
+						batch.push_back(message.id);
+						if (!message.is_copy && home(message) != source) {
+							moved.push_back(message.id);
+						}
+					}
+				}
+				rows = batch.size();
+				if (!moved.empty()) {
+					execute(mysql, "UPDATE `messages` SET `is_copy` = TRUE WHERE `id` IN (" + idList(moved) + ")");
+				}
+				if (!batch.empty()) {
+					execute(mysql, "DELETE FROM `messages` WHERE `id` IN (" + idList(batch) + ") AND `is_copy` "
+						"AND NOT EXISTS (SELECT 1 FROM `unread_messages` WHERE `unread_messages`.`message_id` = `messages`.`id`)");
+				}
+				messages += moved.size();
+			} while (rows == BATCH);
+			std::cout << source.name() << ": delivery state of " << users << " users and " << messages << " messages moved out" << std::endl;
+		}
+
+		std::string user_;
+		std::string password_;
+		ShardMap from_;
+		ShardMap to_;
+		std::map<std::string, std::unique_ptr<Mysql>> connections_; // by endpoint name, shared by both layouts
+	};
+}
+
+int main(int argc, char *argv[]) {
+	if (argc != 2) {
+		std::cerr << "Usage: " << argv[0] << " \"host[:port]/dbname, ...\"" << std::endl
+			<< "Moves messages from the shards of server.cfg to the given shards, the servers must be stopped" << std::endl;
+		return EXIT_FAILURE;
+	}
+	try {
+		ConfigFile config{ "server.cfg" };
+		Resharder{ config, argv[1] }.run();
+		std::cout << "Done. Set DBShards = " << argv[1] << " in server.cfg" << std::endl;
+	}
+	catch (const std::exception &e) {
+		std::cerr << "Fatal error! " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
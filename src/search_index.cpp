@@ -0,0 +1,395 @@
+#include "search_index.h"
+#include "project_lib.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+extern "C" {
+	#include <fcntl.h>
+	#include <signal.h>
+	#include <unistd.h>
+}
+
+namespace fs = std::filesystem;
+
+namespace {
+	const uint32_t MAGIC{ 0x58444953 }; // "SIDX"
+	const size_t MAX_TERM{ 32 }; // longer words are cut
+	const size_t MAX_SEGMENTS{ 8 }; // more are merged into one
+	const std::string SUFFIX{ ".segment" };
+
+	std::string systemError(const std::string &what) {
+		return what + ": " + strerror(errno);
+	}
+
+	void putInt(std::string &buffer, uint64_t value, size_t bytes) {
+		for (size_t i = 0; i < bytes; ++i) {
+			buffer.push_back(static_cast<char>(value & 0xFF));
+			value >>= 8;
+		}
+	}
+
+	void putString(std::string &buffer, const std::string &value) {
+		putInt(buffer, value.size(), 4);
+		buffer += value;
+	}
+
+	void putVarint(std::string &buffer, uint64_t value) {
+		while (value >= 0x80) {
+			buffer.push_back(static_cast<char>(value | 0x80));
+			value >>= 7;
+		}
+		buffer.push_back(static_cast<char>(value));
+	}
+
+	// segment decoder, fails softly on malformed data
+	class Decoder final {
+	public:
+		Decoder(const std::string &buffer, size_t pos) : buffer_{ buffer }, pos_{ pos } {}
+
+		uint64_t getInt(size_t bytes) {
+			if (!ok_ || buffer_.size() - pos_ < bytes) {
+				ok_ = false;
+				return 0;
+			}
+			uint64_t value{ 0 };
+			for (size_t i = 0; i < bytes; ++i) {
+				value |= static_cast<uint64_t>(static_cast<uint8_t>(buffer_[pos_ + i])) << (8 * i);
+			}
+			pos_ += bytes;
+			return value;
+		}
+
+		std::string getString() {
+			auto length = getInt(4);
+			if (!ok_ || buffer_.size() - pos_ < length) {
+				ok_ = false;
+				return std::string{};
+			}
+			std::string value{ buffer_.substr(pos_, length) };
+			pos_ += length;
+			return value;
+		}
+
+		bool good() const { return ok_; }
+		bool finished() const { return ok_ && pos_ == buffer_.size(); }
+
+	private:
+		const std::string &buffer_;
+		size_t pos_;
+		bool ok_{ true };
+	};
+
+	// calls back with every id of varint deltas starting from base, false if the data is malformed
+	template <typename Callback>
+	bool forEachId(const std::string &data, uint64_t base, Callback callback) {
+		uint64_t value{ 0 };
+		unsigned shift{ 0 };
+		for (auto c: data) {
+			auto byte = static_cast<uint8_t>(c);
+			if (shift > 63) {
+				return false;
+			}
+			value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+			if (byte & 0x80) {
+				shift += 7;
+				continue;
+			}
+			base += value;
+			callback(base);
+			value = 0;
+			shift = 0;
+		}
+		return shift == 0;
+	}
+}
+
+SearchIndex::SearchIndex(const std::string &directory) :
+	directory_{ directory } {
+	fs::create_directories(directory_);
+	// left by a writer that has died, another server process may be writing its own
+	for (const auto &entry: fs::directory_iterator(directory_)) {
+		auto name = entry.path().filename().string();
+		unsigned long long first, end;
+		int pid;
+		if (name.ends_with(".tmp") && std::sscanf(name.c_str(), "%llu-%llu.%d", &first, &end, &pid) == 3 &&
+			kill(pid, 0) == -1 && errno == ESRCH) {
+			fs::remove(entry.path());
+		}
+	}
+	for (const auto &segment: segments()) {
+		if (segment.first > next()) {
+			// a missing segment, the rest is indexed again
+			break;
+		}
+		if (segment.end > next() && !load(segment)) {
+			break;
+		}
+	}
+	saved_ = next();
+}
+
+void SearchIndex::append(Postings &postings, const unsigned long long id) {
+	putVarint(postings.data, id - postings.last);
+	postings.last = id;
+	++postings.count;
+}
+
+std::vector<unsigned long long> SearchIndex::decode(const Postings &postings) {
+	std::vector<unsigned long long> ids;
+	ids.reserve(postings.count);
+	forEachId(postings.data, 0, [&](uint64_t id) { ids.push_back(id); });
+	return ids;
+}
+
+std::vector<std::string> SearchIndex::terms(const std::string_view text) {
+	std::vector<std::string> terms;
+	std::string term;
+	auto finish = [&]() {
+		if (!term.empty()) {
+			terms.push_back(std::move(term));
+			term.clear();
+		}
+	};
+	for (auto c: text) {
+		auto byte = static_cast<unsigned char>(c);
+		// bytes of multibyte UTF-8 characters are parts of words
+		if (byte >= 0x80 || (byte >= '0' && byte <= '9') || (byte >= 'a' && byte <= 'z')) {
+			if (term.size() < MAX_TERM) {
+				term.push_back(c);
+			}
+		}
+		else if (byte >= 'A' && byte <= 'Z') {
+			if (term.size() < MAX_TERM) {
+				term.push_back(static_cast<char>(byte - 'A' + 'a'));
+			}
+		}
+		else {
+			finish();
+		}
+	}
+	finish();
+	std::sort(terms.begin(), terms.end());
+	terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+	return terms;
+}
+
+void SearchIndex::add(const unsigned long long id, const Scope &scope, const std::string_view text) {
+	if (id < next()) {
+		return;
+	}
+	// ids of deleted or rolled back messages stay empty
+	scopes_.resize(id, Scope{ NONE, 0, 0 });
+	scopes_.push_back(scope);
+	for (const auto &term: terms(text)) {
+		append(postings_[term], id);
+		auto [it, inserted] = unsaved_.try_emplace(term);
+		if (inserted) {
+			it->second.last = saved_;
+		}
+		append(it->second, id);
+	}
+}
+
+std::vector<unsigned long long> SearchIndex::search(const std::string_view query, const unsigned user_id, const std::vector<unsigned long long> &channels, const size_t limit) const {
+	std::vector<const Postings *> lists;
+	for (const auto &term: terms(query)) {
+		auto it = postings_.find(term);
+		if (it == postings_.end()) {
+			return {};
+		}
+		lists.push_back(&it->second);
+	}
+	if (lists.empty()) {
+		return {};
+	}
+	// the rarest term first keeps the intersection small
+	std::sort(lists.begin(), lists.end(), [](const Postings *a, const Postings *b) {
+		return a->count < b->count;
+	});
+	auto ids = decode(*lists.front());
+	for (size_t i = 1; i < lists.size() && !ids.empty(); ++i) {
+		auto other = decode(*lists[i]);
+		std::vector<unsigned long long> both;
+		std::set_intersection(ids.begin(), ids.end(), other.begin(), other.end(), std::back_inserter(both));
+		ids = std::move(both);
+	}
+
+	std::vector<unsigned long long> found;
+	for (auto it = ids.rbegin(); it != ids.rend() && found.size() < limit; ++it) {
+		const auto &scope = scopes_[*it];
+		bool visible{ false };
+		switch (scope.visibility) {
+		case BROADCAST:
+			visible = true;
+			break;
+		case PRIVATE:
+			visible = scope.sender == user_id || scope.target == user_id;
+			break;
+		case CHANNEL:
+			visible = std::binary_search(channels.begin(), channels.end(), scope.target);
+			break;
+		case NONE:
+			break;
+		}
+		if (visible) {
+			found.push_back(*it);
+		}
+	}
+	return found;
+}
+
+std::vector<SearchIndex::Segment> SearchIndex::segments() const {
+	std::vector<Segment> segments;
+	for (const auto &entry: fs::directory_iterator(directory_)) {
+		auto name = entry.path().filename().string();
+		unsigned long long first, end;
+		if (name.size() > SUFFIX.size() && name.ends_with(SUFFIX) &&
+			std::sscanf(name.c_str(), "%llu-%llu", &first, &end) == 2 && first < end) {
+			segments.push_back({ entry.path().string(), first, end });
+		}
+	}
+	// the longest of segments starting at the same id first
+	std::sort(segments.begin(), segments.end(), [](const Segment &a, const Segment &b) {
+		return a.first != b.first ? a.first < b.first : a.end > b.end;
+	});
+	return segments;
+}
+
+bool SearchIndex::load(const Segment &segment) {
+	std::ifstream file{ segment.path, std::ios::binary };
+	std::string buffer{ std::istreambuf_iterator<char>{ file }, std::istreambuf_iterator<char>{} };
+	Decoder header{ buffer, 0 };
+	if (header.getInt(4) != MAGIC) {
+		return false;
+	}
+	auto crc = header.getInt(4);
+	if (!header.good() || Chat::crc32(buffer.data() + 8, buffer.size() - 8) != crc) {
+		return false;
+	}
+
+	Decoder decoder{ buffer, 8 };
+	auto first = decoder.getInt(8);
+	auto end = decoder.getInt(8);
+	if (first != segment.first || end != segment.end) {
+		return false;
+	}
+	std::vector<Scope> scopes;
+	scopes.reserve(end - first);
+	for (auto id = first; id < end && decoder.good(); ++id) {
+		auto visibility = static_cast<Visibility>(decoder.getInt(1));
+		auto sender = static_cast<uint32_t>(decoder.getInt(4));
+		scopes.push_back({ visibility, sender, decoder.getInt(8) });
+	}
+	std::vector<std::pair<std::string, std::string>> terms(decoder.getInt(4));
+	for (auto &[term, data]: terms) {
+		term = decoder.getString();
+		data = decoder.getString();
+	}
+	if (!decoder.finished()) {
+		return false;
+	}
+
+	for (const auto &[term, data]: terms) {
+		uint64_t last{ first };
+		bool ordered{ true };
+		auto valid = forEachId(data, first, [&](uint64_t id) {
+			ordered = ordered && id >= last && id < end;
+			last = id;
+		});
+		if (!valid || !ordered) {
+			return false;
+		}
+	}
+
+	// messages indexed by earlier segments are skipped
+	auto from = next();
+	for (const auto &[term, data]: terms) {
+		auto &postings = postings_[term];
+		forEachId(data, first, [&](uint64_t id) {
+			if (id >= from) {
+				append(postings, id);
+			}
+		});
+	}
+	scopes_.insert(scopes_.end(), scopes.begin() + (from - first), scopes.end());
+	return true;
+}
+
+void SearchIndex::write(const uint64_t first, const std::unordered_map<std::string, Postings> &postings) const {
+	std::string payload;
+	putInt(payload, first, 8);
+	putInt(payload, next(), 8);
+	for (auto id = first; id < next(); ++id) {
+		const auto &scope = scopes_[id];
+		putInt(payload, scope.visibility, 1);
+		putInt(payload, scope.sender, 4);
+		putInt(payload, scope.target, 8);
+	}
+	putInt(payload, postings.size(), 4);
+	for (const auto &[term, list]: postings) {
+		putString(payload, term);
+		putString(payload, list.data);
+	}
+	std::string segment;
+	putInt(segment, MAGIC, 4);
+	putInt(segment, Chat::crc32(payload.data(), payload.size()), 4);
+	segment += payload;
+
+	char name[64];
+	std::snprintf(name, sizeof(name), "%020llu-%020llu", static_cast<unsigned long long>(first), next());
+	auto path = directory_ + "/" + name + SUFFIX;
+	auto temporary = directory_ + "/" + name + "." + std::to_string(getpid()) + ".tmp";
+	int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		throw std::runtime_error{ systemError("Can not create search index segment " + temporary) };
+	}
+	size_t written{ 0 };
+	while (written < segment.size()) {
+		auto count = ::write(fd, segment.data() + written, segment.size() - written);
+		if (count == -1 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			break;
+		}
+		written += count;
+	}
+	// the segment appears under its name complete and flushed
+	bool flushed = written == segment.size() && fsync(fd) == 0;
+	close(fd);
+	if (!flushed || rename(temporary.c_str(), path.c_str()) == -1) {
+		auto error = systemError("Can not write search index segment " + path);
+		unlink(temporary.c_str());
+		throw std::runtime_error{ error };
+	}
+}
+
+void SearchIndex::save() {
+	if (unsaved() == 0) {
+		return;
+	}
+	write(saved_, unsaved_);
+	unsaved_.clear();
+	saved_ = next();
+	if (segments().size() > MAX_SEGMENTS) {
+		compact();
+	}
+}
+
+void SearchIndex::compact() {
+	// postings in memory are deltas from 0, as in a segment starting at id 0
+	write(0, postings_);
+	for (const auto &segment: segments()) {
+		// a newer segment may be written by the process this one has taken over from
+		if (segment.end < next() || (segment.end == next() && segment.first != 0)) {
+			fs::remove(segment.path);
+		}
+	}
+}
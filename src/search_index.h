@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Inverted index of message texts: every term maps to the ascending ids of the messages
+// containing it, each id stored as a varint of its difference from the previous one.
+// Messages are added in id order and saved to segment files in a local directory,
+// a segment holds the messages added since the previous one. Segments are merged into one
+// when there are too many, so a restart loads them instead of reading all messages again
+class SearchIndex final {
+public:
+	enum Visibility : uint8_t {
+		NONE, // id without a message
+		BROADCAST,
+		PRIVATE, // sender and receiver only
+		CHANNEL // channel members only
+	};
+
+	struct Scope {
+		Visibility visibility;
+		uint32_t sender;
+		uint64_t target; // receiver id or channel id
+	};
+
+	// loads saved segments, throws std::runtime_error if the directory is not usable
+	explicit SearchIndex(const std::string &directory);
+	SearchIndex(const SearchIndex &) = delete;
+	SearchIndex &operator=(const SearchIndex &) = delete;
+
+	// messages with smaller ids are indexed
+	unsigned long long next() const { return scopes_.size(); }
+	size_t unsaved() const { return scopes_.size() - saved_; }
+
+	// ids below next() are skipped
+	void add(unsigned long long id, const Scope &scope, std::string_view text);
+
+	// ids of the newest messages containing all words of the query and visible to the user,
+	// newest first. Channels are the sorted ids of the user's channels
+	std::vector<unsigned long long> search(std::string_view query, unsigned user_id, const std::vector<unsigned long long> &channels, size_t limit) const;
+
+	// writes messages added since the last save to a new segment, throws std::runtime_error
+	void save();
+
+	// lowercase words of a text, without duplicates
+	static std::vector<std::string> terms(std::string_view text);
+
+private:
+	struct Postings {
+		std::string data; // varint deltas, the first one from 0
+		unsigned long long last{ 0 }; // last id
+		size_t count{ 0 };
+	};
+
+	struct Segment {
+		std::string path;
+		uint64_t first;
+		uint64_t end; // id after the last message
+	};
+
+	static void append(Postings &postings, unsigned long long id);
+	static std::vector<unsigned long long> decode(const Postings &postings);
+
+	std::vector<Segment> segments() const; // ordered by first id
+	bool load(const Segment &segment); // false if the segment is damaged
+	void write(uint64_t first, const std::unordered_map<std::string, Postings> &postings) const;
+	void compact(); // replaces all segments with one
+
+	const std::string directory_;
+	std::vector<Scope> scopes_; // by message id
+	std::unordered_map<std::string, Postings> postings_;
+	std::unordered_map<std::string, Postings> unsaved_; // postings added since the last save, deltas from saved_
+	size_t saved_{ 0 }; // messages with smaller ids are saved
+};
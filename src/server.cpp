@@ -1,12 +1,15 @@
 #include "chat_server.h"
 
 
-int main() {
+int main(int argc, char *argv[]) {
 	try {
-		static ChatServer chat;
+		// --takeover: replace the running server without dropping client connections
+		static ChatServer chat{ argc > 1 && std::string{ argv[1] } == "--takeover" };
 		signal(SIGTERM, [](int signum) { chat.sigTermHandler(signum); });
-		signal(SIGCHLD, [](int signum) { chat.childDeathHandler(signum); });
 		signal(SIGINT, [](int signum) { chat.sigIntHandler(signum); });
+		signal(SIGUSR1, [](int signum) { chat.drainHandler(signum); });
+		signal(SIGUSR2, [](int signum) { chat.handOverHandler(signum); });
+		signal(SessionRegistry::WAKE_SIGNAL, [](int signum) { chat.wakeHandler(signum); });
 		chat.work();
 	}
 	catch (const std::runtime_error &e) {
@@ -0,0 +1,87 @@
+#include "session_registry.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+extern "C" {
+	#include <unistd.h>
+}
+
+SessionRegistry::SessionRegistry(const size_t slots) : slots_{ slots } {
+	if (slots_ == 0) {
+		throw std::invalid_argument{ "Session registry must have at least one slot" };
+	}
+	// anonymous mapping is zero filled, so every slot is free
+	memory_ = std::make_unique<SharedMemory>(sizeof(std::atomic<size_t>) + slots_ * sizeof(Slot));
+	used_ = memory_->as<std::atomic<size_t>>();
+	table_ = reinterpret_cast<Slot *>(memory_->as<char>() + sizeof(std::atomic<size_t>));
+}
+
+bool SessionRegistry::attach() {
+	auto pid = getpid();
+	for (size_t i = 0; i < slots_; ++i) {
+		pid_t free{ 0 };
+		if (table_[i].pid.load(std::memory_order_relaxed) != 0 || !table_[i].pid.compare_exchange_strong(free, pid)) {
+			continue;
+		}
+		own_ = &table_[i];
+		auto used = used_->load();
+		while (used < i + 1 && !used_->compare_exchange_weak(used, i + 1)) {
+		}
+		return true;
+	}
+	return false;
+}
+
+void SessionRegistry::setUser(const unsigned user_id) {
+	if (own_ != nullptr) {
+		own_->user.store(static_cast<uint64_t>(user_id) + 1);
+	}
+}
+
+void SessionRegistry::clearUser() {
+	if (own_ != nullptr) {
+		own_->user.store(0);
+	}
+}
+
+void SessionRegistry::release(const pid_t pid) {
+	auto used = used_->load();
+	for (size_t i = 0; i < used; ++i) {
+		if (table_[i].pid.load(std::memory_order_relaxed) == pid) {
+			table_[i].user.store(0);
+			table_[i].pid.store(0);
+			return;
+		}
+	}
+}
+
+size_t SessionRegistry::wake(const std::vector<unsigned> &user_ids) const {
+	auto sorted = user_ids;
+	std::sort(sorted.begin(), sorted.end());
+	size_t count{ 0 };
+	auto used = used_->load();
+	for (size_t i = 0; i < used; ++i) {
+		auto user = table_[i].user.load(std::memory_order_relaxed);
+		if (user == 0 || !std::binary_search(sorted.begin(), sorted.end(), static_cast<unsigned>(user - 1))) {
+			continue;
+		}
+		auto pid = table_[i].pid.load(std::memory_order_relaxed);
+		if (pid > 0 && kill(pid, WAKE_SIGNAL) == 0) {
+			++count;
+		}
+	}
+	return count;
+}
+
+size_t SessionRegistry::wakeAll() const {
+	size_t count{ 0 };
+	auto used = used_->load();
+	for (size_t i = 0; i < used; ++i) {
+		auto pid = table_[i].pid.load(std::memory_order_relaxed);
+		if (pid > 0 && table_[i].user.load(std::memory_order_relaxed) != 0 && kill(pid, WAKE_SIGNAL) == 0) {
+			++count;
+		}
+	}
+	return count;
+}
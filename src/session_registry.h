@@ -0,0 +1,50 @@
+#pragma once
+
+#include "shared_memory.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+extern "C" {
+	#include <signal.h>
+	#include <sys/types.h>
+}
+
+// Client processes of this node with the users logged in there. A process that has saved
+// a message wakes the processes of its recipients with WAKE_SIGNAL, so they read their unread
+// messages at once instead of polling the database. Must be created before fork()
+class SessionRegistry final {
+public:
+	// ignored by processes without a handler, a stale pid receives nothing harmful
+	static const int WAKE_SIGNAL{ SIGURG };
+
+	explicit SessionRegistry(size_t slots);
+	SessionRegistry(const SessionRegistry &) = delete;
+	SessionRegistry &operator=(const SessionRegistry &) = delete;
+
+	// takes a slot for the calling client process, false if all are taken
+	bool attach();
+	// user logged in by the calling process
+	void setUser(unsigned user_id);
+	void clearUser();
+	// frees the slot of the exited process
+	void release(pid_t pid);
+
+	// returns the number of signalled processes
+	size_t wake(const std::vector<unsigned> &user_ids) const;
+	size_t wakeAll() const; // every process with a logged user
+
+private:
+	struct Slot {
+		std::atomic<pid_t> pid; // 0 if free
+		std::atomic<uint64_t> user; // user id + 1, 0 if nobody is logged in
+	};
+
+	const size_t slots_;
+	std::unique_ptr<SharedMemory> memory_;
+	std::atomic<size_t> *used_; // slots below are or have been taken
+	Slot *table_;
+	Slot *own_{ nullptr }; // slot of this process
+};
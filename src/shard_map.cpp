@@ -0,0 +1,75 @@
+#include "shard_map.h"
+#include "project_lib.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+	std::string trim(const std::string &value) {
+		auto first = value.find_first_not_of(" \t");
+		if (first == std::string::npos) {
+			return {};
+		}
+		return value.substr(first, value.find_last_not_of(" \t") - first + 1);
+	}
+}
+
+std::string ShardMap::Endpoint::name() const {
+	return host + ':' + std::to_string(port) + '/' + dbname;
+}
+
+bool ShardMap::Endpoint::operator==(const Endpoint &other) const {
+	return host == other.host && port == other.port && dbname == other.dbname;
+}
+
+ShardMap::ShardMap(const std::string &list) {
+	for (const auto &item: Chat::split(list, ",")) {
+		auto entry = trim(item);
+		if (entry.empty()) {
+			continue;
+		}
+		auto slash = entry.find('/');
+		if (slash == std::string::npos || slash == 0 || slash == entry.size() - 1) {
+			throw std::invalid_argument{ "Invalid shard: " + entry };
+		}
+		Endpoint endpoint{ entry.substr(0, slash), DEFAULT_PORT, entry.substr(slash + 1) };
+		auto colon = endpoint.host.rfind(':');
+		if (colon != std::string::npos) {
+			try {
+				size_t end;
+				auto port = std::stoul(endpoint.host.substr(colon + 1), &end);
+				if (end != endpoint.host.size() - colon - 1 || port == 0 || port > UINT16_MAX) {
+					throw std::invalid_argument{ entry };
+				}
+				endpoint.port = static_cast<unsigned short>(port);
+			}
+			catch (const std::logic_error &e) {
+				throw std::invalid_argument{ "Invalid shard: " + entry };
+			}
+			endpoint.host.resize(colon);
+		}
+		if (std::find(endpoints_.begin(), endpoints_.end(), endpoint) != endpoints_.end()) {
+			throw std::invalid_argument{ "Duplicate shard: " + entry };
+		}
+		endpoints_.push_back(std::move(endpoint));
+	}
+	if (endpoints_.empty()) {
+		throw std::invalid_argument{ "Empty shard list" };
+	}
+	std::vector<unsigned> numbers;
+	for (unsigned i = 1; i <= endpoints_.size(); ++i) {
+		numbers.push_back(i);
+	}
+	ring_ = std::make_unique<HashRing>(numbers);
+}
+
+size_t ShardMap::shardOf(const unsigned long long key) const {
+	return ring_->owner(static_cast<unsigned>(key)) - 1;
+}
+
+size_t ShardMap::shardOf(const bool is_private, const unsigned receiver_id, const unsigned long long channel_id) const {
+	if (is_private) {
+		return shardOf(receiver_id);
+	}
+	return shardOf(channel_id == 0 ? BROADCAST_KEY : channel_id);
+}
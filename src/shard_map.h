@@ -0,0 +1,42 @@
+#pragma once
+
+#include "hash_ring.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Placement of message data on the MySQL databases of the DBShards option. A private message and
+// the delivery state of a user belong to the shard of the user, a channel message to the shard
+// of the channel and a broadcast message to the shard of BROADCAST_KEY. Shards are numbered by
+// their position in the list and placed on a HashRing, so a shard appended to the list takes
+// about 1/N of the keys from the others
+class ShardMap final {
+public:
+	static const unsigned long long BROADCAST_KEY{ 0 };
+	static const unsigned short DEFAULT_PORT{ 3306 };
+
+	struct Endpoint {
+		std::string host;
+		unsigned short port;
+		std::string dbname;
+
+		std::string name() const; // host:port/dbname
+		bool operator==(const Endpoint &other) const; // the same host written differently is another endpoint
+	};
+
+	// "host[:port]/dbname, ...", throws std::invalid_argument
+	explicit ShardMap(const std::string &list);
+
+	size_t size() const { return endpoints_.size(); }
+	const Endpoint &operator[](size_t shard) const { return endpoints_[shard]; }
+
+	// shard of a user or channel id
+	size_t shardOf(unsigned long long key) const;
+	// shard of a message: the receiver of a private message, the channel of a channel message
+	size_t shardOf(bool is_private, unsigned receiver_id, unsigned long long channel_id) const;
+
+private:
+	std::vector<Endpoint> endpoints_;
+	std::unique_ptr<HashRing> ring_;
+};
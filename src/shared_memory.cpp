@@ -0,0 +1,32 @@
+#include "shared_memory.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+extern "C" {
+	#include <sys/mman.h>
+	#include <errno.h>
+}
+
+SharedMemory::SharedMemory(const size_t size) : size_{ size } {
+	data_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (data_ == MAP_FAILED) {
+		data_ = nullptr;
+		throw std::runtime_error{ std::string{ "Can not map shared memory: " } + strerror(errno) };
+	}
+}
+
+SharedMemory::~SharedMemory() {
+	if (data_ != nullptr) {
+		munmap(data_, size_);
+	}
+}
+
+void *SharedMemory::data() const {
+	return data_;
+}
+
+size_t SharedMemory::size() const {
+	return size_;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+
+// Anonymous shared mapping. Must be created before fork() to be visible
+// in every process of the server tree
+class SharedMemory final {
+public:
+	SharedMemory(size_t size);
+	SharedMemory() = delete;
+	SharedMemory(const SharedMemory &) = delete;
+	SharedMemory &operator=(const SharedMemory &) = delete;
+	~SharedMemory();
+
+	void *data() const;
+	size_t size() const;
+	template<typename T> T *as() const { return static_cast<T *>(data_); }
+
+private:
+	void *data_{ nullptr };
+	size_t size_{ 0 };
+};
@@ -0,0 +1,932 @@
+#include "sqlite_storage.h"
+#include "metrics.h"
+#include "query_stats.h"
+
+#include <chrono>
+#include <climits>
+#include <filesystem>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+namespace {
+	const char *SCHEMA =
+		"CREATE TABLE IF NOT EXISTS `users` ("
+			"`id` INTEGER NOT NULL PRIMARY KEY, "
+			"`login` TEXT NOT NULL UNIQUE, "
+			"`name` TEXT NOT NULL, "
+			"`password_hash` TEXT NOT NULL, "
+			"`last_login` TIMESTAMP"
+		");"
+		"CREATE TABLE IF NOT EXISTS `active_sessions` ("
+			"`user_id` INTEGER NOT NULL UNIQUE REFERENCES `users`(`id`) ON DELETE CASCADE ON UPDATE CASCADE, "
+			"`ip` TEXT NOT NULL, "
+			"`pid` INTEGER NOT NULL, "
+			"`port` INTEGER NOT NULL, "
+			"`session_start` TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP, "
+			"`last_activity` TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP, "
+			"`node` INTEGER NOT NULL DEFAULT 0, "
+			"UNIQUE(`node`, `pid`)"
+		");"
+		"CREATE TABLE IF NOT EXISTS `channels` ("
+			"`id` INTEGER NOT NULL PRIMARY KEY, "
+			"`name` TEXT NOT NULL UNIQUE"
+		");"
+		"CREATE TABLE IF NOT EXISTS `channel_members` ("
+			"`channel_id` INTEGER NOT NULL REFERENCES `channels`(`id`) ON DELETE CASCADE ON UPDATE CASCADE, "
+			"`user_id` INTEGER NOT NULL REFERENCES `users`(`id`) ON DELETE CASCADE ON UPDATE CASCADE, "
+			"UNIQUE(`channel_id`, `user_id`)"
+		");"
+		"CREATE TABLE IF NOT EXISTS `messages` ("
+			"`id` INTEGER NOT NULL PRIMARY KEY, "
+			"`type` TEXT CHECK(`type` IN ('BROADCAST', 'PRIVATE')), "
+			"`sender` INTEGER NOT NULL REFERENCES `users`(`id`) ON DELETE CASCADE ON UPDATE CASCADE, "
+			"`receiver` INTEGER REFERENCES `users`(`id`) ON DELETE CASCADE ON UPDATE CASCADE, "
+			"`channel_id` INTEGER REFERENCES `channels`(`id`) ON DELETE CASCADE ON UPDATE CASCADE, "
+			"`text` TEXT NOT NULL, "
+			"`sent` TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP"
+		");"
+		"CREATE INDEX IF NOT EXISTS `messages_conversation` ON `messages`(`receiver`, `sender`, `id`);"
+		"CREATE TABLE IF NOT EXISTS `unread_messages` ("
+			"`message_id` INTEGER NOT NULL REFERENCES `messages`(`id`) ON DELETE CASCADE ON UPDATE CASCADE, "
+			"`user_id` INTEGER NOT NULL REFERENCES `users`(`id`) ON DELETE CASCADE ON UPDATE CASCADE, "
+			"`seq` INTEGER NOT NULL DEFAULT 0, "
+			"UNIQUE(`message_id`, `user_id`)"
+		");"
+		"CREATE TABLE IF NOT EXISTS `delivery_cursors` ("
+			"`user_id` INTEGER NOT NULL PRIMARY KEY REFERENCES `users`(`id`) ON DELETE CASCADE ON UPDATE CASCADE, "
+			"`last_seq` INTEGER NOT NULL, "
+			"`acked_seq` INTEGER NOT NULL"
+		");"
+		"CREATE TABLE IF NOT EXISTS `journal_checkpoint` ("
+			"`id` INTEGER NOT NULL PRIMARY KEY, "
+			"`position` INTEGER NOT NULL"
+		");"
+		"CREATE TABLE IF NOT EXISTS `id_sequences` ("
+			"`name` TEXT NOT NULL PRIMARY KEY, "
+			"`next_id` INTEGER NOT NULL"
+		");"
+		"CREATE TABLE IF NOT EXISTS `id_horizons` ("
+			"`node` INTEGER NOT NULL, "
+			"`name` TEXT NOT NULL, "
+			"`next_id` INTEGER NOT NULL, "
+			"`updated` INTEGER NOT NULL, "
+			"PRIMARY KEY (`node`, `name`)"
+		");";
+
+	// next seq of the recipient, the cursor row serializes concurrent writers
+	const char *NEXT_SEQ =
+		"INSERT INTO `delivery_cursors` (`user_id`, `last_seq`, `acked_seq`) "
+		"SELECT `id`, 1, 0 FROM `users` WHERE `login` = ? "
+		"ON CONFLICT(`user_id`) DO UPDATE SET `last_seq` = `last_seq` + 1";
+	const char *INSERT_UNREAD =
+		"INSERT INTO `unread_messages` (`message_id`, `user_id`, `seq`) "
+		"SELECT ?, `users`.`id`, `delivery_cursors`.`last_seq` FROM `users` "
+		"JOIN `delivery_cursors` ON `delivery_cursors`.`user_id` = `users`.`id` "
+		"WHERE `users`.`login` = ?";
+
+	// newest messages before the key, the caller puts them in chronological order
+	const char *HISTORY_PAGE =
+		"SELECT `messages`.`id`, `senders`.`login` AS `sender`, `receivers`.`login` AS `receiver`, `messages`.`text`, "
+			"CAST(strftime('%s', `messages`.`sent`) AS REAL) AS `sent`, `channels`.`name` AS `channel`, `messages`.`sender` AS `sender_id` "
+		"FROM `messages` "
+		"JOIN `users` AS `senders` ON `senders`.`id` = `messages`.`sender` "
+		"LEFT JOIN `users` AS `receivers` ON `receivers`.`id` = `messages`.`receiver` "
+		"LEFT JOIN `channels` ON `channels`.`id` = `messages`.`channel_id` ";
+
+	// columns of Storage::User
+	const char *USER = "SELECT `id`, `login`, `password_hash`, `name` FROM `users` ";
+
+	// columns of Storage::StoredMessage
+	const char *STORED_MESSAGE =
+		"SELECT `id`, `sender`, `receiver`, COALESCE(`channel_id`, 0), `text`, CAST(strftime('%s', `sent`) AS REAL) FROM `messages` ";
+
+	// the retention policy removes messages without unread deliveries
+	const char *READ_MESSAGE =
+		"NOT EXISTS (SELECT 1 FROM `unread_messages` WHERE `unread_messages`.`message_id` = `messages`.`id`) ";
+
+	std::string placeholders(const size_t count) {
+		std::string list{ "?" };
+		for (size_t i = 1; i < count; ++i) {
+			list += ", ?";
+		}
+		return list;
+	}
+
+	// broadcast or channel messages, the channel id is bound if there is one
+	std::string channelFilter(const Storage::Conversation &conversation) {
+		return conversation.channel_id == 0 ?
+			"`channel_id` IS NULL AND `receiver` IS NULL " :
+			"`channel_id` = ? AND `receiver` IS NULL ";
+	}
+
+	// no cursor means the newest page
+	long long historyKey(const unsigned long long before_id) {
+		return before_id == 0 || before_id > LLONG_MAX ? LLONG_MAX : static_cast<long long>(before_id);
+	}
+}
+
+SqliteStorage::Statement::Statement(sqlite3 *db, const std::string &sql, const std::source_location &location) :
+	db_{ db },
+	sql_{ sql } {
+	if (sqlite3_prepare_v2(db_, sql_.c_str(), sql_.length() + 1, &stmt_, nullptr) != SQLITE_OK) {
+		Metrics::add(Metrics::DB_ERRORS);
+		throw std::runtime_error{
+			std::string{ "SQLite error: " } + sqlite3_errmsg(db_) +
+			" at " + location.file_name() + ':' + std::to_string(location.line())
+		};
+	}
+}
+
+SqliteStorage::Statement::~Statement() {
+	sqlite3_finalize(stmt_);
+	Metrics::add(Metrics::DB_QUERIES);
+	Metrics::observe(Metrics::DB_QUERY_SECONDS, elapsed_);
+	// placeholders make the statement text a fingerprint already
+	QueryStats::record(sql_, static_cast<uint64_t>(elapsed_ * 1e6), rows_);
+}
+
+SqliteStorage::Statement &SqliteStorage::Statement::bind(const int index, const long long value) {
+	sqlite3_bind_int64(stmt_, index, value);
+	return *this;
+}
+
+SqliteStorage::Statement &SqliteStorage::Statement::bind(const int index, const std::string &value) {
+	sqlite3_bind_text(stmt_, index, value.c_str(), value.length(), SQLITE_TRANSIENT);
+	return *this;
+}
+
+bool SqliteStorage::Statement::step() {
+	auto start = std::chrono::steady_clock::now();
+	auto rc = sqlite3_step(stmt_);
+	std::chrono::duration<double> elapsed{ std::chrono::steady_clock::now() - start };
+	elapsed_ += elapsed.count();
+	if (rc == SQLITE_ROW) {
+		++rows_;
+		return true;
+	}
+	if (rc == SQLITE_DONE) {
+		if (!sqlite3_stmt_readonly(stmt_)) {
+			rows_ += sqlite3_changes(db_);
+		}
+		return false;
+	}
+	Metrics::add(Metrics::DB_ERRORS);
+	throw std::runtime_error{ std::string{ "SQLite error: " } + sqlite3_errmsg(db_) };
+}
+
+SqliteStorage::Statement &SqliteStorage::Statement::reset() {
+	sqlite3_reset(stmt_);
+	sqlite3_clear_bindings(stmt_);
+	return *this;
+}
+
+void SqliteStorage::Statement::run() {
+	while (step()) {}
+}
+
+bool SqliteStorage::Statement::isNull(const int column) const {
+	return sqlite3_column_type(stmt_, column) == SQLITE_NULL;
+}
+
+long long SqliteStorage::Statement::getInt(const int column) const {
+	return sqlite3_column_int64(stmt_, column);
+}
+
+double SqliteStorage::Statement::getDouble(const int column) const {
+	return sqlite3_column_double(stmt_, column);
+}
+
+std::string_view SqliteStorage::Statement::getText(const int column) const {
+	auto text = reinterpret_cast<const char *>(sqlite3_column_text(stmt_, column));
+	if (text == nullptr) {
+		return std::string_view{};
+	}
+	return std::string_view{ text, static_cast<size_t>(sqlite3_column_bytes(stmt_, column)) };
+}
+
+SqliteStorage::SqliteStorage(const std::string &filename) {
+	if (sqlite3_open(filename.c_str(), &db_) != SQLITE_OK) {
+		std::string error{ sqlite3_errmsg(db_) };
+		sqlite3_close(db_);
+		db_ = nullptr;
+		throw std::runtime_error{ "can't open SQLite database " + filename + " (" + error + ")" };
+	}
+	// every server process has its own connection to the same file
+	sqlite3_busy_timeout(db_, 5000);
+	try {
+		execute("PRAGMA journal_mode = WAL");
+		execute("PRAGMA foreign_keys = ON");
+		execute(SCHEMA);
+		migrate();
+	}
+	catch (const std::runtime_error &e) {
+		sqlite3_close(db_);
+		db_ = nullptr;
+		throw;
+	}
+	Metrics::add(Metrics::DB_CONNECTIONS_OPEN, 1);
+}
+
+SqliteStorage::~SqliteStorage() {
+	if (db_ != nullptr) {
+		Metrics::add(Metrics::DB_CONNECTIONS_OPEN, -1);
+		sqlite3_close(db_);
+	}
+}
+
+void SqliteStorage::migrate() {
+	// columns added after the table had been created in existing database files
+	auto hasColumn = [this](const std::string &table, const std::string &column) {
+		Statement stmt{ db_, "SELECT COUNT(*) FROM pragma_table_info(?) WHERE `name` = ?" };
+		stmt.bind(1, table).bind(2, column);
+		return stmt.step() && stmt.getInt(0) > 0;
+	};
+	if (!hasColumn("messages", "channel_id")) {
+		execute("ALTER TABLE `messages` ADD COLUMN `channel_id` INTEGER REFERENCES `channels`(`id`) ON DELETE CASCADE ON UPDATE CASCADE");
+	}
+	if (!hasColumn("active_sessions", "node")) {
+		// sessions of older files belong to node 0, their pids stay unique over all nodes
+		execute("ALTER TABLE `active_sessions` ADD COLUMN `node` INTEGER NOT NULL DEFAULT 0");
+	}
+	if (!hasColumn("unread_messages", "seq")) {
+		// unread messages are numbered in the order they were sent, cursors continue from the last number
+		beginTransaction();
+		try {
+			execute("ALTER TABLE `unread_messages` ADD COLUMN `seq` INTEGER NOT NULL DEFAULT 0");
+			execute(
+				"UPDATE `unread_messages` SET `seq` = ("
+					"SELECT COUNT(*) FROM `unread_messages` AS `earlier` "
+					"WHERE `earlier`.`user_id` = `unread_messages`.`user_id` AND `earlier`.`message_id` <= `unread_messages`.`message_id`"
+				")"
+			);
+			execute(
+				"INSERT OR REPLACE INTO `delivery_cursors` (`user_id`, `last_seq`, `acked_seq`) "
+				"SELECT `user_id`, MAX(`seq`), 0 FROM `unread_messages` GROUP BY `user_id`"
+			);
+			commitTransaction();
+		}
+		catch (const std::runtime_error &e) {
+			rollbackTransaction();
+			throw;
+		}
+	}
+	// history of broadcasts and channels, channel_id may be added above
+	execute("CREATE INDEX IF NOT EXISTS `messages_channel` ON `messages`(`channel_id`, `receiver`, `id`)");
+	// private conversations in both directions, walked by the retention job
+	execute(
+		"CREATE INDEX IF NOT EXISTS `messages_pair` ON `messages`(MIN(`receiver`, `sender`), MAX(`receiver`, `sender`)) "
+		"WHERE `receiver` IS NOT NULL"
+	);
+	// replaces the index on user_id alone
+	execute("DROP INDEX IF EXISTS `unread_messages_user`");
+	execute("CREATE UNIQUE INDEX IF NOT EXISTS `unread_messages_seq` ON `unread_messages`(`user_id`, `seq`)");
+	// ids were the maximum plus one before the sequences
+	execute("INSERT OR IGNORE INTO `id_sequences` (`name`, `next_id`) SELECT 'users', COALESCE(MAX(`id`), -1) + 1 FROM `users`");
+	execute("INSERT OR IGNORE INTO `id_sequences` (`name`, `next_id`) SELECT 'messages', COALESCE(MAX(`id`), -1) + 1 FROM `messages`");
+	// channel 0 stands for the broadcast
+	execute("INSERT OR IGNORE INTO `id_sequences` (`name`, `next_id`) SELECT 'channels', COALESCE(MAX(`id`), 0) + 1 FROM `channels`");
+}
+
+bool SqliteStorage::isConnected() const {
+	return db_ != nullptr;
+}
+
+void SqliteStorage::execute(const std::string &sql) {
+	char *error{ nullptr };
+	if (sqlite3_exec(db_, sql.c_str(), nullptr, nullptr, &error) != SQLITE_OK) {
+		std::string message{ error != nullptr ? error : "unknown error" };
+		sqlite3_free(error);
+		Metrics::add(Metrics::DB_ERRORS);
+		throw std::runtime_error{ "SQLite error: " + message };
+	}
+}
+
+void SqliteStorage::beginTransaction() {
+	if (transactionDepth_ == 0) {
+		// take the write lock at once, so concurrent writers wait in busy handler instead of failing on upgrade
+		execute("BEGIN IMMEDIATE");
+	}
+	++transactionDepth_;
+}
+
+void SqliteStorage::commitTransaction() {
+	if (transactionDepth_ == 0) {
+		return;
+	}
+	if (--transactionDepth_ == 0) {
+		try {
+			execute("COMMIT");
+		}
+		catch (const std::runtime_error &e) {
+			finishTransaction(false);
+			throw;
+		}
+		finishTransaction(true);
+	}
+}
+
+void SqliteStorage::rollbackTransaction() {
+	if (transactionDepth_ == 0) {
+		return;
+	}
+	transactionDepth_ = 0;
+	sqlite3_exec(db_, "ROLLBACK", nullptr, nullptr, nullptr);
+	finishTransaction(false);
+}
+
+unsigned long long SqliteStorage::reserveIds(const IdAllocator::Sequence sequence, const unsigned long long count) {
+	std::string name{ IdAllocator::name(sequence) };
+	auto size = static_cast<long long>(count);
+	beginTransaction();
+	try {
+		// the block starts at a multiple of its size
+		Statement update{ db_, "UPDATE `id_sequences` SET `next_id` = (`next_id` + ? - 1) / ? * ? + ? WHERE `name` = ?" };
+		for (int i = 1; i <= 4; ++i) {
+			update.bind(i, size);
+		}
+		update.bind(5, name).run();
+		Statement stmt{ db_, "SELECT `next_id` FROM `id_sequences` WHERE `name` = ?" };
+		if (!stmt.bind(1, name).step()) {
+			throw std::runtime_error{ "SQLite error: no id sequence " + name };
+		}
+		auto start = static_cast<unsigned long long>(stmt.getInt(0)) - count;
+		commitTransaction();
+		return start;
+	}
+	catch (const std::runtime_error &e) {
+		rollbackTransaction();
+		throw;
+	}
+}
+
+bool SqliteStorage::sequenceInTransaction() const {
+	return transactionDepth_ != 0;
+}
+
+unsigned long long SqliteStorage::sequenceNext(const IdAllocator::Sequence sequence) {
+	Statement stmt{ db_, "SELECT `next_id` FROM `id_sequences` WHERE `name` = ?" };
+	return stmt.bind(1, std::string{ IdAllocator::name(sequence) }).step() ? static_cast<unsigned long long>(stmt.getInt(0)) : 0;
+}
+
+void SqliteStorage::saveHorizon(const IdAllocator::Sequence sequence, const unsigned long long horizon) {
+	Statement stmt{ db_, "INSERT OR REPLACE INTO `id_horizons` (`node`, `name`, `next_id`, `updated`) VALUES (?, ?, ?, strftime('%s', 'now'))" };
+	stmt.bind(1, node_).bind(2, std::string{ IdAllocator::name(sequence) }).bind(3, static_cast<long long>(horizon)).run();
+}
+
+std::optional<unsigned long long> SqliteStorage::savedHorizon(const IdAllocator::Sequence sequence, const std::chrono::seconds age) {
+	Statement stmt{ db_,
+		"SELECT MIN(`next_id`) FROM `id_horizons` WHERE `name` = ? AND `node` <> ? AND `updated` >= CAST(strftime('%s', 'now') AS INTEGER) - ?"
+	};
+	stmt.bind(1, std::string{ IdAllocator::name(sequence) }).bind(2, node_).bind(3, static_cast<long long>(age.count()));
+	if (!stmt.step() || stmt.isNull(0)) {
+		return std::nullopt;
+	}
+	return static_cast<unsigned long long>(stmt.getInt(0));
+}
+
+void SqliteStorage::forEachUser(const std::function<void(const User &)> &callback) {
+	Statement stmt{ db_, std::string{ USER } + "ORDER BY `id`" };
+	forEachUserRow(stmt, callback);
+}
+
+void SqliteStorage::forEachUserById(const std::vector<unsigned> &ids, const std::function<void(const User &)> &callback) {
+	if (ids.empty()) {
+		return;
+	}
+	Statement stmt{ db_, std::string{ USER } + "WHERE `id` IN (" + placeholders(ids.size()) + ')' };
+	for (size_t i = 0; i < ids.size(); ++i) {
+		stmt.bind(static_cast<int>(i + 1), ids[i]);
+	}
+	forEachUserRow(stmt, callback);
+}
+
+void SqliteStorage::forEachUserByLogin(const std::vector<std::string> &logins, const std::function<void(const User &)> &callback) {
+	if (logins.empty()) {
+		return;
+	}
+	Statement stmt{ db_, std::string{ USER } + "WHERE `login` IN (" + placeholders(logins.size()) + ')' };
+	for (size_t i = 0; i < logins.size(); ++i) {
+		stmt.bind(static_cast<int>(i + 1), logins[i]);
+	}
+	forEachUserRow(stmt, callback);
+}
+
+void SqliteStorage::forEachUserRow(Statement &stmt, const std::function<void(const User &)> &callback) {
+	while (stmt.step()) {
+		callback(User{ static_cast<unsigned>(stmt.getInt(0)), stmt.getText(1), stmt.getText(2), stmt.getText(3) });
+	}
+}
+
+void SqliteStorage::saveUser(const unsigned id, const std::string &login, const std::string &password_hash, const std::string &name) {
+	Statement{ db_, "INSERT INTO `users` (`id`, `login`, `password_hash`, `name`) VALUES (?, ?, ?, ?)" }
+		.bind(1, id)
+		.bind(2, login)
+		.bind(3, password_hash)
+		.bind(4, name)
+		.run();
+}
+
+void SqliteStorage::removeUser(const std::string &login) {
+	Statement{ db_, "DELETE FROM `users` WHERE `login` = ?" }.bind(1, login).run();
+}
+
+void SqliteStorage::saveSessions(const std::vector<Session> &sessions) {
+	beginTransaction();
+	try {
+		Statement{ db_, "DELETE FROM `active_sessions` WHERE `node` = ?" }.bind(1, node_).run();
+		// a user may be online on two nodes for a moment, the newer snapshot shows it
+		Statement insert{ db_,
+			"INSERT OR REPLACE INTO `active_sessions` (`user_id`, `ip`, `pid`, `port`, `session_start`, `last_activity`, `node`) "
+			"VALUES (?, ?, ?, ?, datetime(?, 'unixepoch'), datetime(?, 'unixepoch'), ?)"
+		};
+		Statement login{ db_, "UPDATE `users` SET `last_login` = datetime(?, 'unixepoch') WHERE `id` = ?" };
+		for (const auto &session: sessions) {
+			insert.reset()
+				.bind(1, session.user_id)
+				.bind(2, session.ip)
+				.bind(3, session.pid)
+				.bind(4, session.port)
+				.bind(5, static_cast<long long>(session.started))
+				.bind(6, static_cast<long long>(session.active))
+				.bind(7, node_)
+				.run();
+			login.reset().bind(1, static_cast<long long>(session.started)).bind(2, session.user_id).run();
+		}
+		commitTransaction();
+	}
+	catch (const std::runtime_error &e) {
+		rollbackTransaction();
+		throw;
+	}
+}
+
+void SqliteStorage::savePrivateMessage(
+	const std::string &sender,
+	const std::string &receiver,
+	const std::string &text,
+	const bool read,
+	const time_t sent
+	) {
+	beginTransaction();
+	try {
+		// taken under the write lock, so ids are committed in ascending order
+		auto new_id = nextId(IdAllocator::MESSAGES);
+		Statement{ db_,
+			"INSERT INTO `messages` (`id`, `type`, `sender`, `receiver`, `text`, `sent`) VALUES (?, 'PRIVATE', "
+				"(SELECT `id` FROM `users` WHERE `login` = ?), "
+				"(SELECT `id` FROM `users` WHERE `login` = ?), ?, datetime(?, 'unixepoch'))"
+		}
+			.bind(1, new_id)
+			.bind(2, sender)
+			.bind(3, receiver)
+			.bind(4, text)
+			.bind(5, sent)
+			.run();
+		if (!read) {
+			Statement{ db_, NEXT_SEQ }.bind(1, receiver).run();
+			Statement{ db_, INSERT_UNREAD }.bind(1, new_id).bind(2, receiver).run();
+		}
+		commitTransaction();
+	}
+	catch (const std::runtime_error &e) {
+		rollbackTransaction();
+		throw;
+	}
+}
+
+void SqliteStorage::saveBroadcastMessage(
+	const std::string &sender,
+	const std::string &text,
+	const std::vector<std::string> &recipients,
+	const time_t sent
+	) {
+	// there is no channel with empty name, so channel_id is NULL
+	saveChannelMessage(sender, std::string{}, text, recipients, sent);
+}
+
+void SqliteStorage::saveChannelMessage(
+	const std::string &sender,
+	const std::string &channel,
+	const std::string &text,
+	const std::vector<std::string> &recipients,
+	const time_t sent
+	) {
+	beginTransaction();
+	try {
+		auto new_id = nextId(IdAllocator::MESSAGES);
+		Statement{ db_,
+			"INSERT INTO `messages` (`id`, `type`, `sender`, `channel_id`, `text`, `sent`) VALUES (?, 'BROADCAST', "
+				"(SELECT `id` FROM `users` WHERE `login` = ?), "
+				"(SELECT `id` FROM `channels` WHERE `name` = ?), ?, datetime(?, 'unixepoch'))"
+		}
+			.bind(1, new_id)
+			.bind(2, sender)
+			.bind(3, channel)
+			.bind(4, text)
+			.bind(5, sent)
+			.run();
+		// prepared statements reused for all recipients inside the transaction
+		Statement nextSeq{ db_, NEXT_SEQ };
+		Statement insertUnread{ db_, INSERT_UNREAD };
+		for (const auto &recipient: recipients) {
+			nextSeq.reset().bind(1, recipient).run();
+			insertUnread.reset().bind(1, new_id).bind(2, recipient).run();
+		}
+		commitTransaction();
+	}
+	catch (const std::runtime_error &e) {
+		rollbackTransaction();
+		throw;
+	}
+}
+
+void SqliteStorage::forEachHistory(Statement &stmt, const std::function<void(const HistoryEntry &)> &callback) {
+	while (stmt.step()) {
+		callback(HistoryEntry{
+			static_cast<unsigned long long>(stmt.getInt(0)),
+			stmt.getText(1),
+			stmt.getText(2),
+			stmt.getText(3),
+			stmt.getDouble(4),
+			stmt.getText(5),
+			static_cast<unsigned>(stmt.getInt(6))
+		});
+	}
+}
+
+void SqliteStorage::forEachMessageById(const std::vector<unsigned long long> &ids, const std::function<void(const HistoryEntry &)> &callback) {
+	if (ids.empty()) {
+		return;
+	}
+	std::string sql{ std::string{ HISTORY_PAGE } + "WHERE `messages`.`id` IN (?" };
+	for (size_t i = 1; i < ids.size(); ++i) {
+		sql += ", ?";
+	}
+	sql += ") ORDER BY `messages`.`id` DESC";
+	Statement stmt{ db_, sql };
+	for (size_t i = 0; i < ids.size(); ++i) {
+		stmt.bind(static_cast<int>(i + 1), static_cast<long long>(ids[i]));
+	}
+	forEachHistory(stmt, callback);
+}
+
+void SqliteStorage::forEachStored(Statement &stmt, const std::function<void(const StoredMessage &)> &callback) {
+	while (stmt.step()) {
+		callback(StoredMessage{
+			static_cast<unsigned long long>(stmt.getInt(0)),
+			static_cast<unsigned>(stmt.getInt(1)),
+			!stmt.isNull(2),
+			static_cast<unsigned>(stmt.getInt(2)),
+			static_cast<unsigned long long>(stmt.getInt(3)),
+			stmt.getText(4),
+			stmt.getDouble(5)
+		});
+	}
+}
+
+void SqliteStorage::forEachMessage(
+	const unsigned long long from_id,
+	const unsigned long long before_id,
+	const unsigned limit,
+	const std::function<void(const StoredMessage &)> &callback
+	) {
+	Statement stmt{ db_, std::string{ STORED_MESSAGE } + "WHERE `id` >= ? AND `id` < ? ORDER BY `id` LIMIT ?" };
+	stmt.bind(1, static_cast<long long>(from_id)).bind(2, historyKey(before_id)).bind(3, limit);
+	forEachStored(stmt, callback);
+}
+
+void SqliteStorage::forEachConversation(const Conversation *after, const unsigned limit, const std::function<void(const Conversation &)> &callback) {
+	std::vector<Conversation> conversations;
+	if (after == nullptr) {
+		conversations.push_back(Conversation{ false, 0, 0, 0 });
+	}
+	if ((after == nullptr || !after->is_private) && conversations.size() < limit) {
+		Statement channels{ db_, "SELECT `id` FROM `channels` WHERE `id` > ? ORDER BY `id` LIMIT ?" };
+		channels.bind(1, static_cast<long long>(after == nullptr ? 0 : after->channel_id)).bind(2, static_cast<long long>(limit - conversations.size()));
+		while (channels.step()) {
+			conversations.push_back(Conversation{ false, 0, 0, static_cast<unsigned long long>(channels.getInt(0)) });
+		}
+	}
+	if (conversations.size() < limit) {
+		// a keyset range of the pair index, both directions of a conversation are in it
+		std::string sql{ "SELECT DISTINCT MIN(`receiver`, `sender`), MAX(`receiver`, `sender`) FROM `messages` WHERE `receiver` IS NOT NULL " };
+		if (after != nullptr && after->is_private) {
+			sql += "AND MIN(`receiver`, `sender`) >= ? AND (MIN(`receiver`, `sender`) > ? OR MAX(`receiver`, `sender`) > ?) ";
+		}
+		Statement pairs{ db_, sql + "ORDER BY 1, 2 LIMIT ?" };
+		int n{ 0 };
+		if (after != nullptr && after->is_private) {
+			pairs.bind(1, after->user_id).bind(2, after->user_id).bind(3, after->peer_id);
+			n = 3;
+		}
+		pairs.bind(n + 1, static_cast<long long>(limit - conversations.size()));
+		while (pairs.step()) {
+			conversations.push_back(Conversation{ true, static_cast<unsigned>(pairs.getInt(0)), static_cast<unsigned>(pairs.getInt(1)), 0 });
+		}
+	}
+	for (const auto &conversation: conversations) {
+		callback(conversation);
+	}
+}
+
+unsigned long long SqliteStorage::conversationFloor(const Conversation &conversation, const unsigned keep) {
+	if (keep == 0) {
+		return 0;
+	}
+	std::string sql;
+	if (!conversation.is_private) {
+		sql = "SELECT `id` FROM `messages` WHERE " + channelFilter(conversation) + "ORDER BY `id` DESC LIMIT 1 OFFSET ?";
+	}
+	else {
+		// every direction gives its newest messages, the floor is among them
+		std::string direction{ "SELECT * FROM (SELECT `id` FROM `messages` WHERE `receiver` = ? AND `sender` = ? ORDER BY `id` DESC LIMIT ?)" };
+		sql = direction;
+		if (conversation.user_id != conversation.peer_id) {
+			sql += " UNION ALL " + direction;
+		}
+		sql += " ORDER BY `id` DESC LIMIT 1 OFFSET ?";
+	}
+	Statement stmt{ db_, sql };
+	int n{ 0 };
+	if (!conversation.is_private) {
+		if (conversation.channel_id != 0) {
+			stmt.bind(++n, static_cast<long long>(conversation.channel_id));
+		}
+	}
+	else {
+		auto bindDirection = [&](const unsigned receiver, const unsigned sender) {
+			stmt.bind(++n, receiver);
+			stmt.bind(++n, sender);
+			stmt.bind(++n, keep);
+		};
+		bindDirection(conversation.user_id, conversation.peer_id);
+		if (conversation.user_id != conversation.peer_id) {
+			bindDirection(conversation.peer_id, conversation.user_id);
+		}
+	}
+	stmt.bind(++n, keep - 1);
+	if (!stmt.step()) {
+		return 0;
+	}
+	return static_cast<unsigned long long>(stmt.getInt(0));
+}
+
+void SqliteStorage::forEachReadMessage(
+	const Conversation *conversation,
+	const unsigned long long from_id,
+	const unsigned long long before_id,
+	const unsigned limit,
+	const std::function<void(const StoredMessage &)> &callback
+	) {
+	std::string range{ std::string{ "`id` >= ? AND `id` < ? AND " } + READ_MESSAGE + "ORDER BY `id` LIMIT ?" };
+	std::string sql;
+	if (conversation == nullptr) {
+		sql = std::string{ STORED_MESSAGE } + "WHERE " + range;
+	}
+	else if (!conversation->is_private) {
+		sql = std::string{ STORED_MESSAGE } + "WHERE " + channelFilter(*conversation) + "AND " + range;
+	}
+	else {
+		// every direction is a separate range of the conversation index
+		std::string direction{ std::string{ "SELECT * FROM (" } + STORED_MESSAGE + "WHERE `receiver` = ? AND `sender` = ? AND " + range + ")" };
+		sql = direction;
+		if (conversation->user_id != conversation->peer_id) {
+			sql += " UNION ALL " + direction + " ORDER BY `id` LIMIT ?";
+		}
+	}
+	Statement stmt{ db_, sql };
+	int n{ 0 };
+	auto bindRange = [&]() {
+		stmt.bind(++n, static_cast<long long>(from_id));
+		stmt.bind(++n, historyKey(before_id));
+		stmt.bind(++n, limit);
+	};
+	if (conversation == nullptr) {
+		bindRange();
+	}
+	else if (!conversation->is_private) {
+		if (conversation->channel_id != 0) {
+			stmt.bind(++n, static_cast<long long>(conversation->channel_id));
+		}
+		bindRange();
+	}
+	else {
+		auto bindDirection = [&](const unsigned receiver, const unsigned sender) {
+			stmt.bind(++n, receiver);
+			stmt.bind(++n, sender);
+			bindRange();
+		};
+		bindDirection(conversation->peer_id, conversation->user_id);
+		if (conversation->user_id != conversation->peer_id) {
+			bindDirection(conversation->user_id, conversation->peer_id);
+			stmt.bind(++n, limit);
+		}
+	}
+	forEachStored(stmt, callback);
+}
+
+size_t SqliteStorage::removeMessages(const std::vector<unsigned long long> &ids) {
+	if (ids.empty()) {
+		return 0;
+	}
+	// unread deliveries would be removed by the foreign key, such messages stay
+	std::string sql{ "DELETE FROM `messages` WHERE `id` IN (?" };
+	for (size_t i = 1; i < ids.size(); ++i) {
+		sql += ", ?";
+	}
+	sql += std::string{ ") AND " } + READ_MESSAGE;
+	Statement stmt{ db_, sql };
+	for (size_t i = 0; i < ids.size(); ++i) {
+		stmt.bind(static_cast<int>(i + 1), static_cast<long long>(ids[i]));
+	}
+	stmt.run();
+	return sqlite3_changes(db_);
+}
+
+void SqliteStorage::forEachBroadcastHistory(const unsigned long long before_id, const unsigned limit, const std::function<void(const HistoryEntry &)> &callback) {
+	Statement stmt{ db_,
+		std::string{ "SELECT * FROM (" } + HISTORY_PAGE +
+			"WHERE `messages`.`channel_id` IS NULL AND `messages`.`receiver` IS NULL AND `messages`.`id` < ? "
+			"ORDER BY `messages`.`id` DESC LIMIT ?"
+		") ORDER BY `id`"
+	};
+	stmt.bind(1, historyKey(before_id)).bind(2, limit);
+	forEachHistory(stmt, callback);
+}
+
+void SqliteStorage::forEachChannelHistory(const std::string &channel, const unsigned long long before_id, const unsigned limit, const std::function<void(const HistoryEntry &)> &callback) {
+	Statement stmt{ db_,
+		std::string{ "SELECT * FROM (" } + HISTORY_PAGE +
+			"WHERE `messages`.`channel_id` = (SELECT `id` FROM `channels` WHERE `name` = ?) AND `messages`.`receiver` IS NULL AND `messages`.`id` < ? "
+			"ORDER BY `messages`.`id` DESC LIMIT ?"
+		") ORDER BY `id`"
+	};
+	stmt.bind(1, channel).bind(2, historyKey(before_id)).bind(3, limit);
+	forEachHistory(stmt, callback);
+}
+
+void SqliteStorage::forEachPrivateHistory(
+	const std::string &login,
+	const std::string &peer,
+	const unsigned long long before_id,
+	const unsigned limit,
+	const std::function<void(const HistoryEntry &)> &callback
+	) {
+	// every direction is a separate range of the conversation index, each limited to the page
+	std::string direction{
+		std::string{ "SELECT * FROM (" } + HISTORY_PAGE +
+			"WHERE `messages`.`receiver` = (SELECT `id` FROM `users` WHERE `login` = ?) "
+				"AND `messages`.`sender` = (SELECT `id` FROM `users` WHERE `login` = ?) "
+				"AND `messages`.`id` < ? "
+			"ORDER BY `messages`.`id` DESC LIMIT ?"
+		")"
+	};
+	// a conversation with oneself is read once
+	Statement stmt{ db_,
+		"SELECT * FROM (" +
+			direction + " UNION ALL " + direction + " WHERE `receiver` <> `sender` "
+			"ORDER BY `id` DESC LIMIT ?"
+		") ORDER BY `id`"
+	};
+	auto key = historyKey(before_id);
+	stmt.bind(1, peer).bind(2, login).bind(3, key).bind(4, limit)
+		.bind(5, login).bind(6, peer).bind(7, key).bind(8, limit)
+		.bind(9, limit);
+	forEachHistory(stmt, callback);
+}
+
+void SqliteStorage::forEachChannelMember(const std::function<void(const ChannelMember &)> &callback) {
+	Statement stmt{ db_,
+		"SELECT "
+			"`channels`.`id`, "
+			"`channels`.`name`, "
+			"`users`.`id`, "
+			"`users`.`login` "
+		"FROM "
+			"`channel_members` "
+		"JOIN "
+			"`channels` ON `channels`.`id` = `channel_members`.`channel_id` "
+		"JOIN "
+			"`users` ON `users`.`id` = `channel_members`.`user_id` "
+		"ORDER BY `channels`.`id`, `users`.`id`"
+	};
+	while (stmt.step()) {
+		callback(ChannelMember{
+			static_cast<unsigned long long>(stmt.getInt(0)),
+			stmt.getText(1),
+			static_cast<unsigned>(stmt.getInt(2)),
+			stmt.getText(3)
+		});
+	}
+}
+
+void SqliteStorage::joinChannel(const std::string &channel, const unsigned user_id) {
+	beginTransaction();
+	try {
+		Statement exists{ db_, "SELECT 1 FROM `channels` WHERE `name` = ?" };
+		if (!exists.bind(1, channel).step()) {
+			Statement{ db_, "INSERT INTO `channels` (`id`, `name`) VALUES (?, ?)" }
+				.bind(1, static_cast<long long>(reserveIds(IdAllocator::CHANNELS, 1))).bind(2, channel).run();
+		}
+		Statement{ db_,
+			"INSERT OR IGNORE INTO `channel_members` (`channel_id`, `user_id`) "
+			"SELECT `id`, ? FROM `channels` WHERE `name` = ?"
+		}.bind(1, user_id).bind(2, channel).run();
+		commitTransaction();
+	}
+	catch (const std::runtime_error &e) {
+		rollbackTransaction();
+		throw;
+	}
+}
+
+void SqliteStorage::leaveChannel(const std::string &channel, const unsigned user_id) {
+	Statement{ db_,
+		"DELETE FROM `channel_members` "
+		"WHERE `user_id` = ? AND `channel_id` = (SELECT `id` FROM `channels` WHERE `name` = ?)"
+	}.bind(1, user_id).bind(2, channel).run();
+}
+
+unsigned long long SqliteStorage::journalPosition() {
+	Statement stmt{ db_, "SELECT `position` FROM `journal_checkpoint` WHERE `id` = 1" };
+	if (!stmt.step()) {
+		return 0;
+	}
+	return stmt.getInt(0);
+}
+
+void SqliteStorage::setJournalPosition(const unsigned long long position) {
+	Statement{ db_, "REPLACE INTO `journal_checkpoint` (`id`, `position`) VALUES (1, ?)" }.bind(1, position).run();
+}
+
+void SqliteStorage::forEachUnread(const unsigned user_id, const unsigned long long after_seq, const unsigned limit, const std::function<void(const Delivery &)> &callback) {
+	Statement stmt{ db_,
+		"SELECT "
+			"`messages`.`receiver`, "
+			"`messages`.`text`, "
+			"`unread_messages`.`user_id`, "
+			"`messages`.`id`, "
+			"`sender_users`.`login`, "
+			"CAST(strftime('%s', `messages`.`sent`) AS REAL), "
+			"`channels`.`name`, "
+			"`unread_messages`.`seq`, "
+			"`messages`.`sender` "
+		"FROM "
+			"`unread_messages` "
+		"JOIN "
+			"`messages` ON `messages`.`id` = `unread_messages`.`message_id` "
+		"JOIN "
+			"`users` AS `sender_users` ON `messages`.`sender` = `sender_users`.`id` "
+		"LEFT JOIN "
+			"`channels` ON `channels`.`id` = `messages`.`channel_id` "
+		"WHERE "
+			"`unread_messages`.`user_id` = ? AND "
+			"`unread_messages`.`seq` > ? "
+		"ORDER BY `unread_messages`.`seq` LIMIT ?"
+	};
+	stmt.bind(1, user_id).bind(2, after_seq).bind(3, limit);
+	while (stmt.step()) {
+		callback(Delivery{
+			static_cast<unsigned long long>(stmt.getInt(3)),
+			static_cast<unsigned>(stmt.getInt(2)),
+			!stmt.isNull(0),
+			stmt.getText(4),
+			stmt.getText(1),
+			stmt.getDouble(5),
+			stmt.getText(6),
+			static_cast<unsigned long long>(stmt.getInt(7)),
+			static_cast<unsigned>(stmt.getInt(8))
+		});
+	}
+}
+
+void SqliteStorage::acknowledge(const unsigned user_id, const unsigned long long seq) {
+	beginTransaction();
+	try {
+		// the cursor is moved forward only, acknowledgements may come out of order after reconnect
+		Statement{ db_, "UPDATE `delivery_cursors` SET `acked_seq` = MAX(`acked_seq`, ?) WHERE `user_id` = ?" }
+			.bind(1, seq)
+			.bind(2, user_id)
+			.run();
+		Statement{ db_, "DELETE FROM `unread_messages` WHERE `user_id` = ? AND `seq` <= ?" }
+			.bind(1, user_id)
+			.bind(2, seq)
+			.run();
+		commitTransaction();
+	}
+	catch (const std::runtime_error &e) {
+		rollbackTransaction();
+		throw;
+	}
+}
+
+MemoryStorage::MemoryStorage(const pid_t serverPid) : SqliteStorage{ filename(serverPid) } {
+	// nothing is kept after exit, so there is no point to wait for the disk
+	execute("PRAGMA synchronous = OFF");
+}
+
+std::string MemoryStorage::filename(const pid_t serverPid) {
+	fs::path dir{ fs::exists("/dev/shm") ? "/dev/shm" : fs::temp_directory_path() };
+	return (dir / ("chat_server-" + std::to_string(serverPid) + ".db")).string();
+}
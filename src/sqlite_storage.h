@@ -0,0 +1,109 @@
+#pragma once
+
+#include "storage.h"
+
+#include <source_location>
+
+extern "C" {
+	#include <sqlite3.h>
+}
+
+// Embedded storage in a SQLite database file. The file may be shared by all server processes
+class SqliteStorage : public Storage {
+public:
+	SqliteStorage(const std::string &filename);
+	SqliteStorage(const SqliteStorage &) = delete;
+	SqliteStorage &operator=(const SqliteStorage &) = delete;
+	~SqliteStorage() override;
+
+	bool isConnected() const override;
+
+	void beginTransaction() override;
+	void commitTransaction() override;
+	void rollbackTransaction() override;
+
+	void forEachUser(const std::function<void(const User &)> &callback) override;
+	void forEachUserById(const std::vector<unsigned> &ids, const std::function<void(const User &)> &callback) override;
+	void forEachUserByLogin(const std::vector<std::string> &logins, const std::function<void(const User &)> &callback) override;
+	void saveUser(unsigned id, const std::string &login, const std::string &password_hash, const std::string &name) override;
+	void removeUser(const std::string &login) override;
+
+	void saveSessions(const std::vector<Session> &sessions) override;
+
+	void savePrivateMessage(const std::string &sender, const std::string &receiver, const std::string &text, bool read, time_t sent) override;
+	void saveBroadcastMessage(const std::string &sender, const std::string &text, const std::vector<std::string> &recipients, time_t sent) override;
+	void saveChannelMessage(const std::string &sender, const std::string &channel, const std::string &text, const std::vector<std::string> &recipients, time_t sent) override;
+
+	void forEachBroadcastHistory(unsigned long long before_id, unsigned limit, const std::function<void(const HistoryEntry &)> &callback) override;
+	void forEachChannelHistory(const std::string &channel, unsigned long long before_id, unsigned limit, const std::function<void(const HistoryEntry &)> &callback) override;
+	void forEachPrivateHistory(const std::string &login, const std::string &peer, unsigned long long before_id, unsigned limit, const std::function<void(const HistoryEntry &)> &callback) override;
+	void forEachMessageById(const std::vector<unsigned long long> &ids, const std::function<void(const HistoryEntry &)> &callback) override;
+	void forEachMessage(unsigned long long from_id, unsigned long long before_id, unsigned limit, const std::function<void(const StoredMessage &)> &callback) override;
+
+	void forEachConversation(const Conversation *after, unsigned limit, const std::function<void(const Conversation &)> &callback) override;
+	unsigned long long conversationFloor(const Conversation &conversation, unsigned keep) override;
+	void forEachReadMessage(const Conversation *conversation, unsigned long long from_id, unsigned long long before_id, unsigned limit, const std::function<void(const StoredMessage &)> &callback) override;
+	size_t removeMessages(const std::vector<unsigned long long> &ids) override;
+
+	void forEachChannelMember(const std::function<void(const ChannelMember &)> &callback) override;
+	void joinChannel(const std::string &channel, unsigned user_id) override;
+	void leaveChannel(const std::string &channel, unsigned user_id) override;
+
+	unsigned long long journalPosition() override;
+	void setJournalPosition(unsigned long long position) override;
+
+	void forEachUnread(unsigned user_id, unsigned long long after_seq, unsigned limit, const std::function<void(const Delivery &)> &callback) override;
+	void acknowledge(unsigned user_id, unsigned long long seq) override;
+
+protected:
+	unsigned long long reserveIds(IdAllocator::Sequence sequence, unsigned long long count) override;
+	bool sequenceInTransaction() const override;
+	unsigned long long sequenceNext(IdAllocator::Sequence sequence) override;
+	void saveHorizon(IdAllocator::Sequence sequence, unsigned long long horizon) override;
+	std::optional<unsigned long long> savedHorizon(IdAllocator::Sequence sequence, std::chrono::seconds age) override;
+
+	// Prepared statement, finalized and accounted in metrics on destruction
+	class Statement {
+	public:
+		Statement(sqlite3 *db, const std::string &sql, const std::source_location &location = std::source_location::current());
+		Statement(const Statement &) = delete;
+		Statement &operator=(const Statement &) = delete;
+		~Statement();
+
+		Statement &bind(int index, long long value);
+		Statement &bind(int index, const std::string &value);
+		Statement &reset(); // to execute again with new values
+		bool step(); // true if a row is available
+		void run(); // step through all rows
+		bool isNull(int column) const;
+		long long getInt(int column) const;
+		double getDouble(int column) const;
+		std::string_view getText(int column) const;
+
+	private:
+		sqlite3 *db_;
+		sqlite3_stmt *stmt_{ nullptr };
+		std::string sql_;
+		double elapsed_{ 0.0 };
+		unsigned long long rows_{ 0 };
+	};
+
+	void execute(const std::string &sql);
+	void migrate(); // bring database files of older versions up to date
+	void forEachUserRow(Statement &stmt, const std::function<void(const User &)> &callback); // rows selected by USER
+	void forEachHistory(Statement &stmt, const std::function<void(const HistoryEntry &)> &callback); // rows of a history page
+	void forEachStored(Statement &stmt, const std::function<void(const StoredMessage &)> &callback); // rows selected by STORED_MESSAGE
+
+	sqlite3 *db_{ nullptr };
+	unsigned transactionDepth_{ 0 };
+};
+
+// Volatile storage for a single server instance: a SQLite database on tmpfs,
+// removed when the server exits. Containers in the heap of one process would not be
+// seen by the forked client processes, the database file is shared by all of them
+class MemoryStorage final : public SqliteStorage {
+public:
+	MemoryStorage(pid_t serverPid);
+
+	static std::string filename(pid_t serverPid);
+};
@@ -0,0 +1,117 @@
+#include "storage.h"
+#include "mysql_storage.h"
+#include "sqlite_storage.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+std::unique_ptr<Storage> Storage::create(const ConfigFile &config, const pid_t serverPid) {
+	auto backend = config.get("StorageBackend", "mysql");
+	std::unique_ptr<Storage> storage;
+	if (backend == "mysql") {
+		storage = std::make_unique<MysqlStorage>(config);
+	}
+	else if (backend == "sqlite") {
+		storage = std::make_unique<SqliteStorage>(config.get("SqliteFile", "chat.db"));
+	}
+	else if (backend == "memory") {
+		storage = std::make_unique<MemoryStorage>(serverPid);
+	}
+	else {
+		throw std::runtime_error{ "Unknown storage backend: " + backend };
+	}
+	try {
+		storage->node_ = std::stoul(config.get("NodeId", "0"));
+	}
+	catch (const std::exception &e) {
+		throw std::runtime_error{ "Invalid NodeId: " + config.get("NodeId", "0") };
+	}
+	return storage;
+}
+
+unsigned long long Storage::nextId(const IdAllocator::Sequence sequence) {
+	if (ids_ == nullptr) {
+		return reserveIds(sequence, 1);
+	}
+	if (sequence != IdAllocator::MESSAGES) {
+		return blockId(sequence);
+	}
+	// messages are committed out of order, readers in id order stop below the ids held until the transaction ends
+	if (!writer_) {
+		writer_ = ids_->enter();
+	}
+	auto id = blockId(sequence);
+	if (!held_ || id < *held_) {
+		held_ = id;
+		ids_->hold(*writer_, id);
+	}
+	return id;
+}
+
+unsigned long long Storage::blockId(const IdAllocator::Sequence sequence) {
+	if (auto id = ids_->take(sequence)) {
+		return *id;
+	}
+	auto &pending = pending_[sequence];
+	if (pending && pending->next < pending->end) {
+		return pending->next++;
+	}
+	auto size = ids_->blockSize();
+	auto start = reserveIds(sequence, size);
+	if (sequenceInTransaction()) {
+		// a rollback returns the block to the sequence, so nobody else may use it before the commit
+		pending = Block{ start, start + 1, start + size };
+	}
+	else {
+		ids_->publish(sequence, start, 1);
+	}
+	return start;
+}
+
+void Storage::finishTransaction(const bool committed) {
+	for (unsigned i = 0; i < IdAllocator::SEQUENCES_TOTAL; ++i) {
+		auto &pending = pending_[i];
+		if (pending && committed) {
+			ids_->publish(static_cast<IdAllocator::Sequence>(i), pending->start, pending->next - pending->start);
+		}
+		pending.reset();
+	}
+	if (writer_) {
+		ids_->leave(*writer_);
+		writer_.reset();
+		held_.reset();
+	}
+}
+
+unsigned long long Storage::messageHorizon(const std::chrono::seconds age) {
+	// the sequence is read before the ids of the node, a block reserved in between starts after it
+	auto next = sequenceNext(IdAllocator::MESSAGES);
+	auto horizon = ids_ != nullptr ? ids_->horizon(next) : next;
+	if (auto others = savedHorizon(IdAllocator::MESSAGES, age)) {
+		horizon = std::min(horizon, *others);
+	}
+	return horizon;
+}
+
+void Storage::saveMessageHorizon(const std::chrono::seconds idle) {
+	if (ids_ == nullptr) {
+		return;
+	}
+	auto next = sequenceNext(IdAllocator::MESSAGES);
+	// the ids of the other nodes above an unused block wait for it otherwise
+	ids_->retire(IdAllocator::MESSAGES, idle, next);
+	saveHorizon(IdAllocator::MESSAGES, ids_->horizon(next));
+}
+
+void Storage::cleanup(const ConfigFile &config, const pid_t serverPid) {
+	if (config.get("StorageBackend", "mysql") != "memory") {
+		return;
+	}
+	auto filename = MemoryStorage::filename(serverPid);
+	for (const auto &suffix: { "", "-wal", "-shm" }) {
+		fs::remove(filename + suffix);
+	}
+}
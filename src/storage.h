@@ -0,0 +1,204 @@
+#pragma once
+
+#include "config_file.h"
+#include "id_allocator.h"
+
+#include <chrono>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+extern "C" {
+	#include <sys/types.h>
+}
+
+// Persistence interface of the chat server: users, sessions, messages and delivery state.
+// Every method throws std::runtime_error on failure. An instance belongs to one process
+// and must not be used across fork()
+class Storage {
+public:
+	// Records passed to visitors. Views are valid only inside the callback
+	struct User {
+		unsigned id;
+		std::string_view login;
+		std::string_view password_hash;
+		std::string_view name;
+	};
+
+	// passed to saveSessions()
+	struct Session {
+		unsigned user_id;
+		std::string ip;
+		unsigned short port;
+		pid_t pid;
+		time_t started;
+		time_t active; // last message
+	};
+
+	struct Delivery {
+		unsigned long long message_id;
+		unsigned user_id;
+		bool is_private;
+		std::string_view sender;
+		std::string_view text;
+		double sent; // unix time
+		std::string_view channel; // empty if not a channel message
+		unsigned long long seq; // position in the delivery stream of the recipient
+		unsigned sender_id;
+	};
+
+	struct HistoryEntry {
+		unsigned long long id;
+		std::string_view sender;
+		std::string_view receiver; // empty if not a private message
+		std::string_view text;
+		double sent; // unix time
+		std::string_view channel; // empty if not a channel message
+		unsigned sender_id;
+	};
+
+	struct StoredMessage {
+		unsigned long long id;
+		unsigned sender_id;
+		bool is_private;
+		unsigned receiver_id; // private message only
+		unsigned long long channel_id; // 0 if not a channel message
+		std::string_view text;
+		double sent; // unix time
+	};
+
+	// unit of the retention policy: the broadcast, a channel or the messages between two users in both directions
+	struct Conversation {
+		bool is_private;
+		unsigned user_id; // private conversation: the smaller user id
+		unsigned peer_id; // and the greater one, equal for a conversation with oneself
+		unsigned long long channel_id; // 0 for the broadcast and private conversations
+	};
+
+	struct ChannelMember {
+		unsigned long long channel_id;
+		std::string_view channel;
+		unsigned user_id;
+		std::string_view login;
+	};
+
+	virtual ~Storage() = default;
+
+	// false if the connection is lost and the instance has to be recreated
+	virtual bool isConnected() const = 0;
+	// another process has written data this one is going to read, backends reading from replicas
+	// keep the next reads on the primary
+	virtual void observeWrite() {}
+
+	// transactions may be nested, only the outermost one is committed. Rollback aborts all levels
+	virtual void beginTransaction() = 0;
+	virtual void commitTransaction() = 0;
+	virtual void rollbackTransaction() = 0;
+
+	// ids of new users and messages are taken from blocks of the allocator shared by the processes
+	// of the node, without it every id is reserved in the database
+	void setIdAllocator(IdAllocator *ids) { ids_ = ids; }
+
+	// users
+	virtual void forEachUser(const std::function<void(const User &)> &callback) = 0;
+	// one query for all the users, the ones not found are skipped
+	virtual void forEachUserById(const std::vector<unsigned> &ids, const std::function<void(const User &)> &callback) = 0;
+	virtual void forEachUserByLogin(const std::vector<std::string> &logins, const std::function<void(const User &)> &callback) = 0;
+	unsigned nextUserId() { return static_cast<unsigned>(nextId(IdAllocator::USERS)); }
+	virtual void saveUser(unsigned id, const std::string &login, const std::string &password_hash, const std::string &name) = 0;
+	virtual void removeUser(const std::string &login) = 0;
+
+	// snapshot of the sessions of this node, replaces the previous one at once and sets the last login
+	// of their users. Sessions of other nodes sharing the database are kept
+	virtual void saveSessions(const std::vector<Session> &sessions) = 0;
+
+	// messages
+	virtual void savePrivateMessage(const std::string &sender, const std::string &receiver, const std::string &text, bool read, time_t sent) = 0;
+	virtual void saveBroadcastMessage(const std::string &sender, const std::string &text, const std::vector<std::string> &recipients, time_t sent) = 0;
+	virtual void saveChannelMessage(const std::string &sender, const std::string &channel, const std::string &text, const std::vector<std::string> &recipients, time_t sent) = 0;
+
+	// history pages, oldest message first. A page holds up to limit messages with id less than before_id,
+	// 0 for the newest ones. Every page is read by index without skipping the newer ones
+	virtual void forEachBroadcastHistory(unsigned long long before_id, unsigned limit, const std::function<void(const HistoryEntry &)> &callback) = 0;
+	virtual void forEachChannelHistory(const std::string &channel, unsigned long long before_id, unsigned limit, const std::function<void(const HistoryEntry &)> &callback) = 0;
+	// messages between two users in both directions
+	virtual void forEachPrivateHistory(const std::string &login, const std::string &peer, unsigned long long before_id, unsigned limit, const std::function<void(const HistoryEntry &)> &callback) = 0;
+	// selected messages, newest first
+	virtual void forEachMessageById(const std::vector<unsigned long long> &ids, const std::function<void(const HistoryEntry &)> &callback) = 0;
+	// up to limit messages with from_id <= id < before_id (0 for no bound) in id order, for indexes kept outside the database
+	virtual void forEachMessage(unsigned long long from_id, unsigned long long before_id, unsigned limit, const std::function<void(const StoredMessage &)> &callback) = 0;
+	// message ids below it are committed or never will be, readers in id order stop there. The other nodes are
+	// known by the horizons they have saved within age
+	unsigned long long messageHorizon(std::chrono::seconds age);
+	// saves the horizon of the ids taken by this node for the other nodes. The current block is given up if
+	// no id has been taken from it for idle and another node has reserved a later one
+	void saveMessageHorizon(std::chrono::seconds idle);
+
+	// retention. Up to limit conversations that may hold messages after the given one (nullptr to start) in their order:
+	// the broadcast, the channels by id, then the private conversations by their user ids
+	virtual void forEachConversation(const Conversation *after, unsigned limit, const std::function<void(const Conversation &)> &callback) = 0;
+	// id of the keep-th newest message of the conversation, 0 if it has no more than keep messages
+	virtual unsigned long long conversationFloor(const Conversation &conversation, unsigned keep) = 0;
+	// up to limit messages read by all their recipients with from_id <= id < before_id (0 for no bound) in id order,
+	// of one conversation or of all of them if it is nullptr
+	virtual void forEachReadMessage(const Conversation *conversation, unsigned long long from_id, unsigned long long before_id, unsigned limit, const std::function<void(const StoredMessage &)> &callback) = 0;
+	// removes the messages that are read by all their recipients, returns the number of removed ones
+	virtual size_t removeMessages(const std::vector<unsigned long long> &ids) = 0;
+
+	// channels, a channel is created by the first member
+	virtual void forEachChannelMember(const std::function<void(const ChannelMember &)> &callback) = 0;
+	virtual void joinChannel(const std::string &channel, unsigned user_id) = 0;
+	virtual void leaveChannel(const std::string &channel, unsigned user_id) = 0;
+
+	// position of the last message journal record applied to the storage, 0 if nothing is applied yet
+	virtual unsigned long long journalPosition() = 0;
+	// written in the current transaction of every database that has records of the journal
+	virtual void setJournalPosition(unsigned long long position) = 0;
+	// the next saved message is the journal record ending at position, until the transaction ends.
+	// Backends committing several databases skip the databases that already have it
+	virtual void setRecordPosition(unsigned long long /*position*/) {}
+
+	// unread messages and delivery state. Every recipient numbers own deliveries by seq starting from 1,
+	// at most limit unread messages with seq greater than after_seq are visited in seq order
+	virtual void forEachUnread(unsigned user_id, unsigned long long after_seq, unsigned limit, const std::function<void(const Delivery &)> &callback) = 0;
+	// cumulative acknowledgement: messages up to seq have reached the client and are removed from unread
+	virtual void acknowledge(unsigned user_id, unsigned long long seq) = 0;
+
+	// creates backend selected by StorageBackend option: mysql (default), sqlite or memory
+	static std::unique_ptr<Storage> create(const ConfigFile &config, pid_t serverPid);
+	// removes data of volatile backends when the server exits
+	static void cleanup(const ConfigFile &config, pid_t serverPid);
+
+protected:
+	unsigned long long nextId(IdAllocator::Sequence sequence);
+	// first of count new ids of the sequence, a multiple of count. Part of the current transaction if the sequence
+	// is written in it, a new one otherwise
+	virtual unsigned long long reserveIds(IdAllocator::Sequence sequence, unsigned long long count) = 0;
+	virtual bool sequenceInTransaction() const = 0; // reserveIds() would be rolled back with the current transaction
+	virtual unsigned long long sequenceNext(IdAllocator::Sequence sequence) = 0; // every id reserved so far is below it
+	virtual void saveHorizon(IdAllocator::Sequence sequence, unsigned long long horizon) = 0; // of this node
+	// the lowest horizon of the other nodes saved within age, nothing if there is none
+	virtual std::optional<unsigned long long> savedHorizon(IdAllocator::Sequence sequence, std::chrono::seconds age) = 0;
+	void finishTransaction(bool committed); // called by the backends when the outermost transaction ends
+
+	unsigned node_{ 0 }; // NodeId option, set by create()
+
+private:
+	struct Block {
+		unsigned long long start;
+		unsigned long long next;
+		unsigned long long end;
+	};
+
+	unsigned long long blockId(IdAllocator::Sequence sequence);
+
+	IdAllocator *ids_{ nullptr };
+	// reserved in the current transaction, the other processes get them after the commit
+	std::optional<Block> pending_[IdAllocator::SEQUENCES_TOTAL];
+	std::optional<size_t> writer_; // of the allocator, while the transaction writes messages
+	std::optional<unsigned long long> held_; // lowest message id of the transaction
+};
@@ -0,0 +1,107 @@
+#include "unix_socket.h"
+
+#include <cstring>
+#include <stdexcept>
+
+extern "C" {
+	#include <errno.h>
+	#include <sys/socket.h>
+	#include <sys/un.h>
+	#include <unistd.h>
+}
+
+namespace {
+	const size_t MAX_DATA{ 4096 };
+
+	sockaddr_un address(const std::string &path) {
+		sockaddr_un addr{};
+		if (path.size() >= sizeof(addr.sun_path)) {
+			throw std::runtime_error{ "Socket path is too long: " + path };
+		}
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, path.c_str());
+		return addr;
+	}
+
+	std::string systemError(const std::string &what) {
+		return what + ": " + strerror(errno);
+	}
+}
+
+int Chat::listenUnix(const std::string &path) {
+	auto addr = address(path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		throw std::runtime_error{ systemError("Can not create local socket") };
+	}
+	unlink(path.c_str());
+	if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+		auto error = systemError("Can not listen " + path);
+		close(fd);
+		throw std::runtime_error{ error };
+	}
+	return fd;
+}
+
+int Chat::connectUnix(const std::string &path) {
+	auto addr = address(path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		throw std::runtime_error{ systemError("Can not create local socket") };
+	}
+	if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1) {
+		auto error = systemError("Can not connect " + path);
+		close(fd);
+		throw std::runtime_error{ error };
+	}
+	return fd;
+}
+
+void Chat::sendDescriptor(const int socket, const int fd, const std::string &data) {
+	if (data.empty() || data.size() > MAX_DATA) {
+		throw std::runtime_error{ "Invalid size of descriptor data" };
+	}
+	iovec iov{ const_cast<char *>(data.data()), data.size() };
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))]{};
+	msghdr msg{};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	auto cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	ssize_t sent;
+	while ((sent = sendmsg(socket, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+	}
+	if (sent != static_cast<ssize_t>(data.size())) {
+		throw std::runtime_error{ systemError("Can not pass descriptor") };
+	}
+}
+
+int Chat::receiveDescriptor(const int socket, std::string &data) {
+	data.resize(MAX_DATA);
+	iovec iov{ data.data(), data.size() };
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))]{};
+	msghdr msg{};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t received;
+	while ((received = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+	}
+	if (received <= 0) {
+		throw std::runtime_error{ received == 0 ? std::string{ "Peer closed local socket" } : systemError("Can not receive descriptor") };
+	}
+	data.resize(received);
+	auto cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		throw std::runtime_error{ "No descriptor received" };
+	}
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
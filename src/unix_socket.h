@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+
+// Local sockets used to hand descriptors over between server processes
+namespace Chat {
+	// bound and listening socket, an existing file at the path is replaced
+	int listenUnix(const std::string &path);
+	int connectUnix(const std::string &path);
+
+	// passes a descriptor with a short text attached (SCM_RIGHTS)
+	void sendDescriptor(int socket, int fd, const std::string &data);
+	// returns the received descriptor, the attached text is stored to data
+	int receiveDescriptor(int socket, std::string &data);
+}
@@ -0,0 +1,189 @@
+#include "user_directory.h"
+
+#include <algorithm>
+#include <utility>
+
+UserDirectory::UserDirectory(const uint32_t cacheSize, std::function<Storage &()> storage) :
+	cacheSize_{ cacheSize },
+	storage_{ std::move(storage) },
+	memory_{ std::make_unique<SharedMemory>(sizeof(std::atomic<uint64_t>)) },
+	generation_{ memory_->as<std::atomic<uint64_t>>() } {
+}
+
+void UserDirectory::load() {
+	if (lazy()) {
+		return;
+	}
+	// the list is replaced only when it is read completely
+	UserTable users;
+	storage_().forEachUser([&users](const Storage::User &user) {
+		users.add(user.id, user.login, user.password_hash, user.name);
+	});
+	table_.swap(users);
+}
+
+void UserDirectory::refresh(const std::string &login) {
+	if (!lazy()) {
+		load();
+		return;
+	}
+	refresh();
+	bool found{ false };
+	storage_().forEachUserByLogin({ login }, [&](const Storage::User &user) {
+		found = true;
+		auto slot = table_.find(user.login);
+		if (slot == UserTable::NONE) {
+			insert(user);
+		}
+		else if (table_.id(slot) == user.id) {
+			// the password or the name may have been changed by another node
+			table_.update(slot, user.password_hash, user.name);
+		}
+		else {
+			// removed and registered again by another node, there is no removal of a single user from the table
+			table_.clear();
+			used_.clear();
+			insert(user);
+		}
+	});
+	if (!found && table_.find(login) != UserTable::NONE) {
+		// removed by another node
+		table_.clear();
+		used_.clear();
+	}
+}
+
+void UserDirectory::refresh() {
+	auto generation = generation_->load();
+	if (generation == loaded_) {
+		return;
+	}
+	table_.clear();
+	used_.clear();
+	loaded_ = generation;
+}
+
+std::optional<Storage::User> UserDirectory::find(const std::string &login) {
+	if (lazy()) {
+		refresh();
+	}
+	auto slot = table_.find(login);
+	if (slot == UserTable::NONE && lazy()) {
+		storage_().forEachUserByLogin({ login }, [this](const Storage::User &user) { insert(user); });
+		slot = table_.find(login);
+	}
+	if (slot == UserTable::NONE) {
+		return std::nullopt;
+	}
+	return user(slot);
+}
+
+std::optional<Storage::User> UserDirectory::find(const unsigned user_id) {
+	if (lazy()) {
+		refresh();
+	}
+	auto slot = table_.findId(user_id);
+	if (slot == UserTable::NONE && lazy()) {
+		storage_().forEachUserById({ user_id }, [this](const Storage::User &user) { insert(user); });
+		slot = table_.findId(user_id);
+	}
+	if (slot == UserTable::NONE) {
+		return std::nullopt;
+	}
+	return user(slot);
+}
+
+void UserDirectory::preload(const std::vector<unsigned> &user_ids) {
+	if (!lazy()) {
+		return;
+	}
+	refresh();
+	std::vector<unsigned> missing;
+	for (auto user_id: user_ids) {
+		if (table_.findId(user_id) == UserTable::NONE) {
+			missing.push_back(user_id);
+		}
+	}
+	std::sort(missing.begin(), missing.end());
+	missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+	// more users than the cache holds would evict each other
+	if (missing.size() > cacheSize_) {
+		missing.resize(cacheSize_);
+	}
+	for (size_t i = 0; i < missing.size(); i += BATCH) {
+		std::vector<unsigned> batch(missing.begin() + i, missing.begin() + std::min(i + BATCH, missing.size()));
+		storage_().forEachUserById(batch, [this](const Storage::User &user) { insert(user); });
+	}
+}
+
+bool UserDirectory::add(const unsigned user_id, const std::string &login, const std::string &password, const std::string &name) {
+	// a login missing in the cache, or registered by another process after the table was read, is looked up in the storage
+	if (find(login)) {
+		return false;
+	}
+	if (!lazy()) {
+		bool taken{ false };
+		storage_().forEachUserByLogin({ login }, [&taken](const Storage::User &) { taken = true; });
+		if (taken) {
+			return false;
+		}
+	}
+	// a login registered meanwhile by another process fails on the unique key
+	storage_().saveUser(user_id, login, password, name);
+	if (lazy()) {
+		insert(Storage::User{ user_id, login, password, name });
+	}
+	else {
+		table_.add(user_id, login, password, name);
+	}
+	return true;
+}
+
+void UserDirectory::remove(const std::string &login) {
+	storage_().removeUser(login);
+	generation_->fetch_add(1);
+}
+
+void UserDirectory::forEachLogin(const std::function<void(std::string_view)> &callback) {
+	if (lazy()) {
+		storage_().forEachUser([&](const Storage::User &user) { callback(user.login); });
+		return;
+	}
+	for (uint32_t slot = 0; slot < table_.size(); ++slot) {
+		callback(table_.login(slot));
+	}
+}
+
+Storage::User UserDirectory::user(const uint32_t slot) {
+	if (lazy()) {
+		used_[slot] = ++clock_;
+	}
+	return Storage::User{ table_.id(slot), table_.login(slot), table_.password(slot), table_.name(slot) };
+}
+
+void UserDirectory::insert(const Storage::User &user) {
+	if (table_.size() >= cacheSize_) {
+		evict();
+	}
+	if (table_.add(user.id, user.login, user.password_hash, user.name)) {
+		used_.push_back(++clock_);
+	}
+}
+
+void UserDirectory::evict() {
+	// a quarter goes at once, so rebuilding the table costs O(1) per cached user
+	std::vector<uint64_t> order{ used_ };
+	auto cut = order.begin() + order.size() / 4;
+	std::nth_element(order.begin(), cut, order.end());
+	auto oldest = *cut; // the marks are unique, the ones up to it are evicted
+	UserTable kept;
+	std::vector<uint64_t> used;
+	for (uint32_t slot = 0; slot < table_.size(); ++slot) {
+		if (used_[slot] > oldest) {
+			kept.add(table_.id(slot), table_.login(slot), table_.password(slot), table_.name(slot));
+			used.push_back(used_[slot]);
+		}
+	}
+	table_.swap(kept);
+	used_.swap(used);
+}
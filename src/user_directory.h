@@ -0,0 +1,62 @@
+#pragma once
+
+#include "shared_memory.h"
+#include "storage.h"
+#include "user_table.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Registered users known to a process. Without a cache size the whole users table is loaded
+// by load(). With one, a user is read from the storage on the first reference, at most cacheSize
+// users are kept and the least recently used ones are evicted, so nothing depends on the number
+// of registered users. A removal makes every process drop its cache. The storage function gives
+// the connection of the calling process. Must be created before fork()
+class UserDirectory final {
+public:
+	static const size_t BATCH{ 500 }; // users read by one query
+
+	UserDirectory(uint32_t cacheSize, std::function<Storage &()> storage); // cache size 0 loads the whole table
+	UserDirectory(const UserDirectory &) = delete;
+	UserDirectory &operator=(const UserDirectory &) = delete;
+
+	bool lazy() const { return cacheSize_ != 0; }
+
+	// replaces the users when the table is read completely, does nothing in lazy mode
+	void load();
+	// the record of the login is read again and replaces the cached one in lazy mode, throws std::runtime_error
+	void refresh(const std::string &login);
+	// nothing if the user does not exist, the views are valid until the next call.
+	// Users missing in the cache are read from the storage, throws std::runtime_error
+	std::optional<Storage::User> find(const std::string &login);
+	std::optional<Storage::User> find(unsigned user_id);
+	// reads the missing users with batched queries before they are looked up one by one
+	void preload(const std::vector<unsigned> &user_ids);
+	// saves a new user, false if the login is taken. The user is cached only after it has been saved,
+	// throws std::runtime_error
+	bool add(unsigned user_id, const std::string &login, const std::string &password, const std::string &name);
+	void remove(const std::string &login); // from the storage, throws std::runtime_error
+	// every registered user, read from the storage in lazy mode without being cached
+	void forEachLogin(const std::function<void(std::string_view)> &callback);
+
+private:
+	void refresh(); // drop the cache if a user has been removed by any process
+	Storage::User user(uint32_t slot); // marks the user as used
+	void insert(const Storage::User &user);
+	void evict(); // the least recently used quarter of the cache
+
+	const uint32_t cacheSize_;
+	const std::function<Storage &()> storage_;
+	std::unique_ptr<SharedMemory> memory_;
+	std::atomic<uint64_t> *generation_; // incremented on every removal
+	uint64_t loaded_{ 0 }; // generation of the cache
+	UserTable table_;
+	std::vector<uint64_t> used_; // by slot of the table, lazy mode only
+	uint64_t clock_{ 0 };
+};
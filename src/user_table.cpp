@@ -0,0 +1,155 @@
+#include "user_table.h"
+
+#include <functional>
+#include <stdexcept>
+
+namespace {
+	const size_t MIN_BUCKETS{ 16 };
+}
+
+uint32_t UserTable::hash(const std::string_view login) {
+	auto value = static_cast<uint64_t>(std::hash<std::string_view>{}(login));
+	return static_cast<uint32_t>(value ^ (value >> 32));
+}
+
+uint32_t UserTable::hash(unsigned user_id) {
+	// murmur3 finalizer, sequential ids are spread over the buckets
+	user_id ^= user_id >> 16;
+	user_id *= 0x85ebca6bU;
+	user_id ^= user_id >> 13;
+	user_id *= 0xc2b2ae35U;
+	return user_id ^ (user_id >> 16);
+}
+
+bool UserTable::add(const unsigned user_id, const std::string_view login, const std::string_view password, const std::string_view name) {
+	if (find(login) != NONE) {
+		return false;
+	}
+	if (ids_.size() >= NONE - 1) {
+		throw std::runtime_error{ "User table is full" };
+	}
+	if ((ids_.size() + 1) * 2 > byLogin_.size()) {
+		grow();
+	}
+	auto slot = size();
+	// a failed allocation leaves the table as it was
+	auto start = text_.size();
+	try {
+		Text texts[]{ intern(login), intern(password), intern(name) };
+		ids_.push_back(user_id);
+		logins_.push_back(texts[0]);
+		passwords_.push_back(texts[1]);
+		names_.push_back(texts[2]);
+	}
+	catch (...) {
+		text_.resize(start);
+		ids_.resize(slot);
+		logins_.resize(slot);
+		passwords_.resize(slot);
+		names_.resize(slot);
+		throw;
+	}
+	insert(byLogin_, hash(login), slot);
+	insert(byId_, hash(user_id), slot);
+	return true;
+}
+
+void UserTable::update(const uint32_t slot, const std::string_view password, const std::string_view name) {
+	auto start = text_.size();
+	try {
+		// unchanged texts are not interned again
+		auto password_text = text(passwords_[slot]) == password ? passwords_[slot] : intern(password);
+		auto name_text = text(names_[slot]) == name ? names_[slot] : intern(name);
+		passwords_[slot] = password_text;
+		names_[slot] = name_text;
+	}
+	catch (...) {
+		text_.resize(start);
+		throw;
+	}
+}
+
+void UserTable::clear() {
+	ids_.clear();
+	logins_.clear();
+	passwords_.clear();
+	names_.clear();
+	text_.clear();
+	byLogin_.assign(byLogin_.size(), Bucket{ 0, NONE });
+	byId_.assign(byId_.size(), Bucket{ 0, NONE });
+}
+
+void UserTable::swap(UserTable &other) noexcept {
+	ids_.swap(other.ids_);
+	logins_.swap(other.logins_);
+	passwords_.swap(other.passwords_);
+	names_.swap(other.names_);
+	text_.swap(other.text_);
+	byLogin_.swap(other.byLogin_);
+	byId_.swap(other.byId_);
+}
+
+uint32_t UserTable::find(const std::string_view login) const {
+	if (byLogin_.empty()) {
+		return NONE;
+	}
+	auto h = hash(login);
+	auto mask = byLogin_.size() - 1;
+	for (auto i = h & mask; byLogin_[i].slot != NONE; i = (i + 1) & mask) {
+		if (byLogin_[i].hash == h && text(logins_[byLogin_[i].slot]) == login) {
+			return byLogin_[i].slot;
+		}
+	}
+	return NONE;
+}
+
+uint32_t UserTable::findId(const unsigned user_id) const {
+	if (byId_.empty()) {
+		return NONE;
+	}
+	auto h = hash(user_id);
+	auto mask = byId_.size() - 1;
+	for (auto i = h & mask; byId_[i].slot != NONE; i = (i + 1) & mask) {
+		if (byId_[i].hash == h && ids_[byId_[i].slot] == user_id) {
+			return byId_[i].slot;
+		}
+	}
+	return NONE;
+}
+
+UserTable::Text UserTable::intern(const std::string_view value) {
+	if (text_.size() + value.size() > UINT32_MAX) {
+		throw std::runtime_error{ "User table is full" };
+	}
+	Text result{ static_cast<uint32_t>(text_.size()), static_cast<uint32_t>(value.size()) };
+	text_.append(value);
+	return result;
+}
+
+void UserTable::grow() {
+	auto buckets = byLogin_.empty() ? MIN_BUCKETS : byLogin_.size() * 2;
+	std::vector<Bucket> byLogin(buckets, Bucket{ 0, NONE });
+	std::vector<Bucket> byId(buckets, Bucket{ 0, NONE });
+	// the cached hashes are reused, the logins are not read again
+	for (const auto &bucket: byLogin_) {
+		if (bucket.slot != NONE) {
+			insert(byLogin, bucket.hash, bucket.slot);
+		}
+	}
+	for (const auto &bucket: byId_) {
+		if (bucket.slot != NONE) {
+			insert(byId, bucket.hash, bucket.slot);
+		}
+	}
+	byLogin_.swap(byLogin);
+	byId_.swap(byId);
+}
+
+void UserTable::insert(std::vector<Bucket> &index, const uint32_t hash, const uint32_t slot) {
+	auto mask = index.size() - 1;
+	auto i = hash & mask;
+	while (index[i].slot != NONE) {
+		i = (i + 1) & mask;
+	}
+	index[i] = Bucket{ hash, slot };
+}
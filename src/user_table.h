@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Registered users of a process in struct-of-arrays form, one dense slot per user. Logins are
+// interned: an open-addressing table maps them to slots, a second one maps user ids, and all
+// texts are kept in one buffer. A lookup compares the cached hashes packed in the index and
+// reads a single login, the password hashes and names are touched only when they are asked for
+class UserTable final {
+public:
+	static const uint32_t NONE{ UINT32_MAX };
+
+	// false if the login is taken, throws std::runtime_error if the table is full
+	bool add(unsigned user_id, std::string_view login, std::string_view password, std::string_view name);
+	// new password hash and name of the slot, the old texts stay in the buffer until the table is built again
+	void update(uint32_t slot, std::string_view password, std::string_view name);
+	void clear(); // keeps the memory for the next load
+	void swap(UserTable &other) noexcept;
+
+	uint32_t find(std::string_view login) const; // slot of the user, NONE if not found
+	uint32_t findId(unsigned user_id) const;
+	uint32_t size() const { return static_cast<uint32_t>(ids_.size()); }
+	bool empty() const { return ids_.empty(); }
+
+	// by slot, the views are valid until the next change of the table
+	unsigned id(uint32_t slot) const { return ids_[slot]; }
+	std::string_view login(uint32_t slot) const { return text(logins_[slot]); }
+	std::string_view password(uint32_t slot) const { return text(passwords_[slot]); }
+	std::string_view name(uint32_t slot) const { return text(names_[slot]); }
+
+private:
+	struct Text {
+		uint32_t offset;
+		uint32_t length;
+	};
+
+	// hash and slot side by side, so a probe reads one cache line
+	struct Bucket {
+		uint32_t hash;
+		uint32_t slot; // NONE if free
+	};
+
+	static uint32_t hash(std::string_view login);
+	static uint32_t hash(unsigned user_id);
+	std::string_view text(const Text &text) const { return { text_.data() + text.offset, text.length }; }
+	Text intern(std::string_view value);
+	void grow(); // doubles both indexes
+	static void insert(std::vector<Bucket> &index, uint32_t hash, uint32_t slot);
+
+	std::vector<unsigned> ids_;
+	std::vector<Text> logins_;
+	std::vector<Text> passwords_;
+	std::vector<Text> names_;
+	std::string text_;
+	std::vector<Bucket> byLogin_; // power of two buckets, at most half taken
+	std::vector<Bucket> byId_;
+};
@@ -0,0 +1,114 @@
+#include "wire_format.h"
+
+#include <algorithm>
+
+namespace {
+	const size_t HEADER{ 4 }; // marker, version, type, flags
+
+	size_t varintSize(uint64_t value) {
+		size_t size{ 1 };
+		while (value >= 0x80) {
+			value >>= 7;
+			++size;
+		}
+		return size;
+	}
+
+	size_t putString(const std::string_view value, char *buffer) {
+		auto size = Chat::encodeVarint(value.size(), buffer);
+		std::copy(value.begin(), value.end(), buffer + size);
+		return size + value.size();
+	}
+
+	// false if data ends before the string
+	bool getString(const std::string_view data, size_t &pos, std::string_view &value) {
+		uint64_t length;
+		auto size = Chat::decodeVarint(data.substr(pos), length);
+		if (size == 0 || length > data.size() - pos - size) {
+			return false;
+		}
+		value = data.substr(pos + size, length);
+		pos += size + length;
+		return true;
+	}
+}
+
+bool Chat::isWireRecord(const std::string_view frame) {
+	return !frame.empty() && static_cast<uint8_t>(frame[0]) == WIRE_MARKER;
+}
+
+size_t Chat::encodeVarint(uint64_t value, char *buffer) {
+	size_t size{ 0 };
+	while (value >= 0x80) {
+		buffer[size++] = static_cast<char>(value | 0x80);
+		value >>= 7;
+	}
+	buffer[size++] = static_cast<char>(value);
+	return size;
+}
+
+size_t Chat::decodeVarint(const std::string_view data, uint64_t &value) {
+	value = 0;
+	for (size_t i = 0; i < data.size() && i < MAX_VARINT; ++i) {
+		auto byte = static_cast<uint8_t>(data[i]);
+		value |= static_cast<uint64_t>(byte & 0x7F) << (7 * i);
+		if ((byte & 0x80) == 0) {
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+size_t Chat::encodeRecord(const WireRecord &record, char *buffer, const size_t size) {
+	size_t fixed = HEADER + varintSize(record.id) + varintSize(record.sent) + varintSize(record.sender_id) +
+		varintSize(record.sender.size()) + record.sender.size() +
+		varintSize(record.target.size()) + record.target.size();
+	if (fixed >= size) {
+		return 0;
+	}
+	// the length prefix is counted for the longest text that could fit
+	auto room = size - fixed;
+	auto text = record.text.substr(0, room - std::min(room, varintSize(std::min(record.text.size(), room))));
+
+	size_t pos{ 0 };
+	buffer[pos++] = static_cast<char>(WIRE_MARKER);
+	buffer[pos++] = static_cast<char>(WIRE_VERSION);
+	buffer[pos++] = static_cast<char>(record.type);
+	buffer[pos++] = static_cast<char>(record.flags);
+	pos += encodeVarint(record.id, buffer + pos);
+	pos += encodeVarint(record.sent, buffer + pos);
+	pos += encodeVarint(record.sender_id, buffer + pos);
+	pos += putString(record.sender, buffer + pos);
+	pos += putString(record.target, buffer + pos);
+	pos += putString(text, buffer + pos);
+	return pos;
+}
+
+size_t Chat::decodeRecord(const std::string_view data, WireRecord &record) {
+	if (data.size() < HEADER || !isWireRecord(data) || static_cast<uint8_t>(data[1]) != WIRE_VERSION) {
+		return 0;
+	}
+	auto type = static_cast<uint8_t>(data[2]);
+	if (type < WireRecord::PRIVATE || type > WireRecord::CHANNEL) {
+		return 0;
+	}
+	record.type = static_cast<WireRecord::Type>(type);
+	record.flags = static_cast<uint8_t>(data[3]);
+
+	size_t pos{ HEADER };
+	uint64_t values[3];
+	for (auto &value: values) {
+		auto size = decodeVarint(data.substr(pos), value);
+		if (size == 0) {
+			return 0;
+		}
+		pos += size;
+	}
+	record.id = values[0];
+	record.sent = values[1];
+	record.sender_id = static_cast<unsigned>(values[2]);
+	if (!getString(data, pos, record.sender) || !getString(data, pos, record.target) || !getString(data, pos, record.text)) {
+		return 0;
+	}
+	return pos;
+}
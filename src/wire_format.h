@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Binary encoding of chat messages sent to clients. A record is
+//   marker, version, type, flags,
+//   varints: message id, sent time, sender id,
+//   strings as a varint length and bytes: sender login, target, text
+// Target is the channel of a channel message and the receiver of a stored private
+// message, empty otherwise. A message delivered to its recipient is followed by the varint
+// seq of the delivery, so one record can be shared by all recipients. Encoding and
+// decoding work on caller buffers and never allocate, decoded strings point into the frame
+namespace Chat {
+	struct WireRecord {
+		enum Type : uint8_t {
+			PRIVATE = 1,
+			BROADCAST = 2,
+			CHANNEL = 3
+		};
+		static constexpr uint8_t STORED{ 0x01 }; // flag of /history and /search results, no seq follows
+
+		Type type;
+		uint8_t flags;
+		unsigned long long id;
+		uint64_t sent; // unix time
+		unsigned sender_id;
+		std::string_view sender;
+		std::string_view target;
+		std::string_view text;
+	};
+
+	constexpr uint8_t WIRE_MARKER{ 0xC7 }; // never the first byte of a text frame
+	constexpr uint8_t WIRE_VERSION{ 1 };
+	constexpr size_t MAX_VARINT{ 10 }; // bytes of the longest 64-bit varint
+
+	bool isWireRecord(std::string_view frame);
+
+	// returns the size of the record, the text is cut to fit the buffer.
+	// 0 if the buffer is too small for the rest of the record
+	size_t encodeRecord(const WireRecord &record, char *buffer, size_t size);
+	// returns the size of the record at the start of data, 0 if it is malformed or of another version
+	size_t decodeRecord(std::string_view data, WireRecord &record);
+
+	// buffer must have room for MAX_VARINT bytes, returns the encoded size
+	size_t encodeVarint(uint64_t value, char *buffer);
+	// returns the number of bytes read, 0 if malformed
+	size_t decodeVarint(std::string_view data, uint64_t &value);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <iostream>
+
+// Checks of the test programs: a failed one is printed and counted, the test goes on.
+// main() returns finish(), 1 if any check has failed
+namespace Test {
+	inline int failures{ 0 };
+
+	inline void check(const bool condition, const char *what, const char *file, const int line) {
+		if (!condition) {
+			std::cerr << file << ":" << line << ": " << what << std::endl;
+			++failures;
+		}
+	}
+
+	inline int finish(const char *name) {
+		if (failures != 0) {
+			std::cerr << name << ": " << failures << " checks failed" << std::endl;
+			return 1;
+		}
+		std::cout << name << ": ok" << std::endl;
+		return 0;
+	}
+}
+
+#define CHECK(condition) Test::check((condition), #condition, __FILE__, __LINE__)
@@ -0,0 +1,140 @@
+#include "check.h"
+#include "../src/config_file.h"
+#include "../src/storage.h"
+
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+extern "C" {
+	#include <sys/wait.h>
+	#include <unistd.h>
+}
+
+// Channels created by their first members on a SQLite file: new channels joined one after another
+// in one transaction, and by processes creating channels at the same time
+namespace {
+	const unsigned PROCESSES{ 4 };
+	const unsigned CHANNELS{ 20 }; // created by every process
+
+	struct Members {
+		unsigned long long channel_id{ 0 };
+		std::set<unsigned> user_ids;
+	};
+
+	std::map<std::string, Members> channels(Storage &storage) {
+		std::map<std::string, Members> result;
+		storage.forEachChannelMember([&](const Storage::ChannelMember &member) {
+			auto &channel = result[std::string{ member.channel }];
+			channel.channel_id = member.channel_id;
+			channel.user_ids.insert(member.user_id);
+		});
+		return result;
+	}
+
+	bool distinctIds(const std::map<std::string, Members> &result) {
+		std::set<unsigned long long> ids;
+		for (const auto &[name, channel]: result) {
+			// channel 0 stands for the broadcast
+			if (channel.channel_id == 0 || !ids.insert(channel.channel_id).second) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void oneTransaction(const ConfigFile &config) {
+		auto storage = Storage::create(config, getpid());
+		storage->saveUser(1, "alice", std::string(64, 'a'), "Alice");
+		storage->saveUser(2, "bob", std::string(64, 'b'), "Bob");
+
+		storage->beginTransaction();
+		storage->joinChannel("dev", 1);
+		storage->joinChannel("ops", 1);
+		storage->commitTransaction();
+		storage->joinChannel("dev", 2);
+		storage->joinChannel("ops", 1);
+
+		auto result = channels(*storage);
+		CHECK(result.size() == 2);
+		CHECK(distinctIds(result));
+		CHECK((result["dev"].user_ids == std::set<unsigned>{ 1, 2 }));
+		CHECK((result["ops"].user_ids == std::set<unsigned>{ 1 }));
+
+		// a rolled back channel is not created, the next one still gets a new id
+		storage->beginTransaction();
+		storage->joinChannel("tmp", 2);
+		storage->rollbackTransaction();
+		storage->joinChannel("qa", 2);
+		result = channels(*storage);
+		CHECK(result.count("tmp") == 0);
+		CHECK(result.size() == 3);
+		CHECK(distinctIds(result));
+	}
+
+	void concurrentProcesses(const ConfigFile &config) {
+		std::vector<pid_t> children;
+		for (unsigned process = 0; process < PROCESSES; ++process) {
+			auto pid = fork();
+			if (pid == 0) {
+				int status{ EXIT_SUCCESS };
+				try {
+					auto storage = Storage::create(config, getppid());
+					for (unsigned i = 0; i < CHANNELS; ++i) {
+						// every process creates channels of its own and joins the shared ones
+						storage->joinChannel("own" + std::to_string(process) + "_" + std::to_string(i), 1);
+						storage->joinChannel("shared" + std::to_string(i), process % 2 + 1);
+					}
+				}
+				catch (const std::exception &e) {
+					std::cerr << "process " << process << ": " << e.what() << std::endl;
+					status = EXIT_FAILURE;
+				}
+				_exit(status);
+			}
+			children.push_back(pid);
+		}
+		for (auto pid: children) {
+			int status;
+			CHECK(waitpid(pid, &status, 0) == pid);
+			CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+		}
+
+		auto storage = Storage::create(config, getpid());
+		auto result = channels(*storage);
+		CHECK(distinctIds(result));
+		CHECK(result.size() == 3 + PROCESSES * CHANNELS + CHANNELS);
+		for (unsigned i = 0; i < CHANNELS; ++i) {
+			CHECK((result["shared" + std::to_string(i)].user_ids == std::set<unsigned>{ 1, 2 }));
+			for (unsigned process = 0; process < PROCESSES; ++process) {
+				CHECK(result["own" + std::to_string(process) + "_" + std::to_string(i)].user_ids.size() == 1);
+			}
+		}
+	}
+}
+
+int main() {
+	auto directory = std::filesystem::temp_directory_path();
+	auto database = (directory / ("test_channels-" + std::to_string(getpid()) + ".db")).string();
+	auto configFile = (directory / ("test_channels-" + std::to_string(getpid()) + ".cfg")).string();
+	std::ofstream{ configFile } << "StorageBackend = sqlite\nSqliteFile = " << database << "\n";
+	try {
+		ConfigFile config{ configFile };
+		oneTransaction(config);
+		concurrentProcesses(config);
+	}
+	catch (const std::exception &e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		++Test::failures;
+	}
+	std::filesystem::remove(configFile);
+	for (const auto &suffix: { "", "-wal", "-shm" }) {
+		std::filesystem::remove(database + suffix);
+	}
+	return Test::finish("channels");
+}
@@ -0,0 +1,195 @@
+#include "check.h"
+#include "../src/cluster_bus.h"
+#include "../src/presence_directory.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+	#include <unistd.h>
+}
+
+// Three nodes in one process on the loopback: notices and presence changes cross the bus,
+// a node that goes down is forgotten by the others and caught up when it is back
+namespace {
+	const size_t NODES{ 3 };
+	const std::chrono::seconds WAIT{ 5 };
+
+	struct Node {
+		std::unique_ptr<PresenceDirectory> presence;
+		std::unique_ptr<ClusterBus> bus;
+		std::vector<ClusterBus::Notice> notices; // delivered from the peers
+	};
+
+	std::vector<ClusterBus::Node> cluster;
+	Node nodes[NODES];
+
+	std::string localSocket(const size_t index) {
+		return "/tmp/chat_test_bus." + std::to_string(getpid()) + "." + std::to_string(index);
+	}
+
+	void start(const size_t index) {
+		auto &node = nodes[index];
+		if (!node.presence) {
+			node.presence = std::make_unique<PresenceDirectory>(64, cluster[index].id);
+		}
+		node.bus = std::make_unique<ClusterBus>(cluster[index].id, cluster, localSocket(index));
+		node.bus->open(*node.presence, [&node](const ClusterBus::Notice &notice) { node.notices.push_back(notice); },
+			[](const std::string &) {});
+	}
+
+	void stop(const size_t index) {
+		nodes[index].bus.reset();
+		unlink(localSocket(index).c_str());
+	}
+
+	// polls the running buses until the condition holds, false if it does not in time
+	bool pump(const std::function<bool()> &condition) {
+		auto deadline = std::chrono::steady_clock::now() + WAIT;
+		while (!condition()) {
+			if (std::chrono::steady_clock::now() > deadline) {
+				return false;
+			}
+			for (auto &node: nodes) {
+				if (node.bus) {
+					node.bus->poll(5);
+				}
+			}
+		}
+		return true;
+	}
+
+	bool connected(const size_t from, const size_t to) {
+		return nodes[from].bus && nodes[from].bus->reachable(cluster[to].id);
+	}
+
+	bool allConnected() {
+		for (size_t i = 0; i < NODES; ++i) {
+			for (size_t j = 0; j < NODES; ++j) {
+				if (!connected(i, j)) {
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	size_t noticesForAll(const Node &node) {
+		return std::count_if(node.notices.begin(), node.notices.end(), [](const ClusterBus::Notice &notice) { return notice.all; });
+	}
+
+	bool noticed(const Node &node, const unsigned user_id) {
+		return std::any_of(node.notices.begin(), node.notices.end(), [&](const ClusterBus::Notice &notice) {
+			return std::find(notice.users.begin(), notice.users.end(), user_id) != notice.users.end();
+		});
+	}
+
+	// true if the user is online at the node as seen by every other running node
+	bool seenOnline(const size_t at, const unsigned user_id) {
+		for (size_t i = 0; i < NODES; ++i) {
+			if (i == at || !nodes[i].bus) {
+				continue;
+			}
+			auto entry = nodes[i].presence->find(user_id);
+			if (!entry || entry->node != cluster[at].id) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool seenOffline(const size_t at, const unsigned user_id) {
+		for (size_t i = 0; i < NODES; ++i) {
+			if (i != at && nodes[i].bus && nodes[i].presence->find(user_id)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void clearNotices() {
+		for (auto &node: nodes) {
+			node.notices.clear();
+		}
+	}
+
+	void connect() {
+		for (size_t i = 0; i < NODES; ++i) {
+			start(i);
+		}
+		CHECK(pump(allConnected));
+		// a connection starts with a notice for all users
+		CHECK(pump([] {
+			return std::all_of(std::begin(nodes), std::end(nodes), [](const Node &node) { return noticesForAll(node) >= NODES - 1; });
+		}));
+	}
+
+	void notices() {
+		clearNotices();
+		nodes[0].bus->publish({ 5, 7 });
+		CHECK(pump([] { return noticed(nodes[1], 5) && noticed(nodes[1], 7) && noticed(nodes[2], 5) && noticed(nodes[2], 7); }));
+		CHECK(nodes[0].notices.empty()); // not sent back to the publisher
+
+		clearNotices();
+		nodes[1].bus->publishAll();
+		CHECK(pump([] { return noticesForAll(nodes[0]) == 1 && noticesForAll(nodes[2]) == 1; }));
+		CHECK(nodes[1].notices.empty());
+	}
+
+	void presence() {
+		auto entry = nodes[1].presence->login(9, 1234, 0x0100007F, 40000);
+		CHECK(entry.has_value());
+		if (entry) {
+			nodes[1].bus->publishPresence({ *entry });
+		}
+		CHECK(pump([] { return seenOnline(1, 9); }));
+		auto entry2 = nodes[1].presence->logout(9, 1234);
+		CHECK(entry2.has_value());
+		if (entry2) {
+			nodes[1].bus->publishPresence({ *entry2 });
+		}
+		CHECK(pump([] { return seenOffline(1, 9); }));
+	}
+
+	void nodeDown() {
+		auto entry = nodes[2].presence->login(11, 4321, 0x0100007F, 40001);
+		CHECK(entry.has_value());
+		if (entry) {
+			nodes[2].bus->publishPresence({ *entry });
+		}
+		CHECK(pump([] { return seenOnline(2, 11); }));
+
+		stop(2);
+		// the sessions of an unreachable node are dropped
+		CHECK(pump([] { return !connected(0, 2) && !connected(1, 2) && seenOffline(2, 11); }));
+		clearNotices();
+		nodes[0].bus->publish({ 5 });
+		CHECK(pump([] { return noticed(nodes[1], 5); }));
+
+		// back with the sessions it kept and a notice for all users
+		clearNotices();
+		start(2);
+		CHECK(pump(allConnected));
+		CHECK(pump([] { return seenOnline(2, 11) && noticesForAll(nodes[0]) >= 1 && noticesForAll(nodes[1]) >= 1; }));
+	}
+}
+
+int main() {
+	// ports next to each other, picked by the pid so parallel runs do not meet
+	auto base = static_cast<unsigned short>(20000 + getpid() % 10000 * NODES);
+	for (unsigned i = 0; i < NODES; ++i) {
+		cluster.push_back(ClusterBus::Node{ i + 1, "127.0.0.1", static_cast<unsigned short>(base + i) });
+	}
+	connect();
+	notices();
+	presence();
+	nodeDown();
+	for (size_t i = 0; i < NODES; ++i) {
+		stop(i);
+	}
+	return Test::finish("cluster bus");
+}
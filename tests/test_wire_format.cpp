@@ -0,0 +1,184 @@
+#include "check.h"
+#include "../src/wire_format.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Round trips of the binary wire codec and decoding of cut and damaged frames
+namespace {
+	Chat::WireRecord sample() {
+		return Chat::WireRecord{ Chat::WireRecord::CHANNEL, 0, 1234567890123ULL, 1700000000, 42, "alice", "general", "hello, world" };
+	}
+
+	void varintRoundTrip() {
+		const uint64_t values[]{ 0, 1, 0x7F, 0x80, 0x3FFF, 0x4000, UINT32_MAX, 1ULL << 56, UINT64_MAX };
+		for (auto value: values) {
+			char buffer[Chat::MAX_VARINT];
+			auto size = Chat::encodeVarint(value, buffer);
+			CHECK(size >= 1 && size <= Chat::MAX_VARINT);
+			uint64_t decoded;
+			CHECK(Chat::decodeVarint({ buffer, size }, decoded) == size);
+			CHECK(decoded == value);
+			// a following byte is not read
+			std::string longer{ buffer, size };
+			longer += '\x01';
+			CHECK(Chat::decodeVarint(longer, decoded) == size);
+			CHECK(decoded == value);
+		}
+		char buffer[Chat::MAX_VARINT];
+		CHECK(Chat::encodeVarint(0x7F, buffer) == 1);
+		CHECK(Chat::encodeVarint(0x80, buffer) == 2);
+		CHECK(Chat::encodeVarint(UINT64_MAX, buffer) == Chat::MAX_VARINT);
+	}
+
+	void varintMalformed() {
+		uint64_t value;
+		CHECK(Chat::decodeVarint({}, value) == 0);
+		// every byte continues
+		CHECK(Chat::decodeVarint("\x80", value) == 0);
+		CHECK(Chat::decodeVarint("\xFF\xFF\xFF", value) == 0);
+		// longer than a 64-bit value may be
+		std::string endless(Chat::MAX_VARINT + 1, '\x80');
+		endless.back() = '\x01';
+		CHECK(Chat::decodeVarint(endless, value) == 0);
+		// a cut encoding
+		char buffer[Chat::MAX_VARINT];
+		auto size = Chat::encodeVarint(UINT64_MAX, buffer);
+		for (size_t cut = 0; cut < size; ++cut) {
+			CHECK(Chat::decodeVarint({ buffer, cut }, value) == 0);
+		}
+	}
+
+	void recordRoundTrip() {
+		auto record = sample();
+		char buffer[256];
+		auto size = Chat::encodeRecord(record, buffer, sizeof(buffer));
+		CHECK(size > 0);
+		CHECK(Chat::isWireRecord({ buffer, size }));
+
+		Chat::WireRecord decoded{};
+		CHECK(Chat::decodeRecord({ buffer, size }, decoded) == size);
+		CHECK(decoded.type == record.type);
+		CHECK(decoded.flags == record.flags);
+		CHECK(decoded.id == record.id);
+		CHECK(decoded.sent == record.sent);
+		CHECK(decoded.sender_id == record.sender_id);
+		CHECK(decoded.sender == record.sender);
+		CHECK(decoded.target == record.target);
+		CHECK(decoded.text == record.text);
+
+		// the seq of a delivery follows the record
+		std::string frame{ buffer, size };
+		char seq[Chat::MAX_VARINT];
+		frame.append(seq, Chat::encodeVarint(77, seq));
+		CHECK(Chat::decodeRecord(frame, decoded) == size);
+		uint64_t value;
+		CHECK(Chat::decodeVarint(std::string_view{ frame }.substr(size), value) > 0);
+		CHECK(value == 77);
+
+		// empty strings, a stored broadcast
+		Chat::WireRecord empty{ Chat::WireRecord::BROADCAST, Chat::WireRecord::STORED, 0, 0, 0, "", "", "" };
+		size = Chat::encodeRecord(empty, buffer, sizeof(buffer));
+		CHECK(size > 0);
+		CHECK(Chat::decodeRecord({ buffer, size }, decoded) == size);
+		CHECK(decoded.type == Chat::WireRecord::BROADCAST);
+		CHECK(decoded.flags == Chat::WireRecord::STORED);
+		CHECK(decoded.sender.empty() && decoded.target.empty() && decoded.text.empty());
+	}
+
+	void recordCutToBuffer() {
+		auto record = sample();
+		std::string text(1000, 'x');
+		record.text = text;
+		char full[2048];
+		auto whole = Chat::encodeRecord(record, full, sizeof(full));
+		CHECK(whole > 0);
+		// every buffer shorter than the record gets a record with a shorter text, or none at all
+		for (size_t size = 1; size < whole; ++size) {
+			char buffer[2048];
+			auto encoded = Chat::encodeRecord(record, buffer, size);
+			CHECK(encoded <= size);
+			if (encoded == 0) {
+				continue;
+			}
+			Chat::WireRecord decoded{};
+			CHECK(Chat::decodeRecord({ buffer, encoded }, decoded) == encoded);
+			CHECK(decoded.text.size() < record.text.size());
+			CHECK(decoded.text == record.text.substr(0, decoded.text.size()));
+			CHECK(decoded.sender == record.sender);
+		}
+		// too small for anything but the text
+		char buffer[16];
+		CHECK(Chat::encodeRecord(record, buffer, sizeof(buffer)) == 0);
+	}
+
+	void recordTruncated() {
+		auto record = sample();
+		char buffer[256];
+		auto size = Chat::encodeRecord(record, buffer, sizeof(buffer));
+		Chat::WireRecord decoded{};
+		for (size_t cut = 0; cut < size; ++cut) {
+			CHECK(Chat::decodeRecord({ buffer, cut }, decoded) == 0);
+		}
+	}
+
+	void recordGarbage() {
+		auto record = sample();
+		char buffer[256];
+		auto size = Chat::encodeRecord(record, buffer, sizeof(buffer));
+		Chat::WireRecord decoded{};
+
+		std::string frame{ buffer, size };
+		frame[0] = 'h'; // a text frame
+		CHECK(!Chat::isWireRecord(frame));
+		CHECK(Chat::decodeRecord(frame, decoded) == 0);
+		CHECK(Chat::decodeRecord("hello", decoded) == 0);
+
+		frame = std::string{ buffer, size };
+		frame[1] = static_cast<char>(Chat::WIRE_VERSION + 1);
+		CHECK(Chat::decodeRecord(frame, decoded) == 0);
+
+		for (auto type: { 0, 4, 0xFF }) {
+			frame = std::string{ buffer, size };
+			frame[2] = static_cast<char>(type);
+			CHECK(Chat::decodeRecord(frame, decoded) == 0);
+		}
+
+		// a string length past the end of the frame
+		frame = std::string{ buffer, size };
+		auto login = frame.find("alice");
+		CHECK(login != std::string::npos);
+		frame[login - 1] = '\x7F';
+		CHECK(Chat::decodeRecord(frame, decoded) == 0);
+
+		// a varint that never ends
+		frame = std::string{ buffer, 4 } + std::string(Chat::MAX_VARINT + 2, '\xFF');
+		CHECK(Chat::decodeRecord(frame, decoded) == 0);
+
+		// every byte flipped: the decoder stays inside the frame, whatever it makes of it
+		for (size_t i = 0; i < size; ++i) {
+			frame = std::string{ buffer, size };
+			frame[i] = static_cast<char>(~frame[i]);
+			auto decodedSize = Chat::decodeRecord(frame, decoded);
+			CHECK(decodedSize <= frame.size());
+			if (decodedSize != 0) {
+				auto begin = frame.data();
+				auto end = begin + frame.size();
+				for (auto view: { decoded.sender, decoded.target, decoded.text }) {
+					CHECK(view.data() >= begin && view.data() + view.size() <= end);
+				}
+			}
+		}
+	}
+}
+
+int main() {
+	varintRoundTrip();
+	varintMalformed();
+	recordRoundTrip();
+	recordCutToBuffer();
+	recordTruncated();
+	recordGarbage();
+	return Test::finish("wire format");
+}